@@ -0,0 +1,831 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 负载测试: 多个客户端线程模拟用户编辑并保存文件(大小与改动方式接近真实分布, 少数热点文件被频繁保存),
+// 分布在多个挂载点上, 同时执行备份、恢复、查询、枚举; 每个统计周期输出各操作的吞吐与 p50/p99/p999 延迟
+//
+// 仓库通过 backup_store_set_repository_local() 放到临时目录中, 只对本进程生效, 不会写入挂载点下的 .andsec-backup,
+// 结束时删除; 无法映射时退出, 不会在真实仓库上运行
+//
+// 用法: backup-load [--clients 16] [--seconds 60] [--interval 5] [--dirs /tmp,/var/tmp,/dev/shm]
+//                   [--files 32] [--max-size 16] [--mix backup=60,restore=15,query=15,enumerate=10]
+//                   [--csv out.csv] [--keep]
+//
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+
+#define LOAD_SUB_BITS       5                                   // 每个 2 的幂区间再分 32 个桶, 误差约 3%
+#define LOAD_SUB_N          (1 << LOAD_SUB_BITS)
+#define LOAD_BUCKET_N       (LOAD_SUB_N * 37)                   // 最大约 2^40 微秒
+#define LOAD_POOL_SIZE      (1024 * 1024)                       // 写入内容取自这块随机数据
+#define LOAD_HOT_PERCENT    20                                  // 20% 的文件承担 80% 的保存
+
+typedef enum
+{
+    LOAD_OP_BACKUP = 0,
+    LOAD_OP_RESTORE,
+    LOAD_OP_QUERY,
+    LOAD_OP_ENUMERATE,
+    LOAD_OP_N,
+} LoadOp;
+
+typedef struct _LoadHist
+{
+    guint64                 count;
+    guint64                 errors;
+    guint64                 bytes;
+    guint64                 max;                                // 微秒
+    guint32                 buckets[LOAD_BUCKET_N];
+} LoadHist;
+
+typedef struct _LoadFile
+{
+    char*                   path;
+    char*                   restorePrefix;                      // 恢复出的文件名为 <name>-<时间><扩展名>
+    guint64                 size;
+    gboolean                backedUp;
+} LoadFile;
+
+typedef struct _LoadClient
+{
+    guint                   id;
+    char*                   dir;
+    GRand*                  rand;
+    LoadFile*               files;
+    guint                   fileN;
+
+    GMutex                  lock;                               // 保护 hist, 统计线程每个周期取走一次
+    LoadHist                hist[LOAD_OP_N];
+} LoadClient;
+
+static const char*  load_op_name                (LoadOp op);
+static guint        load_bucket                 (guint64 us);
+static guint64      load_bucket_value           (guint bucket);
+static guint64      load_percentile             (const LoadHist* hist, double p);
+static void         load_hist_add               (LoadHist* dst, const LoadHist* src);
+static void         load_record                 (LoadClient* c, LoadOp op, gint64 start, gint64 end, gboolean ok, guint64 bytes);
+static guint64      load_pick_size              (GRand* rand);
+static gboolean     load_fill                   (int fd, guint64 offset, guint64 len, GRand* rand);
+static gboolean     load_write_new              (const char* path, guint64 size, GRand* rand);
+static gboolean     load_mutate                 (LoadClient* c, LoadFile* f);
+static LoadFile*    load_pick_file              (LoadClient* c, gboolean backedUp);
+static guint64      load_remove_restored        (LoadClient* c, const LoadFile* f);
+static void         load_query_cb               (const char* srcPath, guint64 timestamp, gpointer data);
+static gboolean     load_enumerate              (const char* dir, guint64* n);
+static gpointer     load_client_thread          (gpointer data);
+static gboolean     load_parse_mix              (const char* mix);
+static gboolean     load_map_repositories       (const char* workDir, GHashTable* mapped);
+static void         load_remove_tree            (const char* path);
+static void         load_report                 (LoadClient* clients, guint clientN, LoadHist* total, double elapsed, double period, FILE* csv);
+static void         load_print_row              (const char* label, LoadOp op, const LoadHist* h, double period, FILE* csv, double elapsed);
+static void         load_on_signal              (int sig);
+
+
+static gint         gsClients = 16;
+static gint         gsSeconds = 60;
+static gint         gsInterval = 5;
+static gint         gsFiles = 32;
+static gint         gsMaxSizeMB = 16;
+static gchar*       gsDirs = NULL;
+static gchar*       gsMixArg = NULL;
+static gchar*       gsCsv = NULL;
+static gboolean     gsKeep = FALSE;
+
+static guint        gsWeights[LOAD_OP_N] = { 60, 15, 15, 10 };
+static guint        gsWeightSum = 100;
+static guchar*      gsPool = NULL;
+static gint64       gsDeadline = 0;
+static volatile sig_atomic_t gsStop = 0;
+
+static GOptionEntry gsOptions[] = {
+    { "clients",  'c', 0, G_OPTION_ARG_INT,      &gsClients,   "并发客户端数", "N" },
+    { "seconds",  't', 0, G_OPTION_ARG_INT,      &gsSeconds,   "运行时间(秒)", "N" },
+    { "interval", 'i', 0, G_OPTION_ARG_INT,      &gsInterval,  "统计周期(秒)", "N" },
+    { "dirs",     'd', 0, G_OPTION_ARG_STRING,   &gsDirs,      "逗号分隔的基准目录, 最好位于不同的挂载点", "DIRS" },
+    { "files",    'f', 0, G_OPTION_ARG_INT,      &gsFiles,     "每个客户端的文件数", "N" },
+    { "max-size", 'm', 0, G_OPTION_ARG_INT,      &gsMaxSizeMB, "单个文件的最大大小(MB)", "N" },
+    { "mix",      'x', 0, G_OPTION_ARG_STRING,   &gsMixArg,    "操作比例, 例如 backup=60,restore=15,query=15,enumerate=10", "MIX" },
+    { "csv",      'o', 0, G_OPTION_ARG_FILENAME, &gsCsv,       "同时把每个周期的统计写入 CSV", "FILE" },
+    { "keep",     'k', 0, G_OPTION_ARG_NONE,     &gsKeep,      "结束后保留临时目录与仓库", NULL },
+    { NULL }
+};
+
+
+int main (int argc, char* argv[])
+{
+    int ret = 1;
+    FILE* csv = NULL;
+    GError* error = NULL;
+    GPtrArray* workDirs = g_ptr_array_new_with_free_func (g_free);
+    GHashTable* mapped = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    LoadClient* clients = NULL;
+    GThread** threads = NULL;
+    LoadHist* total = NULL;
+    gboolean mapFailed = FALSE;
+
+    GOptionContext* opt = g_option_context_new ("- andsec-backup 负载测试");
+    g_option_context_add_main_entries (opt, gsOptions, NULL);
+
+    do {
+        if (!g_option_context_parse (opt, &argc, &argv, &error)) {
+            printf("%s\n", error->message);
+            break;
+        }
+        if (gsClients <= 0 || gsSeconds <= 0 || gsInterval <= 0 || gsFiles <= 0 || gsMaxSizeMB <= 0) {
+            printf("invalid arguments\n");
+            break;
+        }
+        if (gsMixArg && !load_parse_mix (gsMixArg)) {
+            printf("invalid mix '%s'\n", gsMixArg);
+            break;
+        }
+
+        // 每个基准目录下建一个临时工作目录; 仓库映射必须在首次使用挂载点之前完成
+        char** dirs = g_strsplit (gsDirs ? gsDirs : "/tmp,/var/tmp,/dev/shm", ",", -1);
+        for (int i = 0; dirs[i]; ++i) {
+            char* base = realpath (g_strstrip (dirs[i]), NULL);
+            if (!base || 0 != access (base, W_OK)) {
+                printf("skip '%s'\n", dirs[i]);
+                free (base);
+                continue;
+            }
+            char* work = g_build_filename (base, "andsec-backup-load-XXXXXX", NULL);
+            free (base);
+            if (!g_mkdtemp (work)) {
+                printf("mkdtemp in '%s' failed: %s\n", dirs[i], g_strerror (errno));
+                g_free (work);
+                continue;
+            }
+            g_ptr_array_add (workDirs, work);
+            if (!load_map_repositories (work, mapped)) {
+                mapFailed = TRUE;
+                break;
+            }
+        }
+        g_strfreev (dirs);
+        if (mapFailed) {
+            break;
+        }
+        if (0 == workDirs->len) {
+            printf("no usable directory\n");
+            break;
+        }
+
+        // 所有请求都在本进程内执行, 不转发给可能在运行的备份服务
+        backup_daemon_set_socket (NULL);
+        backup_file_register ();
+
+        if (gsCsv) {
+            csv = fopen (gsCsv, "w");
+            if (!csv) {
+                printf("open '%s' failed: %s\n", gsCsv, g_strerror (errno));
+                break;
+            }
+            fprintf (csv, "elapsed,op,count,errors,bytes,ops_per_sec,mb_per_sec,p50_us,p99_us,p999_us,max_us\n");
+        }
+
+        GRand* rand = g_rand_new ();
+        gsPool = g_malloc (LOAD_POOL_SIZE);
+        for (int i = 0; i < LOAD_POOL_SIZE / 4; ++i) {
+            ((guint32*) gsPool)[i] = g_rand_int (rand);
+        }
+        g_rand_free (rand);
+
+        printf("clients: %d, files/client: %d, seconds: %d, mounts: %u\n", gsClients, gsFiles, gsSeconds, g_hash_table_size (mapped));
+        for (guint i = 0; i < workDirs->len; ++i) {
+            printf("  %s\n", (char*) workDirs->pdata[i]);
+        }
+
+        // 初始文件不计入统计
+        clients = g_new0 (LoadClient, gsClients);
+        guint64 initBytes = 0;
+        for (int i = 0; i < gsClients; ++i) {
+            LoadClient* c = &clients[i];
+            c->id = i;
+            c->dir = g_strdup_printf ("%s/client-%03d", (char*) workDirs->pdata[i % workDirs->len], i);
+            c->rand = g_rand_new ();
+            c->fileN = gsFiles;
+            c->files = g_new0 (LoadFile, gsFiles);
+            g_mutex_init (&c->lock);
+            g_mkdir_with_parents (c->dir, 0755);
+            for (guint j = 0; j < c->fileN; ++j) {
+                LoadFile* f = &c->files[j];
+                f->path = g_strdup_printf ("%s/f%03u.dat", c->dir, j);
+                f->restorePrefix = g_strdup_printf ("f%03u-", j);
+                f->size = load_pick_size (c->rand);
+                load_write_new (f->path, f->size, c->rand);
+                initBytes += f->size;
+            }
+        }
+        printf("initial data: %.1f MB\n\n", (double) initBytes / (1024 * 1024));
+        printf("%8s %-10s %9s %9s %9s %9s %9s %9s %9s %7s\n",
+               "time(s)", "op", "ops", "ops/s", "MB/s", "p50(ms)", "p99(ms)", "p999(ms)", "max(ms)", "errors");
+
+        struct sigaction sa;
+        memset (&sa, 0, sizeof (sa));
+        sa.sa_handler = load_on_signal;
+        sigaction (SIGINT, &sa, NULL);
+        sigaction (SIGTERM, &sa, NULL);
+
+        total = g_new0 (LoadHist, LOAD_OP_N);
+        const gint64 start = g_get_monotonic_time ();
+        gsDeadline = start + (gint64) gsSeconds * G_USEC_PER_SEC;
+
+        threads = g_new0 (GThread*, gsClients);
+        for (int i = 0; i < gsClients; ++i) {
+            threads[i] = g_thread_new ("load", load_client_thread, &clients[i]);
+        }
+
+        gint64 last = start;
+        while (!gsStop) {
+            const gint64 now = g_get_monotonic_time ();
+            if (now >= gsDeadline) {
+                break;
+            }
+            const gint64 next = MIN (last + (gint64) gsInterval * G_USEC_PER_SEC, gsDeadline);
+            if (now < next) {
+                g_usleep (MIN (next - now, G_USEC_PER_SEC / 10));
+                continue;
+            }
+            load_report (clients, gsClients, total, (double) (now - start) / G_USEC_PER_SEC, (double) (now - last) / G_USEC_PER_SEC, csv);
+            last = now;
+        }
+
+        gsStop = 1;
+        for (int i = 0; i < gsClients; ++i) {
+            g_thread_join (threads[i]);
+        }
+
+        const gint64 end = g_get_monotonic_time ();
+        if (end - last > G_USEC_PER_SEC / 10) {
+            load_report (clients, gsClients, total, (double) (end - start) / G_USEC_PER_SEC, (double) (end - last) / G_USEC_PER_SEC, csv);
+        }
+
+        printf("\ntotal\n");
+        guint64 errors = 0;
+        for (int op = 0; op < LOAD_OP_N; ++op) {
+            load_print_row ("all", op, &total[op], (double) (end - start) / G_USEC_PER_SEC, NULL, 0);
+            errors += total[op].errors;
+        }
+
+        ret = (errors > 0) ? 1 : 0;
+    } while (FALSE);
+
+    if (clients) {
+        for (int i = 0; i < gsClients; ++i) {
+            LoadClient* c = &clients[i];
+            for (guint j = 0; c->files && j < c->fileN; ++j) {
+                g_free (c->files[j].path);
+                g_free (c->files[j].restorePrefix);
+            }
+            g_free (c->files);
+            g_free (c->dir);
+            if (c->rand) {
+                g_rand_free (c->rand);
+            }
+            g_mutex_clear (&c->lock);
+        }
+        g_free (clients);
+    }
+
+    for (guint i = 0; i < workDirs->len; ++i) {
+        if (gsKeep) {
+            printf("kept '%s'\n", (char*) workDirs->pdata[i]);
+        }
+        else {
+            load_remove_tree (workDirs->pdata[i]);
+        }
+    }
+
+    if (csv) {
+        fclose (csv);
+    }
+    if (error) {
+        g_error_free (error);
+    }
+    g_free (threads);
+    g_free (total);
+    g_free (gsPool);
+    g_ptr_array_free (workDirs, TRUE);
+    g_hash_table_destroy (mapped);
+    g_option_context_free (opt);
+
+    return ret;
+}
+
+static const char* load_op_name (LoadOp op)
+{
+    switch (op) {
+        case LOAD_OP_BACKUP:    return "backup";
+        case LOAD_OP_RESTORE:   return "restore";
+        case LOAD_OP_QUERY:     return "query";
+        case LOAD_OP_ENUMERATE: return "enumerate";
+        default:                return "?";
+    }
+}
+
+/**
+ * 对数线性分桶: 小于 32 微秒每微秒一个桶, 之后每个 2 的幂区间 32 个桶
+ */
+static guint load_bucket (guint64 us)
+{
+    if (us < LOAD_SUB_N) {
+        return (guint) us;
+    }
+
+    const guint msb = 63 - __builtin_clzll (us);
+    const guint shift = msb - LOAD_SUB_BITS;
+    const guint bucket = (shift + 1) * LOAD_SUB_N + (guint) ((us >> shift) - LOAD_SUB_N);
+
+    return MIN (bucket, LOAD_BUCKET_N - 1);
+}
+
+/**
+ * 桶的中点
+ */
+static guint64 load_bucket_value (guint bucket)
+{
+    if (bucket < LOAD_SUB_N) {
+        return bucket;
+    }
+
+    const guint shift = bucket / LOAD_SUB_N - 1;
+    const guint64 low = (guint64) (LOAD_SUB_N + bucket % LOAD_SUB_N) << shift;
+
+    return low + ((1ULL << shift) >> 1);
+}
+
+static guint64 load_percentile (const LoadHist* hist, double p)
+{
+    if (0 == hist->count) {
+        return 0;
+    }
+
+    guint64 rank = (guint64) (p * (double) hist->count + 0.999999);
+    rank = CLAMP (rank, 1, hist->count);
+
+    guint64 seen = 0;
+    for (guint i = 0; i < LOAD_BUCKET_N; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            return MIN (load_bucket_value (i), hist->max);
+        }
+    }
+
+    return hist->max;
+}
+
+static void load_hist_add (LoadHist* dst, const LoadHist* src)
+{
+    dst->count += src->count;
+    dst->errors += src->errors;
+    dst->bytes += src->bytes;
+    dst->max = MAX (dst->max, src->max);
+    for (guint i = 0; i < LOAD_BUCKET_N; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+static void load_record (LoadClient* c, LoadOp op, gint64 start, gint64 end, gboolean ok, guint64 bytes)
+{
+    const guint64 us = (guint64) MAX (end - start, 0);
+
+    g_mutex_lock (&c->lock);
+    LoadHist* h = &c->hist[op];
+    h->count++;
+    h->bytes += bytes;
+    h->max = MAX (h->max, us);
+    h->buckets[load_bucket (us)]++;
+    if (!ok) {
+        h->errors++;
+    }
+    g_mutex_unlock (&c->lock);
+}
+
+/**
+ * 文档类文件的大小分布: 大多数为几 KB 到几十 KB, 少数为 MB 级, 极少数达到上限
+ */
+static guint64 load_pick_size (GRand* rand)
+{
+    const guint64 max = (guint64) gsMaxSizeMB * 1024 * 1024;
+    const gint r = g_rand_int_range (rand, 0, 100);
+    guint64 size = 0;
+
+    if (r < 45) {
+        size = g_rand_int_range (rand, 1024, 16 * 1024);
+    }
+    else if (r < 75) {
+        size = g_rand_int_range (rand, 16 * 1024, 256 * 1024);
+    }
+    else if (r < 93) {
+        size = g_rand_int_range (rand, 256 * 1024, 2 * 1024 * 1024);
+    }
+    else if (r < 99) {
+        size = g_rand_int_range (rand, 2 * 1024 * 1024, 8 * 1024 * 1024);
+    }
+    else {
+        size = max;
+    }
+
+    return MIN (size, max);
+}
+
+/**
+ * 从随机数据池的随机位置取内容写入, 每次写入的内容都不同
+ */
+static gboolean load_fill (int fd, guint64 offset, guint64 len, GRand* rand)
+{
+    while (len > 0) {
+        const guint64 from = (guint64) g_rand_int_range (rand, 0, LOAD_POOL_SIZE / 2);
+        const guint64 n = MIN (len, (guint64) (LOAD_POOL_SIZE - from));
+        const ssize_t w = pwrite (fd, gsPool + from, n, (off_t) offset);
+        if (w <= 0) {
+            if (w < 0 && EINTR == errno) {
+                continue;
+            }
+            return FALSE;
+        }
+        offset += (guint64) w;
+        len -= (guint64) w;
+    }
+
+    return TRUE;
+}
+
+static gboolean load_write_new (const char* path, guint64 size, GRand* rand)
+{
+    const int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    const gboolean ret = load_fill (fd, 0, size, rand);
+    close (fd);
+
+    return ret;
+}
+
+/**
+ * 模拟一次编辑: 局部改写、追加、整体重写(写临时文件后 rename, 与多数编辑器相同)或不修改直接保存
+ */
+static gboolean load_mutate (LoadClient* c, LoadFile* f)
+{
+    const guint64 max = (guint64) gsMaxSizeMB * 1024 * 1024;
+    const gint r = g_rand_int_range (c->rand, 0, 100);
+    gboolean ret = TRUE;
+
+    if (r < 50 && f->size > 0) {
+        const int fd = open (f->path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return FALSE;
+        }
+        // MIN 会对参数求值两次, 随机数要先取出来
+        const guint64 want = (guint64) g_rand_int_range (c->rand, 512, 64 * 1024);
+        const guint64 len = MIN (f->size, want);
+        const guint64 off = (guint64) g_rand_double_range (c->rand, 0, (double) (f->size - len + 1));
+        ret = load_fill (fd, MIN (off, f->size - len), len, c->rand);
+        close (fd);
+    }
+    else if (r < 70) {
+        const guint64 len = (guint64) g_rand_int_range (c->rand, 1, 64 * 1024);
+        if (f->size + len > max) {
+            f->size = load_pick_size (c->rand);
+            ret = load_write_new (f->path, f->size, c->rand);
+        }
+        else {
+            const int fd = open (f->path, O_WRONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return FALSE;
+            }
+            ret = load_fill (fd, f->size, len, c->rand);
+            f->size += len;
+            close (fd);
+        }
+    }
+    else if (r < 90) {
+        char* tmp = g_strdup_printf ("%s.tmp", f->path);
+        f->size = load_pick_size (c->rand);
+        ret = load_write_new (tmp, f->size, c->rand) && 0 == rename (tmp, f->path);
+        g_free (tmp);
+    }
+
+    return ret;
+}
+
+static LoadFile* load_pick_file (LoadClient* c, gboolean backedUp)
+{
+    const guint hotN = MAX (1, c->fileN * LOAD_HOT_PERCENT / 100);
+
+    for (int tries = 0; tries < 8; ++tries) {
+        const guint idx = (g_rand_int_range (c->rand, 0, 100) < 80)
+            ? (guint) g_rand_int_range (c->rand, 0, hotN)
+            : (guint) g_rand_int_range (c->rand, 0, c->fileN);
+        LoadFile* f = &c->files[idx];
+        if (!backedUp || f->backedUp) {
+            return f;
+        }
+    }
+
+    for (guint i = 0; i < c->fileN; ++i) {
+        if (c->files[i].backedUp) {
+            return &c->files[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 删除恢复出的文件, 避免占满磁盘; 返回删除的字节数
+ */
+static guint64 load_remove_restored (LoadClient* c, const LoadFile* f)
+{
+    guint64 bytes = 0;
+    GDir* dir = g_dir_open (c->dir, 0, NULL);
+    if (!dir) {
+        return 0;
+    }
+
+    const char* name = NULL;
+    while (NULL != (name = g_dir_read_name (dir))) {
+        if (!g_str_has_prefix (name, f->restorePrefix)) {
+            continue;
+        }
+        struct stat sb;
+        char* path = g_build_filename (c->dir, name, NULL);
+        if (0 == stat (path, &sb)) {
+            bytes += (guint64) sb.st_size;
+        }
+        unlink (path);
+        g_free (path);
+    }
+    g_dir_close (dir);
+
+    return bytes;
+}
+
+static void load_query_cb (const char* srcPath, guint64 timestamp, gpointer data)
+{
+    (void) srcPath;
+    (void) timestamp;
+
+    ++*(guint64*) data;
+}
+
+static gboolean load_enumerate (const char* dir, guint64* n)
+{
+    char* uri = g_strdup_printf ("andsec-backup://%s", dir);
+    GFile* file = g_file_new_for_uri (uri);
+    GFileEnumerator* e = g_file_enumerate_children (file, "standard::*", G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+    if (e) {
+        GFileInfo* info = NULL;
+        while (NULL != (info = g_file_enumerator_next_file (e, NULL, NULL))) {
+            ++*n;
+            g_object_unref (info);
+        }
+        g_file_enumerator_close (e, NULL, NULL);
+        g_object_unref (e);
+    }
+
+    g_object_unref (file);
+    g_free (uri);
+
+    return NULL != e;
+}
+
+static gpointer load_client_thread (gpointer data)
+{
+    LoadClient* c = data;
+
+    while (!gsStop && g_get_monotonic_time () < gsDeadline) {
+        guint r = (guint) g_rand_int_range (c->rand, 0, (gint32) gsWeightSum);
+        LoadOp op = LOAD_OP_BACKUP;
+        for (int i = 0; i < LOAD_OP_N; ++i) {
+            if (r < gsWeights[i]) {
+                op = i;
+                break;
+            }
+            r -= gsWeights[i];
+        }
+
+        LoadFile* f = NULL;
+        if (LOAD_OP_RESTORE == op && NULL == (f = load_pick_file (c, TRUE))) {
+            op = LOAD_OP_BACKUP;
+        }
+
+        switch (op) {
+            case LOAD_OP_BACKUP: {
+                f = load_pick_file (c, FALSE);
+                if (!load_mutate (c, f)) {
+                    printf("write '%s' failed: %s\n", f->path, g_strerror (errno));
+                    gsStop = 1;
+                    break;
+                }
+                const gint64 start = g_get_monotonic_time ();
+                const gboolean ok = backup_file_backup_by_abspath (f->path);
+                load_record (c, op, start, g_get_monotonic_time (), ok, f->size);
+                f->backedUp |= ok;
+                break;
+            }
+            case LOAD_OP_RESTORE: {
+                const gint64 start = g_get_monotonic_time ();
+                const gboolean ok = backup_file_restore_by_abspath (f->path);
+                const gint64 end = g_get_monotonic_time ();
+                const guint64 bytes = load_remove_restored (c, f);
+                load_record (c, op, start, end, ok, bytes);
+                break;
+            }
+            case LOAD_OP_QUERY: {
+                // 一半查询最近一分钟, 一半不限时间
+                guint64 n = 0;
+                const guint64 since = g_rand_boolean (c->rand) ? (guint64) time (NULL) - 60 : 0;
+                const gint64 start = g_get_monotonic_time ();
+                const gboolean ok = backup_store_query (NULL, c->dir, since, 0, load_query_cb, &n);
+                load_record (c, op, start, g_get_monotonic_time (), ok, 0);
+                break;
+            }
+            case LOAD_OP_ENUMERATE: {
+                // 多数枚举自己的目录(走索引), 少数枚举根目录(遍历所有 meta)
+                guint64 n = 0;
+                const gboolean root = (0 == g_rand_int_range (c->rand, 0, 16));
+                const gint64 start = g_get_monotonic_time ();
+                const gboolean ok = load_enumerate (root ? "/" : c->dir, &n);
+                load_record (c, op, start, g_get_monotonic_time (), ok, 0);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean load_parse_mix (const char* mix)
+{
+    guint weights[LOAD_OP_N] = {0};
+    gboolean ret = TRUE;
+    char** items = g_strsplit (mix, ",", -1);
+
+    for (int i = 0; ret && items[i]; ++i) {
+        char** kv = g_strsplit (g_strstrip (items[i]), "=", 2);
+        ret = FALSE;
+        if (kv[0] && kv[1] && g_ascii_isdigit (kv[1][0])) {
+            for (int op = 0; op < LOAD_OP_N; ++op) {
+                if (0 == g_strcmp0 (kv[0], load_op_name (op))) {
+                    weights[op] = (guint) MIN (strtoul (kv[1], NULL, 10), 1000000UL);
+                    ret = TRUE;
+                    break;
+                }
+            }
+        }
+        g_strfreev (kv);
+    }
+    g_strfreev (items);
+
+    guint sum = 0;
+    for (int op = 0; op < LOAD_OP_N; ++op) {
+        sum += weights[op];
+    }
+    if (!ret || 0 == sum) {
+        return FALSE;
+    }
+
+    memcpy (gsWeights, weights, sizeof (gsWeights));
+    gsWeightSum = sum;
+
+    return TRUE;
+}
+
+/**
+ * 与库相同, 工作目录的挂载点为 /etc/mtab 中最长的前缀; 多个工作目录位于同一挂载点时仓库放在第一个之下
+ */
+static gboolean load_map_repositories (const char* workDir, GHashTable* mapped)
+{
+    gboolean ret = TRUE;
+    FILE* fr = fopen ("/etc/mtab", "r");
+    if (!fr) {
+        printf("open /etc/mtab failed: %s\n", g_strerror (errno));
+        return FALSE;
+    }
+
+    char* mountPoint = NULL;
+    char line[4096];
+    while (fgets (line, sizeof (line), fr)) {
+        char** fields = g_strsplit_set (line, " \t", -1);
+        const char* mp = (fields[0] && fields[1]) ? fields[1] : NULL;
+        if (mp && '/' == mp[0] && g_str_has_prefix (workDir, mp) && (!mountPoint || strlen (mp) > strlen (mountPoint))) {
+            g_free (mountPoint);
+            mountPoint = g_strdup (mp);
+        }
+        g_strfreev (fields);
+    }
+    fclose (fr);
+
+    if (!mountPoint) {
+        printf("no mount point for '%s'\n", workDir);
+        ret = FALSE;
+    }
+    else if (!g_hash_table_contains (mapped, mountPoint)) {
+        char* repo = g_build_filename (workDir, "repo", NULL);
+        if (backup_store_set_repository_local (mountPoint, repo)) {
+            g_hash_table_add (mapped, mountPoint);
+            mountPoint = NULL;
+        }
+        else {
+            printf("set repository for '%s' failed\n", mountPoint);
+            ret = FALSE;
+        }
+        g_free (repo);
+    }
+    g_free (mountPoint);
+
+    return ret;
+}
+
+static void load_remove_tree (const char* path)
+{
+    struct stat sb;
+    if (0 != lstat (path, &sb)) {
+        return;
+    }
+
+    if (S_ISDIR (sb.st_mode)) {
+        GDir* dir = g_dir_open (path, 0, NULL);
+        if (dir) {
+            const char* name = NULL;
+            while (NULL != (name = g_dir_read_name (dir))) {
+                char* child = g_build_filename (path, name, NULL);
+                load_remove_tree (child);
+                g_free (child);
+            }
+            g_dir_close (dir);
+        }
+        rmdir (path);
+    }
+    else {
+        unlink (path);
+    }
+}
+
+static void load_report (LoadClient* clients, guint clientN, LoadHist* total, double elapsed, double period, FILE* csv)
+{
+    LoadHist* cur = g_new0 (LoadHist, LOAD_OP_N);
+
+    for (guint i = 0; i < clientN; ++i) {
+        LoadClient* c = &clients[i];
+        g_mutex_lock (&c->lock);
+        for (int op = 0; op < LOAD_OP_N; ++op) {
+            load_hist_add (&cur[op], &c->hist[op]);
+        }
+        memset (c->hist, 0, sizeof (c->hist));
+        g_mutex_unlock (&c->lock);
+    }
+
+    char label[32] = {0};
+    g_snprintf (label, sizeof (label), "%.1f", elapsed);
+    for (int op = 0; op < LOAD_OP_N; ++op) {
+        load_print_row (label, op, &cur[op], period, csv, elapsed);
+        load_hist_add (&total[op], &cur[op]);
+    }
+    fflush (stdout);
+
+    g_free (cur);
+}
+
+static void load_print_row (const char* label, LoadOp op, const LoadHist* h, double period, FILE* csv, double elapsed)
+{
+    const double ops = (period > 0) ? (double) h->count / period : 0;
+    const double mbs = (period > 0) ? (double) h->bytes / (1024 * 1024) / period : 0;
+    const guint64 p50 = load_percentile (h, 0.50);
+    const guint64 p99 = load_percentile (h, 0.99);
+    const guint64 p999 = load_percentile (h, 0.999);
+
+    printf("%8s %-10s %9" G_GUINT64_FORMAT " %9.1f %9.2f %9.3f %9.3f %9.3f %9.3f %7" G_GUINT64_FORMAT "\n",
+           label, load_op_name (op), h->count, ops, mbs,
+           p50 / 1000.0, p99 / 1000.0, p999 / 1000.0, h->max / 1000.0, h->errors);
+
+    if (csv) {
+        fprintf (csv, "%.1f,%s,%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%.1f,%.3f,%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT "\n",
+                 elapsed, load_op_name (op), h->count, h->errors, h->bytes, ops, mbs, p50, p99, p999, h->max);
+        fflush (csv);
+    }
+}
+
+static void load_on_signal (int sig)
+{
+    (void) sig;
+
+    gsStop = 1;
+}
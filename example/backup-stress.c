@@ -0,0 +1,192 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 并发压力测试: 多个线程同时执行备份、恢复、枚举、query_info,
+// 其中一部分线程使用各自的 GMainContext 执行异步 query_info
+//
+// 用法: backup-stress [dir] [threads] [seconds]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backup.h"
+
+#define STRESS_FILE_N       32
+
+typedef struct _StressCtx
+{
+    const char*             dir;
+    gint64                  deadline;
+
+    gint                    backups;
+    gint                    restores;
+    gint                    enums;
+    gint                    queries;
+    gint                    failures;
+} StressCtx;
+
+typedef struct _AsyncQuery
+{
+    gboolean                done;
+    GFileInfo*              info;
+} AsyncQuery;
+
+static void stress_write_file (const char* path, guint seq)
+{
+    char buf[256] = {0};
+    const int len = g_snprintf (buf, sizeof(buf), "%s %u\n", path, seq);
+
+    g_file_set_contents (path, buf, len, NULL);
+}
+
+static void stress_query_done (GObject* obj, GAsyncResult* res, gpointer data)
+{
+    AsyncQuery* q = data;
+
+    q->info = g_file_query_info_finish (G_FILE(obj), res, NULL);
+    q->done = TRUE;
+}
+
+static void stress_enumerate (StressCtx* ctx)
+{
+    GFile* root = g_file_new_for_uri ("andsec-backup:///");
+    GFileEnumerator* e = g_file_enumerate_children (root, "standard::*", G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+    if (e) {
+        GFileInfo* info = NULL;
+        while (NULL != (info = g_file_enumerator_next_file (e, NULL, NULL))) {
+            g_object_unref (info);
+        }
+        g_file_enumerator_close (e, NULL, NULL);
+        g_object_unref (e);
+        g_atomic_int_inc (&ctx->enums);
+    }
+    else {
+        g_atomic_int_inc (&ctx->failures);
+    }
+
+    g_object_unref (root);
+}
+
+static void stress_query (StressCtx* ctx, GMainContext* mc, const char* path)
+{
+    GFile* file = backup_file_new_for_path (path);
+    GFileInfo* info = NULL;
+
+    if (mc) {
+        AsyncQuery q = { FALSE, NULL };
+        g_file_query_info_async (file, "standard::*", G_FILE_QUERY_INFO_NONE, G_PRIORITY_DEFAULT, NULL, stress_query_done, &q);
+        while (!q.done) {
+            g_main_context_iteration (mc, TRUE);
+        }
+        info = q.info;
+    }
+    else {
+        info = g_file_query_info (file, "standard::*", G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    }
+
+    if (info) {
+        char* name = g_file_get_basename (file);
+        const char* n = g_file_info_get_name (info);
+        if (!name || !n) {
+            g_atomic_int_inc (&ctx->failures);
+        }
+        g_free (name);
+        g_object_unref (info);
+        g_atomic_int_inc (&ctx->queries);
+    }
+    else {
+        g_atomic_int_inc (&ctx->failures);
+    }
+
+    g_object_unref (file);
+}
+
+static gpointer stress_thread (gpointer data)
+{
+    StressCtx* ctx = data;
+    GRand* rand = g_rand_new ();
+
+    // 一半线程在自己的 GMainContext 里运行, 验证 supports_thread_contexts
+    GMainContext* mc = NULL;
+    if (g_rand_boolean (rand)) {
+        mc = g_main_context_new ();
+        g_main_context_push_thread_default (mc);
+    }
+
+    guint seq = 0;
+    while (g_get_monotonic_time () < ctx->deadline) {
+        char path[512] = {0};
+        g_snprintf (path, sizeof(path), "%s/file-%02d.txt", ctx->dir, g_rand_int_range (rand, 0, STRESS_FILE_N));
+
+        switch (g_rand_int_range (rand, 0, 4)) {
+            case 0: {
+                stress_write_file (path, ++seq);
+                if (backup_file_backup_by_abspath (path)) {
+                    g_atomic_int_inc (&ctx->backups);
+                }
+                break;
+            }
+            case 1: {
+                // 尚未备份过的文件恢复失败是正常的, 只检查不会崩溃或死锁
+                if (backup_file_restore_by_abspath (path)) {
+                    g_atomic_int_inc (&ctx->restores);
+                }
+                break;
+            }
+            case 2: {
+                stress_enumerate (ctx);
+                break;
+            }
+            default: {
+                stress_query (ctx, mc, path);
+                break;
+            }
+        }
+    }
+
+    if (mc) {
+        g_main_context_pop_thread_default (mc);
+        g_main_context_unref (mc);
+    }
+    g_rand_free (rand);
+
+    return NULL;
+}
+
+int main (int argc, char* argv[])
+{
+    const char* dir = (argc > 1) ? argv[1] : "/tmp/andsec-backup-stress";
+    const int threadN = (argc > 2) ? atoi (argv[2]) : 16;
+    const int seconds = (argc > 3) ? atoi (argv[3]) : 10;
+
+    g_return_val_if_fail (threadN > 0 && seconds > 0, 1);
+
+    if (g_mkdir_with_parents (dir, 0755) < 0) {
+        printf("mkdir '%s' failed\n", dir);
+        return 1;
+    }
+
+    backup_file_register ();
+
+    StressCtx ctx;
+    memset (&ctx, 0, sizeof(ctx));
+    ctx.dir = dir;
+    ctx.deadline = g_get_monotonic_time () + (gint64) seconds * G_USEC_PER_SEC;
+
+    GThread** threads = g_new0 (GThread*, threadN);
+    for (int i = 0; i < threadN; ++i) {
+        threads[i] = g_thread_new ("stress", stress_thread, &ctx);
+    }
+    for (int i = 0; i < threadN; ++i) {
+        g_thread_join (threads[i]);
+    }
+    g_free (threads);
+
+    printf("threads: %d, seconds: %d\n", threadN, seconds);
+    printf("backup: %d, restore: %d, enumerate: %d, query: %d, failure: %d\n",
+           ctx.backups, ctx.restores, ctx.enums, ctx.queries, ctx.failures);
+
+    return ctx.failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_BACKUP_PRIVATE_H
+#define gvfs_backup_BACKUP_PRIVATE_H
+#include "backup.h"
+
+G_BEGIN_DECLS
+
+#define BREAK_IF_FAIL(x)        if (!(x)) { break; }
+#define BREAK_NULL(x)           if ((x) == NULL) { break; }
+#define NOT_NULL_RUN(x,f,...)   G_STMT_START if (x) { f(x, ##__VA_ARGS__); x = NULL; } G_STMT_END
+#define BACKUP_KEY_SIZE         33                      // 路径 MD5 的十六进制形式, 含结尾 '\0'
+#define BACKUP_META_BAD_MARK    '!'                     // 巡检发现损坏的版本, 在 meta 中其 MD5 前加此标记
+#define G_OBJ_FREE(x)           G_STMT_START if (G_IS_OBJECT(x)) {g_object_unref (G_OBJECT(x)); x = NULL;} G_STMT_END
+
+typedef struct _BackupMetaFile
+{
+    int                     version;
+    char*                   srcFilePath;
+    char*                   srcFilePathMD5;
+
+    char*                   backupFileCtxMD51;
+    char*                   backupFileCtxMD52;
+    char*                   backupFileCtxMD53;
+
+    guint64                 backupFileTimestamp1;
+    guint64                 backupFileTimestamp2;
+    guint64                 backupFileTimestamp3;
+} BackupMetaFile;
+
+static inline char** backup_meta_slot_ctx (BackupMetaFile* info, int slot)
+{
+    switch (slot) {
+        case 1: return &info->backupFileCtxMD51;
+        case 2: return &info->backupFileCtxMD52;
+        case 3: return &info->backupFileCtxMD53;
+        default: return NULL;
+    }
+}
+
+static inline guint64* backup_meta_slot_timestamp (BackupMetaFile* info, int slot)
+{
+    switch (slot) {
+        case 1: return &info->backupFileTimestamp1;
+        case 2: return &info->backupFileTimestamp2;
+        case 3: return &info->backupFileTimestamp3;
+        default: return NULL;
+    }
+}
+
+/**
+ * 该版本存在且未被巡检标记为损坏, 恢复时只使用这样的版本
+ */
+static inline gboolean backup_meta_slot_good (BackupMetaFile* info, int slot)
+{
+    const char* ctx = *backup_meta_slot_ctx (info, slot);
+
+    return ctx && BACKUP_META_BAD_MARK != ctx[0];
+}
+
+GList*      get_all_mount_points            ();
+char*       get_mount_point_by_path         (const char* path);
+gboolean    backup_path_key                 (const char* path, char key[BACKUP_KEY_SIZE]);
+
+/**
+ * 立即同步备份, 不经过合并队列
+ */
+gboolean    backup_file_backup_now          (const char* path);
+
+/**
+ * 与 backup_file_backup_now 相同, 但内容从 openat(dirFd, name) 打开的文件读取(不跟随符号链接),
+ * path 只用作 key 与记录的源路径; 目录树备份用它避免按路径重新解析时目录被替换. 转发给守护进程时仍按 path 备份
+ */
+gboolean    backup_file_backup_at           (int dirFd, const char* name, const char* path);
+
+/**
+ * 内容从已打开的 fd 读取, path 只用作 key 与记录的源路径
+ */
+gboolean    backup_file_backup_fd           (int fd, const char* path);
+
+/**
+ * 最新版本是 since(秒)之后写入的则标记为损坏, 恢复时跳过; 用于备份期间源文件被改写、内容可能是新旧混合的版本
+ */
+gboolean    backup_file_mark_torn           (const char* path, guint64 since);
+
+/**
+ * 合并队列开启时登记请求并返回 TRUE, 否则返回 FALSE
+ */
+gboolean    backup_queue_submit             (const char* path);
+
+void        backup_meta_free                (BackupMetaFile* info);
+gboolean    backup_meta_parse_file_path     (BackupMetaFile* info/*in*/, const char* filePath);
+gboolean    backup_meta_parse_at            (BackupMetaFile* info/*in*/, int dirFd, const char* relPath);
+gboolean    backup_meta_save                (const BackupMetaFile* info, const char* filePathMD5, const char* mountPoint);
+gboolean    backup_meta_parse               (BackupMetaFile* info/*in*/, const char* filePath, const char* filePathMD5, const char* mountPoint);
+
+G_END_DECLS
+
+#endif // gvfs_backup_BACKUP_PRIVATE_H
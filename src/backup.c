@@ -2,16 +2,27 @@
 // Created by dingjing on 1/8/25.
 //
 #include "backup.h"
+#include "trace.h"
+#include "hash.h"
+#include "dedup.h"
+#include "pack.h"
+#include "delta.h"
+#include "cache.h"
+#include "monitor.h"
+#include "index.h"
+#include "store.h"
+#include "copy.h"
+#include "io.h"
+#include "daemon.h"
+#include "backup-private.h"
 
 #include <time.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
-#define BREAK_IF_FAIL(x)        if (!(x)) { break; }
-#define BREAK_NULL(x)           if ((x) == NULL) { break; }
-#define NOT_NULL_RUN(x,f,...)   G_STMT_START if (x) { f(x, ##__VA_ARGS__); x = NULL; } G_STMT_END
-#define G_OBJ_FREE(x)           G_STMT_START if (G_IS_OBJECT(x)) {g_object_unref (G_OBJECT(x)); x = NULL;} G_STMT_END
-
 typedef enum
 {
     PROP_0,
@@ -24,10 +35,15 @@ struct _BackupFile
 {
     GObject                 parent;
 
-    char*                   filePath;
-    char*                   fileURI;
+    char*                   fileURI;        // <schema>://<path>, path 与 basename 都指向这块内存内部
+    guint                   pathOffset;
+    guint                   baseOffset;
+    guint                   hash;
 };
 
+#define BACKUP_FILE_PATH(f)         ((f)->fileURI ? (f)->fileURI + (f)->pathOffset : NULL)
+#define BACKUP_FILE_BASENAME(f)     ((f)->fileURI ? (f)->fileURI + (f)->baseOffset : NULL)
+
 struct _BackupFileEnum
 {
     GFileEnumerator         parent;
@@ -35,22 +51,8 @@ struct _BackupFileEnum
     GList*                  iter;
 };
 
-typedef struct _BackupMetaFile
-{
-    int                     version;
-    char*                   srcFilePath;
-    char*                   srcFilePathMD5;
-
-    char*                   backupFileCtxMD51;
-    char*                   backupFileCtxMD52;
-    char*                   backupFileCtxMD53;
-
-    guint64                 backupFileTimestamp1;
-    guint64                 backupFileTimestamp2;
-    guint64                 backupFileTimestamp3;
-} BackupMetaFile;
-
 static void backup_file_init                    (BackupFile* self);
+static void backup_file_finalize                (GObject* object);
 static void backup_file_interface_init          (GFileIface* interface);
 static void backup_file_class_init              (BackupFileClass* klass);
 static void backup_file_get_property            (GObject* object, guint id, GValue* value, GParamSpec* spec);
@@ -58,6 +60,9 @@ static void backup_file_set_property            (GObject* object, guint id, cons
 
 static void backup_file_enum_init               (BackupFileEnum* self);
 static void backup_file_enum_class_init         (BackupFileEnumClass* klass);
+static void backup_file_enum_load_all           (BackupFileEnum* self);
+static void backup_file_enum_query_cb           (const char* srcPath, guint64 timestamp, gpointer data);
+static gboolean backup_file_enum_parse_query    (const char* query, guint64* since, guint64* until);
 static GFileEnumerator* vfs_file_enum_children  (GFile* file, const char* attribute, GFileQueryInfoFlags flags, GCancellable* cancel, GError** error);
 
 
@@ -83,33 +88,34 @@ static GFile*       vfs_resolve_relative_path       (GFile* file, const char* re
 static GFile*       vfs_get_child_for_display_name  (GFile* file, const char* displayName, GError** error);
 static GFileInfo*   vfs_file_query_fs_info          (GFile* file, const char* attr, GCancellable* cancel, GError** error);
 static GFileInfo*   vfs_file_query_info             (GFile* file, const char* attr, GFileQueryInfoFlags flags, GCancellable* cancel, GError** error);
+static GFileMonitor* vfs_file_monitor_dir           (GFile* file, GFileMonitorFlags flags, GCancellable* cancel, GError** error);
+static GFileMonitor* vfs_file_monitor_file          (GFile* file, GFileMonitorFlags flags, GCancellable* cancel, GError** error);
 static gboolean     vfs_file_backup_restore         (GFile* src, GFile* dest, GFileCopyFlags flags, GCancellable* cancel, GFileProgressCallback progress, gpointer uData, GError** error);
 
 static GFileInfo*   vfs_file_enum_next_file         (GFileEnumerator *enumerator, GCancellable *cancellable, GError **error);
 static gboolean     vfs_file_enum_close             (GFileEnumerator *enumerator, GCancellable *cancellable, GError **error);
 
-static GList*       get_all_mount_points            ();
 static char*        read_line                       (FILE* fr);
+static gboolean     meta_parse_content              (BackupMetaFile* info, const char* content);
 static char*        get_mount_point_by_uri          (GFile* file);
-static void         file_path_format                (char* filePath);
+static gsize        file_path_canonicalize          (const char* path, char* out);
 static void         file_name_to_lower              (char* fileName);
-static char*        get_file_content_md5            (const char* path);
-static char*        get_file_path_md5               (const char* path);
+static guint64      get_file_size                   (GFile* file);
+static gboolean     file_copy                       (GFile* src, GFile* dst, GFileCopyFlags flags, const char* tracePath, GError** error);
+static gboolean     version_write                   (BackupStore* store, const char* key, int slot, GFile* src, GFile* dst, const char* path, const char* ctxMD5, const BackupDelta* delta, GError** error);
+static gboolean     version_read                    (BackupStore* store, const char* key, int slot, BackupMetaFile* meta, GFile* dst, const char* path, GError** error);
 static gboolean     make_backup_dirs_if_needed      (const char* mountPoint);
 static gint         mount_point_compare             (gconstpointer a, gconstpointer b);
-static gboolean     do_backup                       (const char* path, const char* mountPoint);
+static gboolean     do_backup                       (const char* path, const char* mountPoint, gboolean* noSpace/*out*/);
 static gboolean     do_restore                      (const char* path, const char* mountPoint);
 static gboolean     vfs_backup                      (GFile* file1, BackupFile* file2, GError** error);
 static gboolean     vfs_restore                     (BackupFile* file1, GFile* file2, GError** error);
 static char*        file_get_restore_path           (const char* srcFilePath, const char* extName, guint64 timestamp);
 
-static void         backup_meta_free                (BackupMetaFile* info);
-static gboolean     backup_meta_parse_file_path     (BackupMetaFile* info/*in*/, const char* filePath);
-static gboolean     backup_meta_save                (const BackupMetaFile* info, const char* filePathMD5, const char* mountPoint);
-static gboolean     backup_meta_parse               (BackupMetaFile* info/*in*/, const char* filePath, const char* filePathMD5, const char* mountPoint);
-
 
 static GParamSpec* gsBackupFileProperty[PROP_N] = { NULL };
+static gint gsMetaTmpSeq = 0;                                   // meta 临时文件序号, 原子递增
+static GPrivate gsBackupSource = G_PRIVATE_INIT (g_free);       // 本线程读取源文件内容用的路径, NULL 时就是源路径
 static const char* gsFileExt[] = {
     ".tar.gz",
     ".tar.xz",
@@ -144,10 +150,14 @@ static const char* gsFileExt[] = {
 };
 
 
+G_DEFINE_QUARK(andsec-backup-error-quark, backup_error)
+
 GFile* backup_file_new_for_uri (const gchar* uri)
 {
     g_return_val_if_fail(uri && !strncmp(uri, BACKUP_STR, strlen(BACKUP_STR)) && (strlen(uri) > strlen(BACKUP_STR) + 3), NULL);
 
+    backup_file_register();
+
     BackupFile* self = BACKUP_FILE(g_object_new(BACKUP_FILE_TYPE, "s-path", uri + strlen(BACKUP_STR) + 3, NULL));
 
     return (GFile*) self;
@@ -157,6 +167,8 @@ GFile* backup_file_new_for_path (const gchar* path)
 {
     g_return_val_if_fail(path && '/' == path[0], NULL);
 
+    backup_file_register();
+
     BackupFile* self = BACKUP_FILE(g_object_new(BACKUP_FILE_TYPE, "s-path", path, NULL));
 
     return (GFile*) self;
@@ -177,18 +189,123 @@ gboolean backup_file_backup_by_abspath(const char* path)
 {
     g_return_val_if_fail (path && '/' == path[0], FALSE);
 
+    // 开启合并队列时只登记请求, 由队列按窗口与最小间隔执行
+    if (backup_queue_submit(path)) {
+        return TRUE;
+    }
+
+    return backup_file_backup_now(path);
+}
+
+gboolean backup_file_backup_now(const char* path)
+{
+    g_return_val_if_fail (path && '/' == path[0], FALSE);
+
     gboolean result = FALSE;
+    GError* error = NULL;               // free
 
     GFile* file = g_file_new_for_path (path);
     GFile* bf = backup_file_new_for_path("/");
-    result = g_file_copy(file, bf, 0, NULL, NULL, NULL, NULL);
+    result = g_file_copy(file, bf, 0, NULL, NULL, NULL, &error);
+    const gboolean noSpace = g_error_matches(error, BACKUP_ERROR, G_IO_ERROR_NO_SPACE);
 
+    NOT_NULL_RUN(error, g_error_free);
     NOT_NULL_RUN(bf, g_object_unref);
     NOT_NULL_RUN(file, g_object_unref);
 
+    // 配额不足被拒绝时置 errno, 守护进程据此回复 ENOSPC
+    if (!result) {
+        errno = noSpace ? ENOSPC : EIO;
+    }
+
+    return result;
+}
+
+gboolean backup_file_backup_at(int dirFd, const char* name, const char* path)
+{
+    g_return_val_if_fail (dirFd >= 0 && name && path && '/' == path[0], FALSE);
+
+    gboolean result = FALSE;
+    struct stat statBuf;
+
+    // O_NONBLOCK 防止打开期间被换成管道时阻塞
+    const int fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    if (0 == fstat(fd, &statBuf) && S_ISREG(statBuf.st_mode)) {
+        result = backup_file_backup_fd(fd, path);
+    }
+    else {
+        errno = EIO;
+    }
+    close(fd);
+
+    return result;
+}
+
+gboolean backup_file_backup_fd(int fd, const char* path)
+{
+    g_return_val_if_fail (fd >= 0 && path && '/' == path[0], FALSE);
+
+    // 经由 /proc/self/fd 读到的总是已打开的这个文件
+    g_private_replace(&gsBackupSource, g_strdup_printf("/proc/self/fd/%d", fd));
+    const gboolean result = backup_file_backup_now(path);
+    g_private_replace(&gsBackupSource, NULL);
+
     return result;
 }
 
+gboolean backup_file_mark_torn(const char* path, guint64 since)
+{
+    g_return_val_if_fail (path && '/' == path[0], FALSE);
+
+    gboolean ret = FALSE;
+    char key[BACKUP_KEY_SIZE];
+    BackupMetaFile meta;                // free
+    char* mountPoint = NULL;            // free
+    BackupStore* store = NULL;
+
+    memset(&meta, 0, sizeof(BackupMetaFile));
+
+    do {
+        mountPoint = get_mount_point_by_path(path);
+        BREAK_NULL(mountPoint);
+        store = backup_store_get(mountPoint);
+        BREAK_NULL(store);
+        BREAK_IF_FAIL(backup_path_key(path, key));
+
+        backup_store_lock_key(store, key);
+        if (backup_meta_parse(&meta, path, key, mountPoint)) {
+            // 只看最新的版本, 它是 since 之后写入的才是本次备份
+            for (int slot = 3; slot >= 1; --slot) {
+                const char* ctxMD5 = *backup_meta_slot_ctx(&meta, slot);
+                if (!ctxMD5) {
+                    continue;
+                }
+                if (backup_meta_slot_good(&meta, slot) && *backup_meta_slot_timestamp(&meta, slot) >= since) {
+                    char* bad = g_strdup_printf("%c%s", BACKUP_META_BAD_MARK, ctxMD5);
+                    STR_FREE(*backup_meta_slot_ctx(&meta, slot));
+                    *backup_meta_slot_ctx(&meta, slot) = bad;
+                    ret = backup_meta_save(&meta, key, mountPoint);
+                }
+                break;
+            }
+        }
+        backup_store_unlock_key(store, key);
+    } while (FALSE);
+
+    if (ret) {
+        backup_monitor_notify(path, G_FILE_MONITOR_EVENT_CHANGED);
+    }
+
+    backup_meta_free(&meta);
+    STR_FREE(mountPoint);
+
+    return ret;
+}
+
 gboolean backup_file_restore(GFile* self)
 {
     g_return_val_if_fail (BACKUP_IS_FILE(self), FALSE);
@@ -230,87 +347,157 @@ static void backup_file_init (BackupFile* self)
 
 }
 
+static void backup_file_finalize (GObject* object)
+{
+    BackupFile* self = BACKUP_FILE (object);
+
+    STR_FREE(self->fileURI);
+
+    G_OBJECT_CLASS(backup_file_parent_class)->finalize(object);
+}
+
+typedef struct _BackupFileEnumScan
+{
+    BackupFileEnum*         self;
+    BackupStore*            store;
+    char*                   paths[IO_BATCH_N];  // 开启 io_uring 时攒够一批再一起读取
+    guint                   pathN;
+} BackupFileEnumScan;
+
+static void backup_file_enum_add (BackupFileEnumScan* scan, BackupMetaFile* bf)
+{
+    if (bf->srcFilePath) {
+        scan->self->files = g_list_prepend (scan->self->files, bf->srcFilePath);
+        bf->srcFilePath = NULL;
+    }
+}
+
+static void backup_file_enum_flush (BackupFileEnumScan* scan)
+{
+    char* contents[IO_BATCH_N];
+    gsize lens[IO_BATCH_N];
+    BackupMetaFile bf;
+
+    const gboolean batched = backup_io_read_files((const char* const*) scan->paths, scan->pathN, contents, lens);
+    for (guint i = 0; i < scan->pathN; ++i) {
+        memset(&bf, 0, sizeof(BackupMetaFile));
+        if (batched) {
+            if (contents[i] && meta_parse_content(&bf, contents[i])) {
+                backup_file_enum_add(scan, &bf);
+            }
+            STR_FREE(contents[i]);
+        }
+        else if (backup_meta_parse_file_path(&bf, scan->paths[i])) {
+            backup_file_enum_add(scan, &bf);
+        }
+        backup_meta_free(&bf);
+        STR_FREE(scan->paths[i]);
+    }
+    scan->pathN = 0;
+}
+
+static void backup_file_enum_meta_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    BackupFileEnumScan* scan = data;
+
+    BackupMetaFile bf;
+    memset(&bf, 0, sizeof(BackupMetaFile));
+
+    // 批量读取跨越多次回调, 那时 dirFd 已经关闭, 只能记下绝对路径
+    if (backup_io_uring_enabled()) {
+        scan->paths[scan->pathN++] = g_strdup_printf("%s/meta/%s", scan->store->root, relPath);
+        if (IO_BATCH_N == scan->pathN) {
+            backup_file_enum_flush(scan);
+        }
+    }
+    else if (backup_meta_parse_at(&bf, dirFd, name)) {
+        backup_file_enum_add(scan, &bf);
+    }
+    backup_meta_free(&bf);
+}
+
 static void backup_file_enum_init (BackupFileEnum* self)
 {
     g_return_if_fail(BACKUP_IS_FILE_ENUM(self));
 
-    char* path = NULL;
+    // 由 vfs_file_enum_children() 按所枚举的路径填充
     self->files = NULL;
-    GFile* file = NULL;
-    GFile* iterFile= NULL;
-    GFileEnumerator* fe = NULL;
-    GFileInfo* iterFileInfo = NULL;
+    self->iter = NULL;
+}
+
+static void backup_file_enum_load_all (BackupFileEnum* self)
+{
+    BackupFileEnumScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.self = self;
+
+    // 不论仓库处于哪种目录布局(包括迁移中途), 都逐层遍历 meta/
     GList* mp = get_all_mount_points();
     for (GList* itr = mp; itr; itr = itr->next) {
-        NOT_NULL_RUN(path, g_free);
-        path = g_strdup_printf("%s/.%s/meta", (char*) itr->data, BACKUP_STR);
-        if (path) {
-            NOT_NULL_RUN(file, g_object_unref);
-            file = g_file_new_for_path (path);
-            if (G_IS_FILE(file)) {
-                if (g_file_query_exists(file, NULL)) {
-                    NOT_NULL_RUN(fe, g_object_unref);
-                    fe = g_file_enumerate_children(file, "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, NULL);
-                    if (G_IS_FILE_ENUMERATOR(fe)) {
-                        do {
-                            // g_file_enumerator_iterate(fe, NULL, &iterFile, NULL, NULL);
-                            NOT_NULL_RUN(iterFile, g_object_unref);
-                            NOT_NULL_RUN(iterFileInfo, g_object_unref);
-                            iterFileInfo = g_file_enumerator_next_file(fe, NULL, NULL);
-                            if (NULL == iterFileInfo) {
-                                break;
-                            }
-
-                            char* uriT = g_file_info_get_attribute_as_string(iterFileInfo, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
-                            BREAK_NULL(uriT);
-
-                            iterFile = g_file_new_for_uri (uriT);
-                            STR_FREE(uriT);
-                            BREAK_NULL(iterFile);
-
-                            char* dir = g_file_get_path(iterFile);
-                            NOT_NULL_RUN(dir, g_object_unref);
-                            BREAK_NULL(dir);
-
-                            BackupMetaFile bf;
-                            memset(&bf, 0, sizeof(BackupMetaFile));
-                            if (backup_meta_parse_file_path(&bf, dir)) {
-                                if (bf.srcFilePath) {
-                                    self->files = g_list_append (self->files, g_strdup(bf.srcFilePath));
-                                    // printf("==>%s\n", bf.srcFilePath);
-                                }
-                            }
-                            STR_FREE(dir);
-                            backup_meta_free(&bf);
-                        } while (TRUE);
-                    }
-                }
-            }
+        scan.store = backup_store_get(itr->data);
+        if (scan.store) {
+            backup_store_walk(scan.store, "meta", backup_file_enum_meta_cb, &scan);
         }
     }
-    NOT_NULL_RUN(path, g_free);
-    NOT_NULL_RUN(fe, g_object_unref);
-    NOT_NULL_RUN(file, g_object_unref);
-    NOT_NULL_RUN(iterFile, g_object_unref);
-    NOT_NULL_RUN(iterFileInfo, g_object_unref);
+    if (scan.pathN > 0) {
+        backup_file_enum_flush(&scan);
+    }
     NOT_NULL_RUN(mp, g_list_free_full, g_free);
+}
 
-    self->iter = self->files;
+static void backup_file_enum_query_cb (const char* srcPath, guint64 timestamp, gpointer data)
+{
+    BackupFileEnum* self = data;
+
+    self->files = g_list_prepend (self->files, g_strdup(srcPath));
+
+    (void) timestamp;
+}
+
+/**
+ * since=<秒>&until=<秒>, 负数表示相对于当前时间; 含有其它内容时返回 FALSE, '?' 按文件名的一部分处理
+ */
+static gboolean backup_file_enum_parse_query (const char* query, guint64* since, guint64* until)
+{
+    gboolean ret = TRUE;
+    const gint64 now = (gint64) time(NULL);
+    char** params = g_strsplit(query, "&", -1);
+
+    for (int i = 0; params && params[i] && ret; ++i) {
+        gint64 value = 0;
+        const char* eq = strchr(params[i], '=');
+        ret = eq && g_ascii_string_to_signed(eq + 1, 10, G_MININT64, G_MAXINT64, &value, NULL);
+        if (ret) {
+            const guint64 t = (guint64) MAX(value < 0 ? now + value : value, 0);
+            if (0 == strncmp(params[i], "since", eq - params[i]) && 5 == eq - params[i]) {
+                *since = t;
+            }
+            else if (0 == strncmp(params[i], "until", eq - params[i]) && 5 == eq - params[i]) {
+                *until = t;
+            }
+            else {
+                ret = FALSE;
+            }
+        }
+    }
+    NOT_NULL_RUN(params, g_strfreev);
+
+    return ret;
 }
 
 static void backup_file_class_init (BackupFileClass* klass)
 {
     GObjectClass* objClass = G_OBJECT_CLASS (klass);
 
+    objClass->finalize = backup_file_finalize;
     objClass->get_property = backup_file_get_property;
     objClass->set_property = backup_file_set_property;
 
-    gsBackupFileProperty[PROP_FILE_PATH] = g_param_spec_string ("s-path", "Path", "", NULL, G_PARAM_READWRITE);
-    gsBackupFileProperty[PROP_FILE_URI]  = g_param_spec_string ("s-uri", "URI", "", NULL, G_PARAM_READWRITE);
+    // 构造后不可修改, 同一个对象可以在多个线程间共享而无需加锁
+    gsBackupFileProperty[PROP_FILE_PATH] = g_param_spec_string ("s-path", "Path", "", NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+    gsBackupFileProperty[PROP_FILE_URI]  = g_param_spec_string ("s-uri", "URI", "", NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
     g_object_class_install_properties(objClass, PROP_N, gsBackupFileProperty);
-
-    backup_file_register();
 }
 
 static void backup_file_enum_class_init (BackupFileEnumClass* klass)
@@ -353,7 +540,7 @@ static void backup_file_get_property (GObject* object, guint id, GValue* value,
 
     switch ((BackupFileProperty) id) {
         case PROP_FILE_PATH: {
-            g_value_set_string(value, self->filePath);
+            g_value_set_string(value, BACKUP_FILE_PATH(self));
             break;
         }
         case PROP_FILE_URI: {
@@ -369,32 +556,41 @@ static void backup_file_get_property (GObject* object, guint id, GValue* value,
     }
 }
 
+/**
+ * 规范化一次后把 URI、路径、文件名放在同一块内存里, 并预先计算 hash, 之后的访问都不再分配内存
+ */
 static void backup_file_set_path_and_uri(BackupFile* obj, const char* pu)
 {
     g_return_if_fail (BACKUP_IS_FILE(obj) && pu);
 
-    const int puLen = (int) strlen (pu);
-    const int schemaLen = (int) strlen(BACKUP_STR);
+    const gsize schemaLen = strlen(BACKUP_STR);
 
     STR_FREE(obj->fileURI);
-    STR_FREE(obj->filePath);
+    obj->pathOffset = 0;
+    obj->baseOffset = 0;
+    obj->hash = 0;
 
-    // format
-    char* dupPath = NULL;
-    if ((puLen - schemaLen >= 3) && (0 == strncmp(pu, BACKUP_STR, schemaLen)) && ('/' == pu[schemaLen + 3])) {
-        dupPath = g_strdup(pu + schemaLen + 4);
+    const char* path = NULL;
+    if (0 == strncmp(pu, BACKUP_STR, schemaLen) && 0 == strncmp(pu + schemaLen, "://", 3) && '/' == pu[schemaLen + 3]) {
+        path = pu + schemaLen + 3;
     }
-    else if (puLen > 0 && '/' == pu[0]) {
-        dupPath = g_strdup(pu);
+    else if ('/' == pu[0]) {
+        path = pu;
     }
+    g_return_if_fail (path);
 
-    if (dupPath) {
-        file_path_format(dupPath);
-        obj->filePath = g_strdup (dupPath);
-        obj->fileURI = g_strdup_printf ("%s://%s", BACKUP_STR, dupPath);
-    }
+    // 规范化后的路径不会比原路径长
+    char* uri = g_malloc (schemaLen + 3 + strlen(path) + 1);
+    memcpy(uri, BACKUP_STR "://", schemaLen + 3);
+
+    char* out = uri + schemaLen + 3;
+    const gsize pathLen = file_path_canonicalize(path, out);
+    const char* base = (pathLen > 1) ? strrchr(out, '/') + 1 : out;
 
-    STR_FREE (dupPath);
+    obj->fileURI = uri;
+    obj->pathOffset = (guint) (schemaLen + 3);
+    obj->baseOffset = (guint) (base - uri);
+    obj->hash = g_str_hash(uri);
 }
 
 static void backup_file_interface_init (GFileIface* interface)
@@ -411,12 +607,14 @@ static void backup_file_interface_init (GFileIface* interface)
     interface->get_uri_scheme               = vfs_get_uri_schema;
     interface->query_info                   = vfs_file_query_info;
     interface->enumerate_children           = vfs_file_enum_children;
+    interface->monitor_dir                  = vfs_file_monitor_dir;
+    interface->monitor_file                 = vfs_file_monitor_file;
     interface->query_filesystem_info        = vfs_file_query_fs_info;
     interface->move                         = vfs_file_backup_restore;
     interface->copy                         = vfs_file_backup_restore;
     interface->resolve_relative_path        = vfs_resolve_relative_path;
     interface->get_child_for_display_name   = vfs_get_child_for_display_name;
-    interface->supports_thread_contexts     = FALSE;
+    interface->supports_thread_contexts     = TRUE;
 }
 
 static GFile* vfs_lookup (GVfs* vfs, const char* uri, gpointer data)
@@ -435,50 +633,21 @@ static char* vfs_get_basename (GFile* file)
 {
     g_return_val_if_fail(BACKUP_IS_FILE(file), NULL);
 
-    char** strArr = NULL;
-    char* basename = NULL;
-    char* path = vfs_get_path(file);
-    if (path) {
-        strArr = g_strsplit(path, "/", -1);
-        if (g_strv_length(strArr) > 1) {
-            for (int i = 0; strArr[i]; i++) {
-                if (strArr[i] && (strArr[i + 1] == NULL)) {
-                    basename = g_strdup(strArr[i]);
-                }
-            }
-        }
-    }
-
-    STR_FREE(path);
-    NOT_NULL_RUN(strArr, g_strfreev);
-
-    return basename;
+    return g_strdup(BACKUP_FILE_BASENAME(BACKUP_FILE(file)));
 }
 
 static char* vfs_get_uri (GFile* file)
 {
     g_return_val_if_fail(BACKUP_IS_FILE(file), NULL);
 
-    GValue value = G_VALUE_INIT;
-    g_value_init (&value, G_TYPE_STRING);
-
-    g_object_get_property (G_OBJECT (file), "s-uri", &value);
-
-    return g_value_dup_string (&value);
+    return g_strdup(BACKUP_FILE(file)->fileURI);
 }
 
 static char* vfs_get_path (GFile* file)
 {
     g_return_val_if_fail(BACKUP_IS_FILE(file), NULL);
 
-    GValue value = G_VALUE_INIT;
-    g_value_init (&value, G_TYPE_STRING);
-
-    g_object_get_property (G_OBJECT (file), "s-path", &value);
-
-    char* path = g_value_dup_string (&value);
-
-    return path;
+    return g_strdup(BACKUP_FILE_PATH(BACKUP_FILE(file)));
 }
 
 static char* vfs_get_uri_schema (GFile* file)
@@ -502,7 +671,7 @@ static gboolean vfs_is_equal (GFile* file, GFile* file2)
     const BackupFile* s1 = BACKUP_FILE (file);
     const BackupFile* s2 = BACKUP_FILE (file2);
 
-    return (0 == g_strcmp0 (s1->fileURI, s2->fileURI));
+    return (s1->hash == s2->hash) && (0 == g_strcmp0 (s1->fileURI, s2->fileURI));
 }
 
 static GFile* vfs_resolve_relative_path (GFile* file, const char* relativePath)
@@ -512,9 +681,9 @@ static GFile* vfs_resolve_relative_path (GFile* file, const char* relativePath)
     char* pp1 = NULL;
     char** strArr = NULL;
     GFile* resFile = NULL;
-    char* path = g_file_get_path (file);
+    const char* path = BACKUP_FILE_PATH(BACKUP_FILE(file));
 
-    if (0 == g_strcmp0(path, "") || 0 == g_strcmp0(path, "/")) {
+    if (0 == g_strcmp0(path, "/")) {
         strArr = g_strsplit(relativePath, "{]", -1);
         if (strArr) {
             pp1 = g_strjoinv("/", strArr);
@@ -525,7 +694,6 @@ static GFile* vfs_resolve_relative_path (GFile* file, const char* relativePath)
     }
 
     STR_FREE(pp1);
-    STR_FREE(path);
     NOT_NULL_RUN(strArr, g_strfreev);
 
     return resFile;
@@ -559,18 +727,9 @@ static GFile* vfs_get_child_for_display_name (GFile* file, const char* displayNa
 
 static guint vfs_hash (GFile* file)
 {
-    guint hash = 0;
-
-    g_return_val_if_fail (BACKUP_IS_FILE(file), hash);
-
-    char* uri = vfs_get_uri (file);
-    if (uri) {
-        hash = g_str_hash(uri);
-    }
-
-    STR_FREE (uri);
+    g_return_val_if_fail (BACKUP_IS_FILE(file), 0);
 
-    return hash;
+    return BACKUP_FILE(file)->hash;
 }
 
 static gboolean vfs_file_backup_restore (GFile* src, GFile* dest, GFileCopyFlags flags, GCancellable* cancel, GFileProgressCallback progress, gpointer uData, GError** error)
@@ -598,30 +757,48 @@ static gboolean vfs_file_backup_restore (GFile* src, GFile* dest, GFileCopyFlags
 static gboolean vfs_backup (GFile* file1, BackupFile* file2, GError** error)
 {
     g_return_val_if_fail (G_IS_FILE(file1) && !BACKUP_IS_FILE(file1), FALSE);
-    if (!error) { NOT_NULL_RUN(*error, g_error_free); }
 
+    gint32 status = 0;
     char* path = NULL;                  // free
     gboolean ret = FALSE;
+    gboolean noSpace = FALSE;
     char* mountPoint = NULL;            // free
+    char key[BACKUP_KEY_SIZE];
 
     do {
         path = g_file_get_path(file1);
         BREAK_NULL(path);
 
+        // 守护进程在运行时交给它执行, 本进程不再解析挂载点、不再访问仓库;
+        // 内容另有来源(本进程的 fd 或快照)时守护进程只能按路径读到现在的文件, 仍在本进程内执行
+        if (!g_private_get(&gsBackupSource) && backup_daemon_forward(DAEMON_OP_BACKUP, path, &status, NULL)) {
+            ret = (0 == status);
+            noSpace = (ENOSPC == status);
+            break;
+        }
+
+        // 本次备份的各个 span 都以 key 关联, 包括读取 /proc/self/fd 与写临时文件的部分
+        if (backup_trace_is_enabled() && backup_path_key(path, key)) {
+            backup_trace_set_key(key);
+        }
+
         mountPoint = get_mount_point_by_uri(file1);
         BREAK_NULL(mountPoint);
 
         if (!make_backup_dirs_if_needed (mountPoint)) { break; };
-        if (!do_backup(path, mountPoint)) { break; }
+        if (!do_backup(path, mountPoint, &noSpace)) { break; }
         ret = TRUE;
     } while (0);
 
+    backup_trace_set_key(NULL);
     STR_FREE(path);
     STR_FREE(mountPoint);
 
-    if (!ret && error) {
-        // printf("set error: %d\n", __LINE__);
-        *error = g_error_new (g_quark_from_static_string(BACKUP_STR), G_IO_ERROR_EXISTS, "%s", g_strdup(""));
+    if (!ret && noSpace) {
+        g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_NO_SPACE, "backup refused: store quota exceeded");
+    }
+    else if (!ret) {
+        g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_EXISTS, "backup failed");
     }
 
     return ret;
@@ -632,16 +809,26 @@ static gboolean vfs_backup (GFile* file1, BackupFile* file2, GError** error)
 static gboolean vfs_restore (BackupFile* file1, GFile* file2, GError** error)
 {
     g_return_val_if_fail (BACKUP_IS_FILE(file1), FALSE);
-    if (!error) { NOT_NULL_RUN(*error, g_error_free); }
 
+    gint32 status = 0;
     char* path = NULL;                  // free
     gboolean ret = FALSE;
     char* mountPoint = NULL;            // free
+    char key[BACKUP_KEY_SIZE];
 
     do {
         path = g_file_get_path(G_FILE(file1));
         BREAK_NULL(path);
 
+        if (backup_daemon_forward(DAEMON_OP_RESTORE, path, &status, NULL)) {
+            ret = (0 == status);
+            break;
+        }
+
+        if (backup_trace_is_enabled() && backup_path_key(path, key)) {
+            backup_trace_set_key(key);
+        }
+
         mountPoint = get_mount_point_by_uri(G_FILE(file1));
         BREAK_NULL(mountPoint);
 
@@ -649,11 +836,12 @@ static gboolean vfs_restore (BackupFile* file1, GFile* file2, GError** error)
         ret = TRUE;
     } while (0);
 
+    backup_trace_set_key(NULL);
     STR_FREE(path);
     STR_FREE(mountPoint);
 
-    if (!ret && error) {
-        *error = g_error_new (g_quark_from_static_string(BACKUP_STR), G_IO_ERROR_FAILED, "%s", g_strdup(""));
+    if (!ret) {
+        g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_FAILED, "restore failed");
     }
 
     return ret;
@@ -662,7 +850,7 @@ static gboolean vfs_restore (BackupFile* file1, GFile* file2, GError** error)
     (void) error;
 }
 
-static GList* get_all_mount_points ()
+GList* get_all_mount_points ()
 {
     FILE* fr = NULL;
     GList* list = NULL;
@@ -770,11 +958,26 @@ static char* get_mount_point_by_uri (GFile* file)
 {
     g_return_val_if_fail (G_IS_FILE(file), NULL);
 
-    char* mountPoint = NULL;
     char* path = g_file_get_path(file);
 
     g_return_val_if_fail (path, NULL);
 
+    char* mountPoint = get_mount_point_by_path(path);
+
+    STR_FREE(path);
+
+    return mountPoint;
+}
+
+char* get_mount_point_by_path (const char* path)
+{
+    g_return_val_if_fail (path, NULL);
+
+    char* mountPoint = NULL;
+    BackupTraceSpan span;
+
+    TRACE_BEGIN(span, BACKUP_TRACE_MOUNT, path);
+
     GList* list = get_all_mount_points();
     for (GList* iter = list; iter; iter = iter->next) {
         if (g_str_has_prefix (path, iter->data)) {
@@ -783,7 +986,8 @@ static char* get_mount_point_by_uri (GFile* file)
         }
     }
 
-    STR_FREE(path);
+    TRACE_END(span, 0);
+
     NOT_NULL_RUN(list, g_list_free_full, g_free);
 
     return mountPoint;
@@ -798,10 +1002,13 @@ static gboolean make_backup_dirs_if_needed (const char* mountPoint)
     char* backupDir = NULL;
 
     do {
-        metaDir = g_strdup_printf("%s/.%s/meta", mountPoint, BACKUP_STR);
+        BackupStore* store = backup_store_get(mountPoint);
+        BREAK_NULL(store);
+
+        metaDir = g_strdup_printf("%s/meta", store->root);
         BREAK_NULL(metaDir);
 
-        backupDir = g_strdup_printf("%s/.%s/backup", mountPoint, BACKUP_STR);
+        backupDir = g_strdup_printf("%s/backup", store->root);
         BREAK_NULL(backupDir);
 
         if (g_mkdir_with_parents(metaDir, 0755) < 0) { break; }
@@ -823,19 +1030,26 @@ static gboolean do_restore (const char* path, const char* mountPoint)
     GError* error = NULL;               // free
     gboolean ret = FALSE;
     char* fileName = NULL;              // free
-    GFile* srcFileF = NULL;             // free
     GFile* dstFileF = NULL;             // free
     char* fileExtStr = NULL;            // free
-    char* srcFileStr = NULL;            // free
     char** extStrArr = NULL;            // free
-    char* filePathMD5 = NULL;           // free
     char* restoreFileStr = NULL;        // free
+    char filePathMD5[BACKUP_KEY_SIZE];
+    gboolean locked = FALSE;
+    BackupStore* store = NULL;
     BackupMetaFile backupMetaFile;      // free
 
+    memset(&backupMetaFile, 0, sizeof(BackupMetaFile));
+
     do {
-        filePathMD5 = get_file_path_md5 (path);
-        BREAK_NULL(filePathMD5);
+        store = backup_store_get(mountPoint);
+        BREAK_NULL(store);
 
+        BREAK_IF_FAIL(backup_path_key (path, filePathMD5));
+
+        backup_store_lock_key(store, filePathMD5);
+        locked = TRUE;
+        backup_store_settle_key(store, filePathMD5);
         if (!backup_meta_parse(&backupMetaFile, path, filePathMD5, mountPoint)) { break; }
         BREAK_NULL(backupMetaFile.srcFilePath);
 
@@ -866,108 +1080,113 @@ static gboolean do_restore (const char* path, const char* mountPoint)
             }
         }
 
-        if (backupMetaFile.backupFileCtxMD53) {
-            restoreFileStr = file_get_restore_path (backupMetaFile.srcFilePath, fileExtStr, backupMetaFile.backupFileTimestamp3);
-            g_object_unref(dstFileF);
+        int slot = 3;
+        while (slot >= 1 && !backup_meta_slot_good(&backupMetaFile, slot)) { --slot; }
+        BREAK_IF_FAIL(slot >= 1);
 
-            srcFileStr = g_strdup_printf("%s/.%s/backup/%s-3", mountPoint, BACKUP_STR, filePathMD5);
-            BREAK_NULL(srcFileStr);
+        restoreFileStr = file_get_restore_path (backupMetaFile.srcFilePath, fileExtStr, *backup_meta_slot_timestamp(&backupMetaFile, slot));
+        g_object_unref(dstFileF);
 
-            srcFileF = g_file_new_for_path (srcFileStr);
-            BREAK_NULL(srcFileF);
-
-            dstFileF = g_file_new_for_path (restoreFileStr);
-            BREAK_NULL(dstFileF);
-
-            g_file_copy(srcFileF, dstFileF, G_FILE_COPY_BACKUP | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
-            ret = (0 == access(restoreFileStr, F_OK));
-        }
-        else if (backupMetaFile.backupFileCtxMD52) {
-            restoreFileStr = file_get_restore_path (backupMetaFile.srcFilePath, fileExtStr, backupMetaFile.backupFileTimestamp2);
-            g_object_unref(dstFileF);
-
-            srcFileStr = g_strdup_printf("%s/.%s/backup/%s-2", mountPoint, BACKUP_STR, filePathMD5);
-            BREAK_NULL(srcFileStr);
-
-            srcFileF = g_file_new_for_path (srcFileStr);
-            BREAK_NULL(srcFileF);
-
-            dstFileF = g_file_new_for_path (restoreFileStr);
-            BREAK_NULL(dstFileF);
-
-            g_file_copy(srcFileF, dstFileF, G_FILE_COPY_BACKUP | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
-            ret = (0 == access(restoreFileStr, F_OK));
-        }
-        else if (backupMetaFile.backupFileCtxMD51) {
-            restoreFileStr = file_get_restore_path (backupMetaFile.srcFilePath, fileExtStr, backupMetaFile.backupFileTimestamp1);
-            g_object_unref(dstFileF);
-
-            srcFileStr = g_strdup_printf("%s/.%s/backup/%s-1", mountPoint, BACKUP_STR, filePathMD5);
-            BREAK_NULL(srcFileStr);
-
-            srcFileF = g_file_new_for_path (srcFileStr);
-            BREAK_NULL(srcFileF);
-
-            dstFileF = g_file_new_for_path (restoreFileStr);
-            BREAK_NULL(dstFileF);
+        dstFileF = g_file_new_for_path (restoreFileStr);
+        BREAK_NULL(dstFileF);
 
-            g_file_copy(srcFileF, dstFileF, G_FILE_COPY_BACKUP | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
-            ret = (0 == access(restoreFileStr, F_OK));
-        }
-        else {
-            // printf("Not found backup file\n");
-            break;
-        }
+        version_read(store, filePathMD5, slot, &backupMetaFile, dstFileF, backupMetaFile.srcFilePath, &error);
+        ret = (0 == access(restoreFileStr, F_OK));
     } while (0);
 
+    if (locked) {
+        backup_store_unlock_key(store, filePathMD5);
+    }
+    if (ret) {
+        backup_monitor_notify(backupMetaFile.srcFilePath, G_FILE_MONITOR_EVENT_CHANGED);
+    }
+
     STR_FREE(fileName);
     STR_FREE(fileExtStr);
-    STR_FREE(srcFileStr);
-    STR_FREE(filePathMD5);
     STR_FREE(restoreFileStr);
     NOT_NULL_RUN(error, g_error_free);
     NOT_NULL_RUN(extStrArr, g_strfreev);
     NOT_NULL_RUN(dstFileF, g_object_unref);
-    NOT_NULL_RUN(srcFileF, g_object_unref);
 
     backup_meta_free(&backupMetaFile);
 
     return ret;
 }
 
-static gboolean do_backup (const char* path, const char* mountPoint)
+static gboolean do_backup (const char* path, const char* mountPoint, gboolean* noSpace)
 {
-    g_return_val_if_fail (path && mountPoint, FALSE);
-    if (0 != access(path, F_OK)) { return FALSE; }
+    g_return_val_if_fail (path && mountPoint && noSpace, FALSE);
+
+    // 内容从 src 读取; key、meta 与记录的源路径仍用 path
+    const char* src = g_private_get(&gsBackupSource) ? g_private_get(&gsBackupSource) : path;
+    if (0 != access(src, F_OK)) { return FALSE; }
 
     GError* error = NULL;               // free
     gboolean ret = FALSE;
-    char* metaFile = NULL;              // free
-    char* filePathMD5 = NULL;           // free
-    char* backupFile1 = NULL;           // free
-    char* backupFile2 = NULL;           // free
-    char* backupFile3 = NULL;           // free
+    char backupFile1[STORE_PATH_MAX];
+    char backupFile2[STORE_PATH_MAX];
+    char backupFile3[STORE_PATH_MAX];
+    char filePathMD5[BACKUP_KEY_SIZE];
     GFile* backupFileF = NULL;          // free
     GFile* backupFileF1 = NULL;         // free
     GFile* backupFileF2 = NULL;         // free
     GFile* backupFileF3 = NULL;         // free
     char* fileContentMD5 = NULL;        // free
+    int newSlot = 0;
+    guint64 reserved = 0;
+    guint64 treeUsage = 0;
+    char treeFile[STORE_PATH_MAX];
+    char treeRel[STORE_PATH_MAX];
+    BackupHashTree tree;                // free
+    BackupDelta delta;                  // free
+    gboolean locked = FALSE;
+    gboolean isNewKey = FALSE;
+    int backupFd = -1;
+    BackupStore* store = NULL;
     BackupMetaFile backupMetaFile;      // free
 
+    memset(&tree, 0, sizeof(BackupHashTree));
+    memset(&delta, 0, sizeof(BackupDelta));
+    memset(&backupMetaFile, 0, sizeof(BackupMetaFile));
+
     do {
-        backupFileF = g_file_new_for_path(path);
+        store = backup_store_get(mountPoint);
+        BREAK_NULL(store);
+        backupFd = backup_store_backup_fd(store);
+        BREAK_IF_FAIL(backupFd >= 0);
+
+        backupFileF = g_file_new_for_path(src);
         BREAK_NULL(backupFileF);
 
-        filePathMD5 = get_file_path_md5 (path);
-        BREAK_NULL(filePathMD5);
+        BREAK_IF_FAIL(backup_path_key (path, filePathMD5));
 
-        fileContentMD5 = get_file_content_md5 (path);
+        fileContentMD5 = backup_hash_file (src, &tree);
         BREAK_NULL(fileContentMD5);
 
+        // 预留可能要等待后台淘汰, 放在取 key 锁之前; 先不加锁看一眼 meta(保存是整体改名, 读到的总是完整的),
+        // 内容未变时既不预留也不触发淘汰. 配额不足且淘汰不出足够空间时放弃本次备份
+        if (backup_meta_parse(&backupMetaFile, path, filePathMD5, mountPoint)) {
+            const int peekSlot = backupMetaFile.backupFileCtxMD53 ? 3 : (backupMetaFile.backupFileCtxMD52 ? 2 : (backupMetaFile.backupFileCtxMD51 ? 1 : 0));
+            if (peekSlot > 0 && 0 == g_strcmp0(*backup_meta_slot_ctx(&backupMetaFile, peekSlot), fileContentMD5)) { ret = TRUE; break; }
+        }
+        backup_meta_free(&backupMetaFile);
+        memset(&backupMetaFile, 0, sizeof(BackupMetaFile));
+
+        reserved = backup_store_file_usage (src);
+        if (!backup_store_reserve (store, reserved)) {
+            *noSpace = (ENOSPC == errno);
+            reserved = 0;
+            break;
+        }
+
+        backup_store_lock_key(store, filePathMD5);
+        locked = TRUE;
+        backup_store_settle_key(store, filePathMD5);
         if (!backup_meta_parse(&backupMetaFile, path, filePathMD5, mountPoint)) { break; }
 
         if (0 == backupMetaFile.version) {
             backupMetaFile.version = 1;
+            isNewKey = TRUE;
         }
 
         if (NULL == backupMetaFile.srcFilePath) {
@@ -978,35 +1197,61 @@ static gboolean do_backup (const char* path, const char* mountPoint)
             backupMetaFile.srcFilePathMD5 = g_strdup (filePathMD5);
         }
 
-        backupFile1 = g_strdup_printf("%s/.%s/backup/%s-1", mountPoint, BACKUP_STR, filePathMD5);
-        BREAK_NULL(backupFile1);
+        BREAK_IF_FAIL(backup_store_blob_path(store, filePathMD5, 1, NULL, backupFile1, sizeof(backupFile1)));
         backupFileF1 = g_file_new_for_path (backupFile1);
         BREAK_NULL(backupFileF1);
 
-        backupFile2 = g_strdup_printf("%s/.%s/backup/%s-2", mountPoint, BACKUP_STR, filePathMD5);
-        BREAK_NULL(backupFile2);
+        BREAK_IF_FAIL(backup_store_blob_path(store, filePathMD5, 2, NULL, backupFile2, sizeof(backupFile2)));
         backupFileF2 = g_file_new_for_path (backupFile2);
         BREAK_NULL(backupFileF2);
 
-        backupFile3 = g_strdup_printf("%s/.%s/backup/%s-3", mountPoint, BACKUP_STR, filePathMD5);
-        BREAK_NULL(backupFile3);
+        BREAK_IF_FAIL(backup_store_blob_path(store, filePathMD5, 3, NULL, backupFile3, sizeof(backupFile3)));
         backupFileF3 = g_file_new_for_path (backupFile3);
         BREAK_NULL(backupFileF3);
 
+        const int lastSlot = backupMetaFile.backupFileCtxMD53 ? 3 : (backupMetaFile.backupFileCtxMD52 ? 2 : (backupMetaFile.backupFileCtxMD51 ? 1 : 0));
+        const char* lastCtxMD5 = (lastSlot > 0) ? *backup_meta_slot_ctx(&backupMetaFile, lastSlot) : NULL;
+        if (lastCtxMD5 && 0 == g_strcmp0(lastCtxMD5, fileContentMD5)) { ret = TRUE; break; }
+
+        // 分块哈希之前备份的大文件版本(没有 <key>-N.tree)记录的是整文件 MD5: 内容未变时改记为根哈希并补上分块哈希, 之后不再重复计算
+        if (lastCtxMD5 && tree.chunkN > 0
+            && backup_store_blob_rel(store, filePathMD5, lastSlot, HASH_TREE_SUFFIX, treeRel, sizeof(treeRel))
+            && backup_store_blob_path(store, filePathMD5, lastSlot, HASH_TREE_SUFFIX, treeFile, sizeof(treeFile))
+            && 0 != faccessat(backupFd, treeRel, F_OK, 0)) {
+            char* legacyMD5 = backup_hash_file_md5(src);
+            const gboolean same = legacyMD5 && 0 == g_strcmp0(legacyMD5, lastCtxMD5);
+            STR_FREE(legacyMD5);
+            if (same) {
+                STR_FREE(*backup_meta_slot_ctx(&backupMetaFile, lastSlot));
+                *backup_meta_slot_ctx(&backupMetaFile, lastSlot) = g_strdup(fileContentMD5);
+                if (backup_hash_tree_save(&tree, treeFile)) {
+                    backup_store_usage_add(store, (gint64) backup_store_file_usage_at(backupFd, treeRel));
+                }
+                backup_meta_save(&backupMetaFile, filePathMD5, mountPoint);
+                ret = TRUE;
+                break;
+            }
+        }
+
+        // 大文件与最新版本比较分块哈希, 变化不多时只保存变化的分块
+        backup_delta_prepare(store, filePathMD5, &backupMetaFile, &tree, &delta);
+
         if (backupMetaFile.backupFileCtxMD53) {
             if (0 == g_strcmp0(backupMetaFile.backupFileCtxMD53, fileContentMD5)) { ret = TRUE; break; }
+            backup_store_usage_add(store, backup_delta_detach(store, filePathMD5, &backupMetaFile, 1));
             STR_FREE(backupMetaFile.backupFileCtxMD51);
             backupMetaFile.backupFileCtxMD51 = backupMetaFile.backupFileCtxMD52;
             backupMetaFile.backupFileTimestamp1 = backupMetaFile.backupFileTimestamp2;
-            remove(backupFile1);
-            rename(backupFile2, backupFile1);
+            backup_store_usage_add(store, - (gint64) backup_store_remove_slot(store, filePathMD5, 1));
+            backup_store_rename_slot(store, filePathMD5, 2, 1);
             backupMetaFile.backupFileCtxMD52 = backupMetaFile.backupFileCtxMD53;
             backupMetaFile.backupFileTimestamp2 = backupMetaFile.backupFileTimestamp3;
-            rename(backupFile3, backupFile2);
+            backup_store_rename_slot(store, filePathMD5, 3, 2);
             backupMetaFile.backupFileCtxMD53 = NULL;
             backupMetaFile.backupFileTimestamp3 = 0;
-            ret = g_file_copy(backupFileF, backupFileF3, G_FILE_COPY_OVERWRITE | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
+            ret = version_write(store, filePathMD5, 3, backupFileF, backupFileF3, src, fileContentMD5, &delta, &error);
             if (ret) {
+                newSlot = 3;
                 backupMetaFile.backupFileCtxMD53 = g_strdup(fileContentMD5);
                 backupMetaFile.backupFileTimestamp3 = time(NULL);
             }
@@ -1015,8 +1260,9 @@ static gboolean do_backup (const char* path, const char* mountPoint)
             if (0 == g_strcmp0(backupMetaFile.backupFileCtxMD52, fileContentMD5)) { ret = TRUE; break; }
             backupMetaFile.backupFileCtxMD53 = NULL;
             backupMetaFile.backupFileTimestamp3 = 0;
-            ret = g_file_copy(backupFileF, backupFileF3, G_FILE_COPY_OVERWRITE | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
+            ret = version_write(store, filePathMD5, 3, backupFileF, backupFileF3, src, fileContentMD5, &delta, &error);
             if (ret) {
+                newSlot = 3;
                 backupMetaFile.backupFileCtxMD53 = g_strdup(fileContentMD5);
                 backupMetaFile.backupFileTimestamp3 = time(NULL);
             }
@@ -1025,8 +1271,9 @@ static gboolean do_backup (const char* path, const char* mountPoint)
             if (0 == g_strcmp0(backupMetaFile.backupFileCtxMD51, fileContentMD5)) { ret = TRUE; break; }
             backupMetaFile.backupFileCtxMD52 = NULL;
             backupMetaFile.backupFileTimestamp2 = 0;
-            ret = g_file_copy(backupFileF, backupFileF2, G_FILE_COPY_OVERWRITE | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
+            ret = version_write(store, filePathMD5, 2, backupFileF, backupFileF2, src, fileContentMD5, &delta, &error);
             if (ret) {
+                newSlot = 2;
                 backupMetaFile.backupFileCtxMD52 = g_strdup(fileContentMD5);
                 backupMetaFile.backupFileTimestamp2 = time(NULL);
             }
@@ -1034,29 +1281,51 @@ static gboolean do_backup (const char* path, const char* mountPoint)
         else {
             backupMetaFile.backupFileCtxMD51 = NULL;
             backupMetaFile.backupFileTimestamp1 = 0;
-            ret = g_file_copy(backupFileF, backupFileF1, G_FILE_COPY_OVERWRITE | G_FILE_COPY_ALL_METADATA, NULL, NULL, NULL, &error);
+            ret = version_write(store, filePathMD5, 1, backupFileF, backupFileF1, src, fileContentMD5, &delta, &error);
             if (ret) {
+                newSlot = 1;
                 backupMetaFile.backupFileCtxMD51 = g_strdup(fileContentMD5);
                 backupMetaFile.backupFileTimestamp1 = time(NULL);
             }
         }
-        if (ret) {
-            backup_meta_save(&backupMetaFile, filePathMD5, mountPoint);
+        // 大文件同时保存分块哈希, 供之后的增量比较复用; 小文件清掉可能残留的旧分块哈希
+        if (newSlot > 0
+            && backup_store_blob_rel(store, filePathMD5, newSlot, HASH_TREE_SUFFIX, treeRel, sizeof(treeRel))
+            && backup_store_blob_path(store, filePathMD5, newSlot, HASH_TREE_SUFFIX, treeFile, sizeof(treeFile))) {
+            if (tree.chunkN > 0 && backup_hash_tree_save(&tree, treeFile)) {
+                treeUsage = backup_store_file_usage_at(backupFd, treeRel);
+            }
+            else {
+                unlinkat(backupFd, treeRel, 0);
+            }
+        }
+        if (ret && backup_meta_save(&backupMetaFile, filePathMD5, mountPoint)) {
+            if (isNewKey) {
+                backup_store_note_new_key(store);
+            }
+            backup_monitor_notify(backupMetaFile.srcFilePath, isNewKey ? G_FILE_MONITOR_EVENT_CREATED : G_FILE_MONITOR_EVENT_CHANGED);
         }
     } while (FALSE);
 
+    if (reserved > 0) {
+        char newRel[STORE_PATH_MAX];
+        const guint64 newUsage = (newSlot > 0 && backup_store_blob_rel(store, filePathMD5, newSlot, NULL, newRel, sizeof(newRel)))
+                               ? backup_store_file_usage_at(backupFd, newRel) + treeUsage : 0;
+        backup_store_usage_add(store, (gint64) newUsage - (gint64) reserved);
+    }
+    if (locked) {
+        backup_store_unlock_key(store, filePathMD5);
+    }
+
 #if 0
     if (error) {
         printf("[BACKUP] error: %d %s\n", error->code, error->message);
     }
 #endif
 
-    STR_FREE(metaFile);
-    STR_FREE(filePathMD5);
-    STR_FREE(backupFile1);
-    STR_FREE(backupFile2);
-    STR_FREE(backupFile3);
     STR_FREE(fileContentMD5);
+    backup_delta_clear(&delta);
+    backup_hash_tree_clear(&tree);
     NOT_NULL_RUN(error, g_error_free);
     NOT_NULL_RUN(backupFileF, g_object_unref);
     NOT_NULL_RUN(backupFileF1, g_object_unref);
@@ -1067,163 +1336,344 @@ static gboolean do_backup (const char* path, const char* mountPoint)
     return ret;
 }
 
-static char* get_file_content_md5 (const char* path)
+/**
+ * 每个线程复用一个 GChecksum, 结果直接写入调用者提供的缓冲区, 热路径上不分配内存
+ */
+gboolean backup_path_key (const char* path, char key[BACKUP_KEY_SIZE])
 {
-    g_return_val_if_fail (path && '/' == path[0], NULL);
+    g_return_val_if_fail (path && key, FALSE);
 
-    int bufLen = 0;
-    FILE* fr = NULL;
-    char* res = NULL;
-    char buf[1024] = {0};
-    GChecksum* cs = NULL;
+    static GPrivate checksum = G_PRIVATE_INIT ((GDestroyNotify) g_checksum_free);
+    static const char hex[] = "0123456789abcdef";
 
-    do {
-        fr = fopen(path, "r");
-        BREAK_NULL(fr);
+    guint8 digest[16];
+    gsize digestLen = sizeof(digest);
 
+    GChecksum* cs = g_private_get (&checksum);
+    if (G_UNLIKELY(!cs)) {
         cs = g_checksum_new(G_CHECKSUM_MD5);
-        BREAK_NULL(cs);
-
-        while ((bufLen = (int) fread (buf, 1, sizeof(buf), fr)) > 0) {
-            g_checksum_update(cs, buf, bufLen);
-        }
-        res = g_strdup(g_checksum_get_string(cs));
+        g_return_val_if_fail (cs, FALSE);
+        g_private_set (&checksum, cs);
+    }
 
-    } while (0);
+    g_checksum_reset(cs);
+    g_checksum_update(cs, (const guchar*) path, (gssize) strlen(path));
+    g_checksum_get_digest(cs, digest, &digestLen);
 
-    NOT_NULL_RUN(fr, fclose);
-    NOT_NULL_RUN(cs, g_checksum_free);
+    for (gsize i = 0; i < digestLen; ++i) {
+        key[2 * i] = hex[digest[i] >> 4];
+        key[2 * i + 1] = hex[digest[i] & 0x0F];
+    }
+    key[2 * digestLen] = '\0';
 
-    return res;
+    return TRUE;
 }
 
-static char* get_file_path_md5 (const char* path)
+static guint64 get_file_size (GFile* file)
 {
-    g_return_val_if_fail (path, NULL);
-
-    char* res = NULL;
-    GChecksum* cs = NULL;
-
-    do {
-        cs = g_checksum_new(G_CHECKSUM_MD5);
-        BREAK_NULL(cs);
-        g_checksum_update(cs, (const guchar*) path, (gssize) strlen(path));
-        res = g_strdup(g_checksum_get_string(cs));
+    g_return_val_if_fail (G_IS_FILE(file), 0);
 
-    } while (0);
-
-    NOT_NULL_RUN(cs, g_checksum_free);
+    guint64 size = 0;
+    GFileInfo* info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_SIZE, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    if (info) {
+        size = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+    }
+    NOT_NULL_RUN(info, g_object_unref);
 
-    return res;
+    return size;
 }
 
-static gboolean backup_meta_parse_file_path (BackupMetaFile* info/*in*/, const char* filePath)
+static gboolean file_copy (GFile* src, GFile* dst, GFileCopyFlags flags, const char* tracePath, GError** error)
 {
-    g_return_val_if_fail (info && filePath && '/' == filePath[0], FALSE);
+    g_return_val_if_fail (G_IS_FILE(src) && G_IS_FILE(dst), FALSE);
 
-    memset(info, 0, sizeof(BackupMetaFile));
+    BackupTraceSpan span;
 
-    FILE* metaFr = NULL;
     gboolean ret = FALSE;
-    char** strArr = NULL;               // free
-    char* metaFileCtx = NULL;           // free
-
-    do {
-        if (0 != access(filePath, F_OK)) {
-            ret = TRUE;
-            break;
+    guint64 bytes = 0;
+    char* srcPath = g_file_get_path(src);
+    char* dstPath = g_file_get_path(dst);
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, tracePath);
+    if (srcPath && dstPath) {
+        // 仓库与源文件可能不在同一设备, 数据自行拷贝(copy_file_range/大块读写), 元数据仍交给 GIO
+        ret = backup_copy_file(srcPath, dstPath, (flags & G_FILE_COPY_BACKUP) != 0, &bytes);
+        if (!ret) {
+            const int err = errno;
+            g_set_error_literal (error, BACKUP_ERROR, g_io_error_from_errno(err), g_strerror(err));
         }
-
-        struct stat statBuf;
-        guint64 backupFileSize = 0;
-        if (!stat(filePath, &statBuf)) {
-            backupFileSize = statBuf.st_size + 1;
+        else if (flags & G_FILE_COPY_ALL_METADATA) {
+            g_file_copy_attributes(src, dst, G_FILE_COPY_ALL_METADATA, NULL, NULL);
         }
-        if (backupFileSize <= 0) { break; }
+    }
+    else {
+        ret = g_file_copy(src, dst, flags, NULL, NULL, NULL, error);
+        bytes = ret ? get_file_size(dst) : 0;
+    }
+    TRACE_END(span, bytes);
 
-        metaFileCtx = g_malloc0(backupFileSize);
-        BREAK_NULL(metaFileCtx);
+    STR_FREE(srcPath);
+    STR_FREE(dstPath);
 
-        metaFr = fopen(filePath, "r");
-        BREAK_NULL(metaFr);
+    return ret;
+}
 
-        if (fread(metaFileCtx, 1, backupFileSize, metaFr) < 0) { break; }
+/**
+ * 写入一个版本: 大文件有增量时只保存变化的分块 <key>-N.delta, 小文件在开启包文件时追加到包中(<key>-N.pack 保存元数据),
+ * 开启去重时保存分块列表 <key>-N.chunks, 否则整文件拷贝到 <key>-N; 并删除其它形式的残留
+ */
+static gboolean version_write (BackupStore* store, const char* key, int slot, GFile* src, GFile* dst, const char* path, const char* ctxMD5, const BackupDelta* delta, GError** error)
+{
+    g_return_val_if_fail (store && key && G_IS_FILE(src) && G_IS_FILE(dst), FALSE);
 
-        fclose(metaFr);
-        metaFr = NULL;
+    gboolean ret = FALSE;
+    char recipe[STORE_PATH_MAX];
+    char deltaFile[STORE_PATH_MAX];
+    char recipeRel[STORE_PATH_MAX];
+    char blobRel[STORE_PATH_MAX];
+    char deltaRel[STORE_PATH_MAX];
+    char stubRel[STORE_PATH_MAX];
+
+    const int backupFd = backup_store_backup_fd(store);
+    g_return_val_if_fail (backupFd >= 0, FALSE);
+    g_return_val_if_fail (backup_store_blob_path(store, key, slot, DEDUP_RECIPE_SUFFIX, recipe, sizeof(recipe)), FALSE);
+    g_return_val_if_fail (backup_store_blob_path(store, key, slot, DELTA_SUFFIX, deltaFile, sizeof(deltaFile)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, DEDUP_RECIPE_SUFFIX, recipeRel, sizeof(recipeRel)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, NULL, blobRel, sizeof(blobRel)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, DELTA_SUFFIX, deltaRel, sizeof(deltaRel)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, PACK_STUB_SUFFIX, stubRel, sizeof(stubRel)), FALSE);
+
+    // 写入包或增量失败(文件已变大或在哈希后被修改)时按普通方式保存
+    const guint packMax = (guint) g_atomic_int_get(&store->packMax);
+    if (delta && delta->baseMD5 && backup_delta_write(delta, path, deltaFile, NULL)) {
+        unlinkat(backupFd, blobRel, 0);
+        unlinkat(backupFd, recipeRel, 0);
+        unlinkat(backupFd, stubRel, 0);
+        backup_store_usage_add(store, (gint64) backup_store_file_usage_at(backupFd, deltaRel));
+        ret = TRUE;
+    }
+    else if (packMax > 0 && ctxMD5 && backup_pack_put(store, path, ctxMD5, packMax, NULL)) {
+        unlinkat(backupFd, blobRel, 0);
+        unlinkat(backupFd, recipeRel, 0);
+        unlinkat(backupFd, deltaRel, 0);
+        struct stat statBuf;
+        const int fd = openat(backupFd, stubRel, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            if (0 == stat(path, &statBuf)) {
+                backup_copy_stat_meta(fd, &statBuf);
+            }
+            close(fd);
+        }
+        ret = TRUE;
+    }
+    else if (g_atomic_int_get(&store->dedup)) {
+        unlinkat(backupFd, blobRel, 0);
+        unlinkat(backupFd, deltaRel, 0);
+        unlinkat(backupFd, stubRel, 0);
+        ret = backup_dedup_write(store, path, recipe, NULL);
+        if (ret) {
+            backup_store_usage_add(store, (gint64) backup_store_file_usage_at(backupFd, recipeRel));
+        }
+        else {
+            g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_FAILED, "dedup write failed");
+        }
+    }
+    else {
+        unlinkat(backupFd, recipeRel, 0);
+        unlinkat(backupFd, deltaRel, 0);
+        unlinkat(backupFd, stubRel, 0);
+        ret = file_copy(src, dst, G_FILE_COPY_OVERWRITE | G_FILE_COPY_ALL_METADATA, path, error);
+    }
 
-        strArr = g_strsplit(metaFileCtx, "|", -1);
-        if (strArr) {
-            const char* version = strArr[0];
-            if (version) {
-                const int verInt = (int) strtol(version, NULL, 10);
-                info->version = verInt;
-                if (1 == verInt) {
-                    if (g_strv_length(strArr) != 9) {
-                        break;
-                    }
-                    if (strArr[1]) { info->srcFilePath          = g_strdup(strArr[1]); }
-                    if (strArr[2]) { info->srcFilePathMD5       = g_strdup(strArr[2]); }
+    return ret;
+}
 
-                    if (strArr[3] && strlen(strArr[3]) > 0) { info->backupFileCtxMD51    = g_strdup(strArr[3]); }
-                    if (strArr[4] && strlen(strArr[4]) > 0) { info->backupFileTimestamp1 = strtoll(strArr[4], NULL, 10); }
-                    if (strArr[5] && strlen(strArr[5]) > 0) { info->backupFileCtxMD52    = g_strdup(strArr[5]); }
-                    if (strArr[6] && strlen(strArr[6]) > 0) { info->backupFileTimestamp2 = strtoll(strArr[6], NULL, 10); }
-                    if (strArr[7] && strlen(strArr[7]) > 0) { info->backupFileCtxMD53    = g_strdup(strArr[7]); }
-                    if (strArr[8] && strlen(strArr[8]) > 0) { info->backupFileTimestamp3 = strtoll(strArr[8], NULL, 10); }
+/**
+ * 与 version_write 对应: 有分块列表时按去重版本读取, 有增量时叠加到基础版本上,
+ * 没有 <key>-N 时从包中按内容 MD5 读取; 版本文件都经 backup/ 的目录 fd 打开
+ */
+static gboolean version_read (BackupStore* store, const char* key, int slot, BackupMetaFile* meta, GFile* dst, const char* path, GError** error)
+{
+    g_return_val_if_fail (store && key && meta && G_IS_FILE(dst), FALSE);
+
+    gboolean ret = FALSE;
+    char recipe[STORE_PATH_MAX];
+    char recipeRel[STORE_PATH_MAX];
+    char blobRel[STORE_PATH_MAX];
+    char deltaRel[STORE_PATH_MAX];
+    char stubRel[STORE_PATH_MAX];
+    const char* ctxMD5 = *backup_meta_slot_ctx(meta, slot);
+
+    const int backupFd = backup_store_backup_fd(store);
+    g_return_val_if_fail (backupFd >= 0, FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, DEDUP_RECIPE_SUFFIX, recipeRel, sizeof(recipeRel)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, NULL, blobRel, sizeof(blobRel)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, DELTA_SUFFIX, deltaRel, sizeof(deltaRel)), FALSE);
+    g_return_val_if_fail (backup_store_blob_rel(store, key, slot, PACK_STUB_SUFFIX, stubRel, sizeof(stubRel)), FALSE);
+
+    char* dstPath = g_file_get_path(dst);
+    g_return_val_if_fail (dstPath, FALSE);
+
+    const gboolean hasBlob = (0 == faccessat(backupFd, blobRel, F_OK, 0));
+    if (0 == faccessat(backupFd, recipeRel, F_OK, 0)) {
+        // 分块列表的解析仍按路径进行
+        ret = backup_store_blob_path(store, key, slot, DEDUP_RECIPE_SUFFIX, recipe, sizeof(recipe))
+           && backup_dedup_read(store, recipe, dstPath, NULL);
+        if (!ret) {
+            g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_FAILED, "dedup read failed");
+        }
+    }
+    else if (!hasBlob && 0 == faccessat(backupFd, deltaRel, F_OK, 0)) {
+        ret = backup_delta_read(store, key, meta, slot, dstPath);
+        if (!ret) {
+            g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_FAILED, "delta read failed");
+        }
+    }
+    else if (!hasBlob && ctxMD5 && backup_pack_contains(store, ctxMD5)) {
+        ret = backup_pack_read(store, ctxMD5, dstPath, NULL);
+        if (!ret) {
+            g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_FAILED, "pack read failed");
+        }
+        else {
+            // 与整文件拷贝一样恢复权限、属主与时间
+            struct stat statBuf;
+            if (0 == fstatat(backupFd, stubRel, &statBuf, 0)) {
+                const int fd = open(dstPath, O_RDONLY | O_CLOEXEC);
+                if (fd >= 0) {
+                    backup_copy_stat_meta(fd, &statBuf);
+                    close(fd);
                 }
             }
         }
-        ret = TRUE;
-    } while (FALSE);
+    }
+    else {
+        BackupTraceSpan span;
+        guint64 bytes = 0;
+        struct stat statBuf;
 
-    STR_FREE(metaFileCtx);
-    NOT_NULL_RUN(strArr, g_strfreev);
-    if (metaFr) { fclose(metaFr); metaFr = NULL; }
+        TRACE_BEGIN(span, BACKUP_TRACE_COPY, path);
+        const int srcFd = openat(backupFd, blobRel, O_RDONLY | O_CLOEXEC);
+        ret = (srcFd >= 0) && backup_copy_file_fd(srcFd, dstPath, TRUE, &bytes);
+        const int err = errno;
+        if (ret && 0 == fstat(srcFd, &statBuf)) {
+            const int fd = open(dstPath, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                backup_copy_stat_meta(fd, &statBuf);
+                close(fd);
+            }
+        }
+        if (srcFd >= 0) { close(srcFd); }
+        if (!ret) {
+            g_set_error_literal (error, BACKUP_ERROR, g_io_error_from_errno(err), g_strerror(err));
+        }
+        TRACE_END(span, bytes);
+    }
+
+    STR_FREE(dstPath);
 
     return ret;
 }
 
-static gboolean backup_meta_parse (BackupMetaFile* info, const char* filePath, const char* filePathMD5, const char* mountPoint)
+gboolean backup_meta_parse_file_path (BackupMetaFile* info/*in*/, const char* filePath)
 {
-    g_return_val_if_fail (info && filePath && filePathMD5 && mountPoint, FALSE);
+    g_return_val_if_fail (info && filePath && '/' == filePath[0], FALSE);
+
+    return backup_meta_parse_at(info, AT_FDCWD, filePath);
+}
+
+/**
+ * meta 不存在(ENOENT/ENOTDIR)时返回 TRUE 且 info 为空; 其它 I/O 错误返回 FALSE 并保留 errno, 内容损坏时 errno 为 EINVAL
+ * 只做 openat + fstat + read, 不再按路径 access/stat; 开启缓存时先 fstatat, 与缓存条目一致则直接返回缓存的内容
+ */
+gboolean backup_meta_parse_at (BackupMetaFile* info/*in*/, int dirFd, const char* relPath)
+{
+    g_return_val_if_fail (info && relPath, FALSE);
 
     memset(info, 0, sizeof(BackupMetaFile));
 
-    FILE* metaFr = NULL;
+    int fd = -1;
+    int err = 0;
     gboolean ret = FALSE;
-    char** strArr = NULL;               // free
-    char* metaFile = NULL;              // free
+    gboolean cacheable = FALSE;
     char* metaFileCtx = NULL;           // free
+    guint64 backupFileSize = 0;
+    struct stat statBuf;
+    BackupTraceSpan span;
+
+    // meta 以 key 命名
+    const char* metaName = strrchr(relPath, '/');
+    TRACE_BEGIN(span, BACKUP_TRACE_META_PARSE, metaName ? metaName + 1 : relPath);
 
     do {
-        metaFile = g_strdup_printf("%s/.%s/meta/%s", mountPoint, BACKUP_STR, filePathMD5);
-        BREAK_NULL(metaFile);
+        // 目录没打开不等于 meta 不存在
+        if (dirFd < 0 && AT_FDCWD != dirFd) {
+            err = EBADF;
+            break;
+        }
 
-        if (0 != access(metaFile, F_OK)) {
-            ret = TRUE;
+        if (backup_meta_cache_enabled()) {
+            if (0 == fstatat(dirFd, relPath, &statBuf, 0)) {
+                if (backup_meta_cache_lookup(dirFd, relPath, &statBuf, info)) { ret = TRUE; break; }
+            }
+            else if (ENOENT == errno || ENOTDIR == errno) {
+                backup_meta_cache_remove(dirFd, relPath);
+                ret = TRUE;
+                break;
+            }
+        }
+
+        fd = openat(dirFd, relPath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            err = errno;
+            ret = (ENOENT == err || ENOTDIR == err);
             break;
         }
 
-        struct stat statBuf;
-        guint64 backupFileSize = 0;
-        if (!stat(metaFile, &statBuf)) {
-            backupFileSize = statBuf.st_size + 1;
+        if (0 != fstat(fd, &statBuf)) {
+            err = errno;
+            break;
         }
-        if (backupFileSize <= 0) { break; }
+        backupFileSize = statBuf.st_size + 1;
+        cacheable = TRUE;
 
         metaFileCtx = g_malloc0(backupFileSize);
         BREAK_NULL(metaFileCtx);
 
-        metaFr = fopen(metaFile, "r");
-        BREAK_NULL(metaFr);
+        gsize off = 0;
+        ssize_t len = 0;
+        while (off < backupFileSize - 1 && ((len = read(fd, metaFileCtx + off, backupFileSize - 1 - off)) > 0 || (len < 0 && EINTR == errno))) {
+            off += MAX(len, 0);
+        }
+        if (len < 0) { err = errno; break; }
 
-        if (fread(metaFileCtx, 1, backupFileSize, metaFr) < 0) { break; }
+        ret = meta_parse_content(info, metaFileCtx);
+        if (!ret) {
+            backup_meta_free(info);
+            err = EINVAL;
+        }
+        else if (cacheable && 1 == info->version) {
+            backup_meta_cache_store(dirFd, relPath, &statBuf, info, FALSE);
+        }
+    } while (FALSE);
+
+    TRACE_END(span, backupFileSize);
 
-        fclose(metaFr);
-        metaFr = NULL;
+    STR_FREE(metaFileCtx);
+    if (fd >= 0) { close(fd); fd = -1; }
 
-        strArr = g_strsplit(metaFileCtx, "|", -1);
+    if (!ret) {
+        errno = err ? err : EIO;
+    }
+
+    return ret;
+}
+
+static gboolean meta_parse_content (BackupMetaFile* info, const char* content)
+{
+    gboolean ret = FALSE;
+    char** strArr = g_strsplit(content, "|", -1);
+
+    do {
         if (strArr) {
             const char* version = strArr[0];
             if (version) {
@@ -1248,29 +1698,75 @@ static gboolean backup_meta_parse (BackupMetaFile* info, const char* filePath, c
         ret = TRUE;
     } while (FALSE);
 
-    STR_FREE(metaFile);
-    STR_FREE(metaFileCtx);
     NOT_NULL_RUN(strArr, g_strfreev);
-    if (metaFr) { fclose(metaFr); metaFr = NULL; }
 
     return ret;
 }
 
-static gboolean backup_meta_save (const BackupMetaFile* info, const char* filePathMD5, const char* mountPoint)
+gboolean backup_meta_parse (BackupMetaFile* info, const char* filePath, const char* filePathMD5, const char* mountPoint)
+{
+    g_return_val_if_fail (info && filePath && filePathMD5 && mountPoint, FALSE);
+
+    memset(info, 0, sizeof(BackupMetaFile));
+
+    char metaFile[STORE_PATH_MAX];
+
+    BackupStore* store = backup_store_get(mountPoint);
+    if (!store || !backup_store_meta_rel(store, filePathMD5, metaFile, sizeof(metaFile))) {
+        errno = EINVAL;
+        return FALSE;
+    }
+
+    // 只有 meta/ 还不存在时才按没有 meta 处理, 打不开目录的其它错误如实返回
+    const int dirFd = backup_store_meta_fd(store);
+    if (dirFd < 0) {
+        return (ENOENT == errno || ENOTDIR == errno);
+    }
+
+    return backup_meta_parse_at(info, dirFd, metaFile);
+}
+
+gboolean backup_meta_save (const BackupMetaFile* info, const char* filePathMD5, const char* mountPoint)
 {
     g_return_val_if_fail (info && filePathMD5 && mountPoint, FALSE);
 
-    FILE* metaFr = NULL;
+    int fd = -1;
+    int dirFd = -1;
     gboolean ret = FALSE;
-    char* metaFile = NULL;              // free
+    char metaFile[STORE_PATH_MAX];
+    char tmpFile[STORE_PATH_MAX] = {0};
     char* metaFileCtx = NULL;           // free
+    guint64 metaFileCtxLen = 0;
+    BackupTraceSpan span;
 
-    do {
-        metaFile = g_strdup_printf("%s/.%s/meta/%s", mountPoint, BACKUP_STR, filePathMD5);
-        BREAK_NULL(metaFile);
+    TRACE_BEGIN(span, BACKUP_TRACE_META_SAVE, filePathMD5);
 
-        metaFr = fopen(metaFile, "w+");
-        BREAK_NULL(metaFr);
+    do {
+        BackupStore* store = backup_store_get(mountPoint);
+        BREAK_NULL(store);
+        BREAK_IF_FAIL(backup_store_meta_rel(store, filePathMD5, metaFile, sizeof(metaFile)));
+
+        dirFd = backup_store_meta_fd(store);
+        BREAK_IF_FAIL(dirFd >= 0);
+
+        // 写到同目录的 .<key>.<pid>.<序号> 再改名: 每次保存都是新 inode, 其它进程在同一时间戳粒度内改写也能被缓存识别;
+        // 以 '.' 开头, 遍历仓库时跳过, 崩溃后残留的由清理任务回收
+        const char* base = strrchr(metaFile, '/');
+        const int dirLen = base ? (int) (base - metaFile + 1) : 0;
+        for (int i = 0; i < 8 && fd < 0; ++i) {
+            if (g_snprintf(tmpFile, sizeof(tmpFile), "%.*s.%s.%d.%d", dirLen, metaFile, metaFile + dirLen,
+                            (int) getpid(), g_atomic_int_add(&gsMetaTmpSeq, 1)) >= (int) sizeof(tmpFile)) {
+                break;
+            }
+            fd = openat(dirFd, tmpFile, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0 && EEXIST != errno) {
+                break;
+            }
+        }
+        if (fd < 0) {
+            tmpFile[0] = '\0';
+            break;
+        }
 
         metaFileCtx = g_strdup_printf("1|%s|%s|%s|%lu|%s|%lu|%s|%lu",
                     info->srcFilePath, filePathMD5,
@@ -1279,20 +1775,49 @@ static gboolean backup_meta_save (const BackupMetaFile* info, const char* filePa
                     info->backupFileCtxMD53 ? info->backupFileCtxMD53 : "", info->backupFileTimestamp3);
         BREAK_NULL(metaFileCtx);
 
-        fwrite(metaFileCtx, 1, strlen(metaFileCtx), metaFr);
-        fclose(metaFr);
-        metaFr = NULL;
-        ret = TRUE;
+        metaFileCtxLen = strlen(metaFileCtx);
+        gsize off = 0;
+        ssize_t len = 0;
+        while (off < metaFileCtxLen && (len = write(fd, metaFileCtx + off, metaFileCtxLen - off)) > 0) {
+            off += len;
+        }
+        BREAK_IF_FAIL(off == metaFileCtxLen);
+
+        struct stat statBuf;
+        const gboolean statOK = (0 == fstat(fd, &statBuf));
+        ret = (0 == close(fd));
+        fd = -1;
+        ret = ret && (0 == renameat(dirFd, tmpFile, dirFd, metaFile));
+        if (ret) {
+            tmpFile[0] = '\0';
+        }
+
+        // 缓存中保存与 meta_parse_content 解析结果相同的内容
+        if (ret && statOK) {
+            BackupMetaFile saved = *info;
+            saved.version = 1;
+            saved.srcFilePathMD5 = (char*) filePathMD5;
+            backup_meta_cache_store(dirFd, metaFile, &statBuf, &saved, TRUE);
+        }
+        else {
+            backup_meta_cache_remove(dirFd, metaFile);
+        }
+        if (ret && info->srcFilePath) {
+            const guint64 timestamps[3] = { info->backupFileTimestamp1, info->backupFileTimestamp2, info->backupFileTimestamp3 };
+            backup_index_put(store, info->srcFilePath, timestamps);
+        }
     } while (0);
 
-    STR_FREE(metaFile);
+    TRACE_END(span, metaFileCtxLen);
+
     STR_FREE(metaFileCtx);
-    if (metaFr) { fclose(metaFr); metaFr = NULL; }
+    if (fd >= 0) { close(fd); fd = -1; }
+    if (tmpFile[0] && dirFd >= 0) { unlinkat(dirFd, tmpFile, 0); }
 
     return ret;
 }
 
-static void backup_meta_free (BackupMetaFile* info)
+void backup_meta_free (BackupMetaFile* info)
 {
     g_return_if_fail (info);
 
@@ -1303,21 +1828,46 @@ static void backup_meta_free (BackupMetaFile* info)
     STR_FREE(info->backupFileCtxMD53);
 }
 
-static void file_path_format (char* filePath)
+/**
+ * 单次扫描: 合并重复的 '/', 去掉 '.', 处理 '..'(不会越过根目录)以及结尾的 '/'
+ * out 至少要有 strlen(path) + 1 字节, 返回结果长度, 根目录为 "/"
+ */
+static gsize file_path_canonicalize (const char* path, char* out)
 {
-    g_return_if_fail(filePath);
+    g_return_val_if_fail(path && out, 0);
+
+    gsize len = 0;
+    const char* p = path;
 
-    int i = 0;
-    const int fLen = (int) strlen (filePath);
-    for (i = 0; filePath[i]; ++i) {
-        while (filePath[i] && '/' == filePath[i] && '/' == filePath[i + 1]) {
-            for (int j = i; filePath[j] || j < fLen; filePath[j] = filePath[j + 1], ++j);
+    while (*p) {
+        while ('/' == *p) { ++p; }
+        if ('\0' == *p) { break; }
+
+        const char* end = p;
+        while (*end && '/' != *end) { ++end; }
+        const gsize segLen = end - p;
+
+        if (1 == segLen && '.' == p[0]) {
+            // skip
         }
+        else if (2 == segLen && '.' == p[0] && '.' == p[1]) {
+            while (len > 0 && '/' != out[len - 1]) { --len; }
+            if (len > 0) { --len; }
+        }
+        else {
+            out[len++] = '/';
+            memcpy(out + len, p, segLen);
+            len += segLen;
+        }
+        p = end;
     }
 
-    if ((i - 1 >= 0) && filePath[i - 1] == '/') {
-        filePath[i - 1] = '\0';
+    if (0 == len) {
+        out[len++] = '/';
     }
+    out[len] = '\0';
+
+    return len;
 }
 
 static void file_name_to_lower (char* fileName)
@@ -1340,7 +1890,9 @@ static char* file_get_restore_path (const char* srcFilePath, const char* extName
 
     char* ret = NULL;
     char timeBuf[32] = {0};
-    struct tm* curTime = localtime (&timestamp);
+    struct tm tmBuf;
+    const time_t t = (time_t) timestamp;
+    struct tm* curTime = localtime_r (&t, &tmBuf);
     int nameLen = strlen (srcFilePath) + sizeof (timeBuf) + 2;
 
     if (extName) {
@@ -1382,15 +1934,14 @@ static GFileInfo* vfs_file_enum_next_file (GFileEnumerator *enumerator, GCancell
         return NULL;
     }
 
-    char* uri = NULL;
     GFile* ff = NULL;
     GFileInfo* info = NULL;
     if (eb->iter && eb->iter->data) {
-        const char* f = eb->files->data;
-        if (f && '/' == f[0]) {
-            uri = g_strdup_printf ("%s://%s", BACKUP_STR, (char*) eb->iter->data);
-            if (uri) {
-                ff = g_file_new_for_uri (uri);
+        const char* f = eb->iter->data;
+        if ('/' == f[0]) {
+            // 直接构造, 不经过默认 GVfs, 工作线程里也不依赖注册状态
+            ff = backup_file_new_for_path (f);
+            if (ff) {
                 info = g_file_query_info(ff, "standard::*", G_FILE_QUERY_INFO_NONE, cancellable, error);
             }
         }
@@ -1403,7 +1954,6 @@ static GFileInfo* vfs_file_enum_next_file (GFileEnumerator *enumerator, GCancell
         NOT_NULL_RUN(info, g_object_unref);
     }
 
-    STR_FREE(uri);
     NOT_NULL_RUN(ff, g_object_unref);
 
     return info;
@@ -1413,9 +1963,34 @@ GFileEnumerator* vfs_file_enum_children (GFile* file, const char* attribute, GFi
 {
     g_return_val_if_fail(BACKUP_IS_FILE(file), NULL);
 
-    GFileEnumerator* e = G_FILE_ENUMERATOR(g_object_new(BACKUP_FILE_ENUM_TYPE, "container", file, NULL));
+    guint64 since = 0;
+    guint64 until = 0;
+    BackupTraceSpan span;
+    const char* path = BACKUP_FILE_PATH(BACKUP_FILE(file));
+    const char* query = strchr(path, '?');
+    BackupFileEnum* e = BACKUP_FILE_ENUM(g_object_new(BACKUP_FILE_ENUM_TYPE, "container", file, NULL));
+
+    TRACE_BEGIN(span, BACKUP_TRACE_ENUM, path);
+
+    if (query && !backup_file_enum_parse_query(query + 1, &since, &until)) {
+        query = NULL;
+    }
+    if (0 == strcmp(path, "/")) {
+        backup_file_enum_load_all(e);
+    }
+    else {
+        // andsec-backup:///<前缀>?since=&until= 只列出前缀之下、时间范围内的备份, 走索引
+        char* prefix = query ? g_strndup(path, query - path) : g_strdup(path);
+        backup_store_query(NULL, prefix, since, until, backup_file_enum_query_cb, e);
+        STR_FREE(prefix);
+    }
 
-    return e;
+    e->files = g_list_reverse (e->files);
+    e->iter = e->files;
+
+    TRACE_END(span, g_list_length(e->files));
+
+    return G_FILE_ENUMERATOR(e);
 
     (void) flags;
     (void) error;
@@ -1444,12 +2019,22 @@ static GFileInfo* vfs_file_query_fs_info (GFile* file, const char* attr, GCancel
 
     GFile* f = NULL;
     GFileInfo* info = NULL;
-    f = g_file_new_for_path ("/");
+    char* mountPoint = get_mount_point_by_uri(file);
+    BackupStore* store = mountPoint ? backup_store_get(mountPoint) : NULL;
 
+    // 仓库可能在独立的卷上, 容量信息取仓库所在的文件系统
+    f = g_file_new_for_path (store ? store->volume : "/");
     if (G_IS_FILE(f)) {
-        info = g_file_query_info (f, attr, G_FILE_QUERY_INFO_NONE, cancel, error);
+        info = g_file_query_filesystem_info (f, attr, cancel, error);
     }
 
+    if (info && mountPoint) {
+        g_file_info_set_attribute_uint64 (info, BACKUP_FILE_ATTRIBUTE_STORE_USAGE, backup_store_get_usage(mountPoint));
+        g_file_info_set_attribute_uint64 (info, BACKUP_FILE_ATTRIBUTE_STORE_QUOTA, backup_store_get_quota(mountPoint));
+    }
+
+    STR_FREE(mountPoint);
+    NOT_NULL_RUN(f, g_object_unref);
 
     return info;
 }
@@ -1503,6 +2088,35 @@ static GFileInfo* vfs_file_query_info (GFile* file, const char* attr, GFileQuery
     (void) cancel;
 }
 
+/**
+ * 只有根目录是目录, 监视它即监视所有备份文件
+ */
+static GFileMonitor* vfs_file_monitor_dir (GFile* file, GFileMonitorFlags flags, GCancellable* cancel, GError** error)
+{
+    g_return_val_if_fail(BACKUP_IS_FILE(file), NULL);
+
+    if (0 != g_strcmp0(BACKUP_FILE_PATH(BACKUP_FILE(file)), "/")) {
+        g_set_error_literal (error, BACKUP_ERROR, G_IO_ERROR_NOT_DIRECTORY, "not a directory");
+        return NULL;
+    }
+
+    return backup_file_monitor_new(file, TRUE);
+
+    (void) flags;
+    (void) cancel;
+}
+
+static GFileMonitor* vfs_file_monitor_file (GFile* file, GFileMonitorFlags flags, GCancellable* cancel, GError** error)
+{
+    g_return_val_if_fail(BACKUP_IS_FILE(file), NULL);
+
+    return backup_file_monitor_new(file, 0 == g_strcmp0(BACKUP_FILE_PATH(BACKUP_FILE(file)), "/"));
+
+    (void) flags;
+    (void) error;
+    (void) cancel;
+}
+
 static gboolean vfs_has_schema (GFile* file, const char* uriSchema)
 {
     g_return_val_if_fail(BACKUP_IS_FILE(file) && uriSchema, FALSE);
@@ -10,6 +10,9 @@
 G_BEGIN_DECLS
 
 #define BACKUP_STR                                      "andsec-backup"
+#define BACKUP_FILE_ATTRIBUTE_STORE_USAGE               BACKUP_STR "::store-usage"
+#define BACKUP_FILE_ATTRIBUTE_STORE_QUOTA               BACKUP_STR "::store-quota"
+#define BACKUP_ERROR                                    (backup_error_quark())
 #define STR_FREE(f)                                     G_STMT_START { if (f) { g_free (f); f = NULL; } } G_STMT_END
 
 #define BACKUP_FILE_TYPE                                (backup_file_get_type())
@@ -26,10 +29,78 @@ G_BEGIN_DECLS
 #define BACKUP_FILE_ENUM(k)                             (G_TYPE_CHECK_INSTANCE_CAST((k), BACKUP_FILE_ENUM_TYPE, BackupFileEnum))
 #define BACKUP_FILE_ENUM_GET_CLASS(k)                   (G_TYPE_INSTANCE_GET_CLASS((k), BACKUP_FILE_ENUM_TYPE, BackupFileEnumClass))
 
+typedef struct _BackupSweepStats
+{
+    guint64                 blobs;
+    guint64                 metas;
+    guint64                 orphanBlobs;        // 没有 meta 引用的版本文件, 含崩溃后残留的临时文件
+    guint64                 brokenMetas;        // 损坏的 meta, 含保存 meta 时残留的临时文件
+    guint64                 freedBytes;
+    guint64                 chunks;
+    guint64                 orphanChunks;
+} BackupSweepStats;
+
+typedef struct _BackupScrubStats
+{
+    guint64                 metas;
+    guint64                 versions;           // 实际校验的版本数
+    guint64                 bytes;              // 校验读取的字节数
+    guint64                 corrupted;          // 内容与 meta 中的 MD5 不符或无法读取
+    guint64                 missing;            // meta 中有记录但版本文件不存在
+    guint64                 skipped;            // 之前已标记为损坏, 或校验期间被新的备份替换
+} BackupScrubStats;
+
+/**
+ * 发现损坏(或丢失)的版本并已在 meta 中标记后, 在工作线程中调用, 各次调用互斥
+ */
+typedef void (*BackupScrubFunc)                 (const char* srcPath, guint64 timestamp, gpointer data);
+
+/**
+ * 按源路径顺序对每个符合条件的备份调用一次, timestamp 为落在时间范围内的最新版本的备份时间
+ */
+typedef void (*BackupQueryFunc)                 (const char* srcPath, guint64 timestamp, gpointer data);
+
+typedef struct _BackupTreeStats
+{
+    guint64                 dirs;
+    guint64                 files;
+    guint64                 backedUp;
+    guint64                 failed;             // 备份失败的文件以及无法读取的目录
+    guint64                 skipped;            // 被过滤的路径、仓库目录、非普通文件
+    guint64                 bytes;
+} BackupTreeStats;
+
+/**
+ * 返回 FALSE 跳过该路径(目录则跳过整个子树), 在工作线程中调用
+ */
+typedef gboolean (*BackupTreeFilterFunc)        (const char* path, gboolean isDir, gpointer data);
+
+/**
+ * 每个文件备份完成后在工作线程中调用
+ */
+typedef void (*BackupTreeFileFunc)              (const char* path, gboolean ok, gpointer data);
+
+typedef struct _BackupRestoreProgress
+{
+    guint64                 total;
+    guint64                 done;
+    guint64                 failed;
+    guint64                 bytesTotal;
+    guint64                 bytesDone;
+    guint64                 bytesPerSec;        // 从开始到现在的平均吞吐量
+    gint64                  etaSec;             // -1 表示尚无法估计
+} BackupRestoreProgress;
+
+/**
+ * 每个文件恢复完成后在工作线程中调用, 各次调用互斥
+ */
+typedef void (*BackupRestoreFunc)               (const char* path, gboolean ok, const BackupRestoreProgress* progress, gpointer data);
+
 G_DECLARE_FINAL_TYPE(BackupFile, backup_file, BackupFile, BACKUP_FILE_TYPE, GObject)
 G_DECLARE_FINAL_TYPE(BackupFileEnum, backup_file_enum, BackupFileEnum, BACKUP_FILE_ENUM_TYPE, GFileEnumerator)
 
 
+GQuark                  backup_error_quark              (void);
 GType                   backup_file_get_type            (void) G_GNUC_CONST;
 GType                   backup_file_enum_get_type       (void) G_GNUC_CONST;
 GFile*                  backup_file_new_for_path        (const gchar* path);
@@ -42,14 +113,210 @@ GFile*                  backup_file_new_for_path        (const gchar* path);
 gboolean                backup_file_backup              (GFile* self);
 gboolean                backup_file_backup_by_abspath   (const char* path);
 
+/**
+ * @brief 并行备份整个目录树, 不跟随符号链接, 跳过 .andsec-backup 与仓库目录
+ *        不小于 8M 的文件用 O_DIRECT 哈希与拷贝(不支持时读写后丢弃页缓存), 不挤掉其它程序的页缓存
+ * @param threads 工作线程数, 0 表示 CPU 数
+ * @param filter 可为 NULL
+ * @param func 可为 NULL
+ * @return 所有文件都备份成功且未被取消时返回 TRUE
+ */
+gboolean                backup_file_backup_tree         (const char* path, guint threads, BackupTreeFilterFunc filter, BackupTreeFileFunc func, gpointer data, BackupTreeStats* stats, GCancellable* cancel);
+
+/**
+ * @brief 开启请求合并队列: 之后 backup_file_backup_by_abspath() 只登记请求并立即返回 TRUE(库内部的捕获、目录树备份与服务不经过队列),
+ *        同一路径在 windowMs 内的多次请求合并为一次备份, 且同一路径两次备份至少间隔 minIntervalSec,
+ *        避免频繁的自动保存把有意义的历史版本挤出三个版本槽; 重复调用只更新参数
+ */
+void                    backup_queue_start              (guint windowMs, guint minIntervalSec);
+
+/**
+ * @brief 立即执行所有排队的请求(不再等待窗口与最小间隔)并等待完成
+ */
+void                    backup_queue_flush              ();
+
+/**
+ * @brief 执行完所有排队的请求后关闭队列, 之后的请求恢复为同步执行; 用于退出前
+ */
+void                    backup_queue_drain              ();
+
+/**
+ * @brief 排队的请求中备份失败的个数(提交时已返回 TRUE), 失败时同时输出 g_warning
+ */
+guint64                 backup_queue_get_failed         ();
+
 /**
  * @brief 执行恢复, andsec-backup:///
  */
 gboolean                backup_file_restore             (GFile* self);
 gboolean                backup_file_restore_by_abspath  (const char* path);
 
+/**
+ * @brief 批量恢复: 先用 FIEMAP 取得每个备份文件的物理起始位置(不支持时用 inode 号),
+ *        按所在设备分组、按位置排序后顺序恢复, 避免机械盘/RAID 上的随机寻道; 大文件与目录树备份一样不经过页缓存
+ * @param parallel 每个设备同时恢复的文件数, 0 与 1 相同
+ * @return 全部恢复成功且未被取消时返回 TRUE
+ */
+gboolean                backup_file_restore_bulk        (const char* const* paths, guint n, guint parallel, BackupRestoreFunc func, gpointer data, GCancellable* cancel);
+
+/**
+ * @brief 向默认 GVfs 注册 andsec-backup:// , 可重复调用, 线程安全;
+ *        backup_file_new_for_*() 会自动调用, 只通过 g_file_new_for_uri() 使用时需先调用一次
+ */
 void                    backup_file_register            ();
 
+/**
+ * @brief 设置备份仓库配额, 字节数与文件系统百分比同时设置时取较小值, 0 表示不限制
+ *        备份写入时超出配额会由后台线程淘汰最旧的历史版本, 每个文件最新的版本永远保留;
+ *        短时间内淘汰不出足够空间时本次备份被拒绝, 错误码为 G_IO_ERROR_NO_SPACE
+ * @param mountPoint 挂载点, 为 NULL 时设置所有挂载点的默认配额(默认为文件系统的 10%)
+ */
+gboolean                backup_store_set_quota          (const char* mountPoint, guint64 maxBytes, guint maxPercent);
+guint64                 backup_store_get_quota          (const char* mountPoint);
+guint64                 backup_store_get_usage          (const char* mountPoint);
+
+/**
+ * @brief 把挂载点的备份仓库放到其它位置(例如专用的 NVMe), 仓库为 <repoDir>/<挂载点路径的 MD5>,
+ *        备份、恢复、枚举、配额与清理都随之使用该仓库; 配额百分比按 repoDir 所在文件系统计算
+ *        必须在该挂载点首次备份/查询之前设置, 之后再改为不同的位置会返回 FALSE;
+ *        设置保存在 <mountPoint>/.andsec-backup/repository, 所有进程(包括守护进程)首次使用该挂载点时读取,
+ *        因此修改时该挂载点不应有其它进程正在使用; 写入失败返回 FALSE
+ * @param repoDir 绝对路径, 为 NULL 时恢复默认的 <mountPoint>/.andsec-backup
+ */
+gboolean                backup_store_set_repository     (const char* mountPoint, const char* repoDir);
+
+/**
+ * @brief 与 backup_store_set_repository 相同, 但只对本进程生效, 不写入 repository 文件, 优先于其中的设置;
+ *        供测试工具等临时使用, 其它进程(包括守护进程)不受影响
+ */
+gboolean                backup_store_set_repository_local (const char* mountPoint, const char* repoDir);
+
+/**
+ * @brief 开启后新备份按内容分块(FastCDC)保存到挂载点共享的分块仓库, 相同内容只存一份;
+ *        已有的整文件版本不受影响, 两种版本可以混存. 不再被引用的分块由 backup_store_sweep() 回收
+ * @param mountPoint 挂载点, 为 NULL 时设置所有挂载点(默认关闭)
+ */
+gboolean                backup_store_set_dedup          (const char* mountPoint, gboolean enabled);
+
+/**
+ * @brief 开启后不超过 maxFileSize 的新版本顺序追加到挂载点共享的包文件(packs/), 不再每个版本占用一个文件,
+ *        相同内容只存一份; 写入按批 fdatasync, 恢复与巡检自动从包中读取
+ *        淘汰后包中留下的空洞由后台淘汰线程定期压缩, 也可以调用 backup_store_repack() 立即压缩
+ * @param mountPoint 挂载点, 为 NULL 时设置所有挂载点(默认关闭)
+ * @param maxFileSize 0 关闭, 最大 1M, 一般取 4096 左右
+ */
+gboolean                backup_store_set_pack           (const char* mountPoint, guint maxFileSize);
+
+/**
+ * @brief 开启后大文件(不小于 64M, 备份时已按 4M 分块计算哈希)的新版本与上一版本按分块哈希比较, 只保存变化的分块(<key>-N.delta),
+ *        恢复时叠加在上一版本上; 最多叠加 2 层, 变化超过一半时保存完整文件;
+ *        作为基础的版本被轮换或淘汰前, 依赖它的增量版本会先合并为完整文件
+ * @param mountPoint 挂载点, 为 NULL 时设置所有挂载点(默认关闭)
+ */
+gboolean                backup_store_set_delta          (const char* mountPoint, gboolean enabled);
+
+/**
+ * @brief 立即压缩包文件: 仍在使用的数据不足一半且一小时内没有写入的包被重写后删除, 返回释放的字节数
+ */
+guint64                 backup_store_repack             (const char* mountPoint, GCancellable* cancel);
+
+/**
+ * @brief 立即淘汰旧版本, 返回实际释放的字节数
+ */
+guint64                 backup_store_evict              (const char* mountPoint, guint64 bytes);
+
+/**
+ * @brief 后台定期检查所有挂载点的仓库, 超出配额时淘汰到配额的 90%
+ */
+void                    backup_store_start_evictor      (guint intervalSec);
+void                    backup_store_stop_evictor       ();
+
+/**
+ * @brief 修改前捕获: 通过 fanotify 打开权限事件, 文件在窗口期内首次被其它进程打开时先备份再放行,
+ *        保证修改之前的内容已在仓库中. 需要 CAP_SYS_ADMIN; 多次调用可添加多个挂载点
+ *        已捕获的文件只查内存缓存; 大于 32M 的文件直接放行, 任何情况下都不拒绝打开;
+ *        支持 reflink 时先做快照再放行; 否则超过 budgetMs 仍未完成时放行, 备份期间被改写的版本标记为损坏
+ * @param windowSec 同一文件在窗口期内只捕获一次
+ * @param budgetMs 每次打开最多等待的毫秒数
+ */
+gboolean                backup_capture_start            (const char* mountPoint, guint windowSec, guint budgetMs);
+void                    backup_capture_stop             ();
+
+/**
+ * @brief 清理备份仓库中没有 meta 引用的备份文件以及损坏/截断的 meta 文件
+ *        可与备份并发执行; 中断(取消)后再次调用会从上次完成的位置继续
+ * @param mountPoint 挂载点, 为 NULL 时清理所有挂载点
+ * @param opsPerSec 每秒最多的文件操作数, 0 表示不限速
+ * @return 全部清理完成返回 TRUE
+ */
+gboolean                backup_store_sweep              (const char* mountPoint, guint opsPerSec, BackupSweepStats* stats, GCancellable* cancel);
+
+/**
+ * @brief 完整性巡检: 多线程重新计算各版本的 MD5(去重版本逐块校验)并与 meta 比较,
+ *        损坏或丢失的版本在 meta 中标记, 之后恢复会跳过它而使用下一个完好的版本, 下次备份也会重新保存
+ *        可与备份并发执行; 每完成 1/256 的 key 记录一次检查点, 中断(取消、进程退出)后再次调用从检查点继续
+ * @param mountPoint 挂载点, 为 NULL 时巡检所有挂载点
+ * @param threads 工作线程数, 0 表示 CPU 数
+ * @param bytesPerSec 所有线程合计每秒最多读取的字节数, 0 表示不限速
+ * @param func 可为 NULL
+ * @return 全部巡检完成返回 TRUE(不论是否发现损坏)
+ */
+gboolean                backup_store_scrub              (const char* mountPoint, guint threads, guint64 bytesPerSec, BackupScrubFunc func, gpointer data, BackupScrubStats* stats, GCancellable* cancel);
+
+/**
+ * @brief 按路径前缀与时间范围查询备份, 由各仓库的有序索引(index/)二分查找, 代价与结果数量相关而与备份总数无关;
+ *        索引随 meta 写入维护, 首次查询时遍历一次 meta 建立; 也可以枚举 andsec-backup:///<前缀>?since=<秒>&until=<秒>,
+ *        参数为负数时表示相对于当前时间, 例如 andsec-backup:///home/x/proj?since=-3600 为最近一小时备份过的文件
+ * @param mountPoint 挂载点, 为 NULL 时查询与前缀有关的所有挂载点
+ * @param prefix 绝对路径, 匹配其本身及其下的所有文件, 为 NULL 或 "/" 时不限制
+ * @param since 版本备份时间(秒)的下限, 0 表示不限制
+ * @param until 版本备份时间(秒)的上限, 0 表示不限制
+ */
+gboolean                backup_store_query              (const char* mountPoint, const char* prefix, guint64 since, guint64 until, BackupQueryFunc func, gpointer data);
+
+/**
+ * @brief 本机备份服务: 在 UNIX 套接字上受理备份、恢复与用量/配额查询, 仓库与工作线程都由本进程持有
+ *        其它进程设置了 backup_daemon_set_socket() 后, 其 backup_file_backup*()、backup_file_restore*()、
+ *        backup_store_get_usage/quota() 转发给它, 服务不可用时仍在各自进程内执行; 转发的请求按守护进程的仓库、
+ *        配额、去重、小文件包与增量设置执行; 只受理 root 与同一用户的连接, 修改前捕获总在本进程内执行
+ *        阻塞直到 cancel 被取消, 已收到的请求执行完后返回
+ * @param socketPath 为 NULL 时使用 backup_daemon_set_socket() 的设置
+ * @param threads 工作线程数, 0 表示 CPU 数
+ */
+gboolean                backup_daemon_run               (const char* socketPath, guint threads, GCancellable* cancel);
+
+/**
+ * @brief 设置转发请求使用的套接字, NULL 表示不转发(默认); 也是 backup_daemon_run() 的默认套接字(未设置时为 /run/andsec-backup.sock)
+ *        也可以通过环境变量开启: ANDSEC_BACKUP_SOCKET=/path/to/socket | on(使用 /run/andsec-backup.sock) | off
+ */
+void                    backup_daemon_set_socket        (const char* socketPath);
+
+/**
+ * @brief 开启 io_uring 批量 I/O(版本拷贝、枚举时读取 meta、统计仓库用量), 内核不支持或被禁止时自动退回同步实现
+ *        也可以通过环境变量开启: ANDSEC_BACKUP_IO=uring
+ */
+void                    backup_io_set_uring             (gboolean enabled);
+
+/**
+ * @brief 设置已解析 meta 的进程内缓存条数(默认 4096, 0 关闭), 重复查询、备份、恢复同一文件时不再重新读取解析;
+ *        每次使用前用 stat 校验 meta 文件未被其它进程改写
+ *        也可以通过环境变量设置: ANDSEC_BACKUP_META_CACHE=条数
+ */
+void                    backup_meta_cache_set_size      (guint entries);
+
+/**
+ * @brief 逐操作追踪, 记录挂载点解析、meta 解析、哈希、拷贝、meta 保存、枚举等阶段的耗时
+ *        也可以通过环境变量开启: ANDSEC_BACKUP_TRACE=1 | sysprof | /path/to/trace.json
+ *        (为路径时进程退出前自动导出; 编译时未开启 sysprof 而指定 sysprof 时给出警告, 退出前导出到临时目录)
+ */
+void                    backup_trace_set_enabled        (gboolean enabled);
+gboolean                backup_trace_is_enabled         ();
+
+/**
+ * @brief 导出为 Chrome trace JSON (chrome://tracing 或 Perfetto 打开)
+ */
+gboolean                backup_trace_dump               (const char* path);
+
 G_END_DECLS
 
 #endif // gvfs_backup_BACKUP_H
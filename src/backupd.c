@@ -0,0 +1,51 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 本机备份服务, 收到 SIGINT/SIGTERM 后执行完已收到的请求再退出
+//
+// 用法: andsec-backupd [socket] [threads]
+//
+#include <signal.h>
+#include <stdlib.h>
+
+#include "backup.h"
+
+static gpointer backupd_signal_thread (gpointer data)
+{
+    int sig = 0;
+    sigset_t set;
+
+    sigemptyset (&set);
+    sigaddset (&set, SIGINT);
+    sigaddset (&set, SIGTERM);
+    sigwait (&set, &sig);
+
+    g_cancellable_cancel (data);
+
+    return NULL;
+}
+
+int main (int argc, char* argv[])
+{
+    const char* socketPath = (argc > 1) ? argv[1] : NULL;
+    const guint threads = (argc > 2) ? (guint) strtoul (argv[2], NULL, 10) : 0;
+
+    // 信号只由专门的线程接收, 需在创建其它线程之前屏蔽
+    sigset_t set;
+    sigemptyset (&set);
+    sigaddset (&set, SIGINT);
+    sigaddset (&set, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+    GCancellable* cancel = g_cancellable_new ();
+    g_thread_unref (g_thread_new ("backupd-signal", backupd_signal_thread, cancel));
+
+    const gboolean ret = backup_daemon_run (socketPath, threads, cancel);
+    if (!ret) {
+        g_printerr ("andsec-backupd: cannot listen on %s\n", socketPath ? socketPath : "default socket");
+    }
+
+    g_object_unref (cancel);
+
+    return ret ? 0 : 1;
+}
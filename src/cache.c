@@ -0,0 +1,214 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 已解析 meta 的 LRU 缓存: 分片加锁, 条目按 stat 结果校验, 本进程保存 meta 时直接更新
+//
+#include "cache.h"
+#include "store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct _CacheEntry
+{
+    char*                   key;
+    dev_t                   dev;
+    ino_t                   ino;
+    off_t                   size;
+    struct timespec         mtime;
+    struct timespec         ctime;
+    BackupMetaFile          meta;
+    GList                   link;               // 所在分片 LRU 队列的节点, data 指向本条目
+} CacheEntry;
+
+typedef struct _CacheShard
+{
+    GMutex                  lock;
+    GHashTable*             entries;            // key -> CacheEntry*
+    GQueue                  lru;                // 头部为最近使用
+} CacheShard;
+
+static void         cache_init_from_env         () __attribute__((constructor));
+static CacheShard*  cache_shard                 (const char* key);
+static gboolean     cache_key                   (int dirFd, const char* relPath, char* buf, gsize bufLen);
+static gboolean     cache_stat_equal            (const CacheEntry* entry, const struct stat* statBuf);
+static void         cache_trim                  (CacheShard* shard, guint max);
+static void         cache_meta_copy             (BackupMetaFile* dst, const BackupMetaFile* src);
+static void         cache_entry_free            (gpointer data);
+
+
+static gint         gsCacheMax = CACHE_DEFAULT_SIZE;    // 原子读写, 0 表示关闭
+static CacheShard   gsCacheShards[CACHE_SHARD_N];
+
+
+void backup_meta_cache_set_size (guint entries)
+{
+    g_atomic_int_set (&gsCacheMax, (gint) MIN (entries, (guint) G_MAXINT));
+
+    const guint max = (entries + CACHE_SHARD_N - 1) / CACHE_SHARD_N;
+    for (int i = 0; i < CACHE_SHARD_N; ++i) {
+        CacheShard* shard = &gsCacheShards[i];
+        g_mutex_lock (&shard->lock);
+        cache_trim (shard, max);
+        g_mutex_unlock (&shard->lock);
+    }
+}
+
+gboolean backup_meta_cache_enabled ()
+{
+    return g_atomic_int_get (&gsCacheMax) > 0;
+}
+
+gboolean backup_meta_cache_lookup (int dirFd, const char* relPath, const struct stat* statBuf, BackupMetaFile* info)
+{
+    g_return_val_if_fail (relPath && statBuf && info, FALSE);
+
+    gboolean hit = FALSE;
+    char key[STORE_PATH_MAX + 16];
+
+    if (!backup_meta_cache_enabled () || !cache_key (dirFd, relPath, key, sizeof (key))) {
+        return FALSE;
+    }
+
+    CacheShard* shard = cache_shard (key);
+    g_mutex_lock (&shard->lock);
+    CacheEntry* entry = shard->entries ? g_hash_table_lookup (shard->entries, key) : NULL;
+    if (entry && cache_stat_equal (entry, statBuf)) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_queue_push_head_link (&shard->lru, &entry->link);
+        cache_meta_copy (info, &entry->meta);
+        hit = TRUE;
+    }
+    else if (entry) {
+        // 已被其它进程改写或替换, 旧条目不再有用
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_hash_table_remove (shard->entries, key);
+    }
+    g_mutex_unlock (&shard->lock);
+
+    return hit;
+}
+
+void backup_meta_cache_store (int dirFd, const char* relPath, const struct stat* statBuf, const BackupMetaFile* info, gboolean written)
+{
+    g_return_if_fail (relPath && statBuf && info);
+
+    char key[STORE_PATH_MAX + 16];
+
+    const guint max = (guint) g_atomic_int_get (&gsCacheMax);
+    if (0 == max || !cache_key (dirFd, relPath, key, sizeof (key))) {
+        return;
+    }
+
+    const gboolean racy = !written && (gint64) statBuf->st_mtim.tv_sec + 1 >= g_get_real_time () / G_USEC_PER_SEC;
+
+    CacheShard* shard = cache_shard (key);
+    g_mutex_lock (&shard->lock);
+    if (!shard->entries) {
+        shard->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_free);
+    }
+    CacheEntry* entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_hash_table_remove (shard->entries, key);
+    }
+    if (!racy) {
+        entry = g_new0 (CacheEntry, 1);
+        entry->key = g_strdup (key);
+        entry->dev = statBuf->st_dev;
+        entry->ino = statBuf->st_ino;
+        entry->size = statBuf->st_size;
+        entry->mtime = statBuf->st_mtim;
+        entry->ctime = statBuf->st_ctim;
+        entry->link.data = entry;
+        cache_meta_copy (&entry->meta, info);
+        g_hash_table_insert (shard->entries, entry->key, entry);
+        g_queue_push_head_link (&shard->lru, &entry->link);
+        cache_trim (shard, (max + CACHE_SHARD_N - 1) / CACHE_SHARD_N);
+    }
+    g_mutex_unlock (&shard->lock);
+}
+
+void backup_meta_cache_remove (int dirFd, const char* relPath)
+{
+    g_return_if_fail (relPath);
+
+    char key[STORE_PATH_MAX + 16];
+
+    if (!backup_meta_cache_enabled () || !cache_key (dirFd, relPath, key, sizeof (key))) {
+        return;
+    }
+
+    CacheShard* shard = cache_shard (key);
+    g_mutex_lock (&shard->lock);
+    CacheEntry* entry = shard->entries ? g_hash_table_lookup (shard->entries, key) : NULL;
+    if (entry) {
+        g_queue_unlink (&shard->lru, &entry->link);
+        g_hash_table_remove (shard->entries, key);
+    }
+    g_mutex_unlock (&shard->lock);
+}
+
+static void cache_init_from_env ()
+{
+    const char* env = g_getenv (CACHE_ENV);
+    if (env && g_ascii_isdigit (env[0])) {
+        backup_meta_cache_set_size ((guint) MIN (strtoull (env, NULL, 10), (guint64) G_MAXINT));
+    }
+}
+
+static CacheShard* cache_shard (const char* key)
+{
+    return &gsCacheShards[g_str_hash (key) % CACHE_SHARD_N];
+}
+
+/**
+ * 仓库的目录 fd 在进程内不会关闭, 与相对路径一起即可唯一确定 meta 文件
+ */
+static gboolean cache_key (int dirFd, const char* relPath, char* buf, gsize bufLen)
+{
+    const int n = g_snprintf (buf, bufLen, "%d:%s", dirFd, relPath);
+
+    return n > 0 && (gsize) n < bufLen;
+}
+
+static gboolean cache_stat_equal (const CacheEntry* entry, const struct stat* statBuf)
+{
+    return entry->dev == statBuf->st_dev
+        && entry->ino == statBuf->st_ino
+        && entry->size == statBuf->st_size
+        && entry->mtime.tv_sec == statBuf->st_mtim.tv_sec && entry->mtime.tv_nsec == statBuf->st_mtim.tv_nsec
+        && entry->ctime.tv_sec == statBuf->st_ctim.tv_sec && entry->ctime.tv_nsec == statBuf->st_ctim.tv_nsec;
+}
+
+static void cache_trim (CacheShard* shard, guint max)
+{
+    while (shard->lru.length > max) {
+        GList* link = g_queue_peek_tail_link (&shard->lru);
+        CacheEntry* entry = link->data;
+        g_queue_unlink (&shard->lru, link);
+        g_hash_table_remove (shard->entries, entry->key);
+    }
+}
+
+static void cache_meta_copy (BackupMetaFile* dst, const BackupMetaFile* src)
+{
+    dst->version = src->version;
+    dst->srcFilePath = g_strdup (src->srcFilePath);
+    dst->srcFilePathMD5 = g_strdup (src->srcFilePathMD5);
+    dst->backupFileCtxMD51 = g_strdup (src->backupFileCtxMD51);
+    dst->backupFileCtxMD52 = g_strdup (src->backupFileCtxMD52);
+    dst->backupFileCtxMD53 = g_strdup (src->backupFileCtxMD53);
+    dst->backupFileTimestamp1 = src->backupFileTimestamp1;
+    dst->backupFileTimestamp2 = src->backupFileTimestamp2;
+    dst->backupFileTimestamp3 = src->backupFileTimestamp3;
+}
+
+static void cache_entry_free (gpointer data)
+{
+    CacheEntry* entry = data;
+
+    backup_meta_free (&entry->meta);
+    STR_FREE(entry->key);
+    g_free (entry);
+}
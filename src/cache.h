@@ -0,0 +1,33 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_CACHE_H
+#define gvfs_backup_CACHE_H
+#include "backup-private.h"
+
+#include <sys/stat.h>
+
+G_BEGIN_DECLS
+
+#define CACHE_ENV                       "ANDSEC_BACKUP_META_CACHE"
+#define CACHE_DEFAULT_SIZE              4096                // 默认缓存的 meta 条数
+#define CACHE_SHARD_N                   16
+
+/**
+ * 已解析 meta 的进程内缓存, 按 (目录 fd, 相对路径) 查找; 条目记录 meta 文件的
+ * 设备、inode、大小、mtime、ctime, 与调用者传入的 stat 结果完全一致才命中
+ */
+gboolean    backup_meta_cache_enabled       ();
+gboolean    backup_meta_cache_lookup        (int dirFd, const char* relPath, const struct stat* statBuf, BackupMetaFile* info/*out*/);
+
+/**
+ * written 为 TRUE 表示内容由本进程刚刚写入新文件并改名到位(inode 在其存在期间不会被其它文件占用);
+ * 否则 mtime 在最近一秒内的 meta 不缓存, 时间戳粒度内其它进程再次原地改写时 stat 可能不变
+ */
+void        backup_meta_cache_store         (int dirFd, const char* relPath, const struct stat* statBuf, const BackupMetaFile* info, gboolean written);
+void        backup_meta_cache_remove        (int dirFd, const char* relPath);
+
+G_END_DECLS
+
+#endif // gvfs_backup_CACHE_H
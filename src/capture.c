@@ -0,0 +1,384 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 修改前捕获: fanotify FAN_OPEN_PERM 拦截打开, 窗口期内首次打开的文件先备份再放行
+//
+#define _GNU_SOURCE
+#include "backup.h"
+#include "store.h"
+#include "daemon.h"
+#include "copy.h"
+#include "backup-private.h"
+
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+
+#define CAPTURE_SYNC_MAX        (32 * 1024 * 1024)          // 更大的文件来不及在预算内备份, 直接放行
+#define CAPTURE_CACHE_MAX       (64 * 1024)                 // 超过后清理已过期的记录
+#define CAPTURE_EVENT_BUF       (16 * 1024)
+
+typedef struct _CaptureKey
+{
+    dev_t                   dev;
+    ino_t                   ino;
+} CaptureKey;
+
+typedef struct _CaptureJob
+{
+    gint                    ref;
+    gint                    responded;          // 原子, 保证每个权限事件只回复一次
+    int                     fd;                 // fanotify 提供的文件描述符
+    CaptureKey              key;
+    gint64                  deadline;
+} CaptureJob;
+
+static gpointer     capture_thread              (gpointer data);
+static void         capture_worker              (gpointer data, gpointer uData);
+static gboolean     capture_backup              (CaptureJob* job, BackupStore* store, const char* path);
+static int          capture_snapshot            (BackupStore* store, int fd, const struct stat* statBuf);
+static void         capture_respond             (CaptureJob* job, guint32 response);
+static void         capture_reply               (int fd, guint32 response);
+static void         capture_job_unref           (CaptureJob* job);
+static gboolean     capture_cache_hit           (const CaptureKey* key, gint64 now);
+static void         capture_cache_add           (const CaptureKey* key, gint64 now);
+static gboolean     capture_cache_expired       (gpointer key, gpointer value, gpointer data);
+static guint        capture_key_hash            (gconstpointer key);
+static gboolean     capture_key_equal           (gconstpointer a, gconstpointer b);
+
+
+static GMutex       gsCaptureLock;                  // 保护启动/停止与以下配置
+static GThread*     gsCapture = NULL;
+static GThreadPool* gsCapturePool = NULL;
+static int          gsCaptureFd = -1;
+static int          gsCaptureWake = -1;
+static gint         gsCaptureStop = 0;
+static gint         gsCaptureWindowSec = 0;         // 原子读写
+static gint         gsCaptureBudgetMs = 0;          // 原子读写
+
+static GMutex       gsCacheLock;
+static GHashTable*  gsCache = NULL;                 // CaptureKey -> 过期时间(单调时钟)
+
+
+gboolean backup_capture_start (const char* mountPoint, guint windowSec, guint budgetMs)
+{
+    g_return_val_if_fail (mountPoint && '/' == mountPoint[0] && windowSec > 0 && budgetMs > 0, FALSE);
+
+    gboolean ret = FALSE;
+
+    g_mutex_lock (&gsCaptureLock);
+    do {
+        g_atomic_int_set (&gsCaptureWindowSec, (gint) windowSec);
+        g_atomic_int_set (&gsCaptureBudgetMs, (gint) budgetMs);
+
+        if (!gsCapture) {
+            gsCaptureFd = fanotify_init (FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+            BREAK_IF_FAIL(gsCaptureFd >= 0);
+            gsCaptureWake = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (gsCaptureWake < 0) {
+                close (gsCaptureFd);
+                gsCaptureFd = -1;
+                break;
+            }
+
+            g_mutex_lock (&gsCacheLock);
+            if (!gsCache) {
+                gsCache = g_hash_table_new_full (capture_key_hash, capture_key_equal, g_free, g_free);
+            }
+            g_mutex_unlock (&gsCacheLock);
+
+            gsCapturePool = g_thread_pool_new (capture_worker, NULL, (gint) g_get_num_processors(), FALSE, NULL);
+            g_atomic_int_set (&gsCaptureStop, 0);
+            gsCapture = g_thread_new ("backup-capture", capture_thread, NULL);
+        }
+
+        // 只关心普通文件的打开, 不加 FAN_ONDIR
+        ret = (0 == fanotify_mark (gsCaptureFd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN_PERM, AT_FDCWD, mountPoint));
+    } while (FALSE);
+    g_mutex_unlock (&gsCaptureLock);
+
+    return ret;
+}
+
+void backup_capture_stop ()
+{
+    g_mutex_lock (&gsCaptureLock);
+    if (gsCapture) {
+        const guint64 one = 1;
+        g_atomic_int_set (&gsCaptureStop, 1);
+        if (write (gsCaptureWake, &one, sizeof (one)) < 0) {
+            // 线程最迟在下一次超时检查时退出
+        }
+        g_thread_join (gsCapture);
+        gsCapture = NULL;
+
+        // 等待正在备份的任务回复完毕再关闭 fanotify, 关闭时内核放行其余未决事件
+        g_thread_pool_free (gsCapturePool, FALSE, TRUE);
+        gsCapturePool = NULL;
+        close (gsCaptureFd);
+        close (gsCaptureWake);
+        gsCaptureFd = -1;
+        gsCaptureWake = -1;
+    }
+    g_mutex_unlock (&gsCaptureLock);
+}
+
+/**
+ * 事件线程从不阻塞在备份上: 命中缓存或无需捕获的打开立即放行, 其余交给线程池,
+ * 超过预算仍未完成的由本线程放行, 不让用户的打开失败. 本进程自己的打开(包括捕获时读源文件、写仓库)总是立即放行
+ */
+static gpointer capture_thread (gpointer data)
+{
+    GQueue pending = G_QUEUE_INIT;              // 按截止时间排列的 CaptureJob*
+    char* buf = g_malloc (CAPTURE_EVENT_BUF);
+
+    while (!g_atomic_int_get (&gsCaptureStop)) {
+        int timeout = -1;
+        const gint64 now = g_get_monotonic_time();
+
+        while (!g_queue_is_empty (&pending)) {
+            CaptureJob* job = g_queue_peek_head (&pending);
+            if (job->deadline > now) {
+                timeout = (int) ((job->deadline - now + 999) / 1000);
+                break;
+            }
+            g_queue_pop_head (&pending);
+            capture_respond (job, FAN_ALLOW);
+            capture_job_unref (job);
+        }
+
+        struct pollfd fds[2] = {
+            { gsCaptureFd, POLLIN, 0 },
+            { gsCaptureWake, POLLIN, 0 },
+        };
+        if (poll (fds, 2, timeout) <= 0 || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        ssize_t len = 0;
+        while ((len = read (gsCaptureFd, buf, CAPTURE_EVENT_BUF)) > 0) {
+            const struct fanotify_event_metadata* ev = (const struct fanotify_event_metadata*) buf;
+            for (; FAN_EVENT_OK (ev, len); ev = FAN_EVENT_NEXT (ev, len)) {
+                if (FANOTIFY_METADATA_VERSION != ev->vers || ev->fd < 0) {
+                    continue;
+                }
+                if (!(ev->mask & FAN_OPEN_PERM)) {
+                    close (ev->fd);
+                    continue;
+                }
+                if (ev->pid == getpid()) {
+                    capture_reply (ev->fd, FAN_ALLOW);
+                    close (ev->fd);
+                    continue;
+                }
+
+                CaptureJob* job = NULL;
+                struct stat statBuf;
+                if (0 == fstat (ev->fd, &statBuf) && S_ISREG(statBuf.st_mode) && statBuf.st_size > 0
+                    && statBuf.st_size <= CAPTURE_SYNC_MAX) {
+                    // poll() 可能阻塞了很久, 循环开头的 now 已过时, 会把刚过期的记录当作命中
+                    const CaptureKey key = { statBuf.st_dev, statBuf.st_ino };
+                    const gint64 evNow = g_get_monotonic_time();
+                    if (!capture_cache_hit (&key, evNow)) {
+                        job = g_new0 (CaptureJob, 1);
+                        job->ref = 2;
+                        job->fd = ev->fd;
+                        job->key = key;
+                        job->deadline = evNow + (gint64) g_atomic_int_get (&gsCaptureBudgetMs) * 1000;
+                    }
+                }
+
+                if (job) {
+                    g_queue_push_tail (&pending, job);
+                    g_thread_pool_push (gsCapturePool, job, NULL);
+                }
+                else {
+                    capture_reply (ev->fd, FAN_ALLOW);
+                    close (ev->fd);
+                }
+            }
+        }
+    }
+
+    CaptureJob* job = NULL;
+    while (NULL != (job = g_queue_pop_head (&pending))) {
+        capture_respond (job, FAN_ALLOW);
+        capture_job_unref (job);
+    }
+
+    STR_FREE(buf);
+
+    return NULL;
+
+    (void) data;
+}
+
+/**
+ * 通过 /proc/self/fd 取得路径后按普通备份处理; 仓库自身的文件不捕获.
+ * 开始前已超过预算的不再备份
+ */
+static void capture_worker (gpointer data, gpointer uData)
+{
+    CaptureJob* job = data;
+    char link[64];
+    char path[STORE_PATH_MAX];
+
+    g_snprintf (link, sizeof (link), "/proc/self/fd/%d", job->fd);
+    const ssize_t len = readlink (link, path, sizeof (path) - 1);
+
+    if (len > 0 && !g_atomic_int_get (&job->responded) && g_get_monotonic_time() < job->deadline) {
+        path[len] = '\0';
+        char* mountPoint = get_mount_point_by_path (path);
+        BackupStore* store = mountPoint ? backup_store_get (mountPoint) : NULL;
+        if (store && '/' == path[0] && !g_str_has_prefix (path, store->root)) {
+            // 只有本进程的打开不受拦截, 交给守护进程打开会再次触发权限事件
+            backup_daemon_set_local (TRUE);
+            if (capture_backup (job, store, path)) {
+                capture_cache_add (&job->key, g_get_monotonic_time());
+            }
+        }
+        STR_FREE(mountPoint);
+    }
+
+    capture_respond (job, FAN_ALLOW);
+    capture_job_unref (job);
+
+    (void) uData;
+}
+
+/**
+ * 优先用 FICLONE 在仓库中做一个快照并立即放行, 之后从快照备份, 写入者不会与备份竞争;
+ * 文件系统不支持(或仓库在别的设备上)时直接读源文件, 超过预算被放行后源文件有变化的版本标记为损坏
+ */
+static gboolean capture_backup (CaptureJob* job, BackupStore* store, const char* path)
+{
+    gboolean ret = FALSE;
+    struct stat before;
+    struct stat after;
+
+    if (0 != fstat (job->fd, &before)) {
+        return FALSE;
+    }
+
+    const int snapFd = capture_snapshot (store, job->fd, &before);
+    if (snapFd >= 0) {
+        capture_respond (job, FAN_ALLOW);
+        ret = backup_file_backup_fd (snapFd, path);
+        close (snapFd);
+        return ret;
+    }
+
+    const guint64 since = (guint64) time (NULL);
+    ret = backup_file_backup_now (path);
+    if (ret && g_atomic_int_get (&job->responded) && 0 == fstat (job->fd, &after)
+        && (after.st_size != before.st_size
+            || after.st_mtim.tv_sec != before.st_mtim.tv_sec || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec
+            || after.st_ctim.tv_sec != before.st_ctim.tv_sec || after.st_ctim.tv_nsec != before.st_ctim.tv_nsec)) {
+        backup_file_mark_torn (path, since);
+        ret = FALSE;
+    }
+
+    return ret;
+}
+
+/**
+ * 快照是仓库目录下的匿名文件(O_TMPFILE), 关闭即释放, 不留残留; 元数据照搬源文件, 备份时一并保存
+ */
+static int capture_snapshot (BackupStore* store, int fd, const struct stat* statBuf)
+{
+    const int backupFd = backup_store_backup_fd (store);
+    if (backupFd < 0) {
+        return -1;
+    }
+
+    const int snapFd = openat (backupFd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (snapFd < 0) {
+        return -1;
+    }
+    if (0 != ioctl (snapFd, FICLONE, fd)) {
+        close (snapFd);
+        return -1;
+    }
+    backup_copy_stat_meta (snapFd, statBuf);
+
+    return snapFd;
+}
+
+static void capture_respond (CaptureJob* job, guint32 response)
+{
+    if (g_atomic_int_compare_and_exchange (&job->responded, 0, 1)) {
+        capture_reply (job->fd, response);
+    }
+}
+
+static void capture_reply (int fd, guint32 response)
+{
+    struct fanotify_response resp;
+    resp.fd = fd;
+    resp.response = response;
+
+    while (write (gsCaptureFd, &resp, sizeof (resp)) < 0 && EINTR == errno) {
+    }
+}
+
+static void capture_job_unref (CaptureJob* job)
+{
+    if (g_atomic_int_dec_and_test (&job->ref)) {
+        close (job->fd);
+        g_free (job);
+    }
+}
+
+static gboolean capture_cache_hit (const CaptureKey* key, gint64 now)
+{
+    g_mutex_lock (&gsCacheLock);
+    const gint64* expire = g_hash_table_lookup (gsCache, key);
+    const gboolean hit = expire && *expire > now;
+    g_mutex_unlock (&gsCacheLock);
+
+    return hit;
+}
+
+static void capture_cache_add (const CaptureKey* key, gint64 now)
+{
+    CaptureKey* k = g_new (CaptureKey, 1);
+    gint64* expire = g_new (gint64, 1);
+    *k = *key;
+    *expire = now + (gint64) g_atomic_int_get (&gsCaptureWindowSec) * G_USEC_PER_SEC;
+
+    g_mutex_lock (&gsCacheLock);
+    if (g_hash_table_size (gsCache) >= CAPTURE_CACHE_MAX) {
+        g_hash_table_foreach_remove (gsCache, capture_cache_expired, &now);
+    }
+    g_hash_table_replace (gsCache, k, expire);
+    g_mutex_unlock (&gsCacheLock);
+}
+
+static gboolean capture_cache_expired (gpointer key, gpointer value, gpointer data)
+{
+    return *(gint64*) value <= *(gint64*) data;
+
+    (void) key;
+}
+
+static guint capture_key_hash (gconstpointer key)
+{
+    const CaptureKey* k = key;
+
+    return (guint) (k->ino ^ (k->ino >> 32) ^ ((guint64) k->dev * 0x9e3779b1u));
+}
+
+static gboolean capture_key_equal (gconstpointer a, gconstpointer b)
+{
+    const CaptureKey* ka = a;
+    const CaptureKey* kb = b;
+
+    return ka->dev == kb->dev && ka->ino == kb->ino;
+}
@@ -0,0 +1,515 @@
+//
+// Created by dingjing on 1/8/25.
+//
+#define _GNU_SOURCE
+#include "copy.h"
+#include "io.h"
+#include "backup-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define COPY_RANGE_MAX          (1024 * 1024 * 1024)
+
+/**
+ * 批量模式下不能使用 O_DIRECT 时, 在读写游标之后丢弃页缓存
+ */
+typedef struct _CopyCursor
+{
+    int                     srcFd;
+    int                     dstFd;
+    gboolean                dropBehind;
+    guint64                 flushed;            // 目标文件已发起回写的位置
+    guint64                 dropped;            // 此前的页缓存已丢弃
+} CopyCursor;
+
+static gboolean     copy_data                   (int srcFd, int dstFd, const struct stat* statBuf, guint64* total);
+static gboolean     copy_data_sparse            (int srcFd, int dstFd, guint64 size, guint64* total, gboolean* fallback, CopyCursor* cur);
+static gboolean     copy_extent                 (int srcFd, int dstFd, guint64 begin, guint64 end, guint8** buf, CopyCursor* cur);
+static gboolean     copy_data_direct            (int srcFd, int dstFd, guint64* total, gboolean* fallback);
+static gboolean     copy_data_range             (int srcFd, int dstFd, guint64 size, guint64* total, gboolean* fallback, CopyCursor* cur);
+static gboolean     copy_data_rw                (int srcFd, int dstFd, guint64* total, CopyCursor* cur);
+static void         copy_cursor_advance         (CopyCursor* cur, guint64 pos);
+static void         copy_cursor_finish          (CopyCursor* cur);
+static gboolean     copy_write_all              (int fd, const guint8* data, gsize len);
+static gboolean     copy_pwrite_all             (int fd, const guint8* data, gsize len, guint64 offset);
+
+
+static GPrivate     gsCopyBulk = G_PRIVATE_INIT (NULL);
+
+
+void backup_copy_set_bulk (gboolean enabled)
+{
+    g_private_set (&gsCopyBulk, GINT_TO_POINTER (enabled ? 1 : 0));
+}
+
+gboolean backup_copy_is_bulk ()
+{
+    return 0 != GPOINTER_TO_INT (g_private_get (&gsCopyBulk));
+}
+
+/**
+ * chown 会清掉 setuid 位, 因此先于 chmod; 没能改属主时也不保留 setuid/setgid
+ */
+void backup_copy_stat_meta (int fd, const struct stat* from)
+{
+    g_return_if_fail (fd >= 0 && from);
+
+    const struct timespec times[2] = { from->st_atim, from->st_mtim };
+
+    const gboolean owned = (0 != geteuid ()) || (0 == fchown (fd, from->st_uid, from->st_gid));
+    fchmod (fd, (owned ? from->st_mode : from->st_mode & ~(S_ISUID | S_ISGID)) & 07777);
+    futimens (fd, times);
+}
+
+gboolean backup_copy_direct_on (int fd, guint64 size)
+{
+    if (!backup_copy_is_bulk () || size < COPY_BULK_MIN_SIZE) {
+        return FALSE;
+    }
+
+    // tmpfs 等不支持 O_DIRECT 的文件系统在这里返回 EINVAL
+    const int flags = fcntl (fd, F_GETFL);
+
+    return flags >= 0 && 0 == fcntl (fd, F_SETFL, flags | O_DIRECT);
+}
+
+gboolean backup_copy_direct_off (int fd)
+{
+    const int flags = fcntl (fd, F_GETFL);
+
+    return flags >= 0 && (flags & O_DIRECT) && 0 == fcntl (fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+
+gboolean backup_copy_file (const char* srcPath, const char* dstPath, gboolean keepOld, guint64* bytes)
+{
+    g_return_val_if_fail (srcPath && dstPath, FALSE);
+
+    const int srcFd = open (srcPath, O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0) {
+        if (bytes) { *bytes = 0; }
+        return FALSE;
+    }
+
+    const gboolean ret = backup_copy_file_fd (srcFd, dstPath, keepOld, bytes);
+    const int savedErrno = errno;
+    close (srcFd);
+    errno = savedErrno;
+
+    return ret;
+}
+
+gboolean backup_copy_file_fd (int srcFd, const char* dstPath, gboolean keepOld, guint64* bytes)
+{
+    g_return_val_if_fail (srcFd >= 0 && dstPath, FALSE);
+
+    int dstFd = -1;
+    int savedErrno = 0;
+    guint64 total = 0;
+    gboolean ret = FALSE;
+    char* tmpPath = NULL;
+    char* oldPath = NULL;
+    struct stat statBuf;
+
+    do {
+        BREAK_IF_FAIL(0 == fstat (srcFd, &statBuf));
+
+        tmpPath = g_strdup_printf ("%s.XXXXXX", dstPath);
+        dstFd = g_mkstemp (tmpPath);
+        BREAK_IF_FAIL(dstFd >= 0);
+
+        BREAK_IF_FAIL(copy_data (srcFd, dstFd, &statBuf, &total));
+        BREAK_IF_FAIL(0 == fchmod (dstFd, statBuf.st_mode & 07777));
+        BREAK_IF_FAIL(0 == close (dstFd));
+        dstFd = -1;
+
+        if (keepOld && 0 == access (dstPath, F_OK)) {
+            oldPath = g_strdup_printf ("%s~", dstPath);
+            remove (oldPath);
+            if (0 != link (dstPath, oldPath)) {
+                BREAK_IF_FAIL(0 == rename (dstPath, oldPath));
+            }
+        }
+
+        BREAK_IF_FAIL(0 == rename (tmpPath, dstPath));
+        ret = TRUE;
+    } while (FALSE);
+
+    savedErrno = errno;
+
+    if (dstFd >= 0) { close (dstFd); }
+    if (!ret && tmpPath) { remove (tmpPath); }
+    if (bytes) { *bytes = ret ? total : 0; }
+
+    STR_FREE(tmpPath);
+    STR_FREE(oldPath);
+
+    errno = savedErrno;
+
+    return ret;
+}
+
+/**
+ * 源文件按顺序读, 提示内核加大预读; 读写交替进行时已写出的部分立即开始回写, 读取下一块与落盘重叠
+ */
+static gboolean copy_data (int srcFd, int dstFd, const struct stat* statBuf, guint64* total)
+{
+    const guint64 size = (guint64) statBuf->st_size;
+    gboolean ret = FALSE;
+    gboolean fallback = FALSE;
+    CopyCursor cur;
+
+    // 同一文件系统且支持 reflink(btrfs/xfs)时共享数据块, 不产生实际 I/O
+    if (0 == ioctl (dstFd, FICLONE, srcFd)) {
+        *total = size;
+        return TRUE;
+    }
+
+    *total = 0;
+    posix_fadvise (srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    memset (&cur, 0, sizeof (cur));
+    cur.srcFd = srcFd;
+    cur.dstFd = dstFd;
+    cur.dropBehind = backup_copy_is_bulk () && size >= COPY_BULK_MIN_SIZE;
+
+    do {
+        // 分配的块少于文件大小说明有空洞, 只拷贝数据区段
+        if ((guint64) statBuf->st_blocks * 512 < size) {
+            if (copy_data_sparse (srcFd, dstFd, size, total, &fallback, &cur)) {
+                ret = TRUE;
+                break;
+            }
+            if (!fallback || 0 != ftruncate (dstFd, 0) || lseek (srcFd, 0, SEEK_SET) < 0 || lseek (dstFd, 0, SEEK_SET) < 0) {
+                break;
+            }
+            *total = 0;
+            fallback = FALSE;
+        }
+        // 批量模式下稠密的大文件绕过页缓存
+        else if (backup_copy_direct_on (srcFd, size)) {
+            if (backup_copy_direct_on (dstFd, size)) {
+                ret = copy_data_direct (srcFd, dstFd, total, &fallback);
+            }
+            else {
+                fallback = TRUE;
+            }
+            backup_copy_direct_off (srcFd);
+            backup_copy_direct_off (dstFd);
+            if (ret) {
+                cur.dropBehind = FALSE;
+                break;
+            }
+            if (!fallback || 0 != ftruncate (dstFd, 0)) {
+                break;
+            }
+            *total = 0;
+            fallback = FALSE;
+        }
+
+        ret = copy_data_range (srcFd, dstFd, size, total, &fallback, &cur) || (fallback && copy_data_rw (srcFd, dstFd, total, &cur));
+    } while (FALSE);
+
+    copy_cursor_finish (&cur);
+
+    return ret;
+}
+
+/**
+ * 按 SEEK_DATA/SEEK_HOLE 逐个拷贝数据区段, 最后用 ftruncate 补出末尾的空洞, 目标文件的空洞与源文件一致
+ * 文件系统不支持时置 fallback, 由调用者从头按普通方式拷贝
+ */
+static gboolean copy_data_sparse (int srcFd, int dstFd, guint64 size, guint64* total, gboolean* fallback, CopyCursor* cur)
+{
+    guint64 off = 0;
+    gboolean ret = TRUE;
+    guint8* buf = NULL;
+
+    while (off < size) {
+        const off_t data = lseek (srcFd, (off_t) off, SEEK_DATA);
+        if (data < 0 && ENXIO == errno) {
+            break;
+        }
+        if (data < 0) {
+            *fallback = (EINVAL == errno || EOPNOTSUPP == errno);
+            ret = FALSE;
+            break;
+        }
+        const off_t hole = lseek (srcFd, data, SEEK_HOLE);
+        const guint64 end = (hole > data) ? (guint64) hole : size;
+        if (!copy_extent (srcFd, dstFd, (guint64) data, end, &buf, cur)) {
+            ret = FALSE;
+            break;
+        }
+        *total += end - (guint64) data;
+        off = end;
+    }
+
+    if (ret) {
+        ret = (0 == ftruncate (dstFd, (off_t) MAX (off, size)));
+    }
+
+    STR_FREE(buf);
+
+    return ret;
+}
+
+/**
+ * 源与目标使用相同偏移; copy_file_range 不可用时改为 pread/pwrite, 缓冲区在多个区段间复用
+ */
+static gboolean copy_extent (int srcFd, int dstFd, guint64 begin, guint64 end, guint8** buf, CopyCursor* cur)
+{
+    loff_t in = (loff_t) begin;
+    loff_t out = (loff_t) begin;
+    const guint64 step = cur->dropBehind ? COPY_BUFFER_SIZE : COPY_RANGE_MAX;
+
+    while ((guint64) in < end && !*buf) {
+        const ssize_t n = copy_file_range (srcFd, &in, dstFd, &out, (size_t) MIN (end - (guint64) in, step), 0);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n < 0 && (ENOSYS == errno || EXDEV == errno || EINVAL == errno || EOPNOTSUPP == errno || EBADF == errno)) {
+            *buf = g_malloc (COPY_BUFFER_SIZE);
+            break;
+        }
+        if (n < 0) {
+            return FALSE;
+        }
+        if (0 == n) {
+            return TRUE;
+        }
+        copy_cursor_advance (cur, (guint64) in);
+    }
+
+    while ((guint64) in < end) {
+        const ssize_t n = pread (srcFd, *buf, (size_t) MIN (end - (guint64) in, COPY_BUFFER_SIZE), in);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n < 0) {
+            return FALSE;
+        }
+        if (0 == n) {
+            break;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            const ssize_t w = pwrite (dstFd, *buf + done, (size_t) (n - done), in + done);
+            if (w < 0 && EINTR == errno) {
+                continue;
+            }
+            if (w <= 0) {
+                return FALSE;
+            }
+            done += w;
+        }
+        in += n;
+        copy_cursor_advance (cur, (guint64) in);
+    }
+
+    return TRUE;
+}
+
+/**
+ * 源与目标都已设置 O_DIRECT, 缓冲区按 COPY_DIRECT_ALIGN 对齐; 末尾不足对齐长度的部分补零写出后截断到实际长度
+ * 第一次读写就返回 EINVAL(设备的对齐要求更大等)时置 fallback, 由调用者按普通方式重新拷贝
+ */
+static gboolean copy_data_direct (int srcFd, int dstFd, guint64* total, gboolean* fallback)
+{
+    guint64 off = 0;
+    gboolean ret = FALSE;
+    gpointer buf = NULL;
+
+    if (0 != posix_memalign (&buf, COPY_DIRECT_ALIGN, COPY_BUFFER_SIZE)) {
+        *fallback = TRUE;
+        return FALSE;
+    }
+
+    while (TRUE) {
+        const ssize_t n = pread (srcFd, buf, COPY_BUFFER_SIZE, (off_t) off);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n < 0) {
+            *fallback = (EINVAL == errno && 0 == off);
+            break;
+        }
+        if (0 == n) {
+            ret = TRUE;
+            break;
+        }
+        const gsize len = ((gsize) n + COPY_DIRECT_ALIGN - 1) & ~((gsize) COPY_DIRECT_ALIGN - 1);
+        memset ((guint8*) buf + n, 0, len - (gsize) n);
+        if (!copy_pwrite_all (dstFd, buf, len, off)) {
+            *fallback = (EINVAL == errno && 0 == off);
+            break;
+        }
+        off += (guint64) n;
+        // 不足对齐长度只会出现在文件末尾
+        if ((gsize) n != len) {
+            ret = TRUE;
+            break;
+        }
+    }
+
+    if (ret) {
+        ret = (0 == ftruncate (dstFd, (off_t) off));
+        *total = off;
+    }
+
+    free (buf);
+
+    return ret;
+}
+
+/**
+ * 旧内核或跨文件系统时 copy_file_range 返回 ENOSYS/EXDEV/EINVAL 等, 此时从已拷贝处退回读写
+ */
+static gboolean copy_data_range (int srcFd, int dstFd, guint64 size, guint64* total, gboolean* fallback, CopyCursor* cur)
+{
+    const guint64 step = cur->dropBehind ? COPY_BUFFER_SIZE : COPY_RANGE_MAX;
+
+    while (*total < size) {
+        const ssize_t n = copy_file_range (srcFd, NULL, dstFd, NULL, (size_t) MIN (size - *total, step), 0);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n < 0 && (ENOSYS == errno || EXDEV == errno || EINVAL == errno || EOPNOTSUPP == errno || EBADF == errno)) {
+            *fallback = TRUE;
+            return FALSE;
+        }
+        if (n < 0) {
+            return FALSE;
+        }
+        if (0 == n) {
+            break;
+        }
+        *total += n;
+        copy_cursor_advance (cur, *total);
+    }
+
+    // 拷贝期间文件变长, 剩余部分按普通读写补齐
+    return copy_data_rw (srcFd, dstFd, total, cur);
+}
+
+/**
+ * 丢弃页缓存时不走 io_uring, 多个缓冲区同时在途无法按游标逐段释放
+ */
+static gboolean copy_data_rw (int srcFd, int dstFd, guint64* total, CopyCursor* cur)
+{
+    if (!cur->dropBehind && backup_io_copy (srcFd, dstFd, total)) {
+        return TRUE;
+    }
+    if (!cur->dropBehind && ENOSYS != errno) {
+        return FALSE;
+    }
+
+    gboolean ret = FALSE;
+    guint64 flushed = *total;
+    guint8* buf = g_malloc (COPY_BUFFER_SIZE);
+
+    while (TRUE) {
+        const ssize_t n = read (srcFd, buf, COPY_BUFFER_SIZE);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        if (0 == n) {
+            ret = TRUE;
+            break;
+        }
+        if (!copy_write_all (dstFd, buf, n)) {
+            break;
+        }
+        *total += n;
+
+        if (cur->dropBehind) {
+            copy_cursor_advance (cur, *total);
+        }
+        else if (*total - flushed >= COPY_BUFFER_SIZE) {
+            sync_file_range (dstFd, (off_t) flushed, (off_t) (*total - flushed), SYNC_FILE_RANGE_WRITE);
+            flushed = *total;
+        }
+    }
+
+    STR_FREE(buf);
+
+    return ret;
+}
+
+/**
+ * 目标每满一个窗口就发起回写; 下一个窗口满时等待上一个窗口落盘, 然后丢弃源与目标这部分的页缓存
+ */
+static void copy_cursor_advance (CopyCursor* cur, guint64 pos)
+{
+    if (!cur->dropBehind || pos < cur->flushed + COPY_BUFFER_SIZE) {
+        return;
+    }
+
+    if (cur->flushed > cur->dropped) {
+        const off_t off = (off_t) cur->dropped;
+        const off_t len = (off_t) (cur->flushed - cur->dropped);
+        sync_file_range (cur->dstFd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise (cur->dstFd, off, len, POSIX_FADV_DONTNEED);
+        posix_fadvise (cur->srcFd, off, len, POSIX_FADV_DONTNEED);
+        cur->dropped = cur->flushed;
+    }
+
+    sync_file_range (cur->dstFd, (off_t) cur->flushed, (off_t) (pos - cur->flushed), SYNC_FILE_RANGE_WRITE);
+    cur->flushed = pos;
+}
+
+static void copy_cursor_finish (CopyCursor* cur)
+{
+    if (!cur->dropBehind) {
+        return;
+    }
+
+    // 长度为 0 表示到文件末尾
+    sync_file_range (cur->dstFd, (off_t) cur->dropped, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise (cur->dstFd, (off_t) cur->dropped, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise (cur->srcFd, (off_t) cur->dropped, 0, POSIX_FADV_DONTNEED);
+}
+
+static gboolean copy_write_all (int fd, const guint8* data, gsize len)
+{
+    while (len > 0) {
+        const ssize_t n = write (fd, data, len);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static gboolean copy_pwrite_all (int fd, const guint8* data, gsize len, guint64 offset)
+{
+    while (len > 0) {
+        const ssize_t n = pwrite (fd, data, len, (off_t) offset);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        data += n;
+        offset += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
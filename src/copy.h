@@ -0,0 +1,56 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_COPY_H
+#define gvfs_backup_COPY_H
+#include <glib.h>
+#include <sys/stat.h>
+
+G_BEGIN_DECLS
+
+#define COPY_BUFFER_SIZE                (4 * 1024 * 1024)
+#define COPY_BULK_MIN_SIZE              (8 * 1024 * 1024)   // 批量模式下小于此大小的文件仍使用页缓存
+#define COPY_DIRECT_ALIGN               4096                // O_DIRECT 的缓冲区地址、偏移与长度按此对齐
+
+/**
+ * 批量模式(按线程): 目录树备份与批量恢复的工作线程中开启, 之后该线程中大文件的拷贝与哈希
+ * 尽量不经过页缓存(O_DIRECT), 文件系统不支持时在读写游标之后丢弃页缓存, 不挤掉其它程序的工作集
+ */
+void        backup_copy_set_bulk            (gboolean enabled);
+gboolean    backup_copy_is_bulk             ();
+
+/**
+ * 批量模式下对 size 不小于 COPY_BULK_MIN_SIZE 的文件设置 O_DIRECT, 成功返回 TRUE
+ */
+gboolean    backup_copy_direct_on           (int fd, guint64 size);
+
+/**
+ * 清除 O_DIRECT, 之前已设置时返回 TRUE; 用于对齐要求不满足(EINVAL)时改回普通读写
+ */
+gboolean    backup_copy_direct_off          (int fd);
+
+/**
+ * 拷贝文件内容: 先写 <dstPath>.XXXXXX 再改名, 失败时 dstPath 保持原样, errno 为失败原因
+ * 优先 reflink(FICLONE), 其次 copy_file_range, 跨设备不支持时退回大块读写
+ * 稀疏文件只拷贝数据区段, 目标保留同样的空洞; bytes 为实际拷贝的数据字节数
+ * 批量模式下大文件改用 O_DIRECT 读写, 不支持时按 posix_fadvise 在游标之后丢弃页缓存
+ * keepOld 为 TRUE 且 dstPath 已存在时, 原文件保留为 <dstPath>~
+ * 只拷贝数据与权限位, 其余元数据由调用者处理
+ */
+gboolean    backup_copy_file                (const char* srcPath, const char* dstPath, gboolean keepOld, guint64* bytes/*out, nullable*/);
+
+/**
+ * 同 backup_copy_file, 源为已打开的 fd(由调用者关闭), 用于按目录 fd 打开的仓库文件
+ */
+gboolean    backup_copy_file_fd             (int srcFd, const char* dstPath, gboolean keepOld, guint64* bytes/*out, nullable*/);
+
+/**
+ * 把 from 中的属主、权限位与访问/修改时间设置到 fd, 用于不经 GIO 写出的版本文件与恢复结果;
+ * 尽力而为, 只有 root 能修改属主
+ */
+void        backup_copy_stat_meta           (int fd, const struct stat* from);
+
+G_END_DECLS
+
+#endif // gvfs_backup_COPY_H
@@ -0,0 +1,487 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 本机备份服务: 一个进程持有仓库与工作线程, 其它进程通过 UNIX 套接字提交请求
+//
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "backup.h"
+#include "copy.h"
+#include "backup-private.h"
+
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#define DAEMON_ENV              "ANDSEC_BACKUP_SOCKET"
+#define DAEMON_RETRY_US         G_USEC_PER_SEC          // 连接失败后这段时间内不再尝试, 直接在本进程执行
+#define DAEMON_DENIED_US        (60 * G_USEC_PER_SEC)   // 被守护进程拒绝(身份不符)后这段时间内不再尝试
+#define DAEMON_BACKLOG          128
+
+typedef struct _DaemonConn
+{
+    gint                    ref;
+    gint                    closed;             // 原子, 读线程已退出
+    int                     fd;
+    GMutex                  writeLock;          // 多个工作线程的响应不能交错
+    GThread*                reader;
+    GThreadPool*            pool;
+} DaemonConn;
+
+typedef struct _DaemonJob
+{
+    DaemonConn*             conn;
+    DaemonRequest           req;
+    char*                   arg;
+} DaemonJob;
+
+typedef struct _DaemonClient
+{
+    int                     fd;
+    gint                    generation;         // 套接字路径变化后重新连接
+    guint32                 nextId;
+} DaemonClient;
+
+static void         daemon_init_from_env        () __attribute__((constructor));
+static gboolean     daemon_client_connect       (DaemonClient* c);
+static void         daemon_client_close         (DaemonClient* c);
+static void         daemon_client_backoff       (gint64 delay);
+static void         daemon_client_free          (gpointer data);
+static int          daemon_listen               (const char* path);
+static gboolean     daemon_peer_allowed         (int fd);
+static gpointer     daemon_conn_thread          (gpointer data);
+static void         daemon_job_run              (gpointer data, gpointer uData);
+static void         daemon_conn_unref           (DaemonConn* conn);
+static gboolean     daemon_send_all             (int fd, const void* buf, gsize len);
+static gboolean     daemon_recv_all             (int fd, void* buf, gsize len);
+
+
+static GMutex       gsDaemonLock;                   // 保护以下两项
+static char*        gsDaemonSocket = NULL;          // NULL 表示不转发
+static gint64       gsDaemonRetryTime = 0;
+static gint         gsDaemonGeneration = 0;         // 原子读写
+static gint         gsDaemonServing = 0;            // 原子读写, 本进程就是守护进程
+static GPrivate     gsDaemonClient = G_PRIVATE_INIT (daemon_client_free);
+static GPrivate     gsDaemonLocal = G_PRIVATE_INIT (NULL);
+
+
+void backup_daemon_set_socket (const char* socketPath)
+{
+    g_mutex_lock (&gsDaemonLock);
+    STR_FREE(gsDaemonSocket);
+    gsDaemonSocket = g_strdup (socketPath);
+    gsDaemonRetryTime = 0;
+    g_mutex_unlock (&gsDaemonLock);
+
+    g_atomic_int_inc (&gsDaemonGeneration);
+}
+
+void backup_daemon_set_local (gboolean local)
+{
+    g_private_set (&gsDaemonLocal, GINT_TO_POINTER (local ? 1 : 0));
+}
+
+/**
+ * 请求在调用线程自己的连接上同步发送, 各线程互不等待; 连接出错时关闭并返回 FALSE, 由调用者在本进程内重试
+ */
+gboolean backup_daemon_forward (DaemonOp op, const char* arg, gint32* status, guint64* value)
+{
+    g_return_val_if_fail (arg && status, FALSE);
+
+    if (g_atomic_int_get (&gsDaemonServing) || 0 != GPOINTER_TO_INT (g_private_get (&gsDaemonLocal))) {
+        return FALSE;
+    }
+
+    const gsize argLen = strlen (arg);
+    if (argLen > DAEMON_PATH_MAX) {
+        return FALSE;
+    }
+
+    DaemonClient* c = g_private_get (&gsDaemonClient);
+    if (!c) {
+        c = g_new0 (DaemonClient, 1);
+        c->fd = -1;
+        g_private_set (&gsDaemonClient, c);
+    }
+    if (c->fd >= 0 && c->generation != g_atomic_int_get (&gsDaemonGeneration)) {
+        daemon_client_close (c);
+    }
+    if (c->fd < 0 && !daemon_client_connect (c)) {
+        return FALSE;
+    }
+
+    char buf[sizeof (DaemonRequest) + DAEMON_PATH_MAX];
+    DaemonRequest req;
+    DaemonResponse resp;
+    memset (&req, 0, sizeof (req));
+    memset (&resp, 0, sizeof (resp));
+    req.len = (guint32) argLen;
+    req.id = ++c->nextId;
+    req.op = (guint16) op;
+    req.flags = backup_copy_is_bulk() ? DAEMON_FLAG_BULK : 0;
+    memcpy (buf, &req, sizeof (req));
+    memcpy (buf + sizeof (req), arg, argLen);
+
+    if (!daemon_send_all (c->fd, buf, sizeof (req) + argLen)
+        || !daemon_recv_all (c->fd, &resp, sizeof (resp))
+        || resp.id != req.id) {
+        // 守护进程拒绝本进程时先回复 EPERM 再断开, 之后一段时间内不再连接
+        if (0 == resp.id && EPERM == resp.status) {
+            daemon_client_backoff (DAEMON_DENIED_US);
+        }
+        daemon_client_close (c);
+        return FALSE;
+    }
+
+    *status = resp.status;
+    if (value) {
+        *value = resp.value;
+    }
+
+    return TRUE;
+}
+
+gboolean backup_daemon_run (const char* socketPath, guint threads, GCancellable* cancel)
+{
+    char* path = NULL;
+    if (socketPath) {
+        path = g_strdup (socketPath);
+    }
+    else {
+        g_mutex_lock (&gsDaemonLock);
+        path = g_strdup (gsDaemonSocket ? gsDaemonSocket : DAEMON_SOCKET_DEFAULT);
+        g_mutex_unlock (&gsDaemonLock);
+    }
+
+    const int listenFd = daemon_listen (path);
+    if (listenFd < 0) {
+        STR_FREE(path);
+        return FALSE;
+    }
+
+    // 本进程内的调用不再转发给自己
+    g_atomic_int_set (&gsDaemonServing, 1);
+
+    GPtrArray* conns = g_ptr_array_new ();
+    GThreadPool* pool = g_thread_pool_new (daemon_job_run, NULL, (gint) (threads > 0 ? threads : g_get_num_processors()), FALSE, NULL);
+    const int cancelFd = cancel ? g_cancellable_get_fd (cancel) : -1;
+
+    while (!g_cancellable_is_cancelled (cancel)) {
+        struct pollfd fds[2] = {
+            { listenFd, POLLIN, 0 },
+            { cancelFd, POLLIN, 0 },
+        };
+        if (poll (fds, (cancelFd >= 0) ? 2 : 1, -1) <= 0 || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        const int fd = accept4 (listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (!daemon_peer_allowed (fd)) {
+            DaemonResponse denied;
+            memset (&denied, 0, sizeof (denied));
+            denied.status = EPERM;
+            daemon_send_all (fd, &denied, sizeof (denied));
+            close (fd);
+            continue;
+        }
+
+        // 顺便回收已断开的连接
+        for (guint i = 0; i < conns->len;) {
+            DaemonConn* conn = g_ptr_array_index (conns, i);
+            if (g_atomic_int_get (&conn->closed)) {
+                g_thread_join (conn->reader);
+                g_ptr_array_remove_index_fast (conns, i);
+                daemon_conn_unref (conn);
+                continue;
+            }
+            ++i;
+        }
+
+        DaemonConn* conn = g_new0 (DaemonConn, 1);
+        conn->ref = 2;                          // 读线程与 conns 各持有一个
+        conn->fd = fd;
+        conn->pool = pool;
+        g_mutex_init (&conn->writeLock);
+        conn->reader = g_thread_new ("backup-daemon-conn", daemon_conn_thread, conn);
+        g_ptr_array_add (conns, conn);
+    }
+
+    close (listenFd);
+    unlink (path);
+
+    // 先停止接收新请求, 已收到的请求执行完并回复后再关闭连接
+    for (guint i = 0; i < conns->len; ++i) {
+        shutdown (((DaemonConn*) g_ptr_array_index (conns, i))->fd, SHUT_RD);
+    }
+    for (guint i = 0; i < conns->len; ++i) {
+        g_thread_join (((DaemonConn*) g_ptr_array_index (conns, i))->reader);
+    }
+    g_thread_pool_free (pool, FALSE, TRUE);
+    for (guint i = 0; i < conns->len; ++i) {
+        daemon_conn_unref (g_ptr_array_index (conns, i));
+    }
+    g_ptr_array_unref (conns);
+
+    if (cancelFd >= 0) {
+        g_cancellable_release_fd (cancel);
+    }
+    g_atomic_int_set (&gsDaemonServing, 0);
+    STR_FREE(path);
+
+    return TRUE;
+}
+
+/**
+ * 转发需要显式开启: 转发后本进程的仓库、配额、去重等设置不再生效, 由守护进程自己的设置决定
+ */
+static void daemon_init_from_env ()
+{
+    const char* env = g_getenv (DAEMON_ENV);
+    if (!env || '\0' == env[0] || 0 == g_strcmp0 (env, "off")) {
+        return;
+    }
+
+    g_mutex_lock (&gsDaemonLock);
+    gsDaemonSocket = g_strdup (('/' == env[0]) ? env : DAEMON_SOCKET_DEFAULT);
+    g_mutex_unlock (&gsDaemonLock);
+}
+
+static gboolean daemon_client_connect (DaemonClient* c)
+{
+    struct sockaddr_un addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+
+    g_mutex_lock (&gsDaemonLock);
+    const gboolean tryIt = gsDaemonSocket && g_get_monotonic_time() >= gsDaemonRetryTime
+                           && strlen (gsDaemonSocket) < sizeof (addr.sun_path);
+    if (tryIt) {
+        g_strlcpy (addr.sun_path, gsDaemonSocket, sizeof (addr.sun_path));
+    }
+    g_mutex_unlock (&gsDaemonLock);
+
+    if (!tryIt) {
+        return FALSE;
+    }
+
+    c->generation = g_atomic_int_get (&gsDaemonGeneration);
+    c->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd >= 0 && 0 == connect (c->fd, (struct sockaddr*) &addr, sizeof (addr))) {
+        return TRUE;
+    }
+
+    daemon_client_close (c);
+    daemon_client_backoff (DAEMON_RETRY_US);
+
+    return FALSE;
+}
+
+static void daemon_client_close (DaemonClient* c)
+{
+    if (c->fd >= 0) {
+        close (c->fd);
+        c->fd = -1;
+    }
+}
+
+static void daemon_client_backoff (gint64 delay)
+{
+    g_mutex_lock (&gsDaemonLock);
+    gsDaemonRetryTime = g_get_monotonic_time() + delay;
+    g_mutex_unlock (&gsDaemonLock);
+}
+
+static void daemon_client_free (gpointer data)
+{
+    DaemonClient* c = data;
+
+    daemon_client_close (c);
+    g_free (c);
+}
+
+/**
+ * 套接字文件已存在时先试着连接: 连得上说明已有守护进程在运行, 否则是上次遗留的, 删除后重新绑定
+ */
+static int daemon_listen (const char* path)
+{
+    struct sockaddr_un addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    g_return_val_if_fail (path && strlen (path) < sizeof (addr.sun_path), -1);
+    g_strlcpy (addr.sun_path, path, sizeof (addr.sun_path));
+
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (0 != bind (fd, (struct sockaddr*) &addr, sizeof (addr)) && EADDRINUSE == errno) {
+        const int probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const gboolean alive = (probe >= 0) && (0 == connect (probe, (struct sockaddr*) &addr, sizeof (addr)));
+        if (probe >= 0) { close (probe); }
+        if (alive || 0 != unlink (path) || 0 != bind (fd, (struct sockaddr*) &addr, sizeof (addr))) {
+            close (fd);
+            return -1;
+        }
+    }
+
+    // 任何用户都能连接, 是否受理由 daemon_peer_allowed() 按对端身份决定
+    if (0 != chmod (path, 0666) || 0 != listen (fd, DAEMON_BACKLOG)) {
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * 守护进程以自己的身份读写任意路径, 只受理 root 与同一用户的请求;
+ * 其它用户的连接收到 EPERM 后被关闭, 其客户端暂停转发, 在自己的进程内以自己的权限执行
+ */
+static gboolean daemon_peer_allowed (int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+
+    if (0 != getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        return FALSE;
+    }
+
+    return 0 == cred.uid || cred.uid == geteuid();
+}
+
+/**
+ * 每个连接一个读线程, 只负责拆包; 请求交给公共线程池执行, 同一连接的多个请求可以同时执行
+ */
+static gpointer daemon_conn_thread (gpointer data)
+{
+    DaemonConn* conn = data;
+    DaemonRequest req;
+
+    while (daemon_recv_all (conn->fd, &req, sizeof (req))) {
+        if (req.len > DAEMON_PATH_MAX) {
+            break;
+        }
+        char* arg = g_malloc (req.len + 1);
+        if (!daemon_recv_all (conn->fd, arg, req.len)) {
+            g_free (arg);
+            break;
+        }
+        arg[req.len] = '\0';
+
+        DaemonJob* job = g_new0 (DaemonJob, 1);
+        job->conn = conn;
+        job->req = req;
+        job->arg = arg;
+        g_atomic_int_inc (&conn->ref);
+        g_thread_pool_push (conn->pool, job, NULL);
+    }
+
+    g_atomic_int_set (&conn->closed, 1);
+    daemon_conn_unref (conn);
+
+    return NULL;
+}
+
+static void daemon_job_run (gpointer data, gpointer uData)
+{
+    DaemonJob* job = data;
+    DaemonResponse resp;
+
+    memset (&resp, 0, sizeof (resp));
+    resp.id = job->req.id;
+
+    if ('/' != job->arg[0]) {
+        resp.status = EINVAL;
+    }
+    else {
+        // 线程池中的线程被不同请求复用, 每次按请求设置
+        backup_copy_set_bulk (0 != (job->req.flags & DAEMON_FLAG_BULK));
+        switch (job->req.op) {
+            case DAEMON_OP_BACKUP: {
+                resp.status = backup_file_backup_now (job->arg) ? 0 : (ENOSPC == errno ? ENOSPC : EIO);
+                break;
+            }
+            case DAEMON_OP_RESTORE: {
+                resp.status = backup_file_restore_by_abspath (job->arg) ? 0 : EIO;
+                break;
+            }
+            case DAEMON_OP_USAGE: {
+                resp.value = backup_store_get_usage (job->arg);
+                break;
+            }
+            case DAEMON_OP_QUOTA: {
+                resp.value = backup_store_get_quota (job->arg);
+                break;
+            }
+            default: {
+                resp.status = EINVAL;
+                break;
+            }
+        }
+    }
+
+    g_mutex_lock (&job->conn->writeLock);
+    daemon_send_all (job->conn->fd, &resp, sizeof (resp));
+    g_mutex_unlock (&job->conn->writeLock);
+
+    daemon_conn_unref (job->conn);
+    STR_FREE(job->arg);
+    g_free (job);
+
+    (void) uData;
+}
+
+static void daemon_conn_unref (DaemonConn* conn)
+{
+    if (g_atomic_int_dec_and_test (&conn->ref)) {
+        close (conn->fd);
+        g_mutex_clear (&conn->writeLock);
+        g_free (conn);
+    }
+}
+
+static gboolean daemon_send_all (int fd, const void* buf, gsize len)
+{
+    const char* p = buf;
+
+    while (len > 0) {
+        const ssize_t n = send (fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static gboolean daemon_recv_all (int fd, void* buf, gsize len)
+{
+    char* p = buf;
+
+    while (len > 0) {
+        const ssize_t n = recv (fd, p, len, 0);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,59 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_DAEMON_H
+#define gvfs_backup_DAEMON_H
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define DAEMON_SOCKET_DEFAULT           "/run/andsec-backup.sock"
+#define DAEMON_PATH_MAX                 4096
+
+/**
+ * 协议(本机字节序, 同一主机内使用):
+ *  请求: DaemonRequest + len 字节的参数(路径或挂载点, 不含 '\0')
+ *  响应: DaemonResponse, 按 id 对应请求; 同一连接上可以连续发送多个请求, 响应可能乱序返回
+ * 只转发写仓库或依赖守护进程内用量统计的操作; 枚举与按时间查询只读 meta(保存时整体改名, 读到的总是完整的),
+ * 结果是文件列表, 不适合放进定长的响应, 仍在调用进程内执行
+ */
+typedef enum
+{
+    DAEMON_OP_BACKUP = 1,
+    DAEMON_OP_RESTORE,
+    DAEMON_OP_USAGE,                    // value 为仓库用量
+    DAEMON_OP_QUOTA,                    // value 为仓库配额
+} DaemonOp;
+
+#define DAEMON_FLAG_BULK                0x1                 // 请求来自批量操作(目录树备份、批量恢复), 守护进程同样按批量模式拷贝
+
+typedef struct _DaemonRequest
+{
+    guint32                 len;
+    guint32                 id;
+    guint16                 op;
+    guint16                 flags;                      // DAEMON_FLAG_*, 旧版本客户端为 0
+} DaemonRequest;
+
+typedef struct _DaemonResponse
+{
+    guint32                 id;
+    gint32                  status;     // 0 成功, 否则为 errno
+    guint64                 value;
+} DaemonResponse;
+
+/**
+ * 守护进程在运行且接受本进程的请求时转发并返回 TRUE, status/value 为其结果;
+ * 否则(未运行、连接断开、本进程就是守护进程)返回 FALSE, 调用者在本进程内执行
+ */
+gboolean    backup_daemon_forward           (DaemonOp op, const char* arg, gint32* status/*out*/, guint64* value/*out, nullable*/);
+
+/**
+ * 调用线程的请求不再转发, 总在本进程内执行; 捕获线程使用: 守护进程打开被拦截的文件会再次触发本进程的权限事件
+ */
+void        backup_daemon_set_local         (gboolean local);
+
+G_END_DECLS
+
+#endif // gvfs_backup_DAEMON_H
@@ -0,0 +1,581 @@
+//
+// Created by dingjing on 1/8/25.
+//
+#include "dedup.h"
+#include "copy.h"
+#include "trace.h"
+#include "backup-private.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DEDUP_RECIPE_MAGIC      "ANDSECC1"
+#define DEDUP_RECIPE_HEADER_LEN (8 + 8 + 4)
+#define DEDUP_RECIPE_ENTRY_LEN  (16 + 4)
+#define DEDUP_READ_SIZE         (4 * 1024 * 1024)
+#define DEDUP_SYNC_BATCH        64                  // 新写入的块攒够这么多个 fd 后一起落盘, 限制同时打开的 fd 数
+
+// 归一化分块(平均 64K = 16 位): 未到平均大小前用 18 位掩码(更难切), 之后用 14 位掩码(更容易切)
+// 只取高位, gear 哈希的高位覆盖最近的更多字节; 不含最高位, 以便两字节一步时左移一位仍完整
+#define DEDUP_MASK_S            0x7fffe00000000000ULL
+#define DEDUP_MASK_L            0x7ffe000000000000ULL
+
+static void         dedup_gear_init             ();
+static gsize        dedup_cut                   (const guint8* data, gsize len);
+/**
+ * 本次写入新建的块: 分块列表保存之前它们必须已经落盘, 包括所在目录中的目录项
+ */
+typedef struct _DedupPending
+{
+    GArray*                 fds;                // 新块的 fd, 尚未 fdatasync
+    guint8                  dirs[256 / 8];      // 新建过块的 ab/ 目录
+    gboolean                newDir;             // 新建了 ab/ 目录, chunks/ 本身也要落盘
+} DedupPending;
+
+static gboolean     dedup_chunk_put             (BackupStore* store, const guint8* data, gsize len, guint8 digest[16], guint64* added, DedupPending* pending);
+static gboolean     dedup_pending_flush         (DedupPending* pending, int chunkFd, gboolean final);
+static void         dedup_hex                   (const guint8 digest[16], char hex[33]);
+static gboolean     dedup_is_zero               (const guint8* data, gsize len);
+static gboolean     dedup_write_all             (int fd, const guint8* data, gsize len);
+static gboolean     dedup_read_all              (int fd, guint8* data, gsize len);
+
+
+static guint64      gsGear[256];
+
+
+gboolean backup_dedup_write (BackupStore* store, const char* srcPath, const char* recipePath, guint64* bytes)
+{
+    g_return_val_if_fail (store && srcPath && recipePath, FALSE);
+
+    int fd = -1;
+    gsize fill = 0;
+    guint64 total = 0;
+    guint64 added = 0;
+    gboolean eof = FALSE;
+    gboolean ret = FALSE;
+    guint8* buf = NULL;
+    GByteArray* recipe = NULL;
+    struct stat srcStat;
+    BackupTraceSpan span;
+    DedupPending pending;
+
+    memset (&pending, 0, sizeof (pending));
+    pending.fds = g_array_new (FALSE, FALSE, sizeof (int));
+
+    dedup_gear_init();
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, srcPath);
+
+    do {
+        fd = open (srcPath, O_RDONLY | O_CLOEXEC);
+        BREAK_IF_FAIL(fd >= 0);
+        BREAK_IF_FAIL(0 == fstat (fd, &srcStat));
+
+        buf = g_malloc (DEDUP_READ_SIZE);
+        recipe = g_byte_array_new ();
+        g_byte_array_set_size (recipe, DEDUP_RECIPE_HEADER_LEN);
+
+        gboolean failed = FALSE;
+        guint32 chunkN = 0;
+        gsize pos = 0;
+        while (!failed) {
+            // 缓冲区里不足一个最大块时先补满, 保证切点只由内容决定
+            if (!eof && fill - pos < DEDUP_CHUNK_MAX) {
+                memmove (buf, buf + pos, fill - pos);
+                fill -= pos;
+                pos = 0;
+                while (fill < DEDUP_READ_SIZE) {
+                    const ssize_t readLen = read (fd, buf + fill, DEDUP_READ_SIZE - fill);
+                    if (readLen < 0 && EINTR == errno) { continue; }
+                    if (readLen < 0) { failed = TRUE; break; }
+                    if (0 == readLen) { eof = TRUE; break; }
+                    fill += readLen;
+                }
+            }
+            if (failed || pos == fill) {
+                break;
+            }
+
+            const gsize cut = dedup_cut (buf + pos, fill - pos);
+            guint8 entry[DEDUP_RECIPE_ENTRY_LEN];
+            const guint32 len = GUINT32_TO_LE ((guint32) cut);
+            if (!dedup_chunk_put (store, buf + pos, cut, entry, &added, &pending)) {
+                failed = TRUE;
+                break;
+            }
+            if (pending.fds->len >= DEDUP_SYNC_BATCH && !dedup_pending_flush (&pending, backup_store_chunk_fd (store), FALSE)) {
+                failed = TRUE;
+                break;
+            }
+            memcpy (entry + 16, &len, 4);
+            g_byte_array_append (recipe, entry, DEDUP_RECIPE_ENTRY_LEN);
+
+            pos += cut;
+            total += cut;
+            chunkN++;
+        }
+        BREAK_IF_FAIL(!failed);
+
+        const guint64 fileSize = GUINT64_TO_LE (total);
+        const guint32 n = GUINT32_TO_LE (chunkN);
+        memcpy (recipe->data, DEDUP_RECIPE_MAGIC, 8);
+        memcpy (recipe->data + 8, &fileSize, 8);
+        memcpy (recipe->data + 16, &n, 4);
+
+        // 分块列表引用的块先落盘, 崩溃后不会留下指向不完整块的分块列表
+        BREAK_IF_FAIL(dedup_pending_flush (&pending, backup_store_chunk_fd (store), TRUE));
+        BREAK_IF_FAIL(g_file_set_contents (recipePath, (const char*) recipe->data, recipe->len, NULL));
+
+        // 分块列表代替 <key>-N 保存源文件的属主、权限与时间, 恢复时设置到重建的文件上
+        const int recipeFd = open (recipePath, O_RDONLY | O_CLOEXEC);
+        if (recipeFd >= 0) {
+            backup_copy_stat_meta (recipeFd, &srcStat);
+            close (recipeFd);
+        }
+        ret = TRUE;
+    } while (FALSE);
+
+    TRACE_END(span, total);
+
+    if (added > 0) {
+        backup_store_usage_add (store, (gint64) added);
+    }
+    if (bytes) {
+        *bytes = total;
+    }
+
+    if (fd >= 0) { close (fd); }
+    for (guint i = 0; i < pending.fds->len; ++i) {
+        close (g_array_index (pending.fds, int, i));
+    }
+    g_array_unref (pending.fds);
+    STR_FREE(buf);
+    if (recipe) { g_byte_array_unref (recipe); }
+
+    return ret;
+}
+
+gboolean backup_dedup_read (BackupStore* store, const char* recipePath, const char* dstPath, guint64* bytes)
+{
+    g_return_val_if_fail (store && recipePath && dstPath, FALSE);
+
+    int fd = -1;
+    gsize len = 0;
+    guint64 total = 0;
+    char* recipe = NULL;
+    gboolean ret = FALSE;
+    char* tmpPath = NULL;
+    guint8* chunk = NULL;
+    BackupTraceSpan span;
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, dstPath);
+
+    do {
+        BREAK_IF_FAIL(g_file_get_contents (recipePath, &recipe, &len, NULL));
+        BREAK_IF_FAIL(len >= DEDUP_RECIPE_HEADER_LEN && 0 == memcmp (recipe, DEDUP_RECIPE_MAGIC, 8));
+
+        guint64 fileSize = 0;
+        guint32 chunkN = 0;
+        memcpy (&fileSize, recipe + 8, 8);
+        memcpy (&chunkN, recipe + 16, 4);
+        fileSize = GUINT64_FROM_LE (fileSize);
+        chunkN = GUINT32_FROM_LE (chunkN);
+        BREAK_IF_FAIL(len == DEDUP_RECIPE_HEADER_LEN + (gsize) chunkN * DEDUP_RECIPE_ENTRY_LEN);
+
+        tmpPath = g_strdup_printf ("%s.XXXXXX", dstPath);
+        fd = g_mkstemp (tmpPath);
+        BREAK_IF_FAIL(fd >= 0);
+
+        chunk = g_malloc (DEDUP_CHUNK_MAX);
+
+        gboolean failed = FALSE;
+        for (guint32 i = 0; i < chunkN && !failed; ++i) {
+            const char* entry = recipe + DEDUP_RECIPE_HEADER_LEN + (gsize) i * DEDUP_RECIPE_ENTRY_LEN;
+            guint32 chunkLen = 0;
+            char hex[33];
+            char chunkPath[STORE_PATH_MAX];
+
+            memcpy (&chunkLen, entry + 16, 4);
+            chunkLen = GUINT32_FROM_LE (chunkLen);
+            dedup_hex ((const guint8*) entry, hex);
+
+            failed = (chunkLen > DEDUP_CHUNK_MAX) || !backup_dedup_chunk_path (store, hex, chunkPath, sizeof (chunkPath));
+            if (!failed) {
+                const int cfd = open (chunkPath, O_RDONLY | O_CLOEXEC);
+                failed = (cfd < 0) || !dedup_read_all (cfd, chunk, chunkLen);
+                if (cfd >= 0) { close (cfd); }
+            }
+            if (!failed) {
+                // 全零的块不写出, 恢复出的文件与稀疏的源文件一样保留空洞
+                if (dedup_is_zero (chunk, chunkLen)) {
+                    failed = (lseek (fd, chunkLen, SEEK_CUR) < 0);
+                }
+                else {
+                    failed = !dedup_write_all (fd, chunk, chunkLen);
+                }
+                total += chunkLen;
+            }
+        }
+        BREAK_IF_FAIL(!failed && total == fileSize);
+        BREAK_IF_FAIL(0 == ftruncate (fd, (off_t) total));
+        struct stat recipeStat;
+        if (0 == stat (recipePath, &recipeStat)) {
+            backup_copy_stat_meta (fd, &recipeStat);
+        }
+        BREAK_IF_FAIL(0 == fsync (fd));
+
+        close (fd);
+        fd = -1;
+        BREAK_IF_FAIL(0 == rename (tmpPath, dstPath));
+        STR_FREE(tmpPath);
+        ret = TRUE;
+    } while (FALSE);
+
+    TRACE_END(span, total);
+
+    if (bytes) {
+        *bytes = total;
+    }
+
+    if (fd >= 0) { close (fd); }
+    if (tmpPath) { remove (tmpPath); }
+    STR_FREE(tmpPath);
+    STR_FREE(chunk);
+    STR_FREE(recipe);
+
+    return ret;
+}
+
+gboolean backup_dedup_verify (BackupStore* store, const char* recipePath, guint64* bytes)
+{
+    g_return_val_if_fail (store && recipePath, FALSE);
+
+    gsize len = 0;
+    guint64 total = 0;
+    char* recipe = NULL;
+    gboolean ret = FALSE;
+    guint8* chunk = NULL;
+    GChecksum* cs = NULL;
+
+    do {
+        BREAK_IF_FAIL(g_file_get_contents (recipePath, &recipe, &len, NULL));
+        BREAK_IF_FAIL(len >= DEDUP_RECIPE_HEADER_LEN && 0 == memcmp (recipe, DEDUP_RECIPE_MAGIC, 8));
+
+        guint64 fileSize = 0;
+        guint32 chunkN = 0;
+        memcpy (&fileSize, recipe + 8, 8);
+        memcpy (&chunkN, recipe + 16, 4);
+        fileSize = GUINT64_FROM_LE (fileSize);
+        chunkN = GUINT32_FROM_LE (chunkN);
+        BREAK_IF_FAIL(len == DEDUP_RECIPE_HEADER_LEN + (gsize) chunkN * DEDUP_RECIPE_ENTRY_LEN);
+
+        chunk = g_malloc (DEDUP_CHUNK_MAX);
+        cs = g_checksum_new (G_CHECKSUM_MD5);
+
+        gboolean failed = FALSE;
+        for (guint32 i = 0; i < chunkN && !failed; ++i) {
+            const char* entry = recipe + DEDUP_RECIPE_HEADER_LEN + (gsize) i * DEDUP_RECIPE_ENTRY_LEN;
+            guint32 chunkLen = 0;
+            char hex[33];
+            char chunkPath[STORE_PATH_MAX];
+            guint8 digest[16];
+            gsize digestLen = sizeof (digest);
+            struct stat statBuf;
+
+            memcpy (&chunkLen, entry + 16, 4);
+            chunkLen = GUINT32_FROM_LE (chunkLen);
+            dedup_hex ((const guint8*) entry, hex);
+
+            failed = (chunkLen > DEDUP_CHUNK_MAX) || !backup_dedup_chunk_path (store, hex, chunkPath, sizeof (chunkPath));
+            if (!failed) {
+                const int cfd = open (chunkPath, O_RDONLY | O_CLOEXEC);
+                failed = (cfd < 0) || 0 != fstat (cfd, &statBuf) || statBuf.st_size != (off_t) chunkLen
+                    || !dedup_read_all (cfd, chunk, chunkLen);
+                if (cfd >= 0) { close (cfd); }
+            }
+            if (!failed) {
+                g_checksum_reset (cs);
+                g_checksum_update (cs, chunk, chunkLen);
+                g_checksum_get_digest (cs, digest, &digestLen);
+                failed = (0 != memcmp (digest, entry, sizeof (digest)));
+                total += chunkLen;
+            }
+        }
+        BREAK_IF_FAIL(!failed && total == fileSize);
+        ret = TRUE;
+    } while (FALSE);
+
+    if (bytes) {
+        *bytes = total;
+    }
+
+    if (cs) { g_checksum_free (cs); }
+    STR_FREE(chunk);
+    STR_FREE(recipe);
+
+    return ret;
+}
+
+gboolean backup_dedup_recipe_foreach (const char* recipePath, BackupDedupChunkFunc func, gpointer data)
+{
+    g_return_val_if_fail (recipePath && func, FALSE);
+
+    gsize len = 0;
+    char* recipe = NULL;
+    gboolean ret = FALSE;
+
+    do {
+        BREAK_IF_FAIL(g_file_get_contents (recipePath, &recipe, &len, NULL));
+        BREAK_IF_FAIL(len >= DEDUP_RECIPE_HEADER_LEN && 0 == memcmp (recipe, DEDUP_RECIPE_MAGIC, 8));
+
+        guint32 chunkN = 0;
+        memcpy (&chunkN, recipe + 16, 4);
+        chunkN = GUINT32_FROM_LE (chunkN);
+        BREAK_IF_FAIL(len == DEDUP_RECIPE_HEADER_LEN + (gsize) chunkN * DEDUP_RECIPE_ENTRY_LEN);
+
+        for (guint32 i = 0; i < chunkN; ++i) {
+            const char* entry = recipe + DEDUP_RECIPE_HEADER_LEN + (gsize) i * DEDUP_RECIPE_ENTRY_LEN;
+            guint32 chunkLen = 0;
+            char hex[33];
+            memcpy (&chunkLen, entry + 16, 4);
+            dedup_hex ((const guint8*) entry, hex);
+            func (hex, GUINT32_FROM_LE (chunkLen), data);
+        }
+        ret = TRUE;
+    } while (FALSE);
+
+    STR_FREE(recipe);
+
+    return ret;
+}
+
+gboolean backup_dedup_chunk_path (BackupStore* store, const char* chunkHex, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (store && chunkHex && strlen (chunkHex) >= 2 && buf, FALSE);
+
+    return g_snprintf (buf, bufLen, "%s/" DEDUP_CHUNK_DIR "/%c%c/%s", store->root, chunkHex[0], chunkHex[1], chunkHex) < (int) bufLen;
+}
+
+/**
+ * 256 个伪随机 64 位数, 固定种子保证不同进程、不同版本切出相同的块
+ */
+static void dedup_gear_init ()
+{
+    static gsize init = 0;
+
+    if (g_once_init_enter (&init)) {
+        guint64 x = 0x616e647365632d62ULL;
+        for (int i = 0; i < 256; ++i) {
+            // splitmix64
+            x += 0x9e3779b97f4a7c15ULL;
+            guint64 z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            gsGear[i] = z ^ (z >> 31);
+        }
+        g_once_init_leave (&init, 1);
+    }
+}
+
+/**
+ * FastCDC: 跳过最小块长度内的字节不计算; gear 哈希是串行递推, 无法按字节向量化,
+ * 这里每次循环处理两个字节(左移 2 位), 减少一半的分支与掩码判断
+ */
+static gsize dedup_cut (const guint8* data, gsize len)
+{
+    if (len <= DEDUP_CHUNK_MIN) {
+        return len;
+    }
+
+    const gsize maxLen = MIN (len, DEDUP_CHUNK_MAX);
+    const gsize normal = MIN (maxLen, DEDUP_CHUNK_AVG);
+    const guint64 maskS2 = DEDUP_MASK_S << 1;
+    const guint64 maskL2 = DEDUP_MASK_L << 1;
+
+    guint64 fp = 0;
+    gsize i = DEDUP_CHUNK_MIN;
+
+    for (; i + 1 < normal; i += 2) {
+        fp = (fp << 2) + gsGear[data[i]];
+        if (G_UNLIKELY(!(fp & maskS2))) {
+            return i;
+        }
+        fp += gsGear[data[i + 1]];
+        if (G_UNLIKELY(!(fp & DEDUP_MASK_S))) {
+            return i + 1;
+        }
+    }
+
+    for (; i + 1 < maxLen; i += 2) {
+        fp = (fp << 2) + gsGear[data[i]];
+        if (G_UNLIKELY(!(fp & maskL2))) {
+            return i;
+        }
+        fp += gsGear[data[i + 1]];
+        if (G_UNLIKELY(!(fp & DEDUP_MASK_L))) {
+            return i + 1;
+        }
+    }
+
+    return maxLen;
+}
+
+/**
+ * 块按内容 MD5 命名, 在 chunks/ 的目录 fd 下以 O_EXCL 直接创建, 不经过临时文件与改名, 落盘由调用者批量进行;
+ * 已存在时只更新时间戳, 让清理任务的宽限期保护这次引用. 长度不符的块(崩溃时没写完)删除后重写
+ */
+static gboolean dedup_chunk_put (BackupStore* store, const guint8* data, gsize len, guint8 digest[16], guint64* added, DedupPending* pending)
+{
+    char hex[33];
+    char rel[36];
+    gsize digestLen = 16;
+    struct stat statBuf;
+
+    GChecksum* cs = g_checksum_new (G_CHECKSUM_MD5);
+    g_checksum_update (cs, data, (gssize) len);
+    g_checksum_get_digest (cs, digest, &digestLen);
+    g_checksum_free (cs);
+
+    dedup_hex (digest, hex);
+    g_snprintf (rel, sizeof (rel), "%c%c/%s", hex[0], hex[1], hex);
+
+    const int chunkFd = backup_store_chunk_fd (store);
+    g_return_val_if_fail (chunkFd >= 0, FALSE);
+
+    gboolean ret = FALSE;
+
+    g_rw_lock_reader_lock (&store->chunkLock);
+    do {
+        if (0 == fstatat (chunkFd, rel, &statBuf, 0)) {
+            if ((gsize) statBuf.st_size == len) {
+                utimensat (chunkFd, rel, NULL, 0);
+                ret = TRUE;
+                break;
+            }
+            unlinkat (chunkFd, rel, 0);
+        }
+
+        int fd = openat (chunkFd, rel, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && ENOENT == errno) {
+            rel[2] = '\0';
+            pending->newDir |= (0 == mkdirat (chunkFd, rel, 0755));
+            rel[2] = '/';
+            fd = openat (chunkFd, rel, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        }
+        if (fd < 0) {
+            // 同时有其它线程或进程写入同一个块, 内容相同
+            ret = (EEXIST == errno);
+            break;
+        }
+        if (!dedup_write_all (fd, data, len)) {
+            close (fd);
+            unlinkat (chunkFd, rel, 0);
+            break;
+        }
+        if (0 == fstat (fd, &statBuf)) {
+            *added += (guint64) statBuf.st_blocks * 512;
+        }
+        g_array_append_val (pending->fds, fd);
+        pending->dirs[digest[0] / 8] |= (guint8) (1u << (digest[0] % 8));
+        ret = TRUE;
+    } while (FALSE);
+    g_rw_lock_reader_unlock (&store->chunkLock);
+
+    return ret;
+}
+
+/**
+ * 新块逐个 fdatasync 后关闭; final 时再同步新建过块的目录, 之后块的内容与目录项都已落盘
+ */
+static gboolean dedup_pending_flush (DedupPending* pending, int chunkFd, gboolean final)
+{
+    gboolean ret = TRUE;
+
+    for (guint i = 0; i < pending->fds->len; ++i) {
+        const int fd = g_array_index (pending->fds, int, i);
+        if (0 != fdatasync (fd)) {
+            ret = FALSE;
+        }
+        close (fd);
+    }
+    g_array_set_size (pending->fds, 0);
+
+    if (!final) {
+        return ret;
+    }
+    if (chunkFd < 0) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        if (!(pending->dirs[i / 8] & (1u << (i % 8)))) {
+            continue;
+        }
+        char sub[3];
+        g_snprintf (sub, sizeof (sub), "%02x", i);
+        const int dirFd = openat (chunkFd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd < 0 || 0 != fsync (dirFd)) {
+            ret = FALSE;
+        }
+        if (dirFd >= 0) { close (dirFd); }
+    }
+    if (pending->newDir && 0 != fsync (chunkFd)) {
+        ret = FALSE;
+    }
+    memset (pending->dirs, 0, sizeof (pending->dirs));
+    pending->newDir = FALSE;
+
+    return ret;
+}
+
+static void dedup_hex (const guint8 digest[16], char hex[33])
+{
+    static const char tab[] = "0123456789abcdef";
+
+    for (int i = 0; i < 16; ++i) {
+        hex[2 * i] = tab[digest[i] >> 4];
+        hex[2 * i + 1] = tab[digest[i] & 0x0F];
+    }
+    hex[32] = '\0';
+}
+
+static gboolean dedup_is_zero (const guint8* data, gsize len)
+{
+    return len > 0 && 0 == data[0] && 0 == memcmp (data, data + 1, len - 1);
+}
+
+static gboolean dedup_write_all (int fd, const guint8* data, gsize len)
+{
+    while (len > 0) {
+        const ssize_t n = write (fd, data, len);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static gboolean dedup_read_all (int fd, guint8* data, gsize len)
+{
+    while (len > 0) {
+        const ssize_t n = read (fd, data, len);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,50 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_DEDUP_H
+#define gvfs_backup_DEDUP_H
+#include "store.h"
+
+G_BEGIN_DECLS
+
+#define DEDUP_RECIPE_SUFFIX             ".chunks"           // 去重版本以 <key>-N.chunks 记录分块列表, 不再有 <key>-N
+#define DEDUP_CHUNK_DIR                 "chunks"            // <root>/chunks/ab/<md5>
+
+#define DEDUP_CHUNK_MIN                 (16 * 1024)
+#define DEDUP_CHUNK_AVG                 (64 * 1024)
+#define DEDUP_CHUNK_MAX                 (256 * 1024)
+
+/**
+ * 把 srcPath 按 FastCDC 切块写入分块仓库(已存在的块直接复用), 并在 recipePath 写下分块列表
+ * 新写入的块计入 store 的用量
+ */
+gboolean    backup_dedup_write              (BackupStore* store, const char* srcPath, const char* recipePath, guint64* bytes/*out, nullable*/);
+
+/**
+ * 按分块列表顺序读取各块, 重建文件到 dstPath(先写临时文件再改名), 属主、权限与时间取自分块列表文件
+ */
+gboolean    backup_dedup_read               (BackupStore* store, const char* recipePath, const char* dstPath, guint64* bytes/*out, nullable*/);
+
+/**
+ * 逐块读取并校验长度与内容 MD5(块以内容 MD5 命名), 所有块都完好且总长度与记录一致时返回 TRUE
+ */
+gboolean    backup_dedup_verify             (BackupStore* store, const char* recipePath, guint64* bytes/*out, nullable*/);
+
+/**
+ * 遍历分块列表中的每个块, 返回 FALSE 表示分块列表无法解析
+ */
+typedef void (*BackupDedupChunkFunc)        (const char* chunkHex, guint32 len, gpointer data);
+gboolean    backup_dedup_recipe_foreach     (const char* recipePath, BackupDedupChunkFunc func, gpointer data);
+
+gboolean    backup_dedup_chunk_path         (BackupStore* store, const char* chunkHex, char* buf, gsize bufLen);
+
+/**
+ * 只回收未被任何分块列表引用的块(与清理任务相同的标记-清除, 实现在 sweep.c), 返回释放的字节数;
+ * 淘汰删除分块列表后调用, 块的空间这时才真正释放. 宽限期内的块不回收
+ */
+guint64     backup_dedup_sweep              (BackupStore* store);
+
+G_END_DECLS
+
+#endif // gvfs_backup_DEDUP_H
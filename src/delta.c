@@ -0,0 +1,554 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 块级增量: 大文件只保存与前一版本相比变化的固定大小分块, 恢复时叠加在基础版本上
+//
+#include "delta.h"
+#include "copy.h"
+#include "dedup.h"
+#include "pack.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DELTA_MAGIC             "ANDSECD1"
+#define DELTA_HEADER_LEN        (8 + 8 + 4 + 4 + 4 + 32)
+#define DELTA_UNUSABLE          (DELTA_CHAIN_MAX + 1)
+
+/**
+ * 格式: magic(8) | fileSize(8) | chunkSize(4) | chunkN(4) | changedN(4) | baseMD5(32) | changedN 个分块序号(4)
+ *       | 各分块数据(只有最后一个分块可能不足 chunkSize), 整数均为小端
+ */
+typedef struct _DeltaHeader
+{
+    guint64                 fileSize;
+    guint32                 chunkSize;
+    guint32                 chunkN;
+    guint32                 changedN;
+    char                    baseMD5[33];
+    guint32*                changed;
+} DeltaHeader;
+
+static gboolean     delta_header_load           (int fd, DeltaHeader* header);
+static guint32      delta_chunk_len             (const DeltaHeader* header, guint32 idx);
+static int          delta_base_slot             (BackupMetaFile* meta, int slot, const char* baseMD5, int exclude);
+static int          delta_depth                 (BackupStore* store, const char* key, BackupMetaFile* meta, int slot, int guard);
+static gboolean     delta_restore               (BackupStore* store, const char* key, BackupMetaFile* meta, int slot, const char* dstPath, int depth, guint64* bytes);
+static gboolean     delta_exists                (BackupStore* store, const char* key, int slot, const char* suffix);
+static int          delta_open                  (BackupStore* store, const char* key, int slot, const char* suffix);
+static gboolean     delta_packed                (BackupStore* store, const char* key, BackupMetaFile* meta, int slot);
+static gboolean     delta_md5_check             (GChecksum* cs, const guint8* data, gsize len, const guint8* digest);
+static gboolean     delta_write_all             (int fd, const guint8* data, gsize len);
+static gboolean     delta_pread_all             (int fd, guint8* data, gsize len, off_t offset);
+
+
+gboolean backup_delta_prepare (BackupStore* store, const char* key, BackupMetaFile* meta, const BackupHashTree* tree, BackupDelta* delta)
+{
+    g_return_val_if_fail (store && key && meta && tree && delta, FALSE);
+
+    gboolean ret = FALSE;
+    char treePath[STORE_PATH_MAX];
+    BackupHashTree baseTree;
+
+    memset (delta, 0, sizeof (BackupDelta));
+    memset (&baseTree, 0, sizeof (baseTree));
+
+    if (!g_atomic_int_get (&store->delta) || 0 == tree->chunkN) {
+        return FALSE;
+    }
+
+    do {
+        // 与 do_backup 判断是否变化时使用同一个"最新版本"
+        const int prev = meta->backupFileCtxMD53 ? 3 : (meta->backupFileCtxMD52 ? 2 : (meta->backupFileCtxMD51 ? 1 : 0));
+        BREAK_IF_FAIL(prev > 0 && backup_meta_slot_good (meta, prev));
+        BREAK_IF_FAIL(delta_depth (store, key, meta, prev, 0) < DELTA_CHAIN_MAX);
+
+        BREAK_IF_FAIL(backup_store_blob_path (store, key, prev, HASH_TREE_SUFFIX, treePath, sizeof (treePath)));
+        BREAK_IF_FAIL(backup_hash_tree_load (&baseTree, treePath));
+        BREAK_IF_FAIL(baseTree.chunkSize == tree->chunkSize);
+
+        delta->changed = g_array_new (FALSE, FALSE, sizeof (guint32));
+        for (guint32 i = 0; i < tree->chunkN; ++i) {
+            if (i >= baseTree.chunkN
+                || 0 != memcmp (tree->digests + (gsize) i * HASH_DIGEST_LEN, baseTree.digests + (gsize) i * HASH_DIGEST_LEN, HASH_DIGEST_LEN)) {
+                g_array_append_val (delta->changed, i);
+            }
+        }
+        BREAK_IF_FAIL((guint64) delta->changed->len * 100 <= (guint64) tree->chunkN * DELTA_CHANGED_MAX_PCT);
+
+        delta->baseMD5 = g_strdup (*backup_meta_slot_ctx (meta, prev));
+        delta->tree = tree;
+        ret = TRUE;
+    } while (FALSE);
+
+    if (!ret) {
+        backup_delta_clear (delta);
+    }
+    backup_hash_tree_clear (&baseTree);
+
+    return ret;
+}
+
+void backup_delta_clear (BackupDelta* delta)
+{
+    g_return_if_fail (delta);
+
+    STR_FREE(delta->baseMD5);
+    NOT_NULL_RUN(delta->changed, g_array_unref);
+    memset (delta, 0, sizeof (BackupDelta));
+}
+
+gboolean backup_delta_write (const BackupDelta* delta, const char* srcPath, const char* deltaPath, guint64* bytes)
+{
+    g_return_val_if_fail (delta && delta->tree && delta->baseMD5 && delta->changed && srcPath && deltaPath, FALSE);
+    g_return_val_if_fail (strlen (delta->baseMD5) == 32, FALSE);
+
+    int fd = -1;
+    int srcFd = -1;
+    guint64 total = 0;
+    gboolean ret = FALSE;
+    char* tmpPath = NULL;
+    guint8* buf = NULL;
+    GChecksum* cs = NULL;
+    GByteArray* header = NULL;
+    BackupTraceSpan span;
+    const BackupHashTree* tree = delta->tree;
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, srcPath);
+
+    do {
+        struct stat statBuf;
+        srcFd = open (srcPath, O_RDONLY | O_CLOEXEC);
+        BREAK_IF_FAIL(srcFd >= 0);
+        BREAK_IF_FAIL(0 == fstat (srcFd, &statBuf) && (guint64) statBuf.st_size == tree->fileSize);
+
+        const guint64 fileSize = GUINT64_TO_LE (tree->fileSize);
+        const guint32 chunkSize = GUINT32_TO_LE (tree->chunkSize);
+        const guint32 chunkN = GUINT32_TO_LE (tree->chunkN);
+        const guint32 changedN = GUINT32_TO_LE (delta->changed->len);
+        header = g_byte_array_sized_new (DELTA_HEADER_LEN + delta->changed->len * 4);
+        g_byte_array_append (header, (const guint8*) DELTA_MAGIC, 8);
+        g_byte_array_append (header, (const guint8*) &fileSize, 8);
+        g_byte_array_append (header, (const guint8*) &chunkSize, 4);
+        g_byte_array_append (header, (const guint8*) &chunkN, 4);
+        g_byte_array_append (header, (const guint8*) &changedN, 4);
+        g_byte_array_append (header, (const guint8*) delta->baseMD5, 32);
+        for (guint i = 0; i < delta->changed->len; ++i) {
+            const guint32 idx = GUINT32_TO_LE (g_array_index (delta->changed, guint32, i));
+            g_byte_array_append (header, (const guint8*) &idx, 4);
+        }
+
+        tmpPath = g_strdup_printf ("%s.XXXXXX", deltaPath);
+        fd = g_mkstemp (tmpPath);
+        BREAK_IF_FAIL(fd >= 0);
+        BREAK_IF_FAIL(delta_write_all (fd, header->data, header->len));
+
+        buf = g_malloc (tree->chunkSize);
+        cs = g_checksum_new (G_CHECKSUM_MD5);
+        gboolean failed = FALSE;
+        for (guint i = 0; i < delta->changed->len && !failed; ++i) {
+            const guint32 idx = g_array_index (delta->changed, guint32, i);
+            const guint64 begin = (guint64) idx * tree->chunkSize;
+            const gsize len = (gsize) MIN (tree->chunkSize, tree->fileSize - begin);
+            // 哈希之后文件可能又被修改, 与分块哈希不符时放弃增量
+            failed = !delta_pread_all (srcFd, buf, len, (off_t) begin)
+                || !delta_md5_check (cs, buf, len, tree->digests + (gsize) idx * HASH_DIGEST_LEN)
+                || !delta_write_all (fd, buf, len);
+            total += len;
+        }
+        BREAK_IF_FAIL(!failed);
+        // 与整文件版本一样保留源文件的权限、属主与时间, 恢复时再设置到重建的文件上
+        backup_copy_stat_meta (fd, &statBuf);
+        BREAK_IF_FAIL(0 == fsync (fd));
+
+        close (fd);
+        fd = -1;
+        BREAK_IF_FAIL(0 == rename (tmpPath, deltaPath));
+        ret = TRUE;
+    } while (FALSE);
+
+    TRACE_END(span, ret ? total : 0);
+
+    if (fd >= 0) { close (fd); }
+    if (srcFd >= 0) { close (srcFd); }
+    if (!ret && tmpPath) { remove (tmpPath); }
+    if (bytes) { *bytes = ret ? total : 0; }
+
+    STR_FREE(tmpPath);
+    STR_FREE(buf);
+    NOT_NULL_RUN(cs, g_checksum_free);
+    if (header) { g_byte_array_unref (header); }
+
+    return ret;
+}
+
+gboolean backup_delta_read (BackupStore* store, const char* key, BackupMetaFile* meta, int slot, const char* dstPath)
+{
+    g_return_val_if_fail (store && key && meta && dstPath, FALSE);
+
+    guint64 bytes = 0;
+    BackupTraceSpan span;
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, key);
+    const gboolean ret = delta_restore (store, key, meta, slot, dstPath, 1, &bytes);
+    TRACE_END(span, bytes);
+
+    return ret;
+}
+
+/**
+ * 合并: 把依赖 slot 的增量版本重建为完整的 <key>-N, 之后删除其 .delta; 内容相同的其它版本仍在时不需要合并
+ */
+gint64 backup_delta_detach (BackupStore* store, const char* key, BackupMetaFile* meta, int slot)
+{
+    g_return_val_if_fail (store && key && meta, 0);
+
+    gint64 added = 0;
+    char deltaRel[STORE_PATH_MAX];
+    char blobRel[STORE_PATH_MAX];
+    char blobPath[STORE_PATH_MAX];
+    const int backupFd = backup_store_backup_fd (store);
+
+    const char* gone = *backup_meta_slot_ctx (meta, slot);
+    if (!gone) {
+        return 0;
+    }
+    if (BACKUP_META_BAD_MARK == gone[0]) {
+        gone++;
+    }
+
+    for (int s = 1; s <= 3; ++s) {
+        if (s == slot || !*backup_meta_slot_ctx (meta, s)
+            || !backup_store_blob_rel (store, key, s, DELTA_SUFFIX, deltaRel, sizeof (deltaRel))
+            || !backup_store_blob_rel (store, key, s, NULL, blobRel, sizeof (blobRel))
+            || !backup_store_blob_path (store, key, s, NULL, blobPath, sizeof (blobPath))) {
+            continue;
+        }
+
+        DeltaHeader header;
+        memset (&header, 0, sizeof (header));
+        const int fd = openat (backupFd, deltaRel, O_RDONLY | O_CLOEXEC);
+        const gboolean loaded = (fd >= 0) && delta_header_load (fd, &header);
+        if (fd >= 0) { close (fd); }
+        STR_FREE(header.changed);
+        if (!loaded || 0 != g_strcmp0 (header.baseMD5, gone) || delta_base_slot (meta, s, header.baseMD5, slot) > 0) {
+            continue;
+        }
+
+        const guint64 oldUsage = backup_store_file_usage_at (backupFd, deltaRel);
+        if (delta_restore (store, key, meta, s, blobPath, 1, NULL)) {
+            unlinkat (backupFd, deltaRel, 0);
+            added += (gint64) backup_store_file_usage_at (backupFd, blobRel) - (gint64) oldUsage;
+        }
+    }
+
+    return added;
+}
+
+gboolean backup_delta_verify (const char* deltaPath, const char* treePath, guint64* bytes)
+{
+    g_return_val_if_fail (deltaPath && treePath, FALSE);
+
+    int fd = -1;
+    guint64 total = 0;
+    gboolean ret = FALSE;
+    guint8* buf = NULL;
+    GChecksum* cs = NULL;
+    DeltaHeader header;
+    BackupHashTree tree;
+
+    memset (&header, 0, sizeof (header));
+    memset (&tree, 0, sizeof (tree));
+
+    do {
+        BREAK_IF_FAIL(backup_hash_tree_load (&tree, treePath));
+        fd = open (deltaPath, O_RDONLY | O_CLOEXEC);
+        BREAK_IF_FAIL(fd >= 0);
+        BREAK_IF_FAIL(delta_header_load (fd, &header));
+        BREAK_IF_FAIL(header.fileSize == tree.fileSize && header.chunkSize == tree.chunkSize && header.chunkN == tree.chunkN);
+
+        posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        buf = g_malloc (header.chunkSize);
+        cs = g_checksum_new (G_CHECKSUM_MD5);
+        off_t off = DELTA_HEADER_LEN + (off_t) header.changedN * 4;
+        gboolean failed = FALSE;
+        for (guint32 i = 0; i < header.changedN && !failed; ++i) {
+            const guint32 idx = header.changed[i];
+            const guint32 len = delta_chunk_len (&header, idx);
+            failed = !delta_pread_all (fd, buf, len, off)
+                || !delta_md5_check (cs, buf, len, tree.digests + (gsize) idx * HASH_DIGEST_LEN);
+            off += len;
+            total += len;
+        }
+        BREAK_IF_FAIL(!failed);
+        posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+        ret = TRUE;
+    } while (FALSE);
+
+    if (fd >= 0) { close (fd); }
+    if (bytes) { *bytes = total; }
+
+    STR_FREE(buf);
+    STR_FREE(header.changed);
+    NOT_NULL_RUN(cs, g_checksum_free);
+    backup_hash_tree_clear (&tree);
+
+    return ret;
+}
+
+static gboolean delta_header_load (int fd, DeltaHeader* header)
+{
+    guint8 buf[DELTA_HEADER_LEN];
+
+    if (!delta_pread_all (fd, buf, sizeof (buf), 0) || 0 != memcmp (buf, DELTA_MAGIC, 8)) {
+        return FALSE;
+    }
+
+    memcpy (&header->fileSize, buf + 8, 8);
+    memcpy (&header->chunkSize, buf + 16, 4);
+    memcpy (&header->chunkN, buf + 20, 4);
+    memcpy (&header->changedN, buf + 24, 4);
+    memcpy (header->baseMD5, buf + 28, 32);
+    header->baseMD5[32] = '\0';
+    header->fileSize = GUINT64_FROM_LE (header->fileSize);
+    header->chunkSize = GUINT32_FROM_LE (header->chunkSize);
+    header->chunkN = GUINT32_FROM_LE (header->chunkN);
+    header->changedN = GUINT32_FROM_LE (header->changedN);
+
+    if (0 == header->chunkSize || header->chunkSize > HASH_TREE_CHUNK_SIZE
+        || header->chunkN != (header->fileSize + header->chunkSize - 1) / header->chunkSize
+        || header->changedN > header->chunkN) {
+        return FALSE;
+    }
+
+    header->changed = g_malloc ((gsize) header->changedN * 4 + 4);
+    if (!delta_pread_all (fd, (guint8*) header->changed, (gsize) header->changedN * 4, DELTA_HEADER_LEN)) {
+        STR_FREE(header->changed);
+        return FALSE;
+    }
+    // 序号必须严格递增且在范围内, 只有最后一个分块可能不足 chunkSize, 数据偏移才能直接算出
+    for (guint32 i = 0; i < header->changedN; ++i) {
+        header->changed[i] = GUINT32_FROM_LE (header->changed[i]);
+        if (header->changed[i] >= header->chunkN || (i > 0 && header->changed[i] <= header->changed[i - 1])) {
+            STR_FREE(header->changed);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static guint32 delta_chunk_len (const DeltaHeader* header, guint32 idx)
+{
+    const guint64 begin = (guint64) idx * header->chunkSize;
+
+    return (guint32) MIN (header->chunkSize, header->fileSize - begin);
+}
+
+/**
+ * 新的版本优先; exclude 为即将删除的版本, 不作为基础
+ */
+static int delta_base_slot (BackupMetaFile* meta, int slot, const char* baseMD5, int exclude)
+{
+    for (int b = 3; b >= 1; --b) {
+        if (b != slot && b != exclude && backup_meta_slot_good (meta, b) && 0 == g_strcmp0 (*backup_meta_slot_ctx (meta, b), baseMD5)) {
+            return b;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * 完整版本(整文件、分块列表或包中的记录)为 0, 每叠加一层增量加 1; 无法恢复时返回 DELTA_UNUSABLE
+ */
+static int delta_depth (BackupStore* store, const char* key, BackupMetaFile* meta, int slot, int guard)
+{
+    if (!delta_exists (store, key, slot, DELTA_SUFFIX)) {
+        return (delta_exists (store, key, slot, NULL) || delta_exists (store, key, slot, DEDUP_RECIPE_SUFFIX)
+                || delta_packed (store, key, meta, slot)) ? 0 : DELTA_UNUSABLE;
+    }
+    if (guard >= DELTA_CHAIN_MAX) {
+        return DELTA_UNUSABLE;
+    }
+
+    DeltaHeader header;
+    memset (&header, 0, sizeof (header));
+    const int fd = delta_open (store, key, slot, DELTA_SUFFIX);
+    const gboolean loaded = (fd >= 0) && delta_header_load (fd, &header);
+    if (fd >= 0) { close (fd); }
+    STR_FREE(header.changed);
+
+    const int base = loaded ? delta_base_slot (meta, slot, header.baseMD5, 0) : 0;
+    if (0 == base) {
+        return DELTA_UNUSABLE;
+    }
+
+    return MIN (1 + delta_depth (store, key, meta, base, guard + 1), DELTA_UNUSABLE);
+}
+
+/**
+ * 基础版本先还原到 <dstPath>.XXXXXX(完整版本直接拷贝, 可以 reflink), 再把变化的分块写到对应偏移,
+ * 按增量文件设置权限与时间后改名; 基础版本的取法与 version_read 相同. bytes 为恢复出的文件大小
+ */
+static gboolean delta_restore (BackupStore* store, const char* key, BackupMetaFile* meta, int slot, const char* dstPath, int depth, guint64* bytes)
+{
+    int fd = -1;
+    int outFd = -1;
+    gboolean ret = FALSE;
+    char* tmpPath = NULL;
+    guint8* buf = NULL;
+    DeltaHeader header;
+    char path[STORE_PATH_MAX];
+
+    memset (&header, 0, sizeof (header));
+
+    do {
+        BREAK_IF_FAIL(depth <= DELTA_CHAIN_MAX);
+        fd = delta_open (store, key, slot, DELTA_SUFFIX);
+        BREAK_IF_FAIL(fd >= 0);
+        BREAK_IF_FAIL(delta_header_load (fd, &header));
+
+        const int base = delta_base_slot (meta, slot, header.baseMD5, 0);
+        BREAK_IF_FAIL(base > 0);
+
+        tmpPath = g_strdup_printf ("%s.XXXXXX", dstPath);
+        outFd = g_mkstemp (tmpPath);
+        BREAK_IF_FAIL(outFd >= 0);
+        close (outFd);
+        outFd = -1;
+
+        gboolean baseOK = FALSE;
+        if (delta_exists (store, key, base, DELTA_SUFFIX)) {
+            baseOK = delta_restore (store, key, meta, base, tmpPath, depth + 1, NULL);
+        }
+        else if (delta_exists (store, key, base, DEDUP_RECIPE_SUFFIX)) {
+            baseOK = backup_store_blob_path (store, key, base, DEDUP_RECIPE_SUFFIX, path, sizeof (path))
+                  && backup_dedup_read (store, path, tmpPath, NULL);
+        }
+        else if (delta_packed (store, key, meta, base)) {
+            baseOK = backup_pack_read (store, *backup_meta_slot_ctx (meta, base), tmpPath, NULL);
+        }
+        else {
+            const int baseFd = delta_open (store, key, base, NULL);
+            baseOK = (baseFd >= 0) && backup_copy_file_fd (baseFd, tmpPath, FALSE, NULL);
+            if (baseFd >= 0) { close (baseFd); }
+        }
+        BREAK_IF_FAIL(baseOK);
+
+        outFd = open (tmpPath, O_WRONLY | O_CLOEXEC);
+        BREAK_IF_FAIL(outFd >= 0);
+
+        buf = g_malloc (header.chunkSize);
+        off_t off = DELTA_HEADER_LEN + (off_t) header.changedN * 4;
+        gboolean failed = FALSE;
+        for (guint32 i = 0; i < header.changedN && !failed; ++i) {
+            const guint32 idx = header.changed[i];
+            const guint32 len = delta_chunk_len (&header, idx);
+            failed = !delta_pread_all (fd, buf, len, off);
+            off += len;
+            for (guint32 done = 0; !failed && done < len; ) {
+                const ssize_t w = pwrite (outFd, buf + done, len - done, (off_t) ((guint64) idx * header.chunkSize + done));
+                if (w < 0 && EINTR == errno) { continue; }
+                failed = (w <= 0);
+                done += failed ? 0 : (guint32) w;
+            }
+        }
+        BREAK_IF_FAIL(!failed);
+        BREAK_IF_FAIL(0 == ftruncate (outFd, (off_t) header.fileSize));
+        struct stat statBuf;
+        if (0 == fstat (fd, &statBuf)) {
+            backup_copy_stat_meta (outFd, &statBuf);
+        }
+        BREAK_IF_FAIL(0 == fsync (outFd));
+
+        close (outFd);
+        outFd = -1;
+        BREAK_IF_FAIL(0 == rename (tmpPath, dstPath));
+        ret = TRUE;
+    } while (FALSE);
+
+    if (fd >= 0) { close (fd); }
+    if (outFd >= 0) { close (outFd); }
+    if (!ret && tmpPath) { remove (tmpPath); }
+    if (bytes) { *bytes = ret ? header.fileSize : 0; }
+
+    STR_FREE(tmpPath);
+    STR_FREE(buf);
+    STR_FREE(header.changed);
+
+    return ret;
+}
+
+static gboolean delta_exists (BackupStore* store, const char* key, int slot, const char* suffix)
+{
+    char rel[STORE_PATH_MAX];
+    const int backupFd = backup_store_backup_fd (store);
+
+    return backupFd >= 0 && backup_store_blob_rel (store, key, slot, suffix, rel, sizeof (rel)) && 0 == faccessat (backupFd, rel, F_OK, 0);
+}
+
+static int delta_open (BackupStore* store, const char* key, int slot, const char* suffix)
+{
+    char rel[STORE_PATH_MAX];
+    const int backupFd = backup_store_backup_fd (store);
+
+    if (backupFd < 0 || !backup_store_blob_rel (store, key, slot, suffix, rel, sizeof (rel))) {
+        return -1;
+    }
+
+    return openat (backupFd, rel, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * 没有 <key>-N 而内容在包中
+ */
+static gboolean delta_packed (BackupStore* store, const char* key, BackupMetaFile* meta, int slot)
+{
+    const char* ctxMD5 = *backup_meta_slot_ctx (meta, slot);
+
+    return ctxMD5 && !delta_exists (store, key, slot, NULL) && backup_pack_contains (store, ctxMD5);
+}
+
+static gboolean delta_md5_check (GChecksum* cs, const guint8* data, gsize len, const guint8* digest)
+{
+    guint8 actual[HASH_DIGEST_LEN];
+    gsize actualLen = sizeof (actual);
+
+    g_checksum_reset (cs);
+    g_checksum_update (cs, data, (gssize) len);
+    g_checksum_get_digest (cs, actual, &actualLen);
+
+    return 0 == memcmp (actual, digest, HASH_DIGEST_LEN);
+}
+
+static gboolean delta_write_all (int fd, const guint8* data, gsize len)
+{
+    while (len > 0) {
+        const ssize_t n = write (fd, data, len);
+        if (n < 0 && EINTR == errno) { continue; }
+        if (n <= 0) { return FALSE; }
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static gboolean delta_pread_all (int fd, guint8* data, gsize len, off_t offset)
+{
+    while (len > 0) {
+        const ssize_t n = pread (fd, data, len, offset);
+        if (n < 0 && EINTR == errno) { continue; }
+        if (n <= 0) { return FALSE; }
+        data += n;
+        offset += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
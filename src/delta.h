@@ -0,0 +1,55 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_DELTA_H
+#define gvfs_backup_DELTA_H
+#include "store.h"
+#include "hash.h"
+#include "backup-private.h"
+
+G_BEGIN_DECLS
+
+#define DELTA_SUFFIX                    ".delta"            // 增量版本以 <key>-N.delta 保存相对基础版本变化的分块, 不再有 <key>-N
+#define DELTA_CHAIN_MAX                 2                   // 恢复时最多叠加的增量层数, 达到后下一个版本保存完整文件
+#define DELTA_CHANGED_MAX_PCT           50                  // 变化的分块超过该比例时保存完整文件
+
+/**
+ * 增量版本以分块哈希(<key>-N.tree)比较得到, 基础版本按内容 MD5 查找, 因此不受版本轮换影响
+ */
+typedef struct _BackupDelta
+{
+    char*                   baseMD5;
+    const BackupHashTree*   tree;                   // 本次的分块哈希, 写入时逐块校验
+    GArray*                 changed;                // guint32, 需要保存的分块序号, 升序
+} BackupDelta;
+
+/**
+ * 开启增量且最新版本可以作为基础(有分块哈希、增量层数未满、变化不多)时填充 delta 并返回 TRUE
+ */
+gboolean    backup_delta_prepare            (BackupStore* store, const char* key, BackupMetaFile* meta, const BackupHashTree* tree, BackupDelta* delta/*out*/);
+void        backup_delta_clear              (BackupDelta* delta);
+
+/**
+ * 写 deltaPath(先写临时文件再改名); 读取的分块与 tree 不符(哈希后被修改)时返回 FALSE, 调用者改存完整文件
+ */
+gboolean    backup_delta_write              (const BackupDelta* delta, const char* srcPath, const char* deltaPath, guint64* bytes/*out, nullable*/);
+
+/**
+ * 重建 slot 对应的完整文件到 dstPath: 先还原基础版本(可能本身也是增量), 再覆盖变化的分块
+ */
+gboolean    backup_delta_read               (BackupStore* store, const char* key, BackupMetaFile* meta, int slot, const char* dstPath);
+
+/**
+ * slot 即将被删除前调用(调用者持有 key 锁): 以它为基础的增量版本先合并为完整文件, 返回仓库用量的变化
+ */
+gint64      backup_delta_detach             (BackupStore* store, const char* key, BackupMetaFile* meta, int slot);
+
+/**
+ * 逐块校验增量中保存的分块与该版本分块哈希一致; 基础版本由其自身的巡检覆盖
+ */
+gboolean    backup_delta_verify             (const char* deltaPath, const char* treePath, guint64* bytes/*out, nullable*/);
+
+G_END_DECLS
+
+#endif // gvfs_backup_DELTA_H
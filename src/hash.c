@@ -0,0 +1,454 @@
+//
+// Created by dingjing on 1/8/25.
+//
+#define _GNU_SOURCE
+#include "hash.h"
+#include "copy.h"
+#include "trace.h"
+#include "backup-private.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HASH_READ_SIZE          (1024 * 1024)
+#define HASH_TREE_MAGIC         "ANDSECT1"
+#define HASH_TREE_HEADER_LEN    (8 + 4 + 4 + 8)
+
+typedef struct _HashTreeJob
+{
+    int                     fd;
+    gboolean                sparse;
+    gboolean                dropBehind;         // 批量模式下未能使用 O_DIRECT, 每块算完即丢弃页缓存
+    BackupHashTree*         tree;
+    gint                    next;               // 下一个待计算的分块, 原子递增
+    gint                    failed;
+
+    GMutex                  lock;
+    GCond                   cond;
+    guint                   active;             // 尚未结束的辅助线程
+} HashTreeJob;
+
+static char*        hash_file_serial            (int fd, guint64 fileSize, gboolean sparse, guint64* total);
+static char*        hash_file_tree              (int fd, guint64 fileSize, gboolean sparse, gboolean dropBehind, BackupHashTree* tree);
+static gboolean     hash_update_range           (GChecksum* cs, int fd, guint64 begin, guint64 end, gboolean sparse, guint8* buf);
+static gboolean     hash_is_hole                (int fd, guint64 begin, guint64 end);
+static const guint8* hash_zero_chunk_digest     ();
+static void         hash_tree_run               (HashTreeJob* job);
+static void         hash_tree_worker            (gpointer data, gpointer uData);
+static gboolean     hash_tree_chunk             (HashTreeJob* job, guint32 idx, guint8* buf);
+static char*        hash_tree_root              (const BackupHashTree* tree);
+static GThreadPool* hash_pool_get               ();
+static guint8*      hash_buf_new                ();
+
+
+static guint8       gsZeros[HASH_READ_SIZE];            // 空洞按全零参与计算, 不读盘
+
+
+char* backup_hash_file (const char* path, BackupHashTree* tree)
+{
+    g_return_val_if_fail (path && '/' == path[0], NULL);
+
+    char* res = NULL;
+    guint64 total = 0;
+    BackupTraceSpan span;
+
+    if (tree) {
+        memset (tree, 0, sizeof (BackupHashTree));
+    }
+
+    TRACE_BEGIN(span, BACKUP_TRACE_HASH, path);
+
+    const int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat statBuf;
+        memset (&statBuf, 0, sizeof (statBuf));
+        const gboolean statOK = (0 == fstat (fd, &statBuf));
+        // 分配的块少于文件大小说明有空洞, 结果与按稠密文件计算相同
+        const gboolean sparse = statOK && (guint64) statBuf.st_blocks * 512 < (guint64) statBuf.st_size;
+        // 批量模式下稠密的大文件绕过页缓存, 否则读完后丢弃
+        const gboolean direct = statOK && !sparse && backup_copy_direct_on (fd, (guint64) statBuf.st_size);
+        const gboolean dropBehind = statOK && !direct && backup_copy_is_bulk() && statBuf.st_size >= COPY_BULK_MIN_SIZE;
+        if (statOK && statBuf.st_size >= HASH_TREE_MIN_SIZE) {
+            BackupHashTree t;
+            memset (&t, 0, sizeof (t));
+            res = hash_file_tree (fd, (guint64) statBuf.st_size, sparse, dropBehind, &t);
+            total = res ? t.fileSize : 0;
+            if (res && tree) {
+                *tree = t;
+            }
+            else {
+                backup_hash_tree_clear (&t);
+            }
+        }
+        else {
+            res = hash_file_serial (fd, (guint64) statBuf.st_size, sparse, &total);
+            if (dropBehind) {
+                posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+        }
+        close (fd);
+    }
+
+    TRACE_END(span, total);
+
+    return res;
+}
+
+char* backup_hash_file_md5 (const char* path)
+{
+    g_return_val_if_fail (path && '/' == path[0], NULL);
+
+    char* res = NULL;
+    guint64 total = 0;
+    struct stat statBuf;
+    BackupTraceSpan span;
+
+    TRACE_BEGIN(span, BACKUP_TRACE_HASH, path);
+
+    const int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (0 == fstat (fd, &statBuf)) {
+            const gboolean sparse = (guint64) statBuf.st_blocks * 512 < (guint64) statBuf.st_size;
+            res = hash_file_serial (fd, (guint64) statBuf.st_size, sparse, &total);
+            if (backup_copy_is_bulk() && statBuf.st_size >= COPY_BULK_MIN_SIZE) {
+                posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+        }
+        close (fd);
+    }
+
+    TRACE_END(span, total);
+
+    return res;
+}
+
+void backup_hash_tree_clear (BackupHashTree* tree)
+{
+    g_return_if_fail (tree);
+
+    STR_FREE(tree->digests);
+    memset (tree, 0, sizeof (BackupHashTree));
+}
+
+/**
+ * 格式: magic(8) | chunkSize(4) | chunkN(4) | fileSize(8) | digests, 整数均为小端
+ */
+gboolean backup_hash_tree_save (const BackupHashTree* tree, const char* path)
+{
+    g_return_val_if_fail (tree && tree->chunkN > 0 && tree->digests && path, FALSE);
+
+    const gsize digestsLen = (gsize) tree->chunkN * HASH_DIGEST_LEN;
+    const guint32 chunkSize = GUINT32_TO_LE (tree->chunkSize);
+    const guint32 chunkN = GUINT32_TO_LE (tree->chunkN);
+    const guint64 fileSize = GUINT64_TO_LE (tree->fileSize);
+
+    char* buf = g_malloc (HASH_TREE_HEADER_LEN + digestsLen);
+    memcpy (buf, HASH_TREE_MAGIC, 8);
+    memcpy (buf + 8, &chunkSize, 4);
+    memcpy (buf + 12, &chunkN, 4);
+    memcpy (buf + 16, &fileSize, 8);
+    memcpy (buf + HASH_TREE_HEADER_LEN, tree->digests, digestsLen);
+
+    const gboolean ret = g_file_set_contents (path, buf, (gssize) (HASH_TREE_HEADER_LEN + digestsLen), NULL);
+
+    STR_FREE(buf);
+
+    return ret;
+}
+
+gboolean backup_hash_tree_load (BackupHashTree* tree, const char* path)
+{
+    g_return_val_if_fail (tree && path, FALSE);
+
+    gsize len = 0;
+    char* buf = NULL;
+    gboolean ret = FALSE;
+    guint32 chunkSize = 0;
+    guint32 chunkN = 0;
+    guint64 fileSize = 0;
+
+    memset (tree, 0, sizeof (BackupHashTree));
+
+    do {
+        BREAK_IF_FAIL(g_file_get_contents (path, &buf, &len, NULL));
+        BREAK_IF_FAIL(len >= HASH_TREE_HEADER_LEN && 0 == memcmp (buf, HASH_TREE_MAGIC, 8));
+
+        memcpy (&chunkSize, buf + 8, 4);
+        memcpy (&chunkN, buf + 12, 4);
+        memcpy (&fileSize, buf + 16, 8);
+        chunkSize = GUINT32_FROM_LE (chunkSize);
+        chunkN = GUINT32_FROM_LE (chunkN);
+        fileSize = GUINT64_FROM_LE (fileSize);
+        BREAK_IF_FAIL(chunkSize > 0 && chunkN > 0 && len == HASH_TREE_HEADER_LEN + (gsize) chunkN * HASH_DIGEST_LEN);
+        BREAK_IF_FAIL((fileSize + chunkSize - 1) / chunkSize == chunkN);
+
+        tree->chunkSize = chunkSize;
+        tree->chunkN = chunkN;
+        tree->fileSize = fileSize;
+        tree->digests = g_malloc ((gsize) chunkN * HASH_DIGEST_LEN);
+        memcpy (tree->digests, buf + HASH_TREE_HEADER_LEN, (gsize) chunkN * HASH_DIGEST_LEN);
+        ret = TRUE;
+    } while (FALSE);
+
+    STR_FREE(buf);
+
+    return ret;
+}
+
+static char* hash_file_serial (int fd, guint64 fileSize, gboolean sparse, guint64* total)
+{
+    char* res = NULL;
+    ssize_t readLen = 0;
+    GChecksum* cs = g_checksum_new (G_CHECKSUM_MD5);
+    guint8* buf = hash_buf_new ();
+
+    *total = 0;
+    gboolean ok = (NULL != buf);
+    // 稀疏文件先按区段计算到 fstat 时的大小, 之后变长的部分仍顺序读取
+    if (sparse) {
+        ok = hash_update_range (cs, fd, 0, fileSize, TRUE, buf) && lseek (fd, (off_t) fileSize, SEEK_SET) >= 0;
+        *total = ok ? fileSize : 0;
+    }
+    while (ok && ((readLen = read (fd, buf, HASH_READ_SIZE)) > 0 || (readLen < 0 && (EINTR == errno || (EINVAL == errno && backup_copy_direct_off (fd)))))) {
+        if (readLen > 0) {
+            g_checksum_update (cs, buf, readLen);
+            *total += readLen;
+        }
+    }
+    if (ok && 0 == readLen) {
+        res = g_strdup (g_checksum_get_string (cs));
+    }
+
+    free (buf);
+    NOT_NULL_RUN(cs, g_checksum_free);
+
+    return res;
+}
+
+/**
+ * 调用线程与线程池中的辅助线程一起按分块序号抢占计算, 线程池繁忙时退化为调用线程独自完成
+ */
+static char* hash_file_tree (int fd, guint64 fileSize, gboolean sparse, gboolean dropBehind, BackupHashTree* tree)
+{
+    HashTreeJob job;
+    memset (&job, 0, sizeof (job));
+
+    tree->chunkSize = HASH_TREE_CHUNK_SIZE;
+    tree->fileSize = fileSize;
+    tree->chunkN = (guint32) ((fileSize + HASH_TREE_CHUNK_SIZE - 1) / HASH_TREE_CHUNK_SIZE);
+    tree->digests = g_malloc0 ((gsize) tree->chunkN * HASH_DIGEST_LEN);
+
+    job.fd = fd;
+    job.sparse = sparse;
+    job.dropBehind = dropBehind;
+    job.tree = tree;
+    g_mutex_init (&job.lock);
+    g_cond_init (&job.cond);
+
+    GThreadPool* pool = hash_pool_get();
+    const guint helperN = MIN ((guint) g_get_num_processors(), tree->chunkN) - 1;
+    for (guint i = 0; pool && i < helperN; ++i) {
+        g_mutex_lock (&job.lock);
+        job.active++;
+        g_mutex_unlock (&job.lock);
+        if (!g_thread_pool_push (pool, &job, NULL)) {
+            g_mutex_lock (&job.lock);
+            job.active--;
+            g_mutex_unlock (&job.lock);
+            break;
+        }
+    }
+
+    hash_tree_run (&job);
+
+    g_mutex_lock (&job.lock);
+    while (job.active > 0) {
+        g_cond_wait (&job.cond, &job.lock);
+    }
+    g_mutex_unlock (&job.lock);
+
+    g_mutex_clear (&job.lock);
+    g_cond_clear (&job.cond);
+
+    return g_atomic_int_get (&job.failed) ? NULL : hash_tree_root (tree);
+}
+
+static void hash_tree_run (HashTreeJob* job)
+{
+    guint8* buf = hash_buf_new ();
+    if (!buf) {
+        g_atomic_int_set (&job->failed, 1);
+        return;
+    }
+
+    while (!g_atomic_int_get (&job->failed)) {
+        const guint idx = (guint) g_atomic_int_add (&job->next, 1);
+        if (idx >= job->tree->chunkN) {
+            break;
+        }
+        if (!hash_tree_chunk (job, idx, buf)) {
+            g_atomic_int_set (&job->failed, 1);
+        }
+    }
+
+    free (buf);
+}
+
+static void hash_tree_worker (gpointer data, gpointer uData)
+{
+    HashTreeJob* job = data;
+
+    hash_tree_run (job);
+
+    g_mutex_lock (&job->lock);
+    job->active--;
+    g_cond_signal (&job->cond);
+    g_mutex_unlock (&job->lock);
+
+    (void) uData;
+}
+
+static gboolean hash_tree_chunk (HashTreeJob* job, guint32 idx, guint8* buf)
+{
+    const guint64 begin = (guint64) idx * job->tree->chunkSize;
+    const guint64 end = MIN (begin + job->tree->chunkSize, job->tree->fileSize);
+    guint8* digest = job->tree->digests + (gsize) idx * HASH_DIGEST_LEN;
+
+    // 完全落在空洞里的整块直接使用全零块的哈希
+    if (job->sparse && end - begin == HASH_TREE_CHUNK_SIZE && hash_is_hole (job->fd, begin, end)) {
+        memcpy (digest, hash_zero_chunk_digest(), HASH_DIGEST_LEN);
+        return TRUE;
+    }
+
+    gsize digestLen = HASH_DIGEST_LEN;
+    GChecksum* cs = g_checksum_new (G_CHECKSUM_MD5);
+
+    const gboolean ret = hash_update_range (cs, job->fd, begin, end, job->sparse, buf);
+    if (ret) {
+        g_checksum_get_digest (cs, digest, &digestLen);
+    }
+    if (job->dropBehind) {
+        posix_fadvise (job->fd, (off_t) begin, (off_t) (end - begin), POSIX_FADV_DONTNEED);
+    }
+
+    g_checksum_free (cs);
+
+    return ret;
+}
+
+/**
+ * 计算 [begin, end) 的内容; sparse 时用 SEEK_DATA/SEEK_HOLE 跳过空洞, 空洞按全零计算, 不支持时全部按数据读取
+ */
+static gboolean hash_update_range (GChecksum* cs, int fd, guint64 begin, guint64 end, gboolean sparse, guint8* buf)
+{
+    guint64 off = begin;
+
+    while (off < end) {
+        guint64 dataEnd = end;
+        if (sparse) {
+            const off_t data = lseek (fd, (off_t) off, SEEK_DATA);
+            const guint64 dataBegin = (data >= 0) ? MIN ((guint64) data, end) : ((ENXIO == errno) ? end : off);
+            while (off < dataBegin) {
+                const gsize n = (gsize) MIN (dataBegin - off, HASH_READ_SIZE);
+                g_checksum_update (cs, gsZeros, (gssize) n);
+                off += n;
+            }
+            if (off >= end) {
+                break;
+            }
+            const off_t hole = lseek (fd, (off_t) off, SEEK_HOLE);
+            dataEnd = (hole > (off_t) off) ? MIN ((guint64) hole, end) : end;
+        }
+        while (off < dataEnd) {
+            // 按对齐的长度读取(O_DIRECT 的要求), 只计算范围内的部分
+            const gsize want = (gsize) MIN (dataEnd - off, HASH_READ_SIZE);
+            const gsize readSize = MIN ((want + COPY_DIRECT_ALIGN - 1) & ~((gsize) COPY_DIRECT_ALIGN - 1), HASH_READ_SIZE);
+            const ssize_t readLen = pread (fd, buf, readSize, (off_t) off);
+            // 对齐要求不满足时改回普通读取
+            if (readLen < 0 && (EINTR == errno || (EINVAL == errno && backup_copy_direct_off (fd)))) {
+                continue;
+            }
+            if (readLen <= 0) {
+                return FALSE;
+            }
+            const gsize used = MIN ((gsize) readLen, want);
+            g_checksum_update (cs, buf, (gssize) used);
+            off += used;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean hash_is_hole (int fd, guint64 begin, guint64 end)
+{
+    const off_t data = lseek (fd, (off_t) begin, SEEK_DATA);
+
+    return (data < 0) ? (ENXIO == errno) : ((guint64) data >= end);
+}
+
+static const guint8* hash_zero_chunk_digest ()
+{
+    static gsize init = 0;
+    static guint8 digest[HASH_DIGEST_LEN];
+
+    if (g_once_init_enter (&init)) {
+        gsize digestLen = HASH_DIGEST_LEN;
+        GChecksum* cs = g_checksum_new (G_CHECKSUM_MD5);
+        for (gsize off = 0; off < HASH_TREE_CHUNK_SIZE; off += HASH_READ_SIZE) {
+            g_checksum_update (cs, gsZeros, HASH_READ_SIZE);
+        }
+        g_checksum_get_digest (cs, digest, &digestLen);
+        g_checksum_free (cs);
+        g_once_init_leave (&init, 1);
+    }
+
+    return digest;
+}
+
+/**
+ * 根哈希同时覆盖分块大小与文件大小, 与整文件 MD5 不会混淆
+ */
+static char* hash_tree_root (const BackupHashTree* tree)
+{
+    const guint32 chunkSize = GUINT32_TO_LE (tree->chunkSize);
+    const guint64 fileSize = GUINT64_TO_LE (tree->fileSize);
+
+    GChecksum* cs = g_checksum_new (G_CHECKSUM_MD5);
+    g_checksum_update (cs, (const guchar*) HASH_TREE_MAGIC, 8);
+    g_checksum_update (cs, (const guchar*) &chunkSize, sizeof (chunkSize));
+    g_checksum_update (cs, (const guchar*) &fileSize, sizeof (fileSize));
+    g_checksum_update (cs, tree->digests, (gssize) tree->chunkN * HASH_DIGEST_LEN);
+
+    char* res = g_strdup (g_checksum_get_string (cs));
+
+    g_checksum_free (cs);
+
+    return res;
+}
+
+static GThreadPool* hash_pool_get ()
+{
+    static gsize init = 0;
+    static GThreadPool* pool = NULL;
+
+    if (g_once_init_enter (&init)) {
+        pool = g_thread_pool_new (hash_tree_worker, NULL, (gint) g_get_num_processors(), FALSE, NULL);
+        g_once_init_leave (&init, 1);
+    }
+
+    return pool;
+}
+
+/**
+ * 按 COPY_DIRECT_ALIGN 对齐, 文件设置了 O_DIRECT 时可以直接读入; 用 free() 释放
+ */
+static guint8* hash_buf_new ()
+{
+    gpointer buf = NULL;
+
+    return (0 == posix_memalign (&buf, COPY_DIRECT_ALIGN, HASH_READ_SIZE)) ? buf : NULL;
+}
@@ -0,0 +1,39 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_HASH_H
+#define gvfs_backup_HASH_H
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define HASH_DIGEST_LEN                 16                          // MD5
+#define HASH_TREE_MIN_SIZE              (64 * 1024 * 1024)          // 小于此大小的文件直接顺序计算整个文件的 MD5
+#define HASH_TREE_CHUNK_SIZE            (4 * 1024 * 1024)
+#define HASH_TREE_SUFFIX                ".tree"                     // 每个版本的分块哈希保存在 <key>-N.tree
+
+/**
+ * 大文件按固定大小分块, 每块单独计算 MD5, 根哈希为所有分块哈希的 MD5
+ */
+typedef struct _BackupHashTree
+{
+    guint32                 chunkSize;
+    guint32                 chunkN;                 // 0 表示没有分块(小文件)
+    guint64                 fileSize;
+    guint8*                 digests;                // chunkN * HASH_DIGEST_LEN
+} BackupHashTree;
+
+char*       backup_hash_file                (const char* path, BackupHashTree* tree/*out, nullable*/);
+
+/**
+ * 不论大小都顺序计算整个文件的 MD5; 引入分块哈希之前备份的大文件版本在 meta 中记录的是它
+ */
+char*       backup_hash_file_md5            (const char* path);
+void        backup_hash_tree_clear          (BackupHashTree* tree);
+gboolean    backup_hash_tree_save           (const BackupHashTree* tree, const char* path);
+gboolean    backup_hash_tree_load           (BackupHashTree* tree/*out*/, const char* path);
+
+G_END_DECLS
+
+#endif // gvfs_backup_HASH_H
@@ -0,0 +1,1037 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 查询索引: index/run 为按源路径排序的条目表与按时间戳排序的时间表(mmap 后二分查找),
+// index/log 追加记录其后的 meta 写入, 超过 INDEX_LOG_MAX 后由后台线程与 run 合并为新的 run
+//
+#include "index.h"
+#include "backup-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_RUN_FILE          "run"
+#define INDEX_RUN_TMP           "run.tmp"
+#define INDEX_LOG_FILE          "log"
+#define INDEX_LOG_TMP           "log.tmp"
+#define INDEX_RUN_MAGIC         "ANDIDX01"
+#define INDEX_LOG_MAGIC         0x31474c49          // "ILG1"
+#define INDEX_BUILD_RETRY       3                   // 遍历 meta 期间日志被清空时重新遍历的次数
+#define INDEX_MERGE_RETRY_US    (60 * G_USEC_PER_SEC)   // 合并失败(例如其它进程正在写 run.tmp)后的重试间隔
+
+/**
+ * run: IndexRunHeader | IndexRunEntry[entryN](按路径字节序) | IndexRunTime[timeN](按时间戳) | 路径字符串区
+ * log: (IndexLogRecord + pathLen 字节路径)*, 同一路径后写入的覆盖先写入的
+ * 多字节字段均为小端
+ */
+typedef struct _IndexRunHeader
+{
+    char                    magic[8];
+    guint64                 entryN;
+    guint64                 timeN;
+    guint64                 reserved;
+} IndexRunHeader;
+
+typedef struct _IndexRunEntry
+{
+    guint64                 pathOff;            // 相对于字符串区
+    guint32                 pathLen;
+    guint32                 reserved;
+    guint64                 timestamps[3];      // 0 表示该版本槽为空
+} IndexRunEntry;
+
+typedef struct _IndexRunTime
+{
+    guint64                 timestamp;
+    guint32                 entry;
+    guint32                 reserved;
+} IndexRunTime;
+
+typedef struct _IndexLogRecord
+{
+    guint32                 magic;
+    guint32                 pathLen;
+    guint64                 timestamps[3];
+} IndexLogRecord;
+
+/**
+ * 由 store->indexLock 保护; 跨进程的追加、合并与重建另外对 index/ 目录加 flock(LOCK_EX), 查询加 LOCK_SH;
+ * 写 run.tmp 期间对其本身加 flock, 后台合并写入时不持有目录锁
+ */
+struct _BackupIndex
+{
+    int                     dirFd;
+    int                     logFd;
+    gboolean                logWritable;        // 只查询时日志以只读打开, 仓库只读时也能使用索引
+    ino_t                   logIno;             // 合并后日志整体替换, inode 变化时重新载入
+    guint64                 logPos;             // 已载入内存的日志长度
+    GHashTable*             log;                // 源路径 -> guint64[3]
+    gboolean                broken;             // 日志或有序文件损坏, 下次查询时从 meta 重建
+    gboolean                merging;            // 后台合并线程正在运行
+    gint64                  mergeTime;          // 上次启动合并的时间
+
+    ino_t                   runIno;
+    guint8*                 run;                // mmap, NULL 表示还没有有序文件
+    gsize                   runLen;
+    const IndexRunEntry*    entries;
+    const IndexRunTime*     times;
+    const char*             strings;
+    guint64                 stringsLen;
+    guint64                 entryN;
+    guint64                 timeN;
+};
+
+static BackupIndex* index_open                  (BackupStore* store, gboolean create);
+static gboolean     index_log_reopen            (BackupIndex* idx, gboolean writable);
+static gboolean     index_log_load              (int fd, guint64* pos, GHashTable* items);
+static void         index_log_refresh           (BackupIndex* idx);
+static gboolean     index_log_reset             (BackupIndex* idx, guint64 keepFrom);
+static void         index_run_refresh           (BackupIndex* idx);
+static void         index_run_unmap             (BackupIndex* idx);
+static void         index_run_items             (BackupIndex* idx, GHashTable* items);
+static int          index_run_write             (int dirFd, GHashTable* items);
+static gboolean     index_run_install           (BackupIndex* idx, int tmpFd, gboolean install);
+static gpointer     index_merge_thread          (gpointer data);
+static gboolean     index_merge                 (BackupStore* store);
+static gboolean     index_build                 (BackupStore* store);
+static void         index_meta_cb               (int dirFd, const char* relPath, const char* name, gpointer data);
+static const char*  index_entry_path            (BackupIndex* idx, guint64 i, gsize* len);
+static guint64      index_entry_bound           (BackupIndex* idx, const char* prefix, gsize prefixLen, gboolean upper);
+static guint64      index_time_bound            (BackupIndex* idx, guint64 timestamp, gboolean upper);
+static void         index_search                (BackupIndex* idx, const char* prefix, guint64 since, guint64 until, GHashTable* results);
+static void         index_search_entry          (BackupIndex* idx, guint64 i, guint64 since, guint64 until, GHashTable* results);
+static void         index_filter                (GHashTable* items, const char* prefix, guint64 since, guint64 until, GHashTable* results);
+static gboolean     index_prefix_match          (const char* path, gsize pathLen, const char* prefix, gsize prefixLen);
+static gboolean     index_in_range              (const guint64 timestamps[3], guint64 since, guint64 until, guint64* newest);
+static void         index_result_add            (GHashTable* results, const char* path, gsize pathLen, guint64 timestamp);
+static gboolean     index_meta_check            (BackupStore* store, const char* path, guint64 since, guint64 until, guint64* newest);
+static void         index_items_insert          (GHashTable* items, char* path, const guint64 timestamps[3]);
+static gint         index_path_compare          (gconstpointer a, gconstpointer b);
+static gint         index_time_compare          (gconstpointer a, gconstpointer b);
+static gboolean     index_write_all             (int fd, const void* data, gsize len);
+static gboolean     index_pread_all             (int fd, void* data, gsize len, off_t offset);
+
+
+gboolean backup_store_query (const char* mountPoint, const char* prefix, guint64 since, guint64 until, BackupQueryFunc func, gpointer data)
+{
+    g_return_val_if_fail (func && (!prefix || '/' == prefix[0]), FALSE);
+
+    // 去掉结尾的 '/', 根目录除外
+    char* dir = g_strdup (prefix ? prefix : "/");
+    gsize dirLen = strlen (dir);
+    while (dirLen > 1 && '/' == dir[dirLen - 1]) {
+        dir[--dirLen] = '\0';
+    }
+    if (0 == until) {
+        until = G_MAXUINT64;
+    }
+
+    GList* mp = mountPoint ? g_list_prepend (NULL, g_strdup (mountPoint)) : get_all_mount_points ();
+    GHashTable* found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    GHashTable* results = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    for (GList* itr = mp; itr; itr = itr->next) {
+        const char* m = itr->data;
+        // 只查与前缀有交集的挂载点: 前缀在挂载点之下, 或挂载点在前缀之下
+        if (!index_prefix_match (dir, dirLen, m, strlen (m)) && !index_prefix_match (m, strlen (m), dir, dirLen)) {
+            continue;
+        }
+        BackupStore* store = backup_store_get (m);
+        if (!store) {
+            continue;
+        }
+
+        g_hash_table_remove_all (results);
+        if (!backup_index_query (store, dir, since, until, results)) {
+            // 索引不可用时退回遍历全部 meta
+            GHashTable* items = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+            backup_store_walk (store, "meta", index_meta_cb, items);
+            index_filter (items, dir, since, until, results);
+            g_hash_table_unref (items);
+        }
+
+        // 索引只用来缩小范围, 以 meta 为准
+        GHashTableIter iter;
+        gpointer key = NULL;
+        g_hash_table_iter_init (&iter, results);
+        while (g_hash_table_iter_next (&iter, &key, NULL)) {
+            guint64 newest = 0;
+            if (index_meta_check (store, key, since, until, &newest)) {
+                guint64* ts = g_new (guint64, 1);
+                *ts = newest;
+                g_hash_table_replace (found, g_strdup (key), ts);
+            }
+        }
+    }
+
+    GList* paths = g_list_sort (g_hash_table_get_keys (found), index_path_compare);
+    for (GList* itr = paths; itr; itr = itr->next) {
+        const guint64* ts = g_hash_table_lookup (found, itr->data);
+        func (itr->data, *ts, data);
+    }
+
+    g_list_free (paths);
+    g_hash_table_unref (found);
+    g_hash_table_unref (results);
+    NOT_NULL_RUN(mp, g_list_free_full, g_free);
+    STR_FREE(dir);
+
+    return TRUE;
+}
+
+void backup_index_put (BackupStore* store, const char* srcPath, const guint64 timestamps[3])
+{
+    g_return_if_fail (store && srcPath && timestamps);
+
+    const gsize pathLen = strlen (srcPath);
+    g_return_if_fail (pathLen > 0 && pathLen < STORE_PATH_MAX);
+
+    IndexLogRecord rec;
+    rec.magic = GUINT32_TO_LE (INDEX_LOG_MAGIC);
+    rec.pathLen = GUINT32_TO_LE ((guint32) pathLen);
+    for (int i = 0; i < 3; ++i) {
+        rec.timestamps[i] = GUINT64_TO_LE (timestamps[i]);
+    }
+
+    gboolean merge = FALSE;
+
+    g_mutex_lock (&store->indexLock);
+    BackupIndex* idx = index_open (store, TRUE);
+    if (idx && 0 == flock (idx->dirFd, LOCK_EX)) {
+        struct stat statBuf;
+        if (index_log_reopen (idx, TRUE) && 0 == fstat (idx->logFd, &statBuf)) {
+            // 一次写入整条记录; 写了一半时截掉, 不给读者留下残缺的记录
+            struct iovec iov[2] = { { &rec, sizeof (rec) }, { (void*) srcPath, pathLen } };
+            const ssize_t writeLen = writev (idx->logFd, iov, 2);
+            if (writeLen != (ssize_t) (sizeof (rec) + pathLen)) {
+                if (writeLen > 0 && 0 != ftruncate (idx->logFd, statBuf.st_size)) {
+                    idx->broken = TRUE;
+                }
+            }
+            else if ((guint64) statBuf.st_size + writeLen > INDEX_LOG_MAX) {
+                const gint64 now = g_get_monotonic_time ();
+                index_run_refresh (idx);
+                if (!idx->run) {
+                    // 还没有有序文件时日志没有用处, 首次查询会遍历 meta 建立索引
+                    index_log_reset (idx, G_MAXUINT64);
+                }
+                else if (!idx->merging && (0 == idx->mergeTime || now - idx->mergeTime >= INDEX_MERGE_RETRY_US)) {
+                    // 合并要重写整个有序文件并落盘, 放到后台, 不拖慢 meta 的保存
+                    idx->merging = TRUE;
+                    idx->mergeTime = now;
+                    merge = TRUE;
+                }
+            }
+        }
+        flock (idx->dirFd, LOCK_UN);
+    }
+    g_mutex_unlock (&store->indexLock);
+
+    if (merge) {
+        g_thread_unref (g_thread_new ("backup-index", index_merge_thread, store));
+    }
+}
+
+gboolean backup_index_query (BackupStore* store, const char* prefix, guint64 since, guint64 until, GHashTable* results)
+{
+    g_return_val_if_fail (store && prefix && results, FALSE);
+
+    gboolean ret = FALSE;
+
+    for (int i = 0; i < 2 && !ret; ++i) {
+        gboolean ready = FALSE;
+        g_mutex_lock (&store->indexLock);
+        BackupIndex* idx = index_open (store, FALSE);
+        if (idx && 0 == flock (idx->dirFd, LOCK_SH)) {
+            index_run_refresh (idx);
+            if (index_log_reopen (idx, FALSE)) {
+                index_log_refresh (idx);
+                ready = idx->run && !idx->broken;
+            }
+            flock (idx->dirFd, LOCK_UN);
+        }
+        if (ready) {
+            index_search (idx, prefix, since, until, results);
+            ret = TRUE;
+        }
+        g_mutex_unlock (&store->indexLock);
+
+        // 遍历 meta 期间不持有锁, 不阻塞备份; 仓库只读时建立失败, 由调用者遍历 meta
+        if (!ret && !index_build (store)) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * create 为 FALSE 时(只查询)不创建 index/, 目录不存在返回 NULL
+ */
+static BackupIndex* index_open (BackupStore* store, gboolean create)
+{
+    if (store->index) {
+        return store->index;
+    }
+
+    BackupIndex* idx = NULL;
+    char* dir = g_strdup_printf ("%s/%s", store->root, INDEX_DIR);
+
+    do {
+        if (create) {
+            mkdir (dir, 0755);
+        }
+        const int dirFd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        BREAK_IF_FAIL(dirFd >= 0);
+
+        idx = g_new0 (BackupIndex, 1);
+        idx->dirFd = dirFd;
+        idx->logFd = -1;
+        idx->log = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        store->index = idx;
+    } while (FALSE);
+
+    STR_FREE(dir);
+
+    return idx;
+}
+
+/**
+ * 调用者持有 flock; 日志被合并替换后改用新日志, 丢弃内存中已载入的记录;
+ * writable 为 FALSE 时只读打开, 日志不存在视为空日志(logFd 为 -1)
+ */
+static gboolean index_log_reopen (BackupIndex* idx, gboolean writable)
+{
+    struct stat statBuf;
+
+    if (idx->logFd >= 0 && (idx->logWritable || !writable)
+        && 0 == fstatat (idx->dirFd, INDEX_LOG_FILE, &statBuf, 0) && statBuf.st_ino == idx->logIno) {
+        return TRUE;
+    }
+
+    const int fd = writable
+        ? openat (idx->dirFd, INDEX_LOG_FILE, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+        : openat (idx->dirFd, INDEX_LOG_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && !writable && ENOENT == errno) {
+        memset (&statBuf, 0, sizeof (statBuf));
+    }
+    else if (fd < 0 || 0 != fstat (fd, &statBuf)) {
+        if (fd >= 0) { close (fd); }
+        return FALSE;
+    }
+
+    if (idx->logFd >= 0) {
+        close (idx->logFd);
+    }
+    idx->logFd = fd;
+    idx->logWritable = writable;
+    idx->logIno = statBuf.st_ino;
+    idx->logPos = 0;
+    g_hash_table_remove_all (idx->log);
+
+    return TRUE;
+}
+
+/**
+ * 从 *pos 读到文件末尾, 只消费完整的记录, 半条记录留到下次; 遇到损坏的记录返回 FALSE
+ */
+static gboolean index_log_load (int fd, guint64* pos, GHashTable* items)
+{
+    struct stat statBuf;
+
+    if (0 != fstat (fd, &statBuf) || (guint64) statBuf.st_size <= *pos) {
+        return TRUE;
+    }
+
+    gsize off = 0;
+    gboolean ret = TRUE;
+    const gsize len = (gsize) ((guint64) statBuf.st_size - *pos);
+    guint8* buf = g_malloc (len);
+
+    if (index_pread_all (fd, buf, len, (off_t) *pos)) {
+        while (off + sizeof (IndexLogRecord) <= len) {
+            IndexLogRecord rec;
+            memcpy (&rec, buf + off, sizeof (rec));
+            const gsize pathLen = GUINT32_FROM_LE (rec.pathLen);
+            if (INDEX_LOG_MAGIC != GUINT32_FROM_LE (rec.magic) || 0 == pathLen || pathLen >= STORE_PATH_MAX) {
+                ret = FALSE;
+                break;
+            }
+            if (off + sizeof (rec) + pathLen > len) {
+                break;
+            }
+            guint64 timestamps[3];
+            for (int i = 0; i < 3; ++i) {
+                timestamps[i] = GUINT64_FROM_LE (rec.timestamps[i]);
+            }
+            index_items_insert (items, g_strndup ((const char*) buf + off + sizeof (rec), pathLen), timestamps);
+            off += sizeof (rec) + pathLen;
+        }
+        *pos += off;
+    }
+
+    STR_FREE(buf);
+
+    return ret;
+}
+
+static void index_log_refresh (BackupIndex* idx)
+{
+    if (idx->logFd >= 0 && !index_log_load (idx->logFd, &idx->logPos, idx->log)) {
+        idx->broken = TRUE;
+    }
+}
+
+/**
+ * 调用者持有 flock 且日志以可写打开; 用只含 keepFrom 之后记录的新日志替换当前日志(已合并到有序文件的部分丢弃)
+ */
+static gboolean index_log_reset (BackupIndex* idx, guint64 keepFrom)
+{
+    gboolean ret = FALSE;
+    struct stat statBuf;
+
+    if (0 != fstat (idx->logFd, &statBuf)) {
+        return FALSE;
+    }
+
+    guint8* tail = NULL;
+    const gsize tailLen = (keepFrom < (guint64) statBuf.st_size) ? (gsize) ((guint64) statBuf.st_size - keepFrom) : 0;
+    const int fd = openat (idx->dirFd, INDEX_LOG_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        ret = TRUE;
+        if (tailLen > 0) {
+            tail = g_malloc (tailLen);
+            ret = index_pread_all (idx->logFd, tail, tailLen, (off_t) keepFrom) && index_write_all (fd, tail, tailLen);
+        }
+        close (fd);
+        ret = ret && (0 == renameat (idx->dirFd, INDEX_LOG_TMP, idx->dirFd, INDEX_LOG_FILE));
+        if (!ret) {
+            unlinkat (idx->dirFd, INDEX_LOG_TMP, 0);
+        }
+    }
+    STR_FREE(tail);
+
+    return ret && index_log_reopen (idx, TRUE);
+}
+
+/**
+ * 有序文件被整体替换(inode 变化)时重新映射; 旧映射在解除之前一直有效
+ */
+static void index_run_refresh (BackupIndex* idx)
+{
+    struct stat statBuf;
+
+    if (0 != fstatat (idx->dirFd, INDEX_RUN_FILE, &statBuf, 0)) {
+        index_run_unmap (idx);
+        return;
+    }
+    if (idx->run && statBuf.st_ino == idx->runIno) {
+        return;
+    }
+
+    index_run_unmap (idx);
+
+    const int fd = openat (idx->dirFd, INDEX_RUN_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    do {
+        BREAK_IF_FAIL(0 == fstat (fd, &statBuf) && (guint64) statBuf.st_size >= sizeof (IndexRunHeader));
+
+        const gsize len = (gsize) statBuf.st_size;
+        guint8* run = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        BREAK_IF_FAIL(MAP_FAILED != run);
+
+        IndexRunHeader header;
+        memcpy (&header, run, sizeof (header));
+        const guint64 entryN = GUINT64_FROM_LE (header.entryN);
+        const guint64 timeN = GUINT64_FROM_LE (header.timeN);
+        const guint64 body = len - sizeof (IndexRunHeader);
+        if (0 != memcmp (header.magic, INDEX_RUN_MAGIC, sizeof (header.magic))
+            || entryN > body / sizeof (IndexRunEntry) || entryN > G_MAXUINT32
+            || timeN > (body - entryN * sizeof (IndexRunEntry)) / sizeof (IndexRunTime)) {
+            munmap (run, len);
+            idx->broken = TRUE;
+            break;
+        }
+
+        idx->run = run;
+        idx->runLen = len;
+        idx->runIno = statBuf.st_ino;
+        idx->entryN = entryN;
+        idx->timeN = timeN;
+        idx->entries = (const IndexRunEntry*) (run + sizeof (IndexRunHeader));
+        idx->times = (const IndexRunTime*) (idx->entries + entryN);
+        idx->strings = (const char*) (idx->times + timeN);
+        idx->stringsLen = len - ((const guint8*) idx->strings - run);
+    } while (FALSE);
+
+    close (fd);
+}
+
+static void index_run_unmap (BackupIndex* idx)
+{
+    if (idx->run) {
+        munmap (idx->run, idx->runLen);
+    }
+    idx->run = NULL;
+    idx->runLen = 0;
+    idx->runIno = 0;
+    idx->entries = NULL;
+    idx->times = NULL;
+    idx->strings = NULL;
+    idx->stringsLen = 0;
+    idx->entryN = 0;
+    idx->timeN = 0;
+}
+
+static void index_run_items (BackupIndex* idx, GHashTable* items)
+{
+    for (guint64 i = 0; i < idx->entryN; ++i) {
+        gsize pathLen = 0;
+        const char* path = index_entry_path (idx, i, &pathLen);
+        if (path) {
+            guint64 timestamps[3];
+            for (int j = 0; j < 3; ++j) {
+                timestamps[j] = GUINT64_FROM_LE (idx->entries[i].timestamps[j]);
+            }
+            index_items_insert (items, g_strndup (path, pathLen), timestamps);
+        }
+    }
+}
+
+/**
+ * 把 items(源路径 -> guint64[3]) 写入 run.tmp 并落盘, 返回对其持有 flock 的描述符, 交给 index_run_install;
+ * 其它线程或进程正在写 run.tmp 时返回 -1
+ */
+static int index_run_write (int dirFd, GHashTable* items)
+{
+    gboolean ret = FALSE;
+
+    GList* paths = g_list_sort (g_hash_table_get_keys (items), index_path_compare);
+    const guint n = g_list_length (paths);
+
+    GArray* entries = g_array_sized_new (FALSE, TRUE, sizeof (IndexRunEntry), n);
+    GArray* times = g_array_sized_new (FALSE, TRUE, sizeof (IndexRunTime), n);
+    GByteArray* strings = g_byte_array_new ();
+
+    for (GList* itr = paths; itr; itr = itr->next) {
+        const guint64* ts = g_hash_table_lookup (items, itr->data);
+        const gsize pathLen = strlen (itr->data);
+        IndexRunEntry entry;
+        memset (&entry, 0, sizeof (entry));
+        entry.pathOff = GUINT64_TO_LE ((guint64) strings->len);
+        entry.pathLen = GUINT32_TO_LE ((guint32) pathLen);
+        for (int i = 0; i < 3; ++i) {
+            entry.timestamps[i] = GUINT64_TO_LE (ts[i]);
+            if (ts[i] > 0) {
+                IndexRunTime tm;
+                memset (&tm, 0, sizeof (tm));
+                tm.timestamp = ts[i];
+                tm.entry = entries->len;
+                g_array_append_val (times, tm);
+            }
+        }
+        g_array_append_val (entries, entry);
+        g_byte_array_append (strings, itr->data, (guint) pathLen);
+    }
+
+    // 排序时用本机字节序, 写入前再转换
+    g_array_sort (times, index_time_compare);
+    for (guint i = 0; i < times->len; ++i) {
+        IndexRunTime* tm = &g_array_index (times, IndexRunTime, i);
+        tm->timestamp = GUINT64_TO_LE (tm->timestamp);
+        tm->entry = GUINT32_TO_LE (tm->entry);
+    }
+
+    IndexRunHeader header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, INDEX_RUN_MAGIC, sizeof (header.magic));
+    header.entryN = GUINT64_TO_LE ((guint64) entries->len);
+    header.timeN = GUINT64_TO_LE ((guint64) times->len);
+
+    // 先加锁再截断, 不破坏别人正在写的 run.tmp
+    int fd = openat (dirFd, INDEX_RUN_TMP, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && 0 != flock (fd, LOCK_EX | LOCK_NB)) {
+        close (fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        ret = 0 == ftruncate (fd, 0)
+            && index_write_all (fd, &header, sizeof (header))
+            && index_write_all (fd, entries->data, (gsize) entries->len * sizeof (IndexRunEntry))
+            && index_write_all (fd, times->data, (gsize) times->len * sizeof (IndexRunTime))
+            && index_write_all (fd, strings->data, strings->len)
+            && 0 == fdatasync (fd);
+        if (!ret) {
+            unlinkat (dirFd, INDEX_RUN_TMP, 0);
+            close (fd);
+            fd = -1;
+        }
+    }
+
+    g_list_free (paths);
+    g_array_unref (entries);
+    g_array_unref (times);
+    g_byte_array_unref (strings);
+
+    return fd;
+}
+
+/**
+ * 调用者持有目录 flock; install 为 TRUE 时用 run.tmp 替换有序文件, 否则丢弃; 都会关闭 tmpFd
+ */
+static gboolean index_run_install (BackupIndex* idx, int tmpFd, gboolean install)
+{
+    const gboolean ret = install && 0 == renameat (idx->dirFd, INDEX_RUN_TMP, idx->dirFd, INDEX_RUN_FILE);
+    if (!ret) {
+        unlinkat (idx->dirFd, INDEX_RUN_TMP, 0);
+    }
+    close (tmpFd);
+
+    return ret;
+}
+
+static gpointer index_merge_thread (gpointer data)
+{
+    BackupStore* store = data;
+
+    index_merge (store);
+
+    g_mutex_lock (&store->indexLock);
+    store->index->merging = FALSE;
+    g_mutex_unlock (&store->indexLock);
+
+    return NULL;
+}
+
+/**
+ * 记下有序文件与日志的 inode 后不持有锁, 用单独的映射与描述符读出全部记录写入 run.tmp;
+ * 换上时两者都未变(期间没有其它合并或重建)才生效, 合并点之后追加的记录移到新日志
+ */
+static gboolean index_merge (BackupStore* store)
+{
+    gboolean ret = FALSE;
+    gboolean ready = FALSE;
+    ino_t logIno = 0;
+    ino_t runIno = 0;
+    guint64 logPos = 0;
+    int tmpFd = -1;
+    struct stat statBuf;
+    BackupIndex* idx = NULL;
+
+    g_mutex_lock (&store->indexLock);
+    idx = store->index;
+    if (idx && 0 == flock (idx->dirFd, LOCK_EX)) {
+        index_run_refresh (idx);
+        if (idx->run && !idx->broken && index_log_reopen (idx, TRUE)) {
+            logIno = idx->logIno;
+            runIno = idx->runIno;
+            ready = TRUE;
+        }
+        flock (idx->dirFd, LOCK_UN);
+    }
+    g_mutex_unlock (&store->indexLock);
+    if (!ready) {
+        return FALSE;
+    }
+
+    BackupIndex snap;
+    memset (&snap, 0, sizeof (snap));
+    snap.dirFd = idx->dirFd;
+    snap.logFd = -1;
+    GHashTable* items = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    do {
+        index_run_refresh (&snap);
+        BREAK_IF_FAIL(snap.run && !snap.broken && snap.runIno == runIno);
+        index_run_items (&snap, items);
+
+        snap.logFd = openat (idx->dirFd, INDEX_LOG_FILE, O_RDONLY | O_CLOEXEC);
+        BREAK_IF_FAIL(snap.logFd >= 0 && 0 == fstat (snap.logFd, &statBuf) && statBuf.st_ino == logIno);
+        BREAK_IF_FAIL(index_log_load (snap.logFd, &logPos, items));
+
+        tmpFd = index_run_write (idx->dirFd, items);
+    } while (FALSE);
+
+    if (snap.logFd >= 0) {
+        close (snap.logFd);
+    }
+    index_run_unmap (&snap);
+    g_hash_table_unref (items);
+    if (tmpFd < 0) {
+        return FALSE;
+    }
+
+    g_mutex_lock (&store->indexLock);
+    if (0 == flock (idx->dirFd, LOCK_EX)) {
+        const gboolean same = index_log_reopen (idx, TRUE) && idx->logIno == logIno
+            && 0 == fstatat (idx->dirFd, INDEX_RUN_FILE, &statBuf, 0) && statBuf.st_ino == runIno;
+        // 先换有序文件再换日志, 中途失败时旧日志重放到新有序文件上结果不变
+        ret = index_run_install (idx, tmpFd, same) && index_log_reset (idx, logPos);
+        index_run_refresh (idx);
+        flock (idx->dirFd, LOCK_UN);
+    }
+    else {
+        index_run_install (idx, tmpFd, FALSE);
+    }
+    g_mutex_unlock (&store->indexLock);
+
+    return ret;
+}
+
+/**
+ * 遍历 meta 建立有序文件; 遍历前记下日志位置, 遍历期间追加的记录之后叠加上去,
+ * 日志在此期间被其它进程清空(记录丢失)时重新遍历
+ */
+static gboolean index_build (BackupStore* store)
+{
+    gboolean ret = FALSE;
+
+    for (int attempt = 0; attempt < INDEX_BUILD_RETRY && !ret; ++attempt) {
+        ino_t ino = 0;
+        guint64 pos = 0;
+        gboolean ready = FALSE;
+        struct stat statBuf;
+
+        g_mutex_lock (&store->indexLock);
+        BackupIndex* idx = index_open (store, TRUE);
+        if (idx && 0 == flock (idx->dirFd, LOCK_EX)) {
+            if (index_log_reopen (idx, TRUE) && 0 == fstat (idx->logFd, &statBuf)) {
+                ino = idx->logIno;
+                pos = (guint64) statBuf.st_size;
+                ready = TRUE;
+            }
+            flock (idx->dirFd, LOCK_UN);
+        }
+        g_mutex_unlock (&store->indexLock);
+        BREAK_IF_FAIL(ready);
+
+        GHashTable* items = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        backup_store_walk (store, "meta", index_meta_cb, items);
+
+        g_mutex_lock (&store->indexLock);
+        if (0 == flock (idx->dirFd, LOCK_EX)) {
+            index_run_refresh (idx);
+            if (index_log_reopen (idx, TRUE)) {
+                if (ino == idx->logIno && index_log_load (idx->logFd, &pos, items)) {
+                    const int tmpFd = index_run_write (idx->dirFd, items);
+                    ret = tmpFd >= 0 && index_run_install (idx, tmpFd, TRUE) && index_log_reset (idx, pos);
+                    if (ret) {
+                        idx->broken = FALSE;
+                        index_run_refresh (idx);
+                    }
+                }
+                else if (idx->run && !idx->broken) {
+                    // 其它进程已经建好
+                    ret = TRUE;
+                }
+            }
+            flock (idx->dirFd, LOCK_UN);
+        }
+        g_mutex_unlock (&store->indexLock);
+
+        g_hash_table_unref (items);
+    }
+
+    return ret;
+}
+
+static void index_meta_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    BackupMetaFile meta;
+
+    if (backup_meta_parse_at (&meta, dirFd, name) && 1 == meta.version && meta.srcFilePath) {
+        const guint64 timestamps[3] = { meta.backupFileTimestamp1, meta.backupFileTimestamp2, meta.backupFileTimestamp3 };
+        index_items_insert (data, meta.srcFilePath, timestamps);
+        meta.srcFilePath = NULL;
+    }
+    backup_meta_free (&meta);
+
+    (void) relPath;
+}
+
+static const char* index_entry_path (BackupIndex* idx, guint64 i, gsize* len)
+{
+    const guint64 off = GUINT64_FROM_LE (idx->entries[i].pathOff);
+    const guint64 pathLen = GUINT32_FROM_LE (idx->entries[i].pathLen);
+
+    if (off > idx->stringsLen || pathLen > idx->stringsLen - off) {
+        *len = 0;
+        return NULL;
+    }
+    *len = (gsize) pathLen;
+
+    return idx->strings + off;
+}
+
+/**
+ * 第一个以 prefix 开头的条目(upper 为 FALSE), 或第一个大于所有以 prefix 开头的条目(upper 为 TRUE)
+ */
+static guint64 index_entry_bound (BackupIndex* idx, const char* prefix, gsize prefixLen, gboolean upper)
+{
+    guint64 lo = 0;
+    guint64 hi = idx->entryN;
+
+    while (lo < hi) {
+        const guint64 mid = lo + (hi - lo) / 2;
+        gsize pathLen = 0;
+        const char* path = index_entry_path (idx, mid, &pathLen);
+        int cmp = path ? memcmp (path, prefix, MIN (pathLen, prefixLen)) : -1;
+        if (0 == cmp && pathLen < prefixLen) {
+            cmp = -1;
+        }
+        if (cmp < 0 || (upper && 0 == cmp)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static guint64 index_time_bound (BackupIndex* idx, guint64 timestamp, gboolean upper)
+{
+    guint64 lo = 0;
+    guint64 hi = idx->timeN;
+
+    while (lo < hi) {
+        const guint64 mid = lo + (hi - lo) / 2;
+        const guint64 ts = GUINT64_FROM_LE (idx->times[mid].timestamp);
+        if (ts < timestamp || (upper && ts == timestamp)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * 在有序文件中分别按路径前缀与时间范围二分, 遍历候选较少的一边; 再用日志中较新的记录覆盖
+ */
+static void index_search (BackupIndex* idx, const char* prefix, guint64 since, guint64 until, GHashTable* results)
+{
+    const gsize prefixLen = strlen (prefix);
+    const gboolean all = (1 == prefixLen);
+    char* dir = all ? g_strdup (prefix) : g_strdup_printf ("%s/", prefix);
+    const gsize dirLen = strlen (dir);
+
+    // 前缀本身只可能是一条, "前缀/" 开头的条目是连续的一段
+    guint64 exact = idx->entryN;
+    guint64 lo = index_entry_bound (idx, dir, dirLen, FALSE);
+    guint64 hi = index_entry_bound (idx, dir, dirLen, TRUE);
+    if (!all) {
+        exact = index_entry_bound (idx, prefix, prefixLen, FALSE);
+        gsize pathLen = 0;
+        if (exact >= idx->entryN || !index_entry_path (idx, exact, &pathLen) || pathLen != prefixLen) {
+            exact = idx->entryN;
+        }
+    }
+    const guint64 pathN = hi - lo + (exact < idx->entryN ? 1 : 0);
+    const guint64 tlo = index_time_bound (idx, since, FALSE);
+    const guint64 thi = index_time_bound (idx, until, TRUE);
+
+    if (pathN <= thi - tlo) {
+        if (exact < idx->entryN) {
+            index_search_entry (idx, exact, since, until, results);
+        }
+        for (guint64 i = lo; i < hi; ++i) {
+            index_search_entry (idx, i, since, until, results);
+        }
+    }
+    else {
+        for (guint64 i = tlo; i < thi; ++i) {
+            const guint64 entry = GUINT32_FROM_LE (idx->times[i].entry);
+            gsize pathLen = 0;
+            const char* path = (entry < idx->entryN) ? index_entry_path (idx, entry, &pathLen) : NULL;
+            if (path && index_prefix_match (path, pathLen, prefix, prefixLen)) {
+                index_result_add (results, path, pathLen, GUINT64_FROM_LE (idx->times[i].timestamp));
+            }
+        }
+    }
+
+    // 日志中的记录比有序文件新, 先去掉有序文件的结果再按日志判断
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gpointer value = NULL;
+    g_hash_table_iter_init (&iter, idx->log);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        guint64 newest = 0;
+        const gsize pathLen = strlen (key);
+        if (index_prefix_match (key, pathLen, prefix, prefixLen)) {
+            g_hash_table_remove (results, key);
+            if (index_in_range (value, since, until, &newest)) {
+                index_result_add (results, key, pathLen, newest);
+            }
+        }
+    }
+
+    STR_FREE(dir);
+}
+
+static void index_search_entry (BackupIndex* idx, guint64 i, guint64 since, guint64 until, GHashTable* results)
+{
+    guint64 timestamps[3];
+    guint64 newest = 0;
+    gsize pathLen = 0;
+    const char* path = index_entry_path (idx, i, &pathLen);
+
+    for (int j = 0; j < 3; ++j) {
+        timestamps[j] = GUINT64_FROM_LE (idx->entries[i].timestamps[j]);
+    }
+    if (path && index_in_range (timestamps, since, until, &newest)) {
+        index_result_add (results, path, pathLen, newest);
+    }
+}
+
+static void index_filter (GHashTable* items, const char* prefix, guint64 since, guint64 until, GHashTable* results)
+{
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gpointer value = NULL;
+    const gsize prefixLen = strlen (prefix);
+
+    g_hash_table_iter_init (&iter, items);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        guint64 newest = 0;
+        const gsize pathLen = strlen (key);
+        if (index_prefix_match (key, pathLen, prefix, prefixLen) && index_in_range (value, since, until, &newest)) {
+            index_result_add (results, key, pathLen, newest);
+        }
+    }
+}
+
+/**
+ * path 等于 prefix 或位于其下; prefix 为 "/" 时匹配所有路径
+ */
+static gboolean index_prefix_match (const char* path, gsize pathLen, const char* prefix, gsize prefixLen)
+{
+    if (1 == prefixLen && '/' == prefix[0]) {
+        return TRUE;
+    }
+
+    return pathLen >= prefixLen
+        && 0 == memcmp (path, prefix, prefixLen)
+        && (pathLen == prefixLen || '/' == path[prefixLen]);
+}
+
+static gboolean index_in_range (const guint64 timestamps[3], guint64 since, guint64 until, guint64* newest)
+{
+    gboolean ret = FALSE;
+
+    *newest = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (timestamps[i] > 0 && timestamps[i] >= since && timestamps[i] <= until) {
+            *newest = MAX (*newest, timestamps[i]);
+            ret = TRUE;
+        }
+    }
+
+    return ret;
+}
+
+static void index_result_add (GHashTable* results, const char* path, gsize pathLen, guint64 timestamp)
+{
+    char* key = g_strndup (path, pathLen);
+    guint64* ts = g_hash_table_lookup (results, key);
+
+    if (ts) {
+        *ts = MAX (*ts, timestamp);
+        STR_FREE(key);
+    }
+    else {
+        ts = g_new (guint64, 1);
+        *ts = timestamp;
+        g_hash_table_insert (results, key, ts);
+    }
+}
+
+static gboolean index_meta_check (BackupStore* store, const char* path, guint64 since, guint64 until, guint64* newest)
+{
+    gboolean ret = FALSE;
+    BackupMetaFile meta;
+    char key[BACKUP_KEY_SIZE];
+
+    memset (&meta, 0, sizeof (meta));
+    if (backup_path_key (path, key) && backup_meta_parse (&meta, path, key, store->mountPoint) && 0 == g_strcmp0 (meta.srcFilePath, path)) {
+        guint64 timestamps[3];
+        for (int slot = 1; slot <= 3; ++slot) {
+            timestamps[slot - 1] = *backup_meta_slot_ctx (&meta, slot) ? *backup_meta_slot_timestamp (&meta, slot) : 0;
+        }
+        ret = index_in_range (timestamps, since, until, newest);
+    }
+    backup_meta_free (&meta);
+
+    return ret;
+}
+
+/**
+ * 取得 path 的所有权, 已有的记录被覆盖
+ */
+static void index_items_insert (GHashTable* items, char* path, const guint64 timestamps[3])
+{
+    guint64* ts = g_new (guint64, 3);
+
+    memcpy (ts, timestamps, sizeof (guint64) * 3);
+    g_hash_table_replace (items, path, ts);
+}
+
+static gint index_path_compare (gconstpointer a, gconstpointer b)
+{
+    return strcmp (a, b);
+}
+
+static gint index_time_compare (gconstpointer a, gconstpointer b)
+{
+    const IndexRunTime* ta = a;
+    const IndexRunTime* tb = b;
+
+    if (ta->timestamp != tb->timestamp) {
+        return ta->timestamp < tb->timestamp ? -1 : 1;
+    }
+
+    return (ta->entry > tb->entry) - (ta->entry < tb->entry);
+}
+
+static gboolean index_write_all (int fd, const void* data, gsize len)
+{
+    const guint8* p = data;
+
+    while (len > 0) {
+        const ssize_t writeLen = write (fd, p, len);
+        if (writeLen < 0 && EINTR == errno) { continue; }
+        if (writeLen <= 0) { return FALSE; }
+        p += writeLen;
+        len -= writeLen;
+    }
+
+    return TRUE;
+}
+
+static gboolean index_pread_all (int fd, void* data, gsize len, off_t offset)
+{
+    guint8* p = data;
+
+    while (len > 0) {
+        const ssize_t readLen = pread (fd, p, len, offset);
+        if (readLen < 0 && EINTR == errno) { continue; }
+        if (readLen <= 0) { return FALSE; }
+        p += readLen;
+        offset += readLen;
+        len -= readLen;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,30 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_INDEX_H
+#define gvfs_backup_INDEX_H
+#include "store.h"
+
+G_BEGIN_DECLS
+
+#define INDEX_DIR                       "index"             // <root>/index/run 与 <root>/index/log
+#define INDEX_LOG_MAX                   (1024 * 1024)       // 日志超过此大小后合并到有序文件
+
+typedef struct _BackupIndex BackupIndex;
+
+/**
+ * meta 保存成功后调用, 把源路径与三个版本时间戳追加到索引日志; 日志过大时由后台线程合并到按路径排序的有序文件
+ */
+void        backup_index_put                (BackupStore* store, const char* srcPath, const guint64 timestamps[3]);
+
+/**
+ * 在索引中查找路径等于 prefix 或位于其下、且有版本时间戳落在 [since, until] 内的源文件,
+ * 结果放入 results(源路径 -> 区间内最新的时间戳, guint64*), 仍需调用者用 meta 确认;
+ * 只读打开索引并加共享锁, 仓库只读时也可查询; 索引不存在且无法建立(例如仓库只读)时返回 FALSE
+ */
+gboolean    backup_index_query              (BackupStore* store, const char* prefix, guint64 since, guint64 until, GHashTable* results);
+
+G_END_DECLS
+
+#endif // gvfs_backup_INDEX_H
@@ -0,0 +1,613 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// io_uring 批量 I/O, 直接使用系统调用, 不依赖 liburing; 每个线程一个环, 线程退出时释放
+//
+#define _GNU_SOURCE
+#include "io.h"
+#include "backup.h"
+#include "backup-private.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define IO_ENV                  "ANDSEC_BACKUP_IO"
+#define IO_RING_DEPTH           64
+#define IO_BUF_N                8
+#define IO_BUF_SIZE             (512 * 1024)
+#define IO_SMALL_SIZE           4096                // meta 文件一般远小于此, 更大的单独读取
+#define IO_DRAIN_TRIES          1000
+#define IO_DRAIN_US             1000
+
+typedef enum
+{
+    IO_STATE_UNKNOWN = 0,
+    IO_STATE_OK,
+    IO_STATE_UNAVAILABLE,
+} IoState;
+
+typedef struct _IoRing
+{
+    int                     fd;
+    guint                   sqEntries;
+    guint*                  sqHead;
+    guint*                  sqTail;
+    guint*                  sqMask;
+    guint*                  sqArray;
+    struct io_uring_sqe*    sqes;
+    guint                   pending;            // 已填写未提交的 sqe
+    guint                   reaped;             // 已取走的 cqe 总数, 与 sqHead 之差为内核持有的请求
+
+    guint*                  cqHead;
+    guint*                  cqTail;
+    guint*                  cqMask;
+    struct io_uring_cqe*    cqes;
+
+    void*                   sqPtr;
+    gsize                   sqLen;
+    void*                   cqPtr;
+    gsize                   cqLen;
+    gsize                   sqesLen;
+
+    guint8*                 bufs;               // IO_BUF_N * IO_BUF_SIZE
+    gboolean                fixedBufs;          // 注册失败(如 RLIMIT_MEMLOCK 不足)时使用普通读写
+} IoRing;
+
+typedef struct _IoCopyBuf
+{
+    guint64                 off;
+    guint32                 len;
+    guint32                 filled;             // 已读入的字节数
+    gboolean                writing;
+    gboolean                busy;
+} IoCopyBuf;
+
+static IoRing*              io_ring_get         ();
+static IoRing*              io_ring_new         ();
+static void                 io_ring_free        (gpointer data);
+static void                 io_ring_reset       (IoRing* ring, gboolean closeFds, gboolean* drained/*out*/);
+static gboolean             io_ring_drain       (IoRing* ring, gboolean closeFds);
+static struct io_uring_sqe* io_ring_sqe         (IoRing* ring);
+static gboolean             io_ring_submit      (IoRing* ring, guint waitN);
+static gboolean             io_ring_cqe         (IoRing* ring, guint64* userData, int* res);
+static void                 io_prep_rw          (IoRing* ring, struct io_uring_sqe* sqe, int op, int fd, guint bufIdx, guint32 bufOff, guint32 len, guint64 off, guint64 userData);
+static void                 io_init_from_env    () __attribute__((constructor));
+
+
+static gint                 gsIoEnabled = 0;
+static gint                 gsIoState = IO_STATE_UNKNOWN;
+static GPrivate             gsIoRing = G_PRIVATE_INIT (io_ring_free);
+
+
+void backup_io_set_uring (gboolean enabled)
+{
+    g_atomic_int_set (&gsIoEnabled, enabled ? 1 : 0);
+}
+
+gboolean backup_io_uring_enabled ()
+{
+    return g_atomic_int_get (&gsIoEnabled) && IO_STATE_UNAVAILABLE != g_atomic_int_get (&gsIoState);
+}
+
+/**
+ * 每个缓冲区依次经历 读 -> 写 -> 空闲; 读取不足时续读剩余部分, 直到读满或返回 0, 读到 0 后不再发起新的读
+ */
+gboolean backup_io_copy (int srcFd, int dstFd, guint64* total)
+{
+    g_return_val_if_fail (srcFd >= 0 && dstFd >= 0 && total, FALSE);
+
+    IoRing* ring = io_ring_get();
+    if (!ring) {
+        errno = ENOSYS;
+        return FALSE;
+    }
+
+    IoCopyBuf bufs[IO_BUF_N];
+    memset (bufs, 0, sizeof (bufs));
+
+    const off_t srcStart = lseek (srcFd, 0, SEEK_CUR);
+    const off_t dstStart = lseek (dstFd, 0, SEEK_CUR);
+    if (srcStart < 0 || dstStart < 0) {
+        return FALSE;
+    }
+
+    int err = 0;
+    guint inflight = 0;
+    guint64 readOff = 0;
+    guint64 copied = 0;
+    gboolean eof = FALSE;
+
+    while (TRUE) {
+        for (guint i = 0; i < IO_BUF_N && !eof && 0 == err; ++i) {
+            if (bufs[i].busy) {
+                continue;
+            }
+            struct io_uring_sqe* sqe = io_ring_sqe (ring);
+            if (!sqe) {
+                break;
+            }
+            bufs[i].off = readOff;
+            bufs[i].len = IO_BUF_SIZE;
+            bufs[i].filled = 0;
+            bufs[i].writing = FALSE;
+            bufs[i].busy = TRUE;
+            io_prep_rw (ring, sqe, IORING_OP_READ, srcFd, i, 0, IO_BUF_SIZE, (guint64) srcStart + readOff, i);
+            readOff += IO_BUF_SIZE;
+            inflight++;
+        }
+
+        if (0 == inflight) {
+            break;
+        }
+        if (!io_ring_submit (ring, 1)) {
+            // 只放弃本次调用, 调用者改用同步拷贝; 目标文件中已写入的部分会被覆盖
+            io_ring_reset (ring, FALSE, NULL);
+            errno = ENOSYS;
+            return FALSE;
+        }
+
+        int res = 0;
+        guint64 idx = 0;
+        while (io_ring_cqe (ring, &idx, &res)) {
+            IoCopyBuf* b = &bufs[idx];
+            inflight--;
+            if (res < 0) {
+                err = -res;
+                b->busy = FALSE;
+                continue;
+            }
+            if (!b->writing) {
+                if (0 == res) {
+                    eof = TRUE;
+                }
+                b->filled += (guint32) res;
+                if (0 != err || 0 == b->filled) {
+                    b->busy = FALSE;
+                    continue;
+                }
+                struct io_uring_sqe* sqe = io_ring_sqe (ring);
+                if (!sqe) {
+                    err = EBUSY;
+                    b->busy = FALSE;
+                    continue;
+                }
+                if (res > 0 && b->filled < IO_BUF_SIZE) {
+                    // 读取不足不一定是文件末尾(被信号打断、网络文件系统等), 留下空洞前先续读剩余部分
+                    io_prep_rw (ring, sqe, IORING_OP_READ, srcFd, (guint) idx, b->filled, IO_BUF_SIZE - b->filled, (guint64) srcStart + b->off + b->filled, idx);
+                    inflight++;
+                    continue;
+                }
+                b->len = b->filled;
+                b->writing = TRUE;
+                io_prep_rw (ring, sqe, IORING_OP_WRITE, dstFd, (guint) idx, 0, b->len, (guint64) dstStart + b->off, idx);
+                inflight++;
+            }
+            else {
+                if (res < (int) b->len) {
+                    // 写入不足(磁盘满等), 同步补齐剩余部分
+                    const guint8* data = ring->bufs + idx * IO_BUF_SIZE;
+                    guint32 done = (guint32) res;
+                    while (done < b->len && 0 == err) {
+                        const ssize_t n = pwrite (dstFd, data + done, b->len - done, (off_t) (dstStart + b->off + done));
+                        if (n < 0 && EINTR == errno) {
+                            continue;
+                        }
+                        if (n <= 0) {
+                            err = (n < 0) ? errno : ENOSPC;
+                            break;
+                        }
+                        done += (guint32) n;
+                    }
+                }
+                copied = MAX (copied, b->off + b->len);
+                b->busy = FALSE;
+            }
+        }
+    }
+
+    if (0 != err) {
+        errno = err;
+        return FALSE;
+    }
+
+    lseek (srcFd, srcStart + (off_t) copied, SEEK_SET);
+    lseek (dstFd, dstStart + (off_t) copied, SEEK_SET);
+    *total += copied;
+
+    return TRUE;
+}
+
+/**
+ * 分三步批量完成: 打开全部 -> 读取全部 -> 关闭; 单个请求失败的项同步重试
+ */
+gboolean backup_io_read_files (const char* const* paths, guint n, char** contents, gsize* lens)
+{
+    g_return_val_if_fail (paths && contents && lens && n <= IO_BATCH_N, FALSE);
+
+    IoRing* ring = io_ring_get();
+    if (!ring) {
+        errno = ENOSYS;
+        return FALSE;
+    }
+
+    int fds[IO_BATCH_N];
+    int res = 0;
+    guint64 idx = 0;
+    guint openN = 0;
+    gboolean drained = FALSE;
+
+    for (guint i = 0; i < n; ++i) {
+        fds[i] = -1;
+        contents[i] = NULL;
+        lens[i] = 0;
+        struct io_uring_sqe* sqe = io_ring_sqe (ring);
+        if (!sqe) {
+            fds[i] = -EAGAIN;
+            continue;
+        }
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (guint64) (guintptr) paths[i];
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = i;
+        openN++;
+    }
+    if (openN > 0 && !io_ring_submit (ring, openN)) {
+        // 已被内核取走的 openat 可能打开了文件, 排空时关闭
+        io_ring_reset (ring, TRUE, NULL);
+        errno = ENOSYS;
+        return FALSE;
+    }
+    while (io_ring_cqe (ring, &idx, &res)) {
+        fds[idx] = res;
+    }
+
+    guint readN = 0;
+    for (guint i = 0; i < n; ++i) {
+        if (fds[i] < 0) {
+            // 内核不支持 OPENAT 时返回 -EINVAL, 提交队列已满的项记为 -EAGAIN, 都同步打开; 文件不存在等为其它错误
+            if (-EINVAL == fds[i] || -EAGAIN == fds[i]) {
+                fds[i] = open (paths[i], O_RDONLY | O_CLOEXEC);
+            }
+            if (fds[i] < 0) {
+                continue;
+            }
+        }
+        struct io_uring_sqe* sqe = io_ring_sqe (ring);
+        if (!sqe) {
+            if (!g_file_get_contents (paths[i], &contents[i], &lens[i], NULL)) {
+                contents[i] = NULL;
+                lens[i] = 0;
+            }
+            continue;
+        }
+        contents[i] = g_malloc (IO_SMALL_SIZE);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[i];
+        sqe->addr = (guint64) (guintptr) contents[i];
+        sqe->len = IO_SMALL_SIZE - 1;
+        sqe->off = 0;
+        sqe->user_data = i;
+        readN++;
+    }
+    if (readN > 0 && !io_ring_submit (ring, readN)) {
+        // 读缓冲区在内核完成前不能释放, 无法排空时与环一起泄漏
+        io_ring_reset (ring, FALSE, &drained);
+        for (guint i = 0; i < n; ++i) {
+            if (drained) {
+                STR_FREE(contents[i]);
+            }
+            contents[i] = NULL;
+            if (fds[i] >= 0) { close (fds[i]); }
+        }
+        errno = ENOSYS;
+        return FALSE;
+    }
+    while (io_ring_cqe (ring, &idx, &res)) {
+        if (res >= 0 && res < IO_SMALL_SIZE - 1) {
+            contents[idx][res] = '\0';
+            lens[idx] = (gsize) res;
+        }
+        else {
+            // 文件较大或读取失败, 单独完整读取
+            STR_FREE(contents[idx]);
+            if (!g_file_get_contents (paths[idx], &contents[idx], &lens[idx], NULL)) {
+                contents[idx] = NULL;
+                lens[idx] = 0;
+            }
+        }
+    }
+
+    for (guint i = 0; i < n; ++i) {
+        if (fds[i] >= 0) {
+            close (fds[i]);
+        }
+    }
+
+    return TRUE;
+}
+
+gboolean backup_io_disk_usage (const char* const* paths, guint n, guint64* usage)
+{
+    g_return_val_if_fail (paths && usage && n <= IO_BATCH_N, FALSE);
+
+    IoRing* ring = io_ring_get();
+    if (!ring) {
+        errno = ENOSYS;
+        return FALSE;
+    }
+
+    int res = 0;
+    guint64 idx = 0;
+    guint statN = 0;
+    struct stat statBuf;
+    struct statx stx[IO_BATCH_N];
+
+    for (guint i = 0; i < n; ++i) {
+        usage[i] = G_MAXUINT64;
+        struct io_uring_sqe* sqe = io_ring_sqe (ring);
+        if (!sqe) {
+            if (0 == lstat (paths[i], &statBuf)) {
+                usage[i] = (guint64) statBuf.st_blocks * 512;
+            }
+            continue;
+        }
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (guint64) (guintptr) paths[i];
+        sqe->len = STATX_BLOCKS;
+        sqe->off = (guint64) (guintptr) &stx[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = i;
+        statN++;
+    }
+    if (statN > 0 && !io_ring_submit (ring, statN)) {
+        // stx 在栈上, 必须等内核已取走的请求完成才能返回
+        io_ring_reset (ring, FALSE, NULL);
+        errno = ENOSYS;
+        return FALSE;
+    }
+    while (io_ring_cqe (ring, &idx, &res)) {
+        if (0 == res) {
+            usage[idx] = (guint64) stx[idx].stx_blocks * 512;
+        }
+        else if (-EINVAL == res) {
+            if (0 == lstat (paths[idx], &statBuf)) {
+                usage[idx] = (guint64) statBuf.st_blocks * 512;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static IoRing* io_ring_get ()
+{
+    if (!backup_io_uring_enabled()) {
+        return NULL;
+    }
+
+    IoRing* ring = g_private_get (&gsIoRing);
+    if (!ring) {
+        ring = io_ring_new();
+        if (ring) {
+            g_private_set (&gsIoRing, ring);
+            g_atomic_int_set (&gsIoState, IO_STATE_OK);
+        }
+        else if (ENOSYS == errno || EPERM == errno || EACCES == errno) {
+            // 内核没有 io_uring, 或被 seccomp / io_uring_disabled 禁止, 之后不再尝试
+            g_atomic_int_set (&gsIoState, IO_STATE_UNAVAILABLE);
+        }
+    }
+
+    return ring;
+}
+
+static IoRing* io_ring_new ()
+{
+    struct io_uring_params p;
+    memset (&p, 0, sizeof (p));
+
+    const int fd = (int) syscall (__NR_io_uring_setup, IO_RING_DEPTH, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    IoRing* ring = g_new0 (IoRing, 1);
+    ring->fd = fd;
+    ring->sqEntries = p.sq_entries;
+    ring->sqLen = p.sq_off.array + p.sq_entries * sizeof (guint);
+    ring->cqLen = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    ring->sqesLen = p.sq_entries * sizeof (struct io_uring_sqe);
+
+    do {
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            ring->sqLen = ring->cqLen = MAX (ring->sqLen, ring->cqLen);
+        }
+        ring->sqPtr = mmap (NULL, ring->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        BREAK_IF_FAIL(MAP_FAILED != ring->sqPtr);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            ring->cqPtr = ring->sqPtr;
+        }
+        else {
+            ring->cqPtr = mmap (NULL, ring->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            BREAK_IF_FAIL(MAP_FAILED != ring->cqPtr);
+        }
+        ring->sqes = mmap (NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        BREAK_IF_FAIL(MAP_FAILED != ring->sqes);
+
+        ring->sqHead = (guint*) ((char*) ring->sqPtr + p.sq_off.head);
+        ring->sqTail = (guint*) ((char*) ring->sqPtr + p.sq_off.tail);
+        ring->sqMask = (guint*) ((char*) ring->sqPtr + p.sq_off.ring_mask);
+        ring->sqArray = (guint*) ((char*) ring->sqPtr + p.sq_off.array);
+        ring->cqHead = (guint*) ((char*) ring->cqPtr + p.cq_off.head);
+        ring->cqTail = (guint*) ((char*) ring->cqPtr + p.cq_off.tail);
+        ring->cqMask = (guint*) ((char*) ring->cqPtr + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*) ((char*) ring->cqPtr + p.cq_off.cqes);
+
+        ring->bufs = mmap (NULL, IO_BUF_N * IO_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        BREAK_IF_FAIL(MAP_FAILED != ring->bufs);
+
+        struct iovec iov[IO_BUF_N];
+        for (guint i = 0; i < IO_BUF_N; ++i) {
+            iov[i].iov_base = ring->bufs + i * IO_BUF_SIZE;
+            iov[i].iov_len = IO_BUF_SIZE;
+        }
+        ring->fixedBufs = (0 == syscall (__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, IO_BUF_N));
+
+        return ring;
+    } while (FALSE);
+
+    const int err = errno;
+    io_ring_free (ring);
+    errno = err;
+
+    return NULL;
+}
+
+static void io_ring_free (gpointer data)
+{
+    IoRing* ring = data;
+    if (!ring) {
+        return;
+    }
+
+    if (ring->bufs && MAP_FAILED != (void*) ring->bufs) {
+        munmap (ring->bufs, IO_BUF_N * IO_BUF_SIZE);
+    }
+    if (ring->sqes && MAP_FAILED != (void*) ring->sqes) {
+        munmap (ring->sqes, ring->sqesLen);
+    }
+    if (ring->cqPtr && MAP_FAILED != ring->cqPtr && ring->cqPtr != ring->sqPtr) {
+        munmap (ring->cqPtr, ring->cqLen);
+    }
+    if (ring->sqPtr && MAP_FAILED != ring->sqPtr) {
+        munmap (ring->sqPtr, ring->sqLen);
+    }
+    close (ring->fd);
+    g_free (ring);
+}
+
+/**
+ * 提交失败只影响本线程的这一个环: 排空内核已取走的请求后释放, 下次调用重新创建;
+ * 排空超时说明内核仍可能写缓冲区, 这时只能把环留给内核, 不释放
+ */
+static void io_ring_reset (IoRing* ring, gboolean closeFds, gboolean* drained)
+{
+    const gboolean ok = io_ring_drain (ring, closeFds);
+    if (ok) {
+        g_private_replace (&gsIoRing, NULL);
+    }
+    else {
+        g_private_set (&gsIoRing, NULL);
+    }
+
+    if (drained) {
+        *drained = ok;
+    }
+}
+
+/**
+ * closeFds: 丢弃的是 openat 的结果, 成功打开的描述符需要关闭
+ */
+static gboolean io_ring_drain (IoRing* ring, gboolean closeFds)
+{
+    int res = 0;
+    guint64 userData = 0;
+
+    for (guint i = 0; i < IO_DRAIN_TRIES; ++i) {
+        while (io_ring_cqe (ring, &userData, &res)) {
+            if (closeFds && res >= 0) {
+                close (res);
+            }
+        }
+        const guint inflight = __atomic_load_n (ring->sqHead, __ATOMIC_ACQUIRE) - ring->reaped;
+        if (0 == inflight) {
+            return TRUE;
+        }
+        // 不再提交新请求, 只等待; 等待本身也失败时轮询完成队列
+        if (syscall (__NR_io_uring_enter, ring->fd, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && EINTR != errno) {
+            g_usleep (IO_DRAIN_US);
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * 每个环只在所属线程使用, 生产者只有一个; 与内核之间用 acquire/release 同步
+ */
+static struct io_uring_sqe* io_ring_sqe (IoRing* ring)
+{
+    const guint head = __atomic_load_n (ring->sqHead, __ATOMIC_ACQUIRE);
+    const guint tail = *ring->sqTail + ring->pending;
+    if (tail - head >= ring->sqEntries) {
+        return NULL;
+    }
+
+    const guint idx = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[idx];
+    memset (sqe, 0, sizeof (*sqe));
+    ring->sqArray[idx] = idx;
+    ring->pending++;
+
+    return sqe;
+}
+
+static gboolean io_ring_submit (IoRing* ring, guint waitN)
+{
+    __atomic_store_n (ring->sqTail, *ring->sqTail + ring->pending, __ATOMIC_RELEASE);
+    ring->pending = 0;
+
+    while (TRUE) {
+        // 被信号打断时可能已经提交了一部分, 按内核尚未取走的数量重新提交
+        const guint submitN = *ring->sqTail - __atomic_load_n (ring->sqHead, __ATOMIC_ACQUIRE);
+        const int ret = (int) syscall (__NR_io_uring_enter, ring->fd, submitN, waitN, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            return TRUE;
+        }
+        if (EINTR != errno) {
+            return FALSE;
+        }
+    }
+}
+
+static gboolean io_ring_cqe (IoRing* ring, guint64* userData, int* res)
+{
+    const guint head = *ring->cqHead;
+    if (head == __atomic_load_n (ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return FALSE;
+    }
+
+    const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+    *userData = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n (ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    ring->reaped++;
+
+    return TRUE;
+}
+
+static void io_prep_rw (IoRing* ring, struct io_uring_sqe* sqe, int op, int fd, guint bufIdx, guint32 bufOff, guint32 len, guint64 off, guint64 userData)
+{
+    sqe->opcode = ring->fixedBufs ? (IORING_OP_READ == op ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED) : op;
+    sqe->fd = fd;
+    sqe->addr = (guint64) (guintptr) (ring->bufs + (gsize) bufIdx * IO_BUF_SIZE + bufOff);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = (guint16) bufIdx;
+    sqe->user_data = userData;
+}
+
+static void io_init_from_env ()
+{
+    if (0 == g_strcmp0 (g_getenv (IO_ENV), "uring")) {
+        backup_io_set_uring (TRUE);
+    }
+}
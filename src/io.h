@@ -0,0 +1,37 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_IO_H
+#define gvfs_backup_IO_H
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define IO_BATCH_N                      32                  // 每批提交的文件数
+
+/**
+ * 批量 I/O 引擎: 开启且内核支持 io_uring 时一次提交多个请求, 否则(未开启、内核过旧、被 seccomp 禁止)
+ * 各函数返回 FALSE 并置 errno 为 ENOSYS, 调用者退回原有的同步实现; 某次提交失败也按 ENOSYS 返回,
+ * 只放弃当前线程的环, 下次调用重新创建
+ */
+gboolean    backup_io_uring_enabled         ();
+
+/**
+ * 从两个文件描述符的当前位置开始拷贝到源文件末尾, 多个注册缓冲区的读写同时在途
+ */
+gboolean    backup_io_copy                  (int srcFd, int dstFd, guint64* total/*in, out*/);
+
+/**
+ * 批量读取小文件(meta), contents[i] 为以 '\0' 结尾的内容, 失败为 NULL, 需 g_free
+ */
+gboolean    backup_io_read_files            (const char* const* paths, guint n, char** contents/*out*/, gsize* lens/*out*/);
+
+/**
+ * 批量获取占用的磁盘字节数(st_blocks * 512), 失败的项为 G_MAXUINT64
+ */
+gboolean    backup_io_disk_usage            (const char* const* paths, guint n, guint64* usage/*out*/);
+
+G_END_DECLS
+
+#endif // gvfs_backup_IO_H
@@ -0,0 +1,451 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// andsec-backup:/// 的文件监视: 本进程的写入路径直接通知, 其它进程的修改通过监视 meta 目录得到,
+// 事件按路径合并后每个 rate-limit 周期最多发出一批
+//
+#include "monitor.h"
+#include "store.h"
+#include "backup-private.h"
+
+#define MONITOR_DEPTH_KEY       "andsec-backup-depth"
+#define MONITOR_WAIT_KEY        "andsec-backup-wait"        // 等待出现的仓库目录或 meta/ 的路径
+
+struct _BackupFileMonitor
+{
+    GFileMonitor            parent;
+
+    GFile*                  file;               // 被监视的文件, 为根目录时 path 为 NULL
+    char*                   path;
+    GMainContext*           context;            // 创建者线程的 thread-default main context, 事件在其中发出
+    GPtrArray*              watches;            // 监视 meta 目录(或单个 meta 文件)的本地 GFileMonitor
+    GHashTable*             metaCreated;        // 刚创建、还没有写完的 meta 文件, 只在 context 中访问
+    GSource*                poll;               // 监视数达到上限后定期通知根目录已变化, 只在 context 中访问
+
+    // 以下字段由 gsMonitorLock 保护
+    GHashTable*             pending;            // srcPath -> GFileMonitorEvent
+    gboolean                rescan;             // 有无法确定路径的变化(meta 被删除), 只通知根目录已变化
+    gboolean                scheduled;
+};
+
+static void         backup_file_monitor_init        (BackupFileMonitor* self);
+static void         backup_file_monitor_class_init  (BackupFileMonitorClass* klass);
+static void         backup_file_monitor_finalize    (GObject* object);
+static gboolean     monitor_cancel                  (GFileMonitor* monitor);
+static void         monitor_watch_stores            (BackupFileMonitor* self);
+static void         monitor_watch_dir               (BackupFileMonitor* self, const char* dirPath, int depth);
+static void         monitor_watch_store             (BackupFileMonitor* self, const char* root);
+static void         monitor_wait_for                (BackupFileMonitor* self, const char* dirPath, const char* wanted);
+static void         monitor_wait_changed            (GFileMonitor* local, GFile* file, GFile* other, GFileMonitorEvent event, gpointer data);
+static void         monitor_poll_start              (BackupFileMonitor* self);
+static gboolean     monitor_poll                    (gpointer data);
+static void         monitor_watch_meta              (BackupFileMonitor* self);
+static void         monitor_meta_changed            (GFileMonitor* local, GFile* file, GFile* other, GFileMonitorEvent event, gpointer data);
+static void         monitor_queue_locked            (BackupFileMonitor* self, const char* srcPath, GFileMonitorEvent event);
+static gboolean     monitor_flush                   (gpointer data);
+
+
+G_DEFINE_TYPE (BackupFileMonitor, backup_file_monitor, G_TYPE_FILE_MONITOR);
+
+
+static GMutex       gsMonitorLock;
+static GList*       gsMonitors = NULL;              // 未取消的 BackupFileMonitor*, 不持有引用
+
+
+GFileMonitor* backup_file_monitor_new (GFile* file, gboolean isDir)
+{
+    g_return_val_if_fail (BACKUP_IS_FILE(file), NULL);
+
+    BackupFileMonitor* self = g_object_new (BACKUP_FILE_MONITOR_TYPE, NULL);
+
+    self->file = g_object_ref (file);
+    self->path = isDir ? NULL : g_file_get_path (file);
+    self->context = g_main_context_ref_thread_default ();
+    self->watches = g_ptr_array_new_with_free_func (g_object_unref);
+    self->metaCreated = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    self->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    if (isDir) {
+        monitor_watch_stores (self);
+    }
+    else {
+        monitor_watch_meta (self);
+    }
+
+    g_mutex_lock (&gsMonitorLock);
+    gsMonitors = g_list_prepend (gsMonitors, self);
+    g_mutex_unlock (&gsMonitorLock);
+
+    return G_FILE_MONITOR (self);
+}
+
+void backup_monitor_notify (const char* srcPath, GFileMonitorEvent event)
+{
+    g_return_if_fail (srcPath);
+
+    g_mutex_lock (&gsMonitorLock);
+    for (GList* itr = gsMonitors; itr; itr = itr->next) {
+        BackupFileMonitor* self = itr->data;
+        if (!self->path || 0 == g_strcmp0 (self->path, srcPath)) {
+            monitor_queue_locked (self, srcPath, event);
+        }
+    }
+    g_mutex_unlock (&gsMonitorLock);
+}
+
+static void backup_file_monitor_init (BackupFileMonitor* self)
+{
+
+}
+
+static void backup_file_monitor_class_init (BackupFileMonitorClass* klass)
+{
+    GObjectClass* objClass = G_OBJECT_CLASS (klass);
+    GFileMonitorClass* monitorClass = G_FILE_MONITOR_CLASS (klass);
+
+    objClass->finalize = backup_file_monitor_finalize;
+    monitorClass->cancel = monitor_cancel;
+}
+
+static void backup_file_monitor_finalize (GObject* object)
+{
+    BackupFileMonitor* self = BACKUP_FILE_MONITOR (object);
+
+    STR_FREE(self->path);
+    NOT_NULL_RUN(self->file, g_object_unref);
+    NOT_NULL_RUN(self->watches, g_ptr_array_unref);
+    NOT_NULL_RUN(self->pending, g_hash_table_unref);
+    NOT_NULL_RUN(self->metaCreated, g_hash_table_unref);
+    NOT_NULL_RUN(self->context, g_main_context_unref);
+
+    G_OBJECT_CLASS(backup_file_monitor_parent_class)->finalize(object);
+}
+
+/**
+ * dispose 时也会调用; 之后排队的事件不再发出
+ */
+static gboolean monitor_cancel (GFileMonitor* monitor)
+{
+    BackupFileMonitor* self = BACKUP_FILE_MONITOR (monitor);
+
+    g_mutex_lock (&gsMonitorLock);
+    gsMonitors = g_list_remove (gsMonitors, self);
+    g_hash_table_remove_all (self->pending);
+    g_mutex_unlock (&gsMonitorLock);
+
+    for (guint i = 0; self->watches && i < self->watches->len; ++i) {
+        GFileMonitor* w = g_ptr_array_index (self->watches, i);
+        g_signal_handlers_disconnect_by_data (w, self);
+        g_file_monitor_cancel (w);
+    }
+    if (self->watches) {
+        g_ptr_array_set_size (self->watches, 0);
+    }
+    if (self->poll) {
+        g_source_destroy (self->poll);
+        g_source_unref (self->poll);
+        self->poll = NULL;
+    }
+
+    return TRUE;
+}
+
+static void monitor_watch_stores (BackupFileMonitor* self)
+{
+    GList* mp = get_all_mount_points ();
+    for (GList* itr = mp; itr; itr = itr->next) {
+        BackupStore* store = backup_store_get (itr->data);
+        if (store) {
+            monitor_watch_store (self, store->root);
+        }
+    }
+    NOT_NULL_RUN(mp, g_list_free_full, g_free);
+}
+
+/**
+ * meta/ 已存在时监视它; 否则监视仓库目录(仓库目录也不存在时监视其上一级), 等 meta/ 出现后再监视,
+ * 其它进程在本监视器创建之后才开始的备份也能看到
+ */
+static void monitor_watch_store (BackupFileMonitor* self, const char* root)
+{
+    char* metaDir = g_build_filename (root, "meta", NULL);
+    char* parent = g_path_get_dirname (root);
+
+    if (g_file_test (metaDir, G_FILE_TEST_IS_DIR)) {
+        monitor_watch_dir (self, metaDir, 0);
+    }
+    else if (g_file_test (root, G_FILE_TEST_IS_DIR)) {
+        monitor_wait_for (self, root, metaDir);
+    }
+    else {
+        monitor_wait_for (self, parent, root);
+    }
+
+    STR_FREE(metaDir);
+    STR_FREE(parent);
+}
+
+/**
+ * 监视 dirPath, 其中出现 wanted 目录时调用 monitor_watch_store(); 等待期间不计入 MONITOR_WATCH_MAX
+ */
+static void monitor_wait_for (BackupFileMonitor* self, const char* dirPath, const char* wanted)
+{
+    GFile* dir = g_file_new_for_path (dirPath);
+    GFileMonitor* w = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE, NULL, NULL);
+    g_object_unref (dir);
+    if (!w) {
+        return;
+    }
+    g_object_set_data_full (G_OBJECT (w), MONITOR_WAIT_KEY, g_strdup (wanted), g_free);
+    g_signal_connect (w, "changed", G_CALLBACK (monitor_wait_changed), self);
+    g_ptr_array_add (self->watches, w);
+}
+
+static void monitor_wait_changed (GFileMonitor* local, GFile* file, GFile* other, GFileMonitorEvent event, gpointer data)
+{
+    BackupFileMonitor* self = data;
+    const char* wanted = g_object_get_data (G_OBJECT (local), MONITOR_WAIT_KEY);
+    char* path = g_file_get_path (file);
+
+    if (G_FILE_MONITOR_EVENT_CREATED == event && path && 0 == g_strcmp0 (path, wanted) && g_file_test (path, G_FILE_TEST_IS_DIR)) {
+        // 等到的是 meta/ 时从它开始监视, 是仓库目录时继续等它下面的 meta/; 之前的备份可能已写入, 通知根目录已变化
+        g_signal_handlers_disconnect_by_data (local, self);
+        g_file_monitor_cancel (local);
+        char* root = g_str_has_suffix (path, "/meta") ? g_path_get_dirname (path) : g_strdup (path);
+        monitor_watch_store (self, root);
+        STR_FREE(root);
+        g_ptr_array_remove (self->watches, local);
+
+        g_mutex_lock (&gsMonitorLock);
+        monitor_queue_locked (self, NULL, G_FILE_MONITOR_EVENT_CHANGED);
+        g_mutex_unlock (&gsMonitorLock);
+    }
+
+    STR_FREE(path);
+
+    (void) other;
+}
+
+/**
+ * inotify 不递归, meta/ 下的分层目录逐个监视; 超过 MONITOR_WATCH_MAX 后不再增加,
+ * 这些目录中其它进程的修改无法得知, 改为每 MONITOR_POLL_SEC 秒通知一次根目录已变化
+ */
+static void monitor_watch_dir (BackupFileMonitor* self, const char* dirPath, int depth)
+{
+    if (!g_file_test (dirPath, G_FILE_TEST_IS_DIR)) {
+        return;
+    }
+    if (self->watches->len >= MONITOR_WATCH_MAX) {
+        monitor_poll_start (self);
+        return;
+    }
+
+    GFile* dir = g_file_new_for_path (dirPath);
+    GFileMonitor* w = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE, NULL, NULL);
+    g_object_unref (dir);
+    if (!w) {
+        return;
+    }
+    g_object_set_data (G_OBJECT (w), MONITOR_DEPTH_KEY, GINT_TO_POINTER (depth));
+    g_signal_connect (w, "changed", G_CALLBACK (monitor_meta_changed), self);
+    g_ptr_array_add (self->watches, w);
+
+    if (depth >= STORE_MAX_DEPTH) {
+        return;
+    }
+
+    GDir* d = g_dir_open (dirPath, 0, NULL);
+    const char* name = NULL;
+    while (d && (name = g_dir_read_name (d))) {
+        if (2 == strlen (name)) {
+            char* sub = g_build_filename (dirPath, name, NULL);
+            monitor_watch_dir (self, sub, depth + 1);
+            STR_FREE(sub);
+        }
+    }
+    NOT_NULL_RUN(d, g_dir_close);
+}
+
+static void monitor_watch_meta (BackupFileMonitor* self)
+{
+    char key[BACKUP_KEY_SIZE];
+    char metaPath[STORE_PATH_MAX];
+
+    char* mountPoint = self->path ? get_mount_point_by_path (self->path) : NULL;
+    BackupStore* store = mountPoint ? backup_store_get (mountPoint) : NULL;
+    STR_FREE(mountPoint);
+
+    if (store && backup_path_key (self->path, key) && backup_store_meta_path (store, key, metaPath, sizeof (metaPath))) {
+        GFile* meta = g_file_new_for_path (metaPath);
+        GFileMonitor* w = g_file_monitor_file (meta, G_FILE_MONITOR_NONE, NULL, NULL);
+        g_object_unref (meta);
+        if (w) {
+            g_signal_connect (w, "changed", G_CALLBACK (monitor_meta_changed), self);
+            g_ptr_array_add (self->watches, w);
+        }
+    }
+}
+
+/**
+ * meta 写完(CHANGES_DONE_HINT)后再读取源文件路径; 删除的 meta 已无法读取, 目录监视器只能通知根目录已变化
+ */
+static void monitor_meta_changed (GFileMonitor* local, GFile* file, GFile* other, GFileMonitorEvent event, gpointer data)
+{
+    BackupFileMonitor* self = data;
+    char* metaPath = g_file_get_path (file);
+    if (!metaPath) {
+        return;
+    }
+
+    // 保存 meta 时先写 .<key>.<pid>.<序号> 再改名, 临时文件的创建与改名走(删除)都不是 meta 的变化
+    char* baseName = g_path_get_basename (metaPath);
+    const gboolean isTemp = ('.' == baseName[0]);
+    STR_FREE(baseName);
+    if (isTemp) {
+        STR_FREE(metaPath);
+        return;
+    }
+
+    switch (event) {
+        case G_FILE_MONITOR_EVENT_CREATED: {
+            if (!self->path && g_file_test (metaPath, G_FILE_TEST_IS_DIR)) {
+                monitor_watch_dir (self, metaPath, GPOINTER_TO_INT (g_object_get_data (G_OBJECT (local), MONITOR_DEPTH_KEY)) + 1);
+            }
+            else {
+                g_hash_table_add (self->metaCreated, g_strdup (metaPath));
+            }
+            break;
+        }
+        case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT: {
+            BackupMetaFile meta;
+            gboolean created = g_hash_table_remove (self->metaCreated, metaPath);
+            if (backup_meta_parse_file_path (&meta, metaPath) && meta.srcFilePath) {
+                // 改名到位的 meta 也报为创建, 覆盖已有的 meta 时旧文件没有删除事件; 只有一个版本的才是新文件
+                created = created && (1 == (meta.backupFileCtxMD51 ? 1 : 0) + (meta.backupFileCtxMD52 ? 1 : 0) + (meta.backupFileCtxMD53 ? 1 : 0));
+                g_mutex_lock (&gsMonitorLock);
+                monitor_queue_locked (self, meta.srcFilePath, created ? G_FILE_MONITOR_EVENT_CREATED : G_FILE_MONITOR_EVENT_CHANGED);
+                g_mutex_unlock (&gsMonitorLock);
+            }
+            backup_meta_free (&meta);
+            break;
+        }
+        case G_FILE_MONITOR_EVENT_DELETED: {
+            g_hash_table_remove (self->metaCreated, metaPath);
+            g_mutex_lock (&gsMonitorLock);
+            monitor_queue_locked (self, self->path, G_FILE_MONITOR_EVENT_DELETED);
+            g_mutex_unlock (&gsMonitorLock);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    STR_FREE(metaPath);
+
+    (void) other;
+}
+
+static void monitor_poll_start (BackupFileMonitor* self)
+{
+    if (self->poll) {
+        return;
+    }
+
+    self->poll = g_timeout_source_new_seconds (MONITOR_POLL_SEC);
+    g_source_set_callback (self->poll, monitor_poll, self, NULL);
+    g_source_attach (self->poll, self->context);
+}
+
+/**
+ * 取消时销毁定时器, 因此不持有监视器的引用
+ */
+static gboolean monitor_poll (gpointer data)
+{
+    BackupFileMonitor* self = data;
+
+    g_mutex_lock (&gsMonitorLock);
+    monitor_queue_locked (self, NULL, G_FILE_MONITOR_EVENT_CHANGED);
+    g_mutex_unlock (&gsMonitorLock);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * 同一路径在一个周期内的多个事件合并为一个: 新建后修改仍为新建, 新建后删除则不发出, 删除后新建为修改
+ */
+static void monitor_queue_locked (BackupFileMonitor* self, const char* srcPath, GFileMonitorEvent event)
+{
+    if (!g_list_find (gsMonitors, self)) {
+        return;
+    }
+
+    if (!srcPath) {
+        self->rescan = TRUE;
+    }
+    else {
+        gpointer old = NULL;
+        if (!g_hash_table_lookup_extended (self->pending, srcPath, NULL, &old)) {
+            g_hash_table_insert (self->pending, g_strdup (srcPath), GINT_TO_POINTER (event));
+        }
+        else if (G_FILE_MONITOR_EVENT_CREATED == event) {
+            const GFileMonitorEvent merged = (G_FILE_MONITOR_EVENT_DELETED == GPOINTER_TO_INT (old)) ? G_FILE_MONITOR_EVENT_CHANGED : G_FILE_MONITOR_EVENT_CREATED;
+            g_hash_table_insert (self->pending, g_strdup (srcPath), GINT_TO_POINTER (merged));
+        }
+        else if (G_FILE_MONITOR_EVENT_DELETED == event) {
+            if (G_FILE_MONITOR_EVENT_CREATED == GPOINTER_TO_INT (old)) {
+                g_hash_table_remove (self->pending, srcPath);
+            }
+            else {
+                g_hash_table_insert (self->pending, g_strdup (srcPath), GINT_TO_POINTER (event));
+            }
+        }
+        else if (G_FILE_MONITOR_EVENT_CREATED != GPOINTER_TO_INT (old)) {
+            g_hash_table_insert (self->pending, g_strdup (srcPath), GINT_TO_POINTER (G_FILE_MONITOR_EVENT_CHANGED));
+        }
+    }
+
+    if (!self->scheduled) {
+        gint rateLimit = 0;
+        g_object_get (self, "rate-limit", &rateLimit, NULL);
+        GSource* src = g_timeout_source_new ((guint) MAX (rateLimit, 0));
+        g_source_set_callback (src, monitor_flush, g_object_ref (self), g_object_unref);
+        g_source_attach (src, self->context);
+        g_source_unref (src);
+        self->scheduled = TRUE;
+    }
+}
+
+static gboolean monitor_flush (gpointer data)
+{
+    BackupFileMonitor* self = data;
+
+    g_mutex_lock (&gsMonitorLock);
+    GHashTable* pending = self->pending;
+    const gboolean rescan = self->rescan;
+    self->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    self->rescan = FALSE;
+    self->scheduled = FALSE;
+    g_mutex_unlock (&gsMonitorLock);
+
+    if (!g_file_monitor_is_cancelled (G_FILE_MONITOR (self))) {
+        if (!self->path && (rescan || g_hash_table_size (pending) > MONITOR_BULK_MAX)) {
+            g_file_monitor_emit_event (G_FILE_MONITOR (self), self->file, NULL, G_FILE_MONITOR_EVENT_CHANGED);
+        }
+        else {
+            GHashTableIter iter;
+            gpointer key = NULL;
+            gpointer value = NULL;
+            g_hash_table_iter_init (&iter, pending);
+            while (g_hash_table_iter_next (&iter, &key, &value)) {
+                GFile* child = self->path ? g_object_ref (self->file) : backup_file_new_for_path (key);
+                g_file_monitor_emit_event (G_FILE_MONITOR (self), child, NULL, (GFileMonitorEvent) GPOINTER_TO_INT (value));
+                g_object_unref (child);
+            }
+        }
+    }
+
+    g_hash_table_unref (pending);
+
+    return G_SOURCE_REMOVE;
+}
@@ -0,0 +1,35 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_MONITOR_H
+#define gvfs_backup_MONITOR_H
+#include "backup.h"
+
+G_BEGIN_DECLS
+
+#define MONITOR_BULK_MAX                128                 // 一批事件超过此数时只通知根目录已变化, 由文件管理器重新枚举
+#define MONITOR_WATCH_MAX               1024                // 每个目录监视器最多监视的 meta 目录数
+#define MONITOR_POLL_SEC                30                  // 超过上限有目录未监视时, 每隔这么久通知一次根目录已变化
+
+#define BACKUP_FILE_MONITOR_TYPE                        (backup_file_monitor_get_type())
+#define BACKUP_IS_FILE_MONITOR(k)                       (G_TYPE_CHECK_INSTANCE_TYPE((k), BACKUP_FILE_MONITOR_TYPE))
+#define BACKUP_FILE_MONITOR(k)                          (G_TYPE_CHECK_INSTANCE_CAST((k), BACKUP_FILE_MONITOR_TYPE, BackupFileMonitor))
+
+G_DECLARE_FINAL_TYPE(BackupFileMonitor, backup_file_monitor, BackupFileMonitor, BACKUP_FILE_MONITOR_TYPE, GFileMonitor)
+
+GType                   backup_file_monitor_get_type    (void) G_GNUC_CONST;
+
+/**
+ * file 为根目录时监视所有备份文件, 否则只监视该文件; 事件在调用者线程的 thread-default main context 中发出
+ */
+GFileMonitor*           backup_file_monitor_new         (GFile* file, gboolean isDir);
+
+/**
+ * 本进程的写入路径(备份、恢复、淘汰、巡检标记)调用, 通知所有相关的监视器; 其它进程的修改由监视 meta 目录得到
+ */
+void                    backup_monitor_notify           (const char* srcPath, GFileMonitorEvent event);
+
+G_END_DECLS
+
+#endif // gvfs_backup_MONITOR_H
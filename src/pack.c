@@ -0,0 +1,974 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 小文件包: 小版本顺序追加到 packs/<id>.pack, packs/index 记录内容 MD5 到 (包, 偏移, 长度) 的映射
+//
+#include "pack.h"
+#include "trace.h"
+#include "backup-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define PACK_INDEX_FILE         "index"
+#define PACK_INDEX_TMP          "index.tmp"
+#define PACK_MAGIC              0x314b5041          // "APK1"
+#define PACK_FILE_MAX           (64 * 1024 * 1024)  // 当前包超过此大小后换新包
+#define PACK_GRACE_SEC          3600                // 最后一次写入超过该时间的包才会被压缩
+#define PACK_REPACK_LIVE_PCT    50                  // 仍在使用的数据低于该比例时压缩
+#define PACK_NAME_LEN           32
+
+/**
+ * 包内每条记录: PackRecordHeader + len 字节数据; 索引为 PackIndexRecord 数组, 只追加, 后写入的覆盖先写入的
+ * 多字节字段均为小端
+ */
+typedef struct _PackRecordHeader
+{
+    guint32                 magic;
+    guint32                 len;
+    guint8                  digest[16];
+} PackRecordHeader;
+
+typedef struct _PackIndexRecord
+{
+    guint8                  digest[16];
+    guint32                 packId;
+    guint32                 len;
+    guint64                 offset;             // 数据(记录头之后)在包内的偏移
+} PackIndexRecord;
+
+typedef struct _PackLive
+{
+    GHashTable*             digests;            // 仍被 meta 引用的内容 MD5(hex)
+    gboolean                failed;             // 有 meta 读取失败
+} PackLive;
+
+typedef struct _PackLoc
+{
+    guint32                 packId;
+    guint32                 len;
+    guint64                 offset;
+} PackLoc;
+
+/**
+ * 由 store->packLock 保护; 跨进程的追加与压缩另外对 packs/ 目录加 flock
+ */
+struct _BackupPack
+{
+    int                     dirFd;
+    int                     indexFd;
+    ino_t                   indexIno;           // 压缩后索引整体替换, inode 变化时重新载入
+    guint64                 indexPos;           // 已载入内存的索引长度
+    GHashTable*             locs;               // 内容 MD5(hex) -> PackLoc*
+
+    guint32                 activeId;
+    int                     activeFd;
+    guint64                 unsynced;
+    gint64                  repackTime;
+
+    guint64                 writeSeq;           // 每追加一条记录加一
+    guint64                 syncedSeq;          // 该序号及之前的追加已落盘
+    gboolean                syncing;            // 有线程正在锁外 fdatasync
+    GCond                   syncCond;
+};
+
+static BackupPack*  pack_open                   (BackupStore* store, gboolean create);
+static void         pack_index_refresh          (BackupPack* pack);
+static void         pack_index_insert           (BackupPack* pack, const PackIndexRecord* rec);
+static gboolean     pack_index_rewrite          (BackupPack* pack);
+static const PackLoc* pack_lookup               (BackupPack* pack, const char* hex);
+static gboolean     pack_is_young               (BackupPack* pack, guint32 packId);
+static int          pack_active                 (BackupPack* pack);
+static gboolean     pack_append                 (BackupPack* pack, const guint8 digest[16], const guint8* data, guint32 len);
+static void         pack_sync_locked            (BackupPack* pack);
+static void         pack_sync_wait              (BackupStore* store, BackupPack* pack, guint64 seq);
+static gboolean     pack_pread_record           (int dirFd, const PackLoc* loc, const guint8 digest[16], guint8** data);
+static gboolean     pack_load                   (BackupStore* store, const char* ctxMD5, guint8** data, guint32* len);
+static guint32      pack_scan                   (int dirFd, GArray* old/*nullable*/);
+static void         pack_live_cb                (int dirFd, const char* relPath, const char* name, gpointer data);
+static void         pack_name                   (guint32 packId, char name[PACK_NAME_LEN]);
+static gboolean     pack_digest_from_hex        (const char* hex, guint8 digest[16]);
+static void         pack_digest_to_hex          (const guint8 digest[16], char hex[33]);
+static gboolean     pack_digest_check           (const guint8* data, gsize len, const guint8 digest[16]);
+static gboolean     pack_write_all              (int fd, const void* data, gsize len);
+static gboolean     pack_pread_all              (int fd, void* data, gsize len, off_t offset);
+
+
+guint64 backup_store_repack (const char* mountPoint, GCancellable* cancel)
+{
+    g_return_val_if_fail (mountPoint, 0);
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, 0);
+
+    return backup_pack_repack (store, 0, cancel);
+}
+
+gboolean backup_pack_put (BackupStore* store, const char* srcPath, const char* ctxMD5, guint maxSize, guint64* bytes)
+{
+    g_return_val_if_fail (store && srcPath && ctxMD5, FALSE);
+
+    int fd = -1;
+    guint64 seq = 0;
+    guint64 added = 0;
+    gboolean ret = FALSE;
+    guint8* data = NULL;
+    guint8 digest[16];
+    BackupPack* pack = NULL;
+    struct stat statBuf;
+    BackupTraceSpan span;
+
+    memset (&statBuf, 0, sizeof (statBuf));
+    if (!pack_digest_from_hex (ctxMD5, digest)) {
+        return FALSE;
+    }
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, srcPath);
+
+    do {
+        fd = open (srcPath, O_RDONLY | O_CLOEXEC);
+        BREAK_IF_FAIL(fd >= 0);
+        BREAK_IF_FAIL(0 == fstat (fd, &statBuf) && S_ISREG(statBuf.st_mode) && (guint64) statBuf.st_size <= maxSize);
+
+        data = g_malloc ((gsize) statBuf.st_size + 1);
+        BREAK_IF_FAIL(pack_pread_all (fd, data, (gsize) statBuf.st_size, 0));
+        // 哈希之后文件可能又被修改, 内容与 ctxMD5 不符时交给调用者按普通方式保存
+        BREAK_IF_FAIL(pack_digest_check (data, (gsize) statBuf.st_size, digest));
+
+        g_mutex_lock (&store->packLock);
+        pack = pack_open (store, TRUE);
+        if (pack) {
+            const PackLoc* loc = pack_lookup (pack, ctxMD5);
+            if (loc && pack_is_young (pack, loc->packId)) {
+                ret = TRUE;
+            }
+            else if (0 == flock (pack->dirFd, LOCK_EX)) {
+                ret = pack_append (pack, digest, data, (guint32) statBuf.st_size);
+                if (ret) {
+                    added = sizeof (PackRecordHeader) + (guint64) statBuf.st_size;
+                }
+                flock (pack->dirFd, LOCK_UN);
+            }
+            seq = pack->writeSeq;
+        }
+        g_mutex_unlock (&store->packLock);
+
+        // 引用记录的 meta 保存之前记录必须已落盘; 复用的记录也可能是本进程刚追加还未落盘的
+        if (ret) {
+            pack_sync_wait (store, pack, seq);
+        }
+    } while (FALSE);
+
+    if (added > 0) {
+        backup_store_usage_add (store, (gint64) added);
+    }
+    if (bytes) {
+        *bytes = ret ? (guint64) statBuf.st_size : 0;
+    }
+
+    TRACE_END(span, ret ? (guint64) statBuf.st_size : 0);
+
+    if (fd >= 0) { close (fd); }
+    STR_FREE(data);
+
+    return ret;
+}
+
+gboolean backup_pack_contains (BackupStore* store, const char* ctxMD5)
+{
+    g_return_val_if_fail (store && ctxMD5, FALSE);
+
+    g_mutex_lock (&store->packLock);
+    BackupPack* pack = pack_open (store, FALSE);
+    const gboolean ret = pack && pack_lookup (pack, ctxMD5);
+    g_mutex_unlock (&store->packLock);
+
+    return ret;
+}
+
+guint64 backup_pack_size (BackupStore* store, const char* ctxMD5)
+{
+    g_return_val_if_fail (store && ctxMD5, 0);
+
+    g_mutex_lock (&store->packLock);
+    BackupPack* pack = pack_open (store, FALSE);
+    const PackLoc* loc = pack ? pack_lookup (pack, ctxMD5) : NULL;
+    const guint64 ret = loc ? sizeof (PackRecordHeader) + loc->len : 0;
+    g_mutex_unlock (&store->packLock);
+
+    return ret;
+}
+
+void backup_pack_ref (BackupStore* store, GHashTable* refs, const char* ctxMD5)
+{
+    g_return_if_fail (store && refs && ctxMD5);
+
+    g_mutex_lock (&store->packLock);
+    const gboolean packed = store->pack && g_hash_table_contains (store->pack->locs, ctxMD5);
+    g_mutex_unlock (&store->packLock);
+
+    if (packed) {
+        const guint n = GPOINTER_TO_UINT (g_hash_table_lookup (refs, ctxMD5));
+        g_hash_table_insert (refs, g_strdup (ctxMD5), GUINT_TO_POINTER (n + 1));
+    }
+}
+
+int backup_pack_locate (BackupStore* store, const char* ctxMD5, guint64* offset, guint32* len)
+{
+    g_return_val_if_fail (store && ctxMD5 && offset && len, -1);
+
+    int fd = -1;
+    char name[PACK_NAME_LEN];
+
+    g_mutex_lock (&store->packLock);
+    BackupPack* pack = pack_open (store, FALSE);
+    const PackLoc* loc = pack ? pack_lookup (pack, ctxMD5) : NULL;
+    if (loc) {
+        pack_name (loc->packId, name);
+        *offset = loc->offset;
+        *len = loc->len;
+        fd = openat (pack->dirFd, name, O_RDONLY | O_CLOEXEC);
+    }
+    g_mutex_unlock (&store->packLock);
+
+    return fd;
+}
+
+gboolean backup_pack_read (BackupStore* store, const char* ctxMD5, const char* dstPath, guint64* bytes)
+{
+    g_return_val_if_fail (store && ctxMD5 && dstPath, FALSE);
+
+    int fd = -1;
+    guint32 len = 0;
+    gboolean ret = FALSE;
+    char* tmpPath = NULL;
+    guint8* data = NULL;
+    BackupTraceSpan span;
+
+    TRACE_BEGIN(span, BACKUP_TRACE_COPY, dstPath);
+
+    do {
+        BREAK_IF_FAIL(pack_load (store, ctxMD5, &data, &len));
+
+        tmpPath = g_strdup_printf ("%s.XXXXXX", dstPath);
+        fd = g_mkstemp (tmpPath);
+        BREAK_IF_FAIL(fd >= 0);
+        // 临时文件为 0600, 没有 <key>-N.pack 的旧版本至少恢复为普通文件的权限, 有时由调用者再按它设置
+        BREAK_IF_FAIL(0 == fchmod (fd, 0644));
+        BREAK_IF_FAIL(pack_write_all (fd, data, len));
+        BREAK_IF_FAIL(0 == fsync (fd));
+
+        close (fd);
+        fd = -1;
+        BREAK_IF_FAIL(0 == rename (tmpPath, dstPath));
+        ret = TRUE;
+    } while (FALSE);
+
+    if (fd >= 0) {
+        close (fd);
+    }
+    if (!ret && tmpPath) {
+        remove (tmpPath);
+    }
+    if (bytes) {
+        *bytes = ret ? len : 0;
+    }
+
+    TRACE_END(span, ret ? len : 0);
+
+    STR_FREE(tmpPath);
+    STR_FREE(data);
+
+    return ret;
+}
+
+gboolean backup_pack_verify (BackupStore* store, const char* ctxMD5, guint64* bytes)
+{
+    g_return_val_if_fail (store && ctxMD5, FALSE);
+
+    guint32 len = 0;
+    guint8* data = NULL;
+
+    const gboolean ret = pack_load (store, ctxMD5, &data, &len);
+    if (bytes) {
+        *bytes = len;
+    }
+    STR_FREE(data);
+
+    return ret;
+}
+
+void backup_pack_sync (BackupStore* store)
+{
+    g_return_if_fail (store);
+
+    g_mutex_lock (&store->packLock);
+    if (store->pack && store->pack->unsynced > 0) {
+        pack_sync_locked (store->pack);
+    }
+    g_mutex_unlock (&store->packLock);
+}
+
+/**
+ * 先不加锁扫描 meta 得到所有仍被引用的内容 MD5, 再持锁把旧包中仍在使用的记录追加到当前包, 重写索引后删除旧包
+ * 备份复用已有记录只发生在最近写过的包上(见 pack_is_young), 因此扫描期间新增的引用不会落在被压缩的包里
+ */
+guint64 backup_pack_repack (BackupStore* store, guint minIntervalSec, GCancellable* cancel)
+{
+    g_return_val_if_fail (store, 0);
+
+    guint64 freed = 0;
+    guint64 added = 0;
+    PackLive liveSet = { NULL, FALSE };
+    GHashTable* live = NULL;
+    GArray* old = g_array_new (FALSE, FALSE, sizeof (guint32));
+    GArray* removed = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+    do {
+        g_mutex_lock (&store->packLock);
+        BackupPack* pack = pack_open (store, FALSE);
+        const gint64 now = g_get_monotonic_time();
+        gboolean due = pack && (0 == pack->repackTime || now - pack->repackTime >= (gint64) minIntervalSec * G_USEC_PER_SEC);
+        if (due) {
+            pack->repackTime = now;
+            pack_scan (pack->dirFd, old);
+        }
+        g_mutex_unlock (&store->packLock);
+        BREAK_IF_FAIL(due && old->len > 0);
+
+        live = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        liveSet.digests = live;
+        backup_store_walk (store, "meta", pack_live_cb, &liveSet);
+        BREAK_IF_FAIL(!liveSet.failed && !g_cancellable_is_cancelled (cancel));
+
+        g_mutex_lock (&store->packLock);
+        if (0 == flock (pack->dirFd, LOCK_EX)) {
+            pack_index_refresh (pack);
+            // 本进程的当前包可能已是旧包, 关闭后搬移只写入编号最大的包, 它不在压缩之列
+            if (pack->activeFd >= 0) {
+                pack_sync_locked (pack);
+                close (pack->activeFd);
+                pack->activeFd = -1;
+            }
+            for (guint i = 0; i < old->len && !g_cancellable_is_cancelled (cancel); ++i) {
+                const guint32 packId = g_array_index (old, guint32, i);
+                char name[PACK_NAME_LEN];
+                struct stat statBuf;
+
+                // 加锁前的扫描结果可能已过时, 重新确认仍是足够旧的包
+                pack_name (packId, name);
+                if (0 != fstatat (pack->dirFd, name, &statBuf, 0) || time (NULL) - statBuf.st_mtime < PACK_GRACE_SEC) {
+                    continue;
+                }
+
+                guint64 liveBytes = 0;
+                GHashTableIter iter;
+                gpointer key = NULL;
+                gpointer value = NULL;
+                g_hash_table_iter_init (&iter, pack->locs);
+                while (g_hash_table_iter_next (&iter, &key, &value)) {
+                    const PackLoc* loc = value;
+                    if (loc->packId == packId && g_hash_table_contains (live, key)) {
+                        liveBytes += sizeof (PackRecordHeader) + loc->len;
+                    }
+                }
+                if (liveBytes * 100 > (guint64) statBuf.st_size * PACK_REPACK_LIVE_PCT) {
+                    continue;
+                }
+
+                // 先收集再搬移, 追加会改写 locs
+                GPtrArray* moves = g_ptr_array_new_with_free_func (g_free);
+                g_hash_table_iter_init (&iter, pack->locs);
+                while (g_hash_table_iter_next (&iter, &key, &value)) {
+                    if (((const PackLoc*) value)->packId == packId) {
+                        g_ptr_array_add (moves, g_strdup (key));
+                    }
+                }
+                gboolean failed = FALSE;
+                for (guint j = 0; j < moves->len && !failed; ++j) {
+                    const char* hex = g_ptr_array_index (moves, j);
+                    const PackLoc* found = g_hash_table_lookup (pack->locs, hex);
+                    if (!found) {
+                        continue;
+                    }
+                    const PackLoc loc = *found;
+                    guint8 digest[16];
+                    guint8* data = NULL;
+                    if (!g_hash_table_contains (live, hex)) {
+                        g_hash_table_remove (pack->locs, hex);
+                    }
+                    else if (pack_digest_from_hex (hex, digest) && pack_pread_record (pack->dirFd, &loc, digest, &data)) {
+                        // 损坏的记录不再搬移, 由巡检标记对应版本
+                        failed = !pack_append (pack, digest, data, loc.len);
+                        added += failed ? 0 : sizeof (PackRecordHeader) + loc.len;
+                    }
+                    else {
+                        g_hash_table_remove (pack->locs, hex);
+                    }
+                    STR_FREE(data);
+                }
+                g_ptr_array_unref (moves);
+                if (failed) {
+                    break;
+                }
+                g_array_append_val (removed, packId);
+                freed += (guint64) statBuf.st_blocks * 512;
+            }
+
+            // 搬移的数据与新索引落盘后才能删除旧包
+            if (removed->len > 0) {
+                pack_sync_locked (pack);
+                if (pack_index_rewrite (pack)) {
+                    for (guint i = 0; i < removed->len; ++i) {
+                        char name[PACK_NAME_LEN];
+                        pack_name (g_array_index (removed, guint32, i), name);
+                        unlinkat (pack->dirFd, name, 0);
+                    }
+                }
+                else {
+                    freed = 0;
+                }
+            }
+            flock (pack->dirFd, LOCK_UN);
+        }
+        g_mutex_unlock (&store->packLock);
+    } while (FALSE);
+
+    backup_store_usage_add (store, (gint64) added - (gint64) freed);
+
+    NOT_NULL_RUN(live, g_hash_table_unref);
+    NOT_NULL_RUN(old, g_array_unref);
+    NOT_NULL_RUN(removed, g_array_unref);
+
+    return (freed > added) ? freed - added : 0;
+}
+
+/**
+ * 调用者持有 store->packLock; 状态创建后不释放, packs/ 还不存在且 create 为 FALSE 时返回 NULL
+ */
+static BackupPack* pack_open (BackupStore* store, gboolean create)
+{
+    if (store->pack) {
+        return store->pack;
+    }
+
+    BackupPack* pack = NULL;
+    const int rootFd = backup_store_root_fd (store);
+
+    do {
+        BREAK_IF_FAIL(rootFd >= 0);
+        if (create) {
+            mkdirat (rootFd, PACK_DIR, 0755);
+        }
+        const int dirFd = openat (rootFd, PACK_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        BREAK_IF_FAIL(dirFd >= 0);
+
+        const int indexFd = openat (dirFd, PACK_INDEX_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (indexFd >= 0) {
+            close (indexFd);
+        }
+
+        pack = g_new0 (BackupPack, 1);
+        pack->dirFd = dirFd;
+        pack->indexFd = -1;
+        pack->activeFd = -1;
+        pack->locs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        g_cond_init (&pack->syncCond);
+        pack_index_refresh (pack);
+        store->pack = pack;
+    } while (FALSE);
+
+    return pack;
+}
+
+/**
+ * 读入其它进程(或压缩)新追加的索引记录; 索引被整体替换时丢弃内存中的映射重新载入
+ */
+static void pack_index_refresh (BackupPack* pack)
+{
+    struct stat statBuf;
+
+    if (0 == fstatat (pack->dirFd, PACK_INDEX_FILE, &statBuf, 0) && statBuf.st_ino != pack->indexIno) {
+        const int fd = openat (pack->dirFd, PACK_INDEX_FILE, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (fd >= 0) {
+            if (pack->indexFd >= 0) {
+                close (pack->indexFd);
+            }
+            pack->indexFd = fd;
+            pack->indexIno = statBuf.st_ino;
+            pack->indexPos = 0;
+            g_hash_table_remove_all (pack->locs);
+        }
+    }
+    if (pack->indexFd < 0) {
+        return;
+    }
+
+    PackIndexRecord recs[256];
+    ssize_t readLen = 0;
+    while ((readLen = pread (pack->indexFd, recs, sizeof (recs), (off_t) pack->indexPos)) > 0 || (readLen < 0 && EINTR == errno)) {
+        // 只消费完整的记录, 半条记录留到下次
+        const gsize n = (gsize) MAX (readLen, 0) / sizeof (PackIndexRecord);
+        for (gsize i = 0; i < n; ++i) {
+            pack_index_insert (pack, &recs[i]);
+        }
+        pack->indexPos += n * sizeof (PackIndexRecord);
+        if (readLen > 0 && (gsize) readLen < sizeof (recs)) {
+            break;
+        }
+    }
+}
+
+static void pack_index_insert (BackupPack* pack, const PackIndexRecord* rec)
+{
+    char hex[33];
+    PackLoc* loc = g_new0 (PackLoc, 1);
+
+    loc->packId = GUINT32_FROM_LE (rec->packId);
+    loc->len = GUINT32_FROM_LE (rec->len);
+    loc->offset = GUINT64_FROM_LE (rec->offset);
+    pack_digest_to_hex (rec->digest, hex);
+    g_hash_table_insert (pack->locs, g_strdup (hex), loc);
+}
+
+/**
+ * 调用者持有 flock; 用内存中的映射生成新索引替换旧索引, 其它进程发现 inode 变化后重新载入
+ */
+static gboolean pack_index_rewrite (BackupPack* pack)
+{
+    gboolean ret = FALSE;
+    GByteArray* buf = g_byte_array_new ();
+
+    GHashTableIter iter;
+    gpointer key = NULL;
+    gpointer value = NULL;
+    g_hash_table_iter_init (&iter, pack->locs);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        const PackLoc* loc = value;
+        PackIndexRecord rec;
+        if (pack_digest_from_hex (key, rec.digest)) {
+            rec.packId = GUINT32_TO_LE (loc->packId);
+            rec.len = GUINT32_TO_LE (loc->len);
+            rec.offset = GUINT64_TO_LE (loc->offset);
+            g_byte_array_append (buf, (const guint8*) &rec, sizeof (rec));
+        }
+    }
+
+    const int fd = openat (pack->dirFd, PACK_INDEX_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        ret = pack_write_all (fd, buf->data, buf->len) && 0 == fdatasync (fd);
+        close (fd);
+        ret = ret && 0 == renameat (pack->dirFd, PACK_INDEX_TMP, pack->dirFd, PACK_INDEX_FILE);
+        if (!ret) {
+            unlinkat (pack->dirFd, PACK_INDEX_TMP, 0);
+        }
+    }
+    if (ret) {
+        pack_index_refresh (pack);
+    }
+
+    g_byte_array_unref (buf);
+
+    return ret;
+}
+
+static const PackLoc* pack_lookup (BackupPack* pack, const char* hex)
+{
+    const PackLoc* loc = g_hash_table_lookup (pack->locs, hex);
+    if (!loc) {
+        pack_index_refresh (pack);
+        loc = g_hash_table_lookup (pack->locs, hex);
+    }
+
+    return loc;
+}
+
+/**
+ * 只复用最近写过的包中的记录: 压缩只处理 PACK_GRACE_SEC 内没有写入的包, 留出足够时间让复用它的备份保存 meta
+ */
+static gboolean pack_is_young (BackupPack* pack, guint32 packId)
+{
+    char name[PACK_NAME_LEN];
+    struct stat statBuf;
+
+    pack_name (packId, name);
+
+    return 0 == fstatat (pack->dirFd, name, &statBuf, 0) && time (NULL) - statBuf.st_mtime < PACK_GRACE_SEC / 2;
+}
+
+/**
+ * 调用者持有 flock; 编号最大的包永远不会被压缩删除, 编号因此不会重复使用
+ */
+static int pack_active (BackupPack* pack)
+{
+    struct stat statBuf;
+
+    if (pack->activeFd >= 0) {
+        if (0 == fstat (pack->activeFd, &statBuf) && statBuf.st_nlink > 0 && statBuf.st_size < PACK_FILE_MAX) {
+            return pack->activeFd;
+        }
+        pack_sync_locked (pack);
+        close (pack->activeFd);
+        pack->activeFd = -1;
+    }
+
+    guint32 packId = MAX (pack_scan (pack->dirFd, NULL), 1);
+    for (int i = 0; i < 16; ++i, ++packId) {
+        char name[PACK_NAME_LEN];
+        pack_name (packId, name);
+        const int fd = openat (pack->dirFd, name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            break;
+        }
+        if (0 == fstat (fd, &statBuf) && statBuf.st_size < PACK_FILE_MAX) {
+            pack->activeId = packId;
+            pack->activeFd = fd;
+            break;
+        }
+        close (fd);
+    }
+
+    return pack->activeFd;
+}
+
+/**
+ * 调用者持有 store->packLock 与 flock; 先读完索引尾部, 之后追加的记录直接计入 indexPos
+ */
+static gboolean pack_append (BackupPack* pack, const guint8 digest[16], const guint8* data, guint32 len)
+{
+    struct stat statBuf;
+
+    pack_index_refresh (pack);
+
+    const int fd = pack_active (pack);
+    if (fd < 0 || pack->indexFd < 0 || 0 != fstat (fd, &statBuf)) {
+        return FALSE;
+    }
+
+    PackRecordHeader header;
+    header.magic = GUINT32_TO_LE (PACK_MAGIC);
+    header.len = GUINT32_TO_LE (len);
+    memcpy (header.digest, digest, 16);
+
+    struct iovec iov[2] = {
+        { &header, sizeof (header) },
+        { (void*) data, len },
+    };
+    const ssize_t total = (ssize_t) (sizeof (header) + len);
+    ssize_t writeLen = 0;
+    do {
+        writeLen = writev (fd, iov, 2);
+    } while (writeLen < 0 && EINTR == errno);
+    if (writeLen != total) {
+        // 记录按索引中的偏移定位, 残留的半条记录不影响读取, 只是尽量截掉, 截不掉时由压缩回收
+        if (0 != ftruncate (fd, statBuf.st_size)) {
+            pack->unsynced += (guint64) MAX (writeLen, 0);
+        }
+        return FALSE;
+    }
+
+    PackIndexRecord rec;
+    memcpy (rec.digest, digest, 16);
+    rec.packId = GUINT32_TO_LE (pack->activeId);
+    rec.len = GUINT32_TO_LE (len);
+    rec.offset = GUINT64_TO_LE ((guint64) statBuf.st_size + sizeof (header));
+    if (!pack_write_all (pack->indexFd, &rec, sizeof (rec))) {
+        return FALSE;
+    }
+    pack->indexPos += sizeof (rec);
+    pack_index_insert (pack, &rec);
+
+    pack->unsynced += (guint64) total + sizeof (rec);
+    pack->writeSeq++;
+
+    return TRUE;
+}
+
+static void pack_sync_locked (BackupPack* pack)
+{
+    if (pack->activeFd >= 0) {
+        fdatasync (pack->activeFd);
+    }
+    if (pack->indexFd >= 0) {
+        fdatasync (pack->indexFd);
+    }
+    pack->unsynced = 0;
+    pack->syncedSeq = pack->writeSeq;
+    g_cond_broadcast (&pack->syncCond);
+}
+
+/**
+ * 组提交: 等待序号 seq 及之前的追加落盘. 同一时刻只有一个线程在锁外 fdatasync, 它覆盖开始时已追加的全部记录;
+ * 其余线程等它结束, 序号已被覆盖时直接返回, 否则由其中一个接着同步下一批
+ */
+static void pack_sync_wait (BackupStore* store, BackupPack* pack, guint64 seq)
+{
+    g_mutex_lock (&store->packLock);
+    while (pack->syncedSeq < seq) {
+        if (pack->syncing) {
+            g_cond_wait (&pack->syncCond, &store->packLock);
+            continue;
+        }
+
+        // 换包或压缩可能在锁外同步期间关闭当前的 fd, 同步用复制出的 fd
+        const guint64 target = pack->writeSeq;
+        const int dataFd = (pack->activeFd >= 0) ? dup (pack->activeFd) : -1;
+        const int indexFd = (pack->indexFd >= 0) ? dup (pack->indexFd) : -1;
+        pack->syncing = TRUE;
+        g_mutex_unlock (&store->packLock);
+
+        if (dataFd >= 0) {
+            fdatasync (dataFd);
+            close (dataFd);
+        }
+        if (indexFd >= 0) {
+            fdatasync (indexFd);
+            close (indexFd);
+        }
+
+        g_mutex_lock (&store->packLock);
+        pack->syncing = FALSE;
+        pack->syncedSeq = MAX (pack->syncedSeq, target);
+        if (pack->syncedSeq == pack->writeSeq) {
+            pack->unsynced = 0;
+        }
+        g_cond_broadcast (&pack->syncCond);
+    }
+    g_mutex_unlock (&store->packLock);
+}
+
+/**
+ * 读出一条记录并校验记录头与内容 MD5, 成功时 *data 由调用者释放
+ */
+static gboolean pack_pread_record (int dirFd, const PackLoc* loc, const guint8 digest[16], guint8** data)
+{
+    gboolean ret = FALSE;
+    char name[PACK_NAME_LEN];
+    PackRecordHeader header;
+    guint8* buf = NULL;
+
+    if (loc->offset < sizeof (header)) {
+        return FALSE;
+    }
+
+    pack_name (loc->packId, name);
+    const int fd = openat (dirFd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    do {
+        BREAK_IF_FAIL(pack_pread_all (fd, &header, sizeof (header), (off_t) (loc->offset - sizeof (header))));
+        BREAK_IF_FAIL(PACK_MAGIC == GUINT32_FROM_LE (header.magic) && loc->len == GUINT32_FROM_LE (header.len));
+        BREAK_IF_FAIL(0 == memcmp (header.digest, digest, 16));
+
+        buf = g_malloc ((gsize) loc->len + 1);
+        BREAK_IF_FAIL(pack_pread_all (fd, buf, loc->len, (off_t) loc->offset));
+        BREAK_IF_FAIL(pack_digest_check (buf, loc->len, digest));
+
+        *data = buf;
+        buf = NULL;
+        ret = TRUE;
+    } while (FALSE);
+
+    close (fd);
+    STR_FREE(buf);
+
+    return ret;
+}
+
+/**
+ * 包可能刚被其它进程压缩删除, 第一次读取失败时重新载入索引再试一次
+ */
+static gboolean pack_load (BackupStore* store, const char* ctxMD5, guint8** data, guint32* len)
+{
+    guint8 digest[16];
+
+    *data = NULL;
+    *len = 0;
+    if (!pack_digest_from_hex (ctxMD5, digest)) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        PackLoc loc;
+        int dirFd = -1;
+
+        g_mutex_lock (&store->packLock);
+        BackupPack* pack = pack_open (store, FALSE);
+        if (pack) {
+            if (i > 0) {
+                pack_index_refresh (pack);
+            }
+            const PackLoc* found = pack_lookup (pack, ctxMD5);
+            if (found) {
+                loc = *found;
+                dirFd = pack->dirFd;
+            }
+        }
+        g_mutex_unlock (&store->packLock);
+
+        if (dirFd < 0) {
+            return FALSE;
+        }
+        if (pack_pread_record (dirFd, &loc, digest, data)) {
+            *len = loc.len;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * 返回最大的包编号(没有包时为 0); old 非空时收集最后写入已超过 PACK_GRACE_SEC 的包, 不含编号最大的包
+ */
+static guint32 pack_scan (int dirFd, GArray* old)
+{
+    guint32 maxId = 0;
+    const time_t now = time (NULL);
+
+    const int fd = openat (dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* d = (fd >= 0) ? fdopendir (fd) : NULL;
+    if (!d) {
+        if (fd >= 0) { close (fd); }
+        return 0;
+    }
+
+    struct dirent* ent = NULL;
+    while (NULL != (ent = readdir (d))) {
+        const char* name = ent->d_name;
+        char* end = NULL;
+        if (!g_ascii_isxdigit (name[0]) || !g_str_has_suffix (name, ".pack")) {
+            continue;
+        }
+        const guint64 packId = g_ascii_strtoull (name, &end, 16);
+        if (0 != g_strcmp0 (end, ".pack") || 0 == packId || packId > G_MAXUINT32) {
+            continue;
+        }
+        maxId = MAX (maxId, (guint32) packId);
+
+        struct stat statBuf;
+        if (old && 0 == fstatat (dirfd (d), name, &statBuf, 0) && now - statBuf.st_mtime >= PACK_GRACE_SEC) {
+            const guint32 id = (guint32) packId;
+            g_array_append_val (old, id);
+        }
+    }
+    closedir (d);
+
+    if (old) {
+        for (guint i = 0; i < old->len; ++i) {
+            if (g_array_index (old, guint32, i) == maxId) {
+                g_array_remove_index_fast (old, i);
+                break;
+            }
+        }
+    }
+
+    return maxId;
+}
+
+/**
+ * 被标记为损坏的版本不再保留其记录
+ */
+static void pack_live_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    PackLive* live = data;
+    BackupMetaFile meta;
+
+    if (backup_meta_parse_at (&meta, dirFd, name)) {
+        for (int slot = 1; slot <= 3; ++slot) {
+            if (backup_meta_slot_good (&meta, slot)) {
+                g_hash_table_add (live->digests, g_strdup (*backup_meta_slot_ctx (&meta, slot)));
+            }
+        }
+    }
+    else if (EINVAL != errno) {
+        // 读不出的 meta 可能引用包中的记录, 引用集合不完整时放弃本次压缩
+        live->failed = TRUE;
+    }
+    backup_meta_free (&meta);
+
+    (void) relPath;
+}
+
+static void pack_name (guint32 packId, char name[PACK_NAME_LEN])
+{
+    g_snprintf (name, PACK_NAME_LEN, "%08x.pack", packId);
+}
+
+static gboolean pack_digest_from_hex (const char* hex, guint8 digest[16])
+{
+    for (int i = 0; i < 16; ++i) {
+        const int hi = g_ascii_xdigit_value (hex[2 * i]);
+        const int lo = (hi >= 0) ? g_ascii_xdigit_value (hex[2 * i + 1]) : -1;
+        if (lo < 0) {
+            return FALSE;
+        }
+        digest[i] = (guint8) ((hi << 4) | lo);
+    }
+
+    return '\0' == hex[32];
+}
+
+static void pack_digest_to_hex (const guint8 digest[16], char hex[33])
+{
+    static const char tab[] = "0123456789abcdef";
+
+    for (int i = 0; i < 16; ++i) {
+        hex[2 * i] = tab[digest[i] >> 4];
+        hex[2 * i + 1] = tab[digest[i] & 0x0F];
+    }
+    hex[32] = '\0';
+}
+
+static gboolean pack_digest_check (const guint8* data, gsize len, const guint8 digest[16])
+{
+    guint8 actual[16];
+    gsize actualLen = sizeof (actual);
+
+    GChecksum* cs = g_checksum_new (G_CHECKSUM_MD5);
+    g_checksum_update (cs, data, (gssize) len);
+    g_checksum_get_digest (cs, actual, &actualLen);
+    g_checksum_free (cs);
+
+    return 0 == memcmp (actual, digest, 16);
+}
+
+static gboolean pack_write_all (int fd, const void* data, gsize len)
+{
+    const guint8* p = data;
+
+    while (len > 0) {
+        const ssize_t writeLen = write (fd, p, len);
+        if (writeLen < 0 && EINTR == errno) { continue; }
+        if (writeLen <= 0) { return FALSE; }
+        p += writeLen;
+        len -= writeLen;
+    }
+
+    return TRUE;
+}
+
+static gboolean pack_pread_all (int fd, void* data, gsize len, off_t offset)
+{
+    guint8* p = data;
+
+    while (len > 0) {
+        const ssize_t readLen = pread (fd, p, len, offset);
+        if (readLen < 0 && EINTR == errno) { continue; }
+        if (readLen <= 0) { return FALSE; }
+        p += readLen;
+        offset += readLen;
+        len -= readLen;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,60 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_PACK_H
+#define gvfs_backup_PACK_H
+#include "store.h"
+
+G_BEGIN_DECLS
+
+#define PACK_DIR                        "packs"             // <root>/packs/<id>.pack 与 <root>/packs/index
+#define PACK_BLOB_MAX                   (1024 * 1024)       // 可以写入包的最大版本
+#define PACK_STUB_SUFFIX                ".pack"             // 包中版本以空文件 <key>-N.pack 保存源文件的权限、属主与时间
+
+typedef struct _BackupPack BackupPack;
+
+/**
+ * 小文件版本追加到挂载点共享的包文件, 按内容 MD5(即 meta 中的版本 MD5)索引, 不再占用 <key>-N;
+ * 内容与 ctxMD5 不符(读取时已被修改)或大于 maxSize 时返回 FALSE, 调用者按普通方式保存;
+ * 返回 TRUE 时记录已落盘, 调用者随后可以保存引用它的 meta
+ */
+gboolean    backup_pack_put                 (BackupStore* store, const char* srcPath, const char* ctxMD5, guint maxSize, guint64* bytes/*out, nullable*/);
+
+gboolean    backup_pack_contains            (BackupStore* store, const char* ctxMD5);
+
+/**
+ * 记录在包中占用的字节数(含记录头), 不在包中时返回 0
+ */
+guint64     backup_pack_size                (BackupStore* store, const char* ctxMD5);
+
+/**
+ * 内容在包中时把 refs 中的引用计数(内容 MD5(hex) -> GUINT_TO_POINTER)加一; 只查已载入的索引, 供遍历 meta 时逐个调用
+ */
+void        backup_pack_ref                 (BackupStore* store, GHashTable* refs, const char* ctxMD5);
+
+/**
+ * 打开记录所在的包并返回其 fd(调用者关闭), 以及数据在包内的偏移和长度, 供批量恢复按物理位置排序; 找不到返回 -1
+ */
+int         backup_pack_locate              (BackupStore* store, const char* ctxMD5, guint64* offset/*out*/, guint32* len/*out*/);
+
+/**
+ * 从包中取出内容写到 dstPath(先写临时文件再改名), 读取时校验记录头与内容 MD5
+ */
+gboolean    backup_pack_read                (BackupStore* store, const char* ctxMD5, const char* dstPath, guint64* bytes/*out, nullable*/);
+gboolean    backup_pack_verify              (BackupStore* store, const char* ctxMD5, guint64* bytes/*out, nullable*/);
+
+/**
+ * 本进程还有未落盘的追加时 fdatasync; 并发的写入者排队调用, 一次落盘覆盖之前所有的追加
+ */
+void        backup_pack_sync                (BackupStore* store);
+
+/**
+ * 压缩: 不再被任何 meta 引用的记录超过一半的旧包, 把仍在使用的记录搬到当前包后删除, 返回释放的字节数
+ * 距上次压缩不足 minIntervalSec 时直接返回 0(需要遍历全部 meta, 后台线程据此限制频率)
+ */
+guint64     backup_pack_repack              (BackupStore* store, guint minIntervalSec, GCancellable* cancel);
+
+G_END_DECLS
+
+#endif // gvfs_backup_PACK_H
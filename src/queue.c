@@ -0,0 +1,234 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 请求合并队列: 自动保存等高频的备份请求按路径合并, 并限制同一路径两次备份的最小间隔
+//
+#include "backup.h"
+#include "backup-private.h"
+
+typedef struct _QueueEntry
+{
+    char*                   path;
+    gint64                  due;                // 排队请求的执行时间(单调时钟), 0 表示没有排队的请求
+    gint64                  lastRun;            // 上一次开始备份的时间, 0 表示还没有备份过
+    gboolean                running;
+} QueueEntry;
+
+static gpointer     queue_thread                (gpointer data);
+static void         queue_worker                (gpointer data, gpointer uData);
+static void         queue_entry_free            (gpointer data);
+
+
+static GMutex       gsQueueLock;                    // 保护以下所有字段
+static GCond        gsQueueCond;
+static GHashTable*  gsQueue = NULL;                 // path -> QueueEntry*
+static GThread*     gsQueueThread = NULL;
+static GThreadPool* gsQueuePool = NULL;
+static gboolean     gsQueueEnabled = FALSE;
+static gboolean     gsQueueStop = FALSE;
+static guint        gsQueueFlushing = 0;            // 正在 flush 的调用者个数, 期间不再等待
+static guint        gsQueuePending = 0;             // 排队中或正在执行的条目数
+static guint64      gsQueueFailed = 0;              // 执行失败的备份数, 提交时已返回 TRUE, 只能在这里报告
+static gint64       gsQueueWindowUs = 0;
+static gint64       gsQueueIntervalUs = 0;
+
+
+void backup_queue_start (guint windowMs, guint minIntervalSec)
+{
+    g_mutex_lock (&gsQueueLock);
+    gsQueueWindowUs = (gint64) windowMs * 1000;
+    gsQueueIntervalUs = (gint64) minIntervalSec * G_USEC_PER_SEC;
+    if (!gsQueueThread) {
+        if (!gsQueue) {
+            gsQueue = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, queue_entry_free);
+        }
+        gsQueueStop = FALSE;
+        gsQueuePool = g_thread_pool_new (queue_worker, NULL, (gint) g_get_num_processors(), FALSE, NULL);
+        gsQueueThread = g_thread_new ("backup-queue", queue_thread, NULL);
+    }
+    gsQueueEnabled = TRUE;
+    g_cond_broadcast (&gsQueueCond);
+    g_mutex_unlock (&gsQueueLock);
+}
+
+void backup_queue_flush ()
+{
+    g_mutex_lock (&gsQueueLock);
+    gsQueueFlushing++;
+    g_cond_broadcast (&gsQueueCond);
+    while (gsQueueThread && gsQueuePending > 0) {
+        g_cond_wait (&gsQueueCond, &gsQueueLock);
+    }
+    gsQueueFlushing--;
+    g_mutex_unlock (&gsQueueLock);
+}
+
+void backup_queue_drain ()
+{
+    GThread* th = NULL;
+    GThreadPool* pool = NULL;
+
+    // 先停止接收, 之后的请求同步执行, 排队中的请求执行完再退出
+    g_mutex_lock (&gsQueueLock);
+    gsQueueEnabled = FALSE;
+    g_mutex_unlock (&gsQueueLock);
+
+    backup_queue_flush ();
+
+    g_mutex_lock (&gsQueueLock);
+    gsQueueStop = TRUE;
+    th = gsQueueThread;
+    pool = gsQueuePool;
+    gsQueueThread = NULL;
+    gsQueuePool = NULL;
+    g_cond_broadcast (&gsQueueCond);
+    g_mutex_unlock (&gsQueueLock);
+
+    if (th) {
+        g_thread_join (th);
+    }
+    if (pool) {
+        g_thread_pool_free (pool, FALSE, TRUE);
+    }
+
+    g_mutex_lock (&gsQueueLock);
+    if (gsQueue && !gsQueueThread) {
+        g_hash_table_remove_all (gsQueue);
+        gsQueuePending = 0;
+    }
+    g_mutex_unlock (&gsQueueLock);
+}
+
+guint64 backup_queue_get_failed ()
+{
+    g_mutex_lock (&gsQueueLock);
+    const guint64 failed = gsQueueFailed;
+    g_mutex_unlock (&gsQueueLock);
+
+    return failed;
+}
+
+/**
+ * 同一路径第一次请求后等待一个窗口期, 期间的重复请求不再延后执行时间, 持续保存时每个窗口期至少备份一次
+ */
+gboolean backup_queue_submit (const char* path)
+{
+    g_return_val_if_fail (path, FALSE);
+
+    gboolean ret = FALSE;
+
+    g_mutex_lock (&gsQueueLock);
+    if (gsQueueEnabled) {
+        const gint64 now = g_get_monotonic_time();
+        QueueEntry* entry = g_hash_table_lookup (gsQueue, path);
+        if (!entry) {
+            entry = g_new0 (QueueEntry, 1);
+            entry->path = g_strdup (path);
+            g_hash_table_insert (gsQueue, entry->path, entry);
+        }
+        if (0 == entry->due) {
+            if (!entry->running) {
+                gsQueuePending++;
+            }
+            entry->due = now + gsQueueWindowUs;
+            if (entry->lastRun > 0) {
+                entry->due = MAX (entry->due, entry->lastRun + gsQueueIntervalUs);
+            }
+            g_cond_broadcast (&gsQueueCond);
+        }
+        ret = TRUE;
+    }
+    g_mutex_unlock (&gsQueueLock);
+
+    return ret;
+}
+
+/**
+ * 调度线程只负责按时间把到期的路径交给线程池; 同一路径同时只有一个备份在执行
+ */
+static gpointer queue_thread (gpointer data)
+{
+    g_mutex_lock (&gsQueueLock);
+    while (!gsQueueStop) {
+        gint64 next = G_MAXINT64;
+        const gint64 now = g_get_monotonic_time();
+
+        GHashTableIter iter;
+        gpointer value = NULL;
+        g_hash_table_iter_init (&iter, gsQueue);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            QueueEntry* entry = value;
+            if (entry->running) {
+                continue;
+            }
+            if (0 == entry->due) {
+                // 最小间隔已过的条目不再影响下一次请求, 删除以免无限增长
+                if (now - entry->lastRun >= gsQueueIntervalUs) {
+                    g_hash_table_iter_remove (&iter);
+                }
+                continue;
+            }
+            if (entry->due <= now || gsQueueFlushing > 0) {
+                entry->due = 0;
+                entry->running = TRUE;
+                entry->lastRun = now;
+                g_thread_pool_push (gsQueuePool, g_strdup (entry->path), NULL);
+            }
+            else {
+                next = MIN (next, entry->due);
+            }
+        }
+
+        if (G_MAXINT64 == next) {
+            g_cond_wait (&gsQueueCond, &gsQueueLock);
+        }
+        else {
+            g_cond_wait_until (&gsQueueCond, &gsQueueLock, next);
+        }
+    }
+    g_mutex_unlock (&gsQueueLock);
+
+    return NULL;
+
+    (void) data;
+}
+
+static void queue_worker (gpointer data, gpointer uData)
+{
+    char* path = data;
+
+    const gboolean ok = backup_file_backup_now (path);
+    if (!ok) {
+        g_warning ("backup queue: backup of '%s' failed", path);
+    }
+
+    g_mutex_lock (&gsQueueLock);
+    if (!ok) {
+        gsQueueFailed++;
+    }
+    QueueEntry* entry = g_hash_table_lookup (gsQueue, path);
+    if (entry) {
+        entry->running = FALSE;
+        if (0 == entry->due) {
+            gsQueuePending--;
+        }
+        else {
+            // 执行期间又有新的请求, 仍需遵守最小间隔
+            entry->due = MAX (entry->due, entry->lastRun + gsQueueIntervalUs);
+        }
+    }
+    g_cond_broadcast (&gsQueueCond);
+    g_mutex_unlock (&gsQueueLock);
+
+    STR_FREE(path);
+
+    (void) uData;
+}
+
+static void queue_entry_free (gpointer data)
+{
+    QueueEntry* entry = data;
+
+    STR_FREE(entry->path);
+    g_free (entry);
+}
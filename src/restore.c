@@ -0,0 +1,326 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 批量恢复: 按备份文件在磁盘上的物理位置排序, 每个设备一组线程按顺序流式恢复
+//
+#include "backup.h"
+#include "store.h"
+#include "dedup.h"
+#include "pack.h"
+#include "delta.h"
+#include "copy.h"
+#include "backup-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define RESTORE_PROGRESS_MIN_US (200 * 1000)        // 吞吐量采样至少跨越的时间, 太短时 ETA 不稳定
+
+typedef struct _RestoreItem
+{
+    const char*             path;
+    dev_t                   dev;
+    guint64                 location;               // 第一个区段的物理偏移, 取不到时为 inode 号
+    guint64                 bytes;
+} RestoreItem;
+
+typedef struct _RestoreDevice
+{
+    GArray*                 items;                  // RestoreItem, 已按 location 排序
+    gint                    next;                   // 原子, 下一个待恢复的下标
+} RestoreDevice;
+
+typedef struct _RestoreCtx
+{
+    GMutex                  lock;                   // 保护 progress 与回调
+    BackupRestoreProgress   progress;
+    gint64                  start;
+
+    BackupRestoreFunc       func;
+    gpointer                data;
+    GCancellable*           cancel;
+} RestoreCtx;
+
+typedef struct _RestoreWorker
+{
+    RestoreCtx*             ctx;
+    RestoreDevice*          dev;
+} RestoreWorker;
+
+static void         restore_plan                (const char* path, RestoreItem* item);
+static gboolean     restore_locate              (int dirFd, const char* rel, RestoreItem* item);
+static gboolean     restore_locate_fd           (int fd, RestoreItem* item);
+static gboolean     restore_recipe_locate       (BackupStore* store, const char* key, int slot, RestoreItem* item);
+static void         restore_recipe_size_cb      (const char* chunkHex, guint32 len, gpointer data);
+static gpointer     restore_worker_thread       (gpointer data);
+static void         restore_finish              (RestoreCtx* ctx, const RestoreItem* item, gboolean ok);
+static gint         restore_item_compare        (gconstpointer a, gconstpointer b);
+
+
+gboolean backup_file_restore_bulk (const char* const* paths, guint n, guint parallel, BackupRestoreFunc func, gpointer data, GCancellable* cancel)
+{
+    g_return_val_if_fail (paths || 0 == n, FALSE);
+
+    RestoreCtx ctx;
+    memset (&ctx, 0, sizeof (ctx));
+    g_mutex_init (&ctx.lock);
+    ctx.func = func;
+    ctx.data = data;
+    ctx.cancel = cancel;
+
+    // 先按设备分组, 同一设备上的恢复按物理位置排序
+    GHashTable* devs = g_hash_table_new (g_int64_hash, g_int64_equal);
+    GPtrArray* devList = g_ptr_array_new ();
+    gint64* devKeys = g_new0 (gint64, MAX (n, 1));
+    for (guint i = 0; i < n; ++i) {
+        RestoreItem item;
+        memset (&item, 0, sizeof (item));
+        item.path = paths[i];
+        restore_plan (paths[i], &item);
+
+        devKeys[i] = (gint64) item.dev;
+        RestoreDevice* dev = g_hash_table_lookup (devs, &devKeys[i]);
+        if (!dev) {
+            dev = g_new0 (RestoreDevice, 1);
+            dev->items = g_array_new (FALSE, TRUE, sizeof (RestoreItem));
+            g_hash_table_insert (devs, &devKeys[i], dev);
+            g_ptr_array_add (devList, dev);
+        }
+        g_array_append_val (dev->items, item);
+        ctx.progress.total++;
+        ctx.progress.bytesTotal += item.bytes;
+    }
+
+    const guint perDev = parallel > 0 ? parallel : 1;
+    GPtrArray* threads = g_ptr_array_new ();
+    RestoreWorker* workers = g_new0 (RestoreWorker, MAX (devList->len, 1));
+    ctx.start = g_get_monotonic_time();
+    for (guint i = 0; i < devList->len; ++i) {
+        RestoreDevice* dev = g_ptr_array_index (devList, i);
+        g_array_sort (dev->items, restore_item_compare);
+        workers[i].ctx = &ctx;
+        workers[i].dev = dev;
+        for (guint j = 0; j < MIN (perDev, dev->items->len); ++j) {
+            g_ptr_array_add (threads, g_thread_new ("backup-restore", restore_worker_thread, &workers[i]));
+        }
+    }
+    for (guint i = 0; i < threads->len; ++i) {
+        g_thread_join (g_ptr_array_index (threads, i));
+    }
+
+    const gboolean ret = (0 == ctx.progress.failed) && (ctx.progress.done == ctx.progress.total);
+
+    for (guint i = 0; i < devList->len; ++i) {
+        RestoreDevice* dev = g_ptr_array_index (devList, i);
+        g_array_unref (dev->items);
+        g_free (dev);
+    }
+    g_ptr_array_unref (threads);
+    g_ptr_array_unref (devList);
+    g_hash_table_unref (devs);
+    STR_FREE(devKeys);
+    STR_FREE(workers);
+    g_mutex_clear (&ctx.lock);
+
+    return ret;
+}
+
+/**
+ * 按 do_restore 的顺序找到将被恢复的最新版本; 找不到时排在最后, 由恢复本身报告失败
+ */
+static void restore_plan (const char* path, RestoreItem* item)
+{
+    char key[BACKUP_KEY_SIZE];
+    char blob[STORE_PATH_MAX];
+
+    item->location = G_MAXUINT64;
+
+    char* mountPoint = get_mount_point_by_path (path);
+    BackupStore* store = mountPoint ? backup_store_get (mountPoint) : NULL;
+    STR_FREE(mountPoint);
+    if (!store || !backup_path_key (path, key)) {
+        return;
+    }
+
+    BackupMetaFile meta;
+    char metaPath[STORE_PATH_MAX];
+    memset (&meta, 0, sizeof (meta));
+    const gboolean hasMeta = backup_store_meta_rel (store, key, metaPath, sizeof (metaPath))
+                          && backup_meta_parse_at (&meta, backup_store_meta_fd (store), metaPath);
+
+    const int backupFd = backup_store_backup_fd (store);
+    for (int slot = 3; slot >= 1; --slot) {
+        if (backup_store_blob_rel (store, key, slot, NULL, blob, sizeof (blob)) && restore_locate (backupFd, blob, item)) {
+            break;
+        }
+        if (restore_recipe_locate (store, key, slot, item)) {
+            break;
+        }
+        // 增量版本按增量文件本身的位置排序, 基础版本的位置不再考虑
+        if (backup_store_blob_rel (store, key, slot, DELTA_SUFFIX, blob, sizeof (blob)) && restore_locate (backupFd, blob, item)) {
+            break;
+        }
+        // 包中的版本按所在包的位置加上包内偏移排序, 同一个包里的小文件因此顺序读取
+        guint64 offset = 0;
+        guint32 len = 0;
+        if (hasMeta && backup_meta_slot_good (&meta, slot)
+            && restore_locate_fd (backup_pack_locate (store, *backup_meta_slot_ctx (&meta, slot), &offset, &len), item)) {
+            item->location += offset;
+            item->bytes = len;
+            break;
+        }
+    }
+
+    backup_meta_free (&meta);
+}
+
+static gboolean restore_locate (int dirFd, const char* rel, RestoreItem* item)
+{
+    return restore_locate_fd (openat (dirFd, rel, O_RDONLY | O_CLOEXEC), item);
+}
+
+/**
+ * 取 fd 所指文件的设备与第一个区段的位置, fd 由这里关闭
+ */
+static gboolean restore_locate_fd (int fd, RestoreItem* item)
+{
+    struct stat statBuf;
+
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    if (0 != fstat (fd, &statBuf)) {
+        close (fd);
+        return FALSE;
+    }
+    item->dev = statBuf.st_dev;
+    item->bytes = (guint64) statBuf.st_size;
+    item->location = (guint64) statBuf.st_ino;
+
+    // 只需要第一个区段; 不支持 FIEMAP 的文件系统(tmpfs、网络文件系统等)退回 inode 号
+    union {
+        struct fiemap   fm;
+        char            buf[sizeof (struct fiemap) + sizeof (struct fiemap_extent)];
+    } fm;
+    memset (&fm, 0, sizeof (fm));
+    fm.fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm.fm_extent_count = 1;
+    if (0 == ioctl (fd, FS_IOC_FIEMAP, &fm.fm) && fm.fm.fm_mapped_extents > 0) {
+        item->location = fm.fm.fm_extents[0].fe_physical;
+    }
+
+    close (fd);
+
+    return TRUE;
+}
+
+/**
+ * 去重版本按第一个分块的位置排序, 大小取分块列表中各块长度之和
+ */
+static gboolean restore_recipe_locate (BackupStore* store, const char* key, int slot, RestoreItem* item)
+{
+    guint64 bytes = 0;
+    char first[STORE_PATH_MAX] = {0};
+    gpointer cb[2] = { &bytes, first };
+    char rel[STORE_PATH_MAX];
+    char recipePath[STORE_PATH_MAX];
+
+    const int backupFd = backup_store_backup_fd (store);
+    if (backupFd < 0
+        || !backup_store_blob_rel (store, key, slot, DEDUP_RECIPE_SUFFIX, rel, sizeof (rel))
+        || 0 != faccessat (backupFd, rel, F_OK, 0)) {
+        return FALSE;
+    }
+
+    // 分块列表的解析仍按路径进行, 只有确认存在之后才拼绝对路径
+    if (!backup_store_blob_path (store, key, slot, DEDUP_RECIPE_SUFFIX, recipePath, sizeof (recipePath))
+        || !backup_dedup_recipe_foreach (recipePath, restore_recipe_size_cb, cb)) {
+        return FALSE;
+    }
+
+    char chunkPath[STORE_PATH_MAX];
+    if (!('\0' != first[0] && backup_dedup_chunk_path (store, first, chunkPath, sizeof (chunkPath))
+          && restore_locate (AT_FDCWD, chunkPath, item))) {
+        restore_locate (backupFd, rel, item);
+    }
+    item->bytes = bytes;
+
+    return TRUE;
+}
+
+static void restore_recipe_size_cb (const char* chunkHex, guint32 len, gpointer data)
+{
+    gpointer* cb = data;
+    guint64* bytes = cb[0];
+    char* first = cb[1];
+
+    if ('\0' == first[0]) {
+        g_strlcpy (first, chunkHex, STORE_PATH_MAX);
+    }
+    *bytes += len;
+}
+
+/**
+ * 同一设备的线程共享一个下标, 按位置顺序依次领取, 同时在途的请求数不超过线程数
+ */
+static gpointer restore_worker_thread (gpointer data)
+{
+    RestoreWorker* w = data;
+
+    // 批量恢复时大文件不经过页缓存
+    backup_copy_set_bulk (TRUE);
+
+    while (!g_cancellable_is_cancelled (w->ctx->cancel)) {
+        const guint idx = (guint) g_atomic_int_add (&w->dev->next, 1);
+        if (idx >= w->dev->items->len) {
+            break;
+        }
+        const RestoreItem* item = &g_array_index (w->dev->items, RestoreItem, idx);
+        const gboolean ok = backup_file_restore_by_abspath (item->path);
+        restore_finish (w->ctx, item, ok);
+    }
+
+    return NULL;
+}
+
+static void restore_finish (RestoreCtx* ctx, const RestoreItem* item, gboolean ok)
+{
+    g_mutex_lock (&ctx->lock);
+
+    BackupRestoreProgress* p = &ctx->progress;
+    p->done++;
+    p->bytesDone += item->bytes;
+    if (!ok) {
+        p->failed++;
+    }
+
+    const gint64 elapsed = g_get_monotonic_time() - ctx->start;
+    if (elapsed >= RESTORE_PROGRESS_MIN_US && p->bytesDone > 0) {
+        p->bytesPerSec = (guint64) ((gdouble) p->bytesDone * G_USEC_PER_SEC / elapsed);
+    }
+    if (p->bytesPerSec > 0) {
+        p->etaSec = (gint64) ((p->bytesTotal - MIN (p->bytesDone, p->bytesTotal)) / p->bytesPerSec);
+    }
+    else {
+        p->etaSec = -1;
+    }
+
+    if (ctx->func) {
+        ctx->func (item->path, ok, p, ctx->data);
+    }
+
+    g_mutex_unlock (&ctx->lock);
+}
+
+static gint restore_item_compare (gconstpointer a, gconstpointer b)
+{
+    const RestoreItem* ia = a;
+    const RestoreItem* ib = b;
+
+    return (ia->location > ib->location) - (ia->location < ib->location);
+}
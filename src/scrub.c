@@ -0,0 +1,522 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 完整性巡检: 重新计算各版本的内容哈希并与 meta 比较, 损坏的版本在 meta 中标记, 恢复时跳过
+//
+#include "store.h"
+#include "hash.h"
+#include "dedup.h"
+#include "pack.h"
+#include "delta.h"
+#include "monitor.h"
+#include "trace.h"
+#include "backup-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SCRUB_BUCKET_N          256                 // 按 key 前两个十六进制字符分桶, 每完成一个桶记录一次检查点
+#define SCRUB_STATE_FILE        "scrub.state"
+
+typedef enum
+{
+    SCRUB_OK = 0,
+    SCRUB_BAD,
+    SCRUB_MISSING,
+} ScrubResult;
+
+typedef struct _ScrubCtx
+{
+    BackupStore*            store;
+    GCancellable*           cancel;
+    BackupScrubFunc         func;
+    gpointer                data;
+    int                     depth;                  // 巡检开始时的分层深度, 0 时各桶的 meta 都在 meta/ 下
+    GPtrArray*              flatKeys[SCRUB_BUCKET_N];   // depth 为 0 时遍历一次 meta/ 按桶分好的 key, 未完成的桶才有
+    gint                    next;                   // 原子, 下一个待领取的桶
+
+    GMutex                  lock;                   // 保护以下字段与回调
+    guint8                  doneMask[SCRUB_BUCKET_N / 8];
+    gboolean                failed;
+    BackupScrubStats        stats;
+
+    guint64                 bytesPerSec;            // 0 表示不限速
+    gint64                  tokenTime;
+    gdouble                 tokens;
+} ScrubCtx;
+
+typedef struct _ScrubBucket
+{
+    ScrubCtx*               ctx;
+    int                     bucket;
+    gboolean                stopped;                // 遍历中途被取消, 本桶不算完成
+    BackupScrubStats        stats;
+} ScrubBucket;
+
+static gboolean     scrub_store                 (BackupStore* store, guint threads, guint64 bytesPerSec, BackupScrubFunc func, gpointer data, BackupScrubStats* stats, GCancellable* cancel);
+static gboolean     scrub_bucket                (ScrubCtx* ctx, int bucket, BackupScrubStats* stats);
+static void         scrub_bucket_cb             (int dirFd, const char* relPath, const char* name, gpointer data);
+static void         scrub_flat_cb               (int dirFd, const char* relPath, const char* name, gpointer data);
+static gpointer     scrub_worker_thread         (gpointer data);
+static void         scrub_key                   (ScrubCtx* ctx, const char* key, BackupScrubStats* stats);
+static ScrubResult  scrub_version               (ScrubCtx* ctx, const char* key, int slot, const char* ctxMD5, guint64* bytes);
+static void         scrub_mark                  (ScrubCtx* ctx, const char* key, int slot, guint64 timestamp, const char* ctxMD5, BackupScrubStats* stats);
+static void         scrub_throttle              (ScrubCtx* ctx, guint64 bytes);
+static void         scrub_drop_cache            (const char* path);
+static int          scrub_bucket_of             (const char* name);
+static void         scrub_state_load            (ScrubCtx* ctx);
+static void         scrub_state_save            (ScrubCtx* ctx);
+static void         scrub_stats_add             (BackupScrubStats* dst, const BackupScrubStats* src);
+
+
+gboolean backup_store_scrub (const char* mountPoint, guint threads, guint64 bytesPerSec, BackupScrubFunc func, gpointer data, BackupScrubStats* stats, GCancellable* cancel)
+{
+    gboolean ret = TRUE;
+
+    if (stats) {
+        memset (stats, 0, sizeof (BackupScrubStats));
+    }
+
+    if (mountPoint) {
+        BackupStore* store = backup_store_get (mountPoint);
+        g_return_val_if_fail (store, FALSE);
+        return scrub_store (store, threads, bytesPerSec, func, data, stats, cancel);
+    }
+
+    GList* mps = get_all_mount_points();
+    for (GList* itr = mps; itr; itr = itr->next) {
+        BackupStore* store = backup_store_get (itr->data);
+        if (store && 0 == access (store->root, F_OK)) {
+            BackupScrubStats st;
+            memset (&st, 0, sizeof (st));
+            if (!scrub_store (store, threads, bytesPerSec, func, data, &st, cancel)) {
+                ret = FALSE;
+            }
+            if (stats) {
+                scrub_stats_add (stats, &st);
+            }
+        }
+    }
+    NOT_NULL_RUN(mps, g_list_free_full, g_free);
+
+    return ret;
+}
+
+static gboolean scrub_store (BackupStore* store, guint threads, guint64 bytesPerSec, BackupScrubFunc func, gpointer data, BackupScrubStats* stats, GCancellable* cancel)
+{
+    g_return_val_if_fail (store, FALSE);
+
+    gboolean ret = FALSE;
+    ScrubCtx ctx;
+
+    memset (&ctx, 0, sizeof (ctx));
+    g_mutex_init (&ctx.lock);
+    ctx.store = store;
+    ctx.cancel = cancel;
+    ctx.func = func;
+    ctx.data = data;
+    ctx.bytesPerSec = bytesPerSec;
+    ctx.tokens = (gdouble) bytesPerSec;
+    ctx.tokenTime = g_get_monotonic_time();
+
+    do {
+        // 迁移期间 meta 与版本文件可能分处两层目录, 等迁移结束再巡检
+        BREAK_IF_FAIL(!backup_store_is_migrating (store));
+
+        scrub_state_load (&ctx);
+        ctx.depth = g_atomic_int_get (&store->depth);
+        if (0 == ctx.depth) {
+            // 平铺时 meta 不超过 STORE_SHARD_ENTRIES 个, 只遍历一次, key 按桶分发后放在内存中
+            for (int i = 0; i < SCRUB_BUCKET_N; ++i) {
+                if (!(ctx.doneMask[i / 8] & (1u << (i % 8)))) {
+                    ctx.flatKeys[i] = g_ptr_array_new_with_free_func (g_free);
+                }
+            }
+            backup_store_walk (store, "meta", scrub_flat_cb, &ctx);
+        }
+
+        const guint n = (threads > 0) ? threads : (guint) g_get_num_processors();
+        GThread** ths = g_new0 (GThread*, n);
+        for (guint i = 0; i < n; ++i) {
+            ths[i] = g_thread_new ("backup-scrub", scrub_worker_thread, &ctx);
+        }
+        for (guint i = 0; i < n; ++i) {
+            g_thread_join (ths[i]);
+        }
+        STR_FREE(ths);
+
+        ret = !ctx.failed;
+        for (int i = 0; ret && i < SCRUB_BUCKET_N / 8; ++i) {
+            ret = (0xFF == ctx.doneMask[i]);
+        }
+    } while (FALSE);
+
+    if (ret) {
+        char* stateFile = g_strdup_printf ("%s/" SCRUB_STATE_FILE, store->root);
+        remove (stateFile);
+        STR_FREE(stateFile);
+    }
+
+    if (stats) {
+        *stats = ctx.stats;
+    }
+
+    for (int i = 0; i < SCRUB_BUCKET_N; ++i) {
+        NOT_NULL_RUN(ctx.flatKeys[i], g_ptr_array_unref);
+    }
+    g_mutex_clear (&ctx.lock);
+
+    return ret;
+}
+
+/**
+ * 每个线程一次领取一个桶, 桶内全部完成后才写检查点, 中断时未完成的桶下次从头再来
+ */
+static gpointer scrub_worker_thread (gpointer data)
+{
+    ScrubCtx* ctx = data;
+
+    while (TRUE) {
+        const int bucket = g_atomic_int_add (&ctx->next, 1);
+        if (bucket >= SCRUB_BUCKET_N) {
+            break;
+        }
+
+        g_mutex_lock (&ctx->lock);
+        const gboolean done = (ctx->doneMask[bucket / 8] & (1u << (bucket % 8)));
+        g_mutex_unlock (&ctx->lock);
+        if (done) {
+            continue;
+        }
+
+        BackupScrubStats stats;
+        memset (&stats, 0, sizeof (stats));
+        const gboolean finished = scrub_bucket (ctx, bucket, &stats);
+
+        g_mutex_lock (&ctx->lock);
+        scrub_stats_add (&ctx->stats, &stats);
+        if (!finished) {
+            ctx->failed = TRUE;
+        }
+        else {
+            ctx->doneMask[bucket / 8] |= (1u << (bucket % 8));
+            scrub_state_save (ctx);
+        }
+        g_mutex_unlock (&ctx->lock);
+
+        if (!finished) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 分层时桶就是 meta/ 下的一级目录, 只遍历这一个目录, 边遍历边巡检;
+ * 平铺时(不超过 STORE_SHARD_ENTRIES 个 meta)使用开始时遍历一次分好的 key
+ */
+static gboolean scrub_bucket (ScrubCtx* ctx, int bucket, BackupScrubStats* stats)
+{
+    ScrubBucket sb;
+
+    memset (&sb, 0, sizeof (sb));
+    sb.ctx = ctx;
+    sb.bucket = bucket;
+
+    if (ctx->depth > 0) {
+        char sub[16] = {0};
+        g_snprintf (sub, sizeof (sub), "meta/%02x", bucket);
+        backup_store_walk (ctx->store, sub, scrub_bucket_cb, &sb);
+    }
+    else if (ctx->flatKeys[bucket]) {
+        const GPtrArray* keys = ctx->flatKeys[bucket];
+        for (guint i = 0; i < keys->len && !sb.stopped; ++i) {
+            scrub_bucket_cb (-1, NULL, g_ptr_array_index (keys, i), &sb);
+        }
+    }
+
+    *stats = sb.stats;
+
+    return !sb.stopped && !g_cancellable_is_cancelled (ctx->cancel);
+}
+
+static void scrub_bucket_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    ScrubBucket* sb = data;
+
+    if (sb->stopped || BACKUP_KEY_SIZE - 1 != strlen (name) || scrub_bucket_of (name) != sb->bucket) {
+        return;
+    }
+    if (g_cancellable_is_cancelled (sb->ctx->cancel)) {
+        sb->stopped = TRUE;
+        return;
+    }
+
+    scrub_key (sb->ctx, name, &sb->stats);
+
+    (void) dirFd;
+    (void) relPath;
+}
+
+static void scrub_flat_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    ScrubCtx* ctx = data;
+
+    const int bucket = scrub_bucket_of (name);
+    if (bucket >= 0 && ctx->flatKeys[bucket] && BACKUP_KEY_SIZE - 1 == strlen (name)) {
+        g_ptr_array_add (ctx->flatKeys[bucket], g_strdup (name));
+    }
+
+    (void) dirFd;
+    (void) relPath;
+}
+
+/**
+ * 哈希计算不持有 key 锁, 不阻塞并发的备份; 只有发现不一致时才加锁复核
+ */
+static void scrub_key (ScrubCtx* ctx, const char* key, BackupScrubStats* stats)
+{
+    BackupMetaFile meta;
+    char metaPath[STORE_PATH_MAX];
+
+    memset (&meta, 0, sizeof (meta));
+    backup_trace_set_key (key);
+
+    if (backup_store_meta_rel (ctx->store, key, metaPath, sizeof (metaPath))
+        && backup_meta_parse_at (&meta, backup_store_meta_fd (ctx->store), metaPath)
+        && 1 == meta.version && meta.srcFilePath) {
+        stats->metas++;
+        for (int slot = 1; slot <= 3; ++slot) {
+            const char* ctxMD5 = *backup_meta_slot_ctx (&meta, slot);
+            if (!ctxMD5) {
+                continue;
+            }
+            if (!backup_meta_slot_good (&meta, slot)) {
+                stats->skipped++;
+                continue;
+            }
+
+            guint64 bytes = 0;
+            const ScrubResult res = scrub_version (ctx, key, slot, ctxMD5, &bytes);
+            stats->versions++;
+            stats->bytes += bytes;
+            if (SCRUB_OK != res) {
+                scrub_mark (ctx, key, slot, *backup_meta_slot_timestamp (&meta, slot), ctxMD5, stats);
+            }
+        }
+    }
+
+    backup_trace_set_key (NULL);
+    backup_meta_free (&meta);
+}
+
+/**
+ * 与 version_read 相同: 有分块列表时按去重版本逐块校验, 增量版本按分块哈希校验保存的分块,
+ * 否则对整文件版本重新计算 MD5, 都没有时校验包中的记录
+ */
+static ScrubResult scrub_version (ScrubCtx* ctx, const char* key, int slot, const char* ctxMD5, guint64* bytes)
+{
+    ScrubResult ret = SCRUB_MISSING;
+    char path[STORE_PATH_MAX];
+    struct stat statBuf;
+
+    const int backupFd = backup_store_backup_fd (ctx->store);
+    if (backupFd < 0) {
+        return SCRUB_MISSING;
+    }
+
+    if (backup_store_blob_rel (ctx->store, key, slot, DEDUP_RECIPE_SUFFIX, path, sizeof (path))
+        && 0 == fstatat (backupFd, path, &statBuf, 0)) {
+        // 块按内容命名, 校验每个块即可, 不需要重建整个文件
+        if (backup_store_blob_path (ctx->store, key, slot, DEDUP_RECIPE_SUFFIX, path, sizeof (path))) {
+            ret = backup_dedup_verify (ctx->store, path, bytes) ? SCRUB_OK : SCRUB_BAD;
+            scrub_throttle (ctx, *bytes);
+        }
+    }
+    else if (backup_store_blob_rel (ctx->store, key, slot, NULL, path, sizeof (path))
+        && 0 == fstatat (backupFd, path, &statBuf, 0)) {
+        if (backup_store_blob_path (ctx->store, key, slot, NULL, path, sizeof (path))) {
+            scrub_throttle (ctx, (guint64) statBuf.st_size);
+            char* md5 = backup_hash_file (path, NULL);
+            // 分块哈希之前备份的大文件记录的是整文件 MD5
+            if (md5 && 0 != g_strcmp0 (md5, ctxMD5) && statBuf.st_size >= HASH_TREE_MIN_SIZE) {
+                STR_FREE(md5);
+                md5 = backup_hash_file_md5 (path);
+            }
+            ret = (md5 && 0 == g_strcmp0 (md5, ctxMD5)) ? SCRUB_OK : SCRUB_BAD;
+            *bytes = (guint64) statBuf.st_size;
+            STR_FREE(md5);
+            scrub_drop_cache (path);
+        }
+    }
+    else if (backup_store_blob_rel (ctx->store, key, slot, DELTA_SUFFIX, path, sizeof (path))
+        && 0 == fstatat (backupFd, path, &statBuf, 0)) {
+        // 基础版本由它自己所在的版本校验
+        char treePath[STORE_PATH_MAX];
+        if (backup_store_blob_path (ctx->store, key, slot, DELTA_SUFFIX, path, sizeof (path))
+            && backup_store_blob_path (ctx->store, key, slot, HASH_TREE_SUFFIX, treePath, sizeof (treePath))) {
+            ret = backup_delta_verify (path, treePath, bytes) ? SCRUB_OK : SCRUB_BAD;
+            scrub_throttle (ctx, *bytes);
+            scrub_drop_cache (path);
+        }
+    }
+    else if (backup_pack_contains (ctx->store, ctxMD5)) {
+        // 包中的记录带有内容 MD5, 读出时即已校验
+        ret = backup_pack_verify (ctx->store, ctxMD5, bytes) ? SCRUB_OK : SCRUB_BAD;
+        scrub_throttle (ctx, *bytes);
+    }
+
+    return ret;
+}
+
+/**
+ * 持有 key 锁复核: meta 中该版本未变且再次校验仍失败才标记, 避免误伤巡检期间刚轮换或重写的版本
+ */
+static void scrub_mark (ScrubCtx* ctx, const char* key, int slot, guint64 timestamp, const char* ctxMD5, BackupScrubStats* stats)
+{
+    BackupMetaFile meta;
+    char metaPath[STORE_PATH_MAX];
+    guint64 bytes = 0;
+    ScrubResult res = SCRUB_OK;
+    gboolean marked = FALSE;
+
+    memset (&meta, 0, sizeof (meta));
+
+    backup_store_lock_key (ctx->store, key);
+    if (backup_store_meta_rel (ctx->store, key, metaPath, sizeof (metaPath))
+        && backup_meta_parse_at (&meta, backup_store_meta_fd (ctx->store), metaPath)
+        && 1 == meta.version
+        && 0 == g_strcmp0 (*backup_meta_slot_ctx (&meta, slot), ctxMD5)
+        && *backup_meta_slot_timestamp (&meta, slot) == timestamp) {
+        res = scrub_version (ctx, key, slot, ctxMD5, &bytes);
+        if (SCRUB_OK != res) {
+            char* bad = g_strdup_printf ("%c%s", BACKUP_META_BAD_MARK, ctxMD5);
+            STR_FREE(*backup_meta_slot_ctx (&meta, slot));
+            *backup_meta_slot_ctx (&meta, slot) = bad;
+            marked = backup_meta_save (&meta, key, ctx->store->mountPoint);
+        }
+    }
+    backup_store_unlock_key (ctx->store, key);
+
+    if (!marked) {
+        stats->skipped++;
+    }
+    else {
+        if (SCRUB_MISSING == res) {
+            stats->missing++;
+        }
+        else {
+            stats->corrupted++;
+        }
+        if (meta.srcFilePath) {
+            backup_monitor_notify (meta.srcFilePath, G_FILE_MONITOR_EVENT_CHANGED);
+        }
+        if (ctx->func) {
+            g_mutex_lock (&ctx->lock);
+            ctx->func (meta.srcFilePath, timestamp, ctx->data);
+            g_mutex_unlock (&ctx->lock);
+        }
+    }
+
+    backup_meta_free (&meta);
+}
+
+/**
+ * 令牌桶按字节计费, 允许透支: 大文件一次读完, 之后按透支的量等待, 长期平均不超过限速
+ */
+static void scrub_throttle (ScrubCtx* ctx, guint64 bytes)
+{
+    if (0 == ctx->bytesPerSec) {
+        return;
+    }
+
+    gint64 waitUs = 0;
+
+    g_mutex_lock (&ctx->lock);
+    const gint64 now = g_get_monotonic_time();
+    ctx->tokens = MIN ((gdouble) ctx->bytesPerSec, ctx->tokens + (gdouble) (now - ctx->tokenTime) * ctx->bytesPerSec / G_USEC_PER_SEC);
+    ctx->tokenTime = now;
+    ctx->tokens -= (gdouble) bytes;
+    if (ctx->tokens < 0) {
+        waitUs = (gint64) (-ctx->tokens * G_USEC_PER_SEC / ctx->bytesPerSec);
+    }
+    g_mutex_unlock (&ctx->lock);
+
+    while (waitUs > 0 && !g_cancellable_is_cancelled (ctx->cancel)) {
+        const gint64 step = MIN (waitUs, G_USEC_PER_SEC);
+        g_usleep (step);
+        waitUs -= step;
+    }
+}
+
+/**
+ * 巡检读的是冷数据, 读完即丢弃页缓存, 不挤掉正在使用的文件
+ */
+static void scrub_drop_cache (const char* path)
+{
+    const int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+        close (fd);
+    }
+}
+
+static int scrub_bucket_of (const char* name)
+{
+    const int hi = g_ascii_xdigit_value (name[0]);
+    const int lo = (hi >= 0) ? g_ascii_xdigit_value (name[1]) : -1;
+
+    return (hi >= 0 && lo >= 0) ? (hi << 4 | lo) : -1;
+}
+
+/**
+ * 检查点格式: 1|<已完成桶的位图, 64 个十六进制字符>
+ */
+static void scrub_state_load (ScrubCtx* ctx)
+{
+    char* content = NULL;
+    char* stateFile = g_strdup_printf ("%s/" SCRUB_STATE_FILE, ctx->store->root);
+
+    if (g_file_get_contents (stateFile, &content, NULL, NULL) && content
+        && g_str_has_prefix (content, "1|") && strlen (content) >= 2 + SCRUB_BUCKET_N / 4) {
+        for (int i = 0; i < SCRUB_BUCKET_N / 8; ++i) {
+            const int hi = g_ascii_xdigit_value (content[2 + 2 * i]);
+            const int lo = g_ascii_xdigit_value (content[2 + 2 * i + 1]);
+            ctx->doneMask[i] = (hi >= 0 && lo >= 0) ? (guint8) (hi << 4 | lo) : 0;
+        }
+    }
+
+    STR_FREE(content);
+    STR_FREE(stateFile);
+}
+
+/**
+ * 调用者需持有 ctx->lock
+ */
+static void scrub_state_save (ScrubCtx* ctx)
+{
+    char buf[2 + SCRUB_BUCKET_N / 4 + 1] = {0};
+    char* stateFile = g_strdup_printf ("%s/" SCRUB_STATE_FILE, ctx->store->root);
+
+    buf[0] = '1';
+    buf[1] = '|';
+    for (int i = 0; i < SCRUB_BUCKET_N / 8; ++i) {
+        g_snprintf (buf + 2 + 2 * i, 3, "%02x", ctx->doneMask[i]);
+    }
+    g_file_set_contents (stateFile, buf, -1, NULL);
+
+    STR_FREE(stateFile);
+}
+
+static void scrub_stats_add (BackupScrubStats* dst, const BackupScrubStats* src)
+{
+    dst->metas += src->metas;
+    dst->versions += src->versions;
+    dst->bytes += src->bytes;
+    dst->corrupted += src->corrupted;
+    dst->missing += src->missing;
+    dst->skipped += src->skipped;
+}
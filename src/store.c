@@ -0,0 +1,1517 @@
+//
+// Created by dingjing on 1/8/25.
+//
+#include "store.h"
+#include "trace.h"
+#include "dedup.h"
+#include "pack.h"
+#include "delta.h"
+#include "index.h"
+#include "monitor.h"
+#include "io.h"
+#include "daemon.h"
+#include "backup-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define STORE_DEFAULT_QUOTA_PERCENT     10
+#define STORE_EVICT_LOW_WATERMARK       90          // 后台淘汰时降到配额的 90%, 留出余量
+#define STORE_EVICT_WAIT_US             (5 * G_USEC_PER_SEC)    // 超出配额的备份最多等待后台淘汰的时间
+#define STORE_REPACK_INTERVAL_SEC       3600        // 后台压缩包文件的最小间隔
+
+#define STORE_LAYOUT_FILE               "layout"
+#define STORE_REPOSITORY_FILE           "repository"    // <mountPoint>/.andsec-backup/repository, 独立仓库的目录
+#define STORE_LAYOUT_LOCK               "layout.lock"   // 迁移者持有 flock, 跨进程只有一个迁移者
+#define STORE_LAYOUT_CHECK_US           G_USEC_PER_SEC
+#define STORE_MIGRATE_PASSES            10          // 每次迁移最多遍历的次数, 仍有残留时保留旧深度, 下次继续
+#define STORE_SHARD_ENTRIES             65536       // 单个目录的目标条目数, 超过后增加一层分层
+
+typedef struct _EvictCandidate
+{
+    guint64                 timestamp;
+    int                     slot;
+    char                    key[64];
+} EvictCandidate;
+
+typedef struct _EvictScan
+{
+    BackupStore*            store;
+    GArray*                 candidates;
+    GHashTable*             packRefs;           // 包中内容 MD5(hex) -> 引用它的版本数
+} EvictScan;
+
+typedef struct _MigrateScan
+{
+    BackupStore*            store;
+    int                     depth;              // 迁移开始时在 store->lock 下取得, 回调中不再读 store 的字段
+    int                     fromDepth;
+    guint64                 left;               // 本次遍历后仍在旧深度的条目数
+} MigrateScan;
+
+typedef struct _UsageScan
+{
+    guint64                 usage;
+    guint64                 metaCount;
+    gboolean                countMeta;
+
+    BackupStore*            store;
+    const char*             sub;
+    gboolean                batched;            // 开启 io_uring 时攒够一批再一起 statx
+    char*                   paths[IO_BATCH_N];
+    guint                   pathN;
+} UsageScan;
+
+static void         store_usage_scan            (BackupStore* store, guint64* usage/*out*/, guint64* metaCount/*out*/);
+static void         store_usage_ensure          (BackupStore* store);
+static void         store_usage_scan_cb         (int dirFd, const char* relPath, const char* name, gpointer data);
+static void         store_usage_scan_flush      (UsageScan* scan);
+static gboolean     store_try_reserve           (BackupStore* store, guint64 bytes, guint64 limit, guint64* need);
+static guint64      store_evict                 (BackupStore* store, guint64 need);
+static guint64      store_evict_exclusive       (BackupStore* store, guint64 need);
+static guint64      store_evict_recipe_bytes    (BackupStore* store, const char* key, int slot);
+static void         store_evict_chunk_cb        (const char* chunkHex, guint32 len, gpointer data);
+static void         store_evict_wait            (BackupStore* store, guint64 bytes, guint64 limit);
+static gpointer     store_evict_thread          (gpointer data);
+static void         store_evict_scan_cb         (int dirFd, const char* relPath, const char* name, gpointer data);
+static gint         evict_candidate_compare     (gconstpointer a, gconstpointer b);
+static gpointer     store_evictor_thread        (gpointer data);
+
+static int          store_dir_fd                (BackupStore* store, int* fd, const char* sub);
+static void         store_dir_check             (int* fd);
+static gboolean     store_build_rel             (const char* key, int depth, const char* name, char* buf, gsize bufLen);
+static gboolean     store_build_path            (BackupStore* store, const char* sub, const char* key, int depth, const char* name, char* buf, gsize bufLen);
+static void         store_walk_dir              (int dirFd, char* relPath, gsize relLen, int level, gboolean hidden, BackupStoreWalkFunc func, gpointer data);
+static char*        store_repository_load       (const char* mountPoint);
+static gboolean     store_repository_save       (const char* mountPoint, const char* repoDir);
+static gboolean     store_set_repository        (const char* mountPoint, const char* repoDir, gboolean persist);
+static gboolean     store_is_shard_name         (const char* name);
+static int          store_rel_level             (const char* relPath);
+static int          store_wanted_depth          (guint64 metaCount);
+static void         store_layout_load           (BackupStore* store);
+static gboolean     store_layout_save           (BackupStore* store, int depth, int fromDepth);
+static void         store_make_shard_dirs       (BackupStore* store, const char* sub, int depth);
+static gpointer     store_migrate_thread        (gpointer data);
+static void         store_migrate_meta_cb       (int dirFd, const char* relPath, const char* name, gpointer data);
+static void         store_migrate_blob_cb       (int dirFd, const char* relPath, const char* name, gpointer data);
+
+
+static GMutex       gsStoresLock;
+static GHashTable*  gsStores = NULL;                // mountPoint -> BackupStore*
+static GHashTable*  gsLocalRepositories = NULL;     // mountPoint -> repoDir, 只对本进程生效, 优先于 repository 文件
+static guint64      gsDefaultQuotaBytes = 0;
+static guint        gsDefaultQuotaPercent = STORE_DEFAULT_QUOTA_PERCENT;
+static gboolean     gsDefaultDedup = FALSE;
+static guint        gsDefaultPackMax = 0;
+static gboolean     gsDefaultDelta = FALSE;
+
+static GMutex       gsEvictorLock;
+static GCond        gsEvictorCond;
+static GThread*     gsEvictor = NULL;
+static gboolean     gsEvictorStop = FALSE;
+static guint        gsEvictorInterval = 0;
+
+
+gboolean backup_store_set_quota (const char* mountPoint, guint64 maxBytes, guint maxPercent)
+{
+    g_return_val_if_fail (maxPercent <= 100, FALSE);
+
+    if (!mountPoint) {
+        g_mutex_lock (&gsStoresLock);
+        gsDefaultQuotaBytes = maxBytes;
+        gsDefaultQuotaPercent = maxPercent;
+        if (gsStores) {
+            GHashTableIter iter;
+            gpointer value = NULL;
+            g_hash_table_iter_init (&iter, gsStores);
+            while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                BackupStore* store = value;
+                g_mutex_lock (&store->lock);
+                store->quotaBytes = maxBytes;
+                store->quotaPercent = maxPercent;
+                g_mutex_unlock (&store->lock);
+            }
+        }
+        g_mutex_unlock (&gsStoresLock);
+        return TRUE;
+    }
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, FALSE);
+
+    g_mutex_lock (&store->lock);
+    store->quotaBytes = maxBytes;
+    store->quotaPercent = maxPercent;
+    g_mutex_unlock (&store->lock);
+
+    return TRUE;
+}
+
+/**
+ * 仓库路径在 BackupStore 创建后不再变化(各处不加锁读取 root), 因此只能在该挂载点首次使用前设置;
+ * 设置写入 <mountPoint>/.andsec-backup/repository, 其它进程(包括守护进程)首次使用该挂载点时读取
+ */
+gboolean backup_store_set_repository (const char* mountPoint, const char* repoDir)
+{
+    return store_set_repository (mountPoint, repoDir, TRUE);
+}
+
+gboolean backup_store_set_repository_local (const char* mountPoint, const char* repoDir)
+{
+    return store_set_repository (mountPoint, repoDir, FALSE);
+}
+
+static gboolean store_set_repository (const char* mountPoint, const char* repoDir, gboolean persist)
+{
+    g_return_val_if_fail (mountPoint && '/' == mountPoint[0], FALSE);
+    g_return_val_if_fail (!repoDir || '/' == repoDir[0], FALSE);
+
+    gboolean ret = TRUE;
+    char mountKey[BACKUP_KEY_SIZE];
+
+    g_mutex_lock (&gsStoresLock);
+    const BackupStore* store = gsStores ? g_hash_table_lookup (gsStores, mountPoint) : NULL;
+    if (store) {
+        // 已在使用, 只接受与当前相同的位置
+        char* root = (repoDir && backup_path_key (mountPoint, mountKey))
+            ? g_strdup_printf ("%s/%s", repoDir, mountKey)
+            : g_strdup_printf ("%s/.%s", mountPoint, BACKUP_STR);
+        ret = (0 == g_strcmp0 (store->root, root));
+        STR_FREE(root);
+    }
+    else if (persist) {
+        ret = store_repository_save (mountPoint, repoDir);
+    }
+    else {
+        if (!gsLocalRepositories) {
+            gsLocalRepositories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        }
+        if (repoDir) {
+            g_hash_table_replace (gsLocalRepositories, g_strdup (mountPoint), g_strdup (repoDir));
+        }
+        else {
+            g_hash_table_remove (gsLocalRepositories, mountPoint);
+        }
+    }
+    g_mutex_unlock (&gsStoresLock);
+
+    return ret;
+}
+
+gboolean backup_store_set_dedup (const char* mountPoint, gboolean enabled)
+{
+    if (!mountPoint) {
+        g_mutex_lock (&gsStoresLock);
+        gsDefaultDedup = enabled;
+        if (gsStores) {
+            GHashTableIter iter;
+            gpointer value = NULL;
+            g_hash_table_iter_init (&iter, gsStores);
+            while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                g_atomic_int_set (&((BackupStore*) value)->dedup, enabled);
+            }
+        }
+        g_mutex_unlock (&gsStoresLock);
+        return TRUE;
+    }
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, FALSE);
+
+    g_atomic_int_set (&store->dedup, enabled);
+
+    return TRUE;
+}
+
+gboolean backup_store_set_delta (const char* mountPoint, gboolean enabled)
+{
+    if (!mountPoint) {
+        g_mutex_lock (&gsStoresLock);
+        gsDefaultDelta = enabled;
+        if (gsStores) {
+            GHashTableIter iter;
+            gpointer value = NULL;
+            g_hash_table_iter_init (&iter, gsStores);
+            while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                g_atomic_int_set (&((BackupStore*) value)->delta, enabled);
+            }
+        }
+        g_mutex_unlock (&gsStoresLock);
+        return TRUE;
+    }
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, FALSE);
+
+    g_atomic_int_set (&store->delta, enabled);
+
+    return TRUE;
+}
+
+gboolean backup_store_set_pack (const char* mountPoint, guint maxFileSize)
+{
+    g_return_val_if_fail (maxFileSize <= PACK_BLOB_MAX, FALSE);
+
+    if (!mountPoint) {
+        g_mutex_lock (&gsStoresLock);
+        gsDefaultPackMax = maxFileSize;
+        if (gsStores) {
+            GHashTableIter iter;
+            gpointer value = NULL;
+            g_hash_table_iter_init (&iter, gsStores);
+            while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                g_atomic_int_set (&((BackupStore*) value)->packMax, (gint) maxFileSize);
+            }
+        }
+        g_mutex_unlock (&gsStoresLock);
+        return TRUE;
+    }
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, FALSE);
+
+    g_atomic_int_set (&store->packMax, (gint) maxFileSize);
+
+    return TRUE;
+}
+
+guint64 backup_store_get_quota (const char* mountPoint)
+{
+    g_return_val_if_fail (mountPoint, 0);
+
+    gint32 status = 0;
+    guint64 value = 0;
+    if (backup_daemon_forward (DAEMON_OP_QUOTA, mountPoint, &status, &value) && 0 == status) {
+        return value;
+    }
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, 0);
+
+    return backup_store_limit (store);
+}
+
+guint64 backup_store_get_usage (const char* mountPoint)
+{
+    g_return_val_if_fail (mountPoint, 0);
+
+    gint32 status = 0;
+    guint64 value = 0;
+    if (backup_daemon_forward (DAEMON_OP_USAGE, mountPoint, &status, &value) && 0 == status) {
+        return value;
+    }
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, 0);
+
+    store_usage_ensure (store);
+    g_mutex_lock (&store->lock);
+    const guint64 usage = store->usage;
+    g_mutex_unlock (&store->lock);
+
+    return usage;
+}
+
+guint64 backup_store_evict (const char* mountPoint, guint64 bytes)
+{
+    g_return_val_if_fail (mountPoint, 0);
+
+    BackupStore* store = backup_store_get (mountPoint);
+    g_return_val_if_fail (store, 0);
+
+    return store_evict_exclusive (store, bytes);
+}
+
+void backup_store_start_evictor (guint intervalSec)
+{
+    g_return_if_fail (intervalSec > 0);
+
+    g_mutex_lock (&gsEvictorLock);
+    gsEvictorInterval = intervalSec;
+    if (!gsEvictor) {
+        gsEvictorStop = FALSE;
+        gsEvictor = g_thread_new ("backup-evictor", store_evictor_thread, NULL);
+    }
+    g_cond_signal (&gsEvictorCond);
+    g_mutex_unlock (&gsEvictorLock);
+}
+
+void backup_store_stop_evictor ()
+{
+    GThread* th = NULL;
+
+    g_mutex_lock (&gsEvictorLock);
+    gsEvictorStop = TRUE;
+    th = gsEvictor;
+    gsEvictor = NULL;
+    g_cond_signal (&gsEvictorCond);
+    g_mutex_unlock (&gsEvictorLock);
+
+    if (th) {
+        g_thread_join (th);
+    }
+}
+
+BackupStore* backup_store_get (const char* mountPoint)
+{
+    g_return_val_if_fail (mountPoint, NULL);
+
+    BackupStore* store = NULL;
+
+    g_mutex_lock (&gsStoresLock);
+    if (G_UNLIKELY(!gsStores)) {
+        gsStores = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+    store = g_hash_table_lookup (gsStores, mountPoint);
+    if (!store) {
+        store = g_new0 (BackupStore, 1);
+        const char* localDir = gsLocalRepositories ? g_hash_table_lookup (gsLocalRepositories, mountPoint) : NULL;
+        char* repoDir = localDir ? g_strdup (localDir) : store_repository_load (mountPoint);
+        char mountKey[BACKUP_KEY_SIZE];
+        store->mountPoint = g_strdup (mountPoint);
+        if (repoDir && backup_path_key (mountPoint, mountKey)) {
+            store->root = g_strdup_printf ("%s/%s", repoDir, mountKey);
+            store->volume = g_strdup (repoDir);
+        }
+        else {
+            store->root = g_strdup_printf ("%s/.%s", mountPoint, BACKUP_STR);
+            store->volume = g_strdup (mountPoint);
+        }
+        STR_FREE(repoDir);
+        store->quotaBytes = gsDefaultQuotaBytes;
+        store->quotaPercent = gsDefaultQuotaPercent;
+        store->dedup = gsDefaultDedup;
+        store->packMax = (gint) gsDefaultPackMax;
+        store->delta = gsDefaultDelta;
+        store->fromDepth = -1;
+        store->metaFd = -1;
+        store->backupFd = -1;
+        store->rootFd = -1;
+        store->chunkFd = -1;
+        g_mutex_init (&store->lock);
+        g_cond_init (&store->evictCond);
+        g_rw_lock_init (&store->chunkLock);
+        g_mutex_init (&store->packLock);
+        g_mutex_init (&store->indexLock);
+        for (int i = 0; i < STORE_KEY_LOCK_N; ++i) {
+            g_mutex_init (&store->keyLocks[i]);
+        }
+        g_hash_table_insert (gsStores, store->mountPoint, store);
+    }
+    g_mutex_unlock (&gsStoresLock);
+
+    // 其它进程可能正在迁移目录布局, 最多每秒重新读取一次; 上次迁移未完成(迁移进程退出)时接着迁移
+    gboolean resume = FALSE;
+    const gint64 now = g_get_monotonic_time();
+    g_mutex_lock (&store->lock);
+    if (0 == store->layoutCheckTime || now - store->layoutCheckTime > STORE_LAYOUT_CHECK_US) {
+        store->layoutCheckTime = now;
+        store_layout_load (store);
+        store_dir_check (&store->metaFd);
+        store_dir_check (&store->backupFd);
+        store_dir_check (&store->rootFd);
+        store_dir_check (&store->chunkFd);
+        if (store->fromDepth >= 0 && !store->migrating) {
+            store->migrating = TRUE;
+            resume = TRUE;
+        }
+    }
+    g_mutex_unlock (&store->lock);
+
+    if (resume) {
+        g_thread_unref (g_thread_new ("backup-layout", store_migrate_thread, store));
+    }
+
+    return store;
+}
+
+void backup_store_lock_key (BackupStore* store, const char* key)
+{
+    g_return_if_fail (store && key);
+
+    GMutex* lock = &store->keyLocks[g_str_hash (key) % STORE_KEY_LOCK_N];
+    if (!g_mutex_trylock (lock)) {
+        BackupTraceSpan span;
+        TRACE_BEGIN(span, BACKUP_TRACE_LOCK, key);
+        g_mutex_lock (lock);
+        TRACE_END(span, 0);
+    }
+}
+
+gboolean backup_store_trylock_key (BackupStore* store, const char* key)
+{
+    g_return_val_if_fail (store && key, FALSE);
+
+    return g_mutex_trylock (&store->keyLocks[g_str_hash (key) % STORE_KEY_LOCK_N]);
+}
+
+void backup_store_unlock_key (BackupStore* store, const char* key)
+{
+    g_return_if_fail (store && key);
+
+    g_mutex_unlock (&store->keyLocks[g_str_hash (key) % STORE_KEY_LOCK_N]);
+}
+
+int backup_store_meta_fd (BackupStore* store)
+{
+    g_return_val_if_fail (store, -1);
+
+    return store_dir_fd (store, &store->metaFd, "meta");
+}
+
+int backup_store_backup_fd (BackupStore* store)
+{
+    g_return_val_if_fail (store, -1);
+
+    return store_dir_fd (store, &store->backupFd, "backup");
+}
+
+int backup_store_root_fd (BackupStore* store)
+{
+    g_return_val_if_fail (store, -1);
+
+    return store_dir_fd (store, &store->rootFd, ".");
+}
+
+int backup_store_chunk_fd (BackupStore* store)
+{
+    g_return_val_if_fail (store, -1);
+
+    if (g_atomic_int_get (&store->chunkFd) < 0) {
+        const int rootFd = backup_store_root_fd (store);
+        if (rootFd >= 0) {
+            mkdirat (rootFd, DEDUP_CHUNK_DIR, 0755);
+        }
+    }
+
+    return store_dir_fd (store, &store->chunkFd, DEDUP_CHUNK_DIR);
+}
+
+gboolean backup_store_meta_rel (BackupStore* store, const char* key, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (store && key && buf, FALSE);
+
+    return store_build_rel (key, g_atomic_int_get (&store->depth), key, buf, bufLen);
+}
+
+gboolean backup_store_blob_rel (BackupStore* store, const char* key, int slot, const char* suffix, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (store && key && buf, FALSE);
+
+    char name[128];
+    if (g_snprintf (name, sizeof (name), "%s-%d%s", key, slot, suffix ? suffix : "") >= (int) sizeof (name)) {
+        return FALSE;
+    }
+
+    return store_build_rel (key, g_atomic_int_get (&store->depth), name, buf, bufLen);
+}
+
+gboolean backup_store_meta_path (BackupStore* store, const char* key, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (store && key && buf, FALSE);
+
+    return store_build_path (store, "meta", key, g_atomic_int_get (&store->depth), key, buf, bufLen);
+}
+
+gboolean backup_store_blob_path (BackupStore* store, const char* key, int slot, const char* suffix, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (store && key && buf, FALSE);
+
+    char name[128];
+    if (g_snprintf (name, sizeof (name), "%s-%d%s", key, slot, suffix ? suffix : "") >= (int) sizeof (name)) {
+        return FALSE;
+    }
+
+    return store_build_path (store, "backup", key, g_atomic_int_get (&store->depth), name, buf, bufLen);
+}
+
+guint64 backup_store_remove_slot (BackupStore* store, const char* key, int slot)
+{
+    g_return_val_if_fail (store && key, 0);
+
+    guint64 freed = 0;
+    char path[STORE_PATH_MAX];
+    const char* suffixes[] = STORE_SLOT_SUFFIXES;
+    const int dirFd = backup_store_backup_fd (store);
+
+    for (int i = 0; dirFd >= 0 && suffixes[i]; ++i) {
+        if (backup_store_blob_rel (store, key, slot, suffixes[i], path, sizeof (path))) {
+            const guint64 usage = backup_store_file_usage_at (dirFd, path);
+            if (0 == unlinkat (dirFd, path, 0)) {
+                freed += usage;
+            }
+        }
+    }
+
+    return freed;
+}
+
+void backup_store_rename_slot (BackupStore* store, const char* key, int fromSlot, int toSlot)
+{
+    g_return_if_fail (store && key);
+
+    char oldPath[STORE_PATH_MAX];
+    char newPath[STORE_PATH_MAX];
+    const char* suffixes[] = STORE_SLOT_SUFFIXES;
+    const int dirFd = backup_store_backup_fd (store);
+
+    for (int i = 0; dirFd >= 0 && suffixes[i]; ++i) {
+        if (backup_store_blob_rel (store, key, fromSlot, suffixes[i], oldPath, sizeof (oldPath))
+            && backup_store_blob_rel (store, key, toSlot, suffixes[i], newPath, sizeof (newPath))) {
+            if (0 != renameat (dirFd, oldPath, dirFd, newPath)) {
+                unlinkat (dirFd, newPath, 0);
+            }
+        }
+    }
+}
+
+/**
+ * 布局迁移期间, 把某个 key 的 meta 与所有版本从旧深度移到当前深度, 调用者需持有该 key 的锁
+ */
+void backup_store_settle_key (BackupStore* store, const char* key)
+{
+    g_return_if_fail (store && key);
+
+    g_mutex_lock (&store->lock);
+    const int depth = store->depth;
+    const int fromDepth = store->fromDepth;
+    g_mutex_unlock (&store->lock);
+
+    if (fromDepth < 0 || fromDepth == depth) {
+        return;
+    }
+
+    char name[128];
+    char oldPath[STORE_PATH_MAX];
+    char newPath[STORE_PATH_MAX];
+    const char* suffixes[] = STORE_SLOT_SUFFIXES;
+    const int metaFd = backup_store_meta_fd (store);
+    const int backupFd = backup_store_backup_fd (store);
+
+    if (metaFd < 0 || backupFd < 0) {
+        return;
+    }
+    if (!store_build_rel (key, depth, key, newPath, sizeof (newPath)) || 0 == faccessat (metaFd, newPath, F_OK, 0)) {
+        return;
+    }
+    if (!store_build_rel (key, fromDepth, key, oldPath, sizeof (oldPath)) || 0 != faccessat (metaFd, oldPath, F_OK, 0)) {
+        return;
+    }
+
+    // 先移版本文件再移 meta, 中途失败时 meta 仍在旧位置, 下次会继续
+    for (int slot = 1; slot <= 3; ++slot) {
+        for (int i = 0; suffixes[i]; ++i) {
+            g_snprintf (name, sizeof (name), "%s-%d%s", key, slot, suffixes[i]);
+            if (store_build_rel (key, fromDepth, name, oldPath, sizeof (oldPath))
+                && store_build_rel (key, depth, name, newPath, sizeof (newPath))) {
+                renameat (backupFd, oldPath, backupFd, newPath);
+            }
+        }
+    }
+
+    store_build_rel (key, fromDepth, key, oldPath, sizeof (oldPath));
+    store_build_rel (key, depth, key, newPath, sizeof (newPath));
+    renameat (metaFd, oldPath, metaFd, newPath);
+}
+
+void backup_store_note_new_key (BackupStore* store)
+{
+    g_return_if_fail (store);
+
+    gboolean start = FALSE;
+
+    g_mutex_lock (&store->lock);
+    store->metaCount++;
+    if (store->usageValid && !store->migrating && store_wanted_depth (store->metaCount) > store->depth) {
+        store->migrating = TRUE;
+        start = TRUE;
+    }
+    g_mutex_unlock (&store->lock);
+
+    if (start) {
+        g_thread_unref (g_thread_new ("backup-layout", store_migrate_thread, store));
+    }
+}
+
+gboolean backup_store_is_migrating (BackupStore* store)
+{
+    g_return_val_if_fail (store, FALSE);
+
+    g_mutex_lock (&store->lock);
+    const gboolean ret = store->migrating || store->fromDepth >= 0;
+    g_mutex_unlock (&store->lock);
+
+    return ret;
+}
+
+/**
+ * 遍历 <root>/<sub> 下所有普通文件, 不论其处于哪一层分层目录
+ */
+void backup_store_walk (BackupStore* store, const char* sub, BackupStoreWalkFunc func, gpointer data)
+{
+    g_return_if_fail (store && sub && func);
+
+    char relPath[STORE_PATH_MAX] = {0};
+    char* dir = g_strdup_printf ("%s/%s", store->root, sub);
+    const int fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        store_walk_dir (fd, relPath, 0, 0, FALSE, func, data);
+    }
+
+    STR_FREE(dir);
+}
+
+/**
+ * 只遍历 <root>/<sub> 下以 '.' 开头的普通文件(写入中途的临时文件), 供清理任务回收崩溃后的残留
+ */
+void backup_store_walk_hidden (BackupStore* store, const char* sub, BackupStoreWalkFunc func, gpointer data)
+{
+    g_return_if_fail (store && sub && func);
+
+    char relPath[STORE_PATH_MAX] = {0};
+    char* dir = g_strdup_printf ("%s/%s", store->root, sub);
+    const int fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        store_walk_dir (fd, relPath, 0, 0, TRUE, func, data);
+    }
+
+    STR_FREE(dir);
+}
+
+guint64 backup_store_limit (BackupStore* store)
+{
+    g_return_val_if_fail (store, 0);
+
+    guint64 limit = 0;
+    struct statvfs fsBuf;
+
+    g_mutex_lock (&store->lock);
+    const guint64 quotaBytes = store->quotaBytes;
+    const guint quotaPercent = store->quotaPercent;
+    g_mutex_unlock (&store->lock);
+
+    if (quotaPercent > 0 && 0 == statvfs (store->volume, &fsBuf)) {
+        limit = (guint64) fsBuf.f_blocks * fsBuf.f_frsize / 100 * quotaPercent;
+    }
+
+    if (quotaBytes > 0 && (0 == limit || quotaBytes < limit)) {
+        limit = quotaBytes;
+    }
+
+    return limit;
+}
+
+gboolean backup_store_reserve (BackupStore* store, guint64 bytes)
+{
+    g_return_val_if_fail (store, FALSE);
+
+    guint64 need = 0;
+    const guint64 limit = backup_store_limit (store);
+
+    gboolean ret = store_try_reserve (store, bytes, limit, &need);
+    if (!ret) {
+        // 超出配额: 交给后台淘汰(同时超额的备份共用一次扫描), 等待有限的时间后重试一次, 仍放不下则拒绝本次备份
+        store_evict_wait (store, bytes, limit);
+        ret = store_try_reserve (store, bytes, limit, &need);
+    }
+    if (!ret) {
+        errno = ENOSPC;
+    }
+
+    return ret;
+}
+
+void backup_store_usage_add (BackupStore* store, gint64 delta)
+{
+    g_return_if_fail (store);
+
+    g_mutex_lock (&store->lock);
+    if (store->usageScanning) {
+        store->usageScanDelta += delta;
+    }
+    if (store->usageValid) {
+        if (delta < 0 && (guint64) (-delta) > store->usage) {
+            store->usage = 0;
+        }
+        else {
+            store->usage += delta;
+        }
+    }
+    g_mutex_unlock (&store->lock);
+}
+
+guint64 backup_store_file_usage (const char* path)
+{
+    g_return_val_if_fail (path, 0);
+
+    return backup_store_file_usage_at (AT_FDCWD, path);
+}
+
+guint64 backup_store_file_usage_at (int dirFd, const char* relPath)
+{
+    g_return_val_if_fail (relPath, 0);
+
+    struct stat statBuf;
+    if (0 != fstatat (dirFd, relPath, &statBuf, 0)) {
+        return 0;
+    }
+
+    return (guint64) statBuf.st_blocks * 512;
+}
+
+static gboolean store_try_reserve (BackupStore* store, guint64 bytes, guint64 limit, guint64* need)
+{
+    g_return_val_if_fail (store && need, FALSE);
+
+    gboolean ret = FALSE;
+
+    store_usage_ensure (store);
+    g_mutex_lock (&store->lock);
+    if (0 == limit || store->usage + bytes <= limit) {
+        store->usage += bytes;
+        if (store->usageScanning) {
+            store->usageScanDelta += (gint64) bytes;
+        }
+        ret = TRUE;
+    }
+    else {
+        *need = store->usage + bytes - limit;
+    }
+    g_mutex_unlock (&store->lock);
+
+    return ret;
+}
+
+/**
+ * 首次统计不持有 store->lock, 遍历期间其它线程的预留与淘汰不被阻塞; 并发统计时以先完成的为准
+ */
+static void store_usage_ensure (BackupStore* store)
+{
+    guint64 usage = 0;
+    guint64 metaCount = 0;
+
+    g_mutex_lock (&store->lock);
+    const gboolean valid = store->usageValid;
+    g_mutex_unlock (&store->lock);
+    if (valid) {
+        return;
+    }
+
+    store_usage_scan (store, &usage, &metaCount);
+
+    g_mutex_lock (&store->lock);
+    if (!store->usageValid) {
+        store->usage = usage;
+        store->metaCount = metaCount;
+        store->usageValid = TRUE;
+    }
+    g_mutex_unlock (&store->lock);
+}
+
+/**
+ * 只读取仓库, 不访问 store 的字段, 调用者无需持有 store->lock
+ */
+static void store_usage_scan (BackupStore* store, guint64* usage, guint64* metaCount)
+{
+    g_return_if_fail (store && usage && metaCount);
+
+    UsageScan scan;
+    memset (&scan, 0, sizeof (scan));
+
+    scan.store = store;
+    scan.batched = backup_io_uring_enabled();
+    scan.countMeta = TRUE;
+    scan.sub = "meta";
+    backup_store_walk (store, scan.sub, store_usage_scan_cb, &scan);
+    store_usage_scan_flush (&scan);
+    scan.countMeta = FALSE;
+    scan.sub = "backup";
+    backup_store_walk (store, scan.sub, store_usage_scan_cb, &scan);
+    store_usage_scan_flush (&scan);
+    scan.sub = DEDUP_CHUNK_DIR;
+    backup_store_walk (store, scan.sub, store_usage_scan_cb, &scan);
+    store_usage_scan_flush (&scan);
+    scan.sub = PACK_DIR;
+    backup_store_walk (store, scan.sub, store_usage_scan_cb, &scan);
+    store_usage_scan_flush (&scan);
+    scan.sub = INDEX_DIR;
+    backup_store_walk (store, scan.sub, store_usage_scan_cb, &scan);
+    store_usage_scan_flush (&scan);
+
+    *usage = scan.usage;
+    *metaCount = scan.metaCount;
+}
+
+static void store_usage_scan_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    UsageScan* scan = data;
+    struct stat statBuf;
+
+    if (scan->batched) {
+        scan->paths[scan->pathN++] = g_strdup_printf ("%s/%s/%s", scan->store->root, scan->sub, relPath);
+        if (IO_BATCH_N == scan->pathN) {
+            store_usage_scan_flush (scan);
+        }
+    }
+    else if (0 == fstatat (dirFd, name, &statBuf, AT_SYMLINK_NOFOLLOW)) {
+        scan->usage += (guint64) statBuf.st_blocks * 512;
+    }
+    if (scan->countMeta) {
+        scan->metaCount++;
+    }
+}
+
+/**
+ * 目录 fd 在回调返回后可能已被关闭, 因此批量时记录完整路径
+ */
+static void store_usage_scan_flush (UsageScan* scan)
+{
+    guint64 usage[IO_BATCH_N];
+
+    const gboolean batched = backup_io_disk_usage ((const char* const*) scan->paths, scan->pathN, usage);
+    for (guint i = 0; i < scan->pathN; ++i) {
+        if (batched && G_MAXUINT64 != usage[i]) {
+            scan->usage += usage[i];
+        }
+        else if (!batched) {
+            scan->usage += backup_store_file_usage (scan->paths[i]);
+        }
+        STR_FREE(scan->paths[i]);
+    }
+    scan->pathN = 0;
+}
+
+/**
+ * 按时间从旧到新淘汰历史版本, 每个文件最新的版本永远保留;
+ * 包中的版本没有自己的文件, 按引用计数判断记录是否已无人引用, 淘汰结束后压缩包文件回收;
+ * 去重版本删除的只是分块列表, 先按版本大小估计, 每轮结束回收无人引用的块后改为实际释放的字节数, 不够再继续淘汰
+ */
+static guint64 store_evict (BackupStore* store, guint64 need)
+{
+    g_return_val_if_fail (store, 0);
+
+    guint64 freed = 0;
+    guint64 packDead = 0;
+    EvictScan scan;
+    char metaPath[STORE_PATH_MAX];
+
+    scan.store = store;
+    scan.candidates = g_array_new (FALSE, TRUE, sizeof (EvictCandidate));
+    scan.packRefs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    backup_store_walk (store, "meta", store_evict_scan_cb, &scan);
+
+    g_array_sort (scan.candidates, evict_candidate_compare);
+
+    guint i = 0;
+    while (i < scan.candidates->len && freed < need) {
+        guint64 chunkDead = 0;
+        for (; i < scan.candidates->len && freed < need; ++i) {
+            const EvictCandidate* c = &g_array_index (scan.candidates, EvictCandidate, i);
+            BackupMetaFile meta;
+
+            memset (&meta, 0, sizeof (meta));
+
+            // 正在备份/恢复的文件直接跳过; 调用者自己也可能持有某个 key 的锁, 这里不能阻塞等待
+            if (!backup_store_trylock_key (store, c->key)) {
+                continue;
+            }
+            backup_store_settle_key (store, c->key);
+            // 扫描之后 meta 可能已被并发的备份改写, 这里重新校验
+            if (backup_store_meta_rel (store, c->key, metaPath, sizeof (metaPath))
+                && backup_meta_parse_at (&meta, backup_store_meta_fd (store), metaPath)
+                && *backup_meta_slot_ctx (&meta, c->slot)
+                && *backup_meta_slot_timestamp (&meta, c->slot) == c->timestamp) {
+                // 以该版本为基础的增量先合并为完整文件, 实际释放的是两者之差
+                const gint64 detached = backup_delta_detach (store, c->key, &meta, c->slot);
+                backup_store_usage_add (store, detached);
+                char* ctxMD5 = *backup_meta_slot_ctx (&meta, c->slot);
+                *backup_meta_slot_ctx (&meta, c->slot) = NULL;
+                *backup_meta_slot_timestamp (&meta, c->slot) = 0;
+                const guint64 chunkBytes = store_evict_recipe_bytes (store, c->key, c->slot);
+                if (backup_meta_save (&meta, c->key, store->mountPoint)) {
+                    const guint64 blobUsage = backup_store_remove_slot (store, c->key, c->slot);
+                    freed += (guint64) MAX ((gint64) blobUsage - detached, 0);
+                    backup_store_usage_add (store, - (gint64) blobUsage);
+                    chunkDead += chunkBytes;
+                    freed += chunkBytes;
+                    // 最后一个引用包中记录的版本被淘汰, 记录的空间在压缩后释放, 先计入以免继续淘汰
+                    const guint refs = GPOINTER_TO_UINT (g_hash_table_lookup (scan.packRefs, ctxMD5));
+                    if (1 == refs) {
+                        const guint64 size = backup_pack_size (store, ctxMD5);
+                        packDead += size;
+                        freed += size;
+                    }
+                    if (refs > 0) {
+                        g_hash_table_insert (scan.packRefs, g_strdup (ctxMD5), GUINT_TO_POINTER (refs - 1));
+                    }
+                    if (meta.srcFilePath) {
+                        backup_monitor_notify (meta.srcFilePath, G_FILE_MONITOR_EVENT_CHANGED);
+                    }
+                }
+                STR_FREE(ctxMD5);
+            }
+            backup_store_unlock_key (store, c->key);
+
+            backup_meta_free (&meta);
+        }
+
+        // 回收自行调整用量; 与其它版本共享的块不会释放, 实际值通常小于估计
+        if (chunkDead > 0) {
+            freed = freed - chunkDead + backup_dedup_sweep (store);
+        }
+    }
+
+    // 压缩自行调整用量, 返回值按实际回收的字节数计
+    if (packDead > 0) {
+        freed = freed - packDead + backup_pack_repack (store, 0, NULL);
+    }
+
+    NOT_NULL_RUN(scan.candidates, g_array_unref);
+    NOT_NULL_RUN(scan.packRefs, g_hash_table_unref);
+
+    return freed;
+}
+
+static guint64 store_evict_recipe_bytes (BackupStore* store, const char* key, int slot)
+{
+    guint64 bytes = 0;
+    char path[STORE_PATH_MAX];
+
+    if (backup_store_blob_path (store, key, slot, DEDUP_RECIPE_SUFFIX, path, sizeof (path))) {
+        backup_dedup_recipe_foreach (path, store_evict_chunk_cb, &bytes);
+    }
+
+    return bytes;
+}
+
+static void store_evict_chunk_cb (const char* chunkHex, guint32 len, gpointer data)
+{
+    *(guint64*) data += len;
+
+    (void) chunkHex;
+}
+
+/**
+ * 没有后台淘汰在运行时启动一个, 与后台淘汰线程一样降到低水位, 给随后的备份留出余量
+ */
+static void store_evict_wait (BackupStore* store, guint64 bytes, guint64 limit)
+{
+    const gint64 deadline = g_get_monotonic_time() + STORE_EVICT_WAIT_US;
+    const guint64 low = limit / 100 * STORE_EVICT_LOW_WATERMARK;
+
+    g_mutex_lock (&store->lock);
+    if (!store->evicting) {
+        store->evicting = TRUE;
+        store->evictNeed = (store->usage + bytes > low) ? store->usage + bytes - low : bytes;
+        g_thread_unref (g_thread_new ("backup-evict", store_evict_thread, store));
+    }
+    while (store->evicting && g_cond_wait_until (&store->evictCond, &store->lock, deadline));
+    g_mutex_unlock (&store->lock);
+}
+
+/**
+ * 手动与定期淘汰: 等正在进行的淘汰结束后再开始, 与按需淘汰(store_evict_wait)互斥, 不会重复选中同一批版本
+ */
+static guint64 store_evict_exclusive (BackupStore* store, guint64 need)
+{
+    g_mutex_lock (&store->lock);
+    while (store->evicting) {
+        g_cond_wait (&store->evictCond, &store->lock);
+    }
+    store->evicting = TRUE;
+    g_mutex_unlock (&store->lock);
+
+    const guint64 freed = store_evict (store, need);
+
+    g_mutex_lock (&store->lock);
+    store->evicting = FALSE;
+    g_cond_broadcast (&store->evictCond);
+    g_mutex_unlock (&store->lock);
+
+    return freed;
+}
+
+static gpointer store_evict_thread (gpointer data)
+{
+    BackupStore* store = data;
+
+    g_mutex_lock (&store->lock);
+    const guint64 need = store->evictNeed;
+    g_mutex_unlock (&store->lock);
+
+    store_evict (store, need);
+
+    g_mutex_lock (&store->lock);
+    store->evicting = FALSE;
+    g_cond_broadcast (&store->evictCond);
+    g_mutex_unlock (&store->lock);
+
+    return NULL;
+}
+
+static void store_evict_scan_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    EvictScan* scan = data;
+    BackupMetaFile meta;
+
+    if (strlen (name) >= sizeof (((EvictCandidate*) NULL)->key)) {
+        return;
+    }
+
+    if (backup_meta_parse_at (&meta, dirFd, name)) {
+        int newest = 0;
+        for (int slot = 1; slot <= 3; ++slot) {
+            if (*backup_meta_slot_ctx (&meta, slot)
+                && (0 == newest || *backup_meta_slot_timestamp (&meta, slot) >= *backup_meta_slot_timestamp (&meta, newest))) {
+                newest = slot;
+            }
+        }
+        for (int slot = 1; slot <= 3; ++slot) {
+            if (*backup_meta_slot_ctx (&meta, slot)) {
+                backup_pack_ref (scan->store, scan->packRefs, *backup_meta_slot_ctx (&meta, slot));
+            }
+            if (slot != newest && *backup_meta_slot_ctx (&meta, slot)) {
+                EvictCandidate c;
+                memset (&c, 0, sizeof (c));
+                c.slot = slot;
+                c.timestamp = *backup_meta_slot_timestamp (&meta, slot);
+                g_strlcpy (c.key, name, sizeof (c.key));
+                g_array_append_val (scan->candidates, c);
+            }
+        }
+    }
+    backup_meta_free (&meta);
+
+    (void) relPath;
+}
+
+static gint evict_candidate_compare (gconstpointer a, gconstpointer b)
+{
+    const EvictCandidate* c1 = a;
+    const EvictCandidate* c2 = b;
+
+    return (c1->timestamp > c2->timestamp) - (c1->timestamp < c2->timestamp);
+}
+
+static gpointer store_evictor_thread (gpointer data)
+{
+    g_mutex_lock (&gsEvictorLock);
+    while (!gsEvictorStop) {
+        const gint64 deadline = g_get_monotonic_time() + (gint64) gsEvictorInterval * G_USEC_PER_SEC;
+        while (!gsEvictorStop && g_cond_wait_until (&gsEvictorCond, &gsEvictorLock, deadline));
+        BREAK_IF_FAIL(!gsEvictorStop);
+        g_mutex_unlock (&gsEvictorLock);
+
+        GList* mps = get_all_mount_points();
+        for (GList* itr = mps; itr; itr = itr->next) {
+            char* root = g_strdup_printf ("%s/.%s", (char*) itr->data, BACKUP_STR);
+            if (0 == access (root, F_OK)) {
+                BackupStore* store = backup_store_get (itr->data);
+                const guint64 limit = backup_store_limit (store);
+                // 其它进程也会写仓库, 每轮都重新统计; 统计期间不持有 store->lock, 这期间本进程的预留与增减
+                // 另外累计, 统计结束后叠加上去, 不会被统计结果覆盖掉
+                guint64 usage = 0;
+                guint64 metaCount = 0;
+                g_mutex_lock (&store->lock);
+                store->usageScanning = TRUE;
+                store->usageScanDelta = 0;
+                g_mutex_unlock (&store->lock);
+                store_usage_scan (store, &usage, &metaCount);
+                g_mutex_lock (&store->lock);
+                const gint64 drift = store->usageScanDelta;
+                usage = (drift < 0 && (guint64) (-drift) > usage) ? 0 : usage + drift;
+                store->usage = usage;
+                store->metaCount = metaCount;
+                store->usageValid = TRUE;
+                store->usageScanning = FALSE;
+                g_mutex_unlock (&store->lock);
+                if (limit > 0 && usage > limit) {
+                    store_evict_exclusive (store, usage - limit / 100 * STORE_EVICT_LOW_WATERMARK);
+                }
+                // 包文件: 空闲时把攒着的写入落盘, 并定期压缩淘汰后留下的空洞
+                backup_pack_sync (store);
+                backup_pack_repack (store, STORE_REPACK_INTERVAL_SEC, NULL);
+            }
+            STR_FREE(root);
+        }
+        NOT_NULL_RUN(mps, g_list_free_full, g_free);
+
+        g_mutex_lock (&gsEvictorLock);
+    }
+    g_mutex_unlock (&gsEvictorLock);
+
+    return NULL;
+
+    (void) data;
+}
+
+/**
+ * 目录 fd 只打开一次, 之后不加锁读取; 打开失败时返回 -1 并保留 open 的 errno, 下次调用再试
+ */
+static int store_dir_fd (BackupStore* store, int* fd, const char* sub)
+{
+    int ret = g_atomic_int_get (fd);
+    if (G_LIKELY(ret >= 0)) {
+        return ret;
+    }
+
+    int err = 0;
+    g_mutex_lock (&store->lock);
+    ret = *fd;
+    if (ret < 0) {
+        char* dir = g_strdup_printf ("%s/%s", store->root, sub);
+        ret = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ret >= 0) {
+            g_atomic_int_set (fd, ret);
+        }
+        else {
+            err = errno;
+        }
+        STR_FREE(dir);
+    }
+    g_mutex_unlock (&store->lock);
+
+    if (ret < 0) {
+        errno = err;
+    }
+
+    return ret;
+}
+
+/**
+ * 仓库目录被删除(之后会由备份重新创建)时丢弃旧的 fd, 调用者需持有 store->lock;
+ * 其它线程可能仍在使用旧 fd, 因此不关闭它, 只在这种少见情况下泄漏一个描述符
+ */
+static void store_dir_check (int* fd)
+{
+    struct stat statBuf;
+
+    if (*fd >= 0 && (0 != fstat (*fd, &statBuf) || 0 == statBuf.st_nlink)) {
+        g_atomic_int_set (fd, -1);
+    }
+}
+
+static gboolean store_build_rel (const char* key, int depth, const char* name, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (key && name && buf, FALSE);
+    g_return_val_if_fail (depth >= 0 && depth <= STORE_MAX_DEPTH && strlen (key) >= 2 * STORE_MAX_DEPTH, FALSE);
+
+    gsize len = 0;
+    if (depth * 3 >= bufLen) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < depth; ++i) {
+        buf[len++] = key[2 * i];
+        buf[len++] = key[2 * i + 1];
+        buf[len++] = '/';
+    }
+
+    return g_snprintf (buf + len, bufLen - len, "%s", name) < (int) (bufLen - len);
+}
+
+static gboolean store_build_path (BackupStore* store, const char* sub, const char* key, int depth, const char* name, char* buf, gsize bufLen)
+{
+    g_return_val_if_fail (store && sub && key && name && buf, FALSE);
+
+    const gsize len = (gsize) g_snprintf (buf, bufLen, "%s/%s/", store->root, sub);
+    if (len >= bufLen) {
+        return FALSE;
+    }
+
+    return store_build_rel (key, depth, name, buf + len, bufLen - len);
+}
+
+/**
+ * hidden 为 FALSE 时跳过以 '.' 开头的条目, 为 TRUE 时只对以 '.' 开头的文件调用 func
+ */
+static void store_walk_dir (int dirFd, char* relPath, gsize relLen, int level, gboolean hidden, BackupStoreWalkFunc func, gpointer data)
+{
+    DIR* d = fdopendir (dirFd);
+    if (!d) {
+        close (dirFd);
+        return;
+    }
+
+    struct dirent* ent = NULL;
+    while (NULL != (ent = readdir (d))) {
+        const char* name = ent->d_name;
+        if (0 == strcmp (name, ".") || 0 == strcmp (name, "..") || (!hidden && '.' == name[0])) {
+            continue;
+        }
+
+        const gsize nameLen = strlen (name);
+        if (relLen + nameLen + 2 >= STORE_PATH_MAX) {
+            continue;
+        }
+
+        gboolean isDir = (DT_DIR == ent->d_type);
+        if (DT_UNKNOWN == ent->d_type) {
+            struct stat statBuf;
+            isDir = (0 == fstatat (dirfd (d), name, &statBuf, AT_SYMLINK_NOFOLLOW)) && S_ISDIR(statBuf.st_mode);
+        }
+
+        memcpy (relPath + relLen, name, nameLen + 1);
+        if (isDir) {
+            if (level < STORE_MAX_DEPTH && store_is_shard_name (name)) {
+                const int subFd = openat (dirfd (d), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (subFd >= 0) {
+                    relPath[relLen + nameLen] = '/';
+                    relPath[relLen + nameLen + 1] = '\0';
+                    store_walk_dir (subFd, relPath, relLen + nameLen + 1, level + 1, hidden, func, data);
+                }
+            }
+        }
+        else if (!hidden || '.' == name[0]) {
+            func (dirfd (d), relPath, name, data);
+        }
+        relPath[relLen] = '\0';
+    }
+
+    closedir (d);
+}
+
+static gboolean store_is_shard_name (const char* name)
+{
+    return g_ascii_isxdigit (name[0]) && g_ascii_isxdigit (name[1]) && '\0' == name[2];
+}
+
+static int store_rel_level (const char* relPath)
+{
+    int level = 0;
+    for (const char* p = relPath; *p; ++p) {
+        if ('/' == *p) {
+            ++level;
+        }
+    }
+
+    return level;
+}
+
+static int store_wanted_depth (guint64 metaCount)
+{
+    int depth = 0;
+    guint64 capacity = STORE_SHARD_ENTRIES;
+
+    while (depth < STORE_MAX_DEPTH && metaCount > capacity) {
+        capacity *= 256;
+        ++depth;
+    }
+
+    return depth;
+}
+
+/**
+ * 没有设置独立仓库时返回 NULL
+ */
+static char* store_repository_load (const char* mountPoint)
+{
+    char* ctx = NULL;
+    char* repoFile = g_strdup_printf ("%s/.%s/" STORE_REPOSITORY_FILE, mountPoint, BACKUP_STR);
+
+    if (g_file_get_contents (repoFile, &ctx, NULL, NULL) && ctx) {
+        g_strstrip (ctx);
+        if ('/' != ctx[0]) {
+            STR_FREE(ctx);
+        }
+    }
+    STR_FREE(repoFile);
+
+    return ctx;
+}
+
+/**
+ * repoDir 为 NULL 时删除设置, 恢复默认仓库
+ */
+static gboolean store_repository_save (const char* mountPoint, const char* repoDir)
+{
+    gboolean ret = FALSE;
+    char* dir = g_strdup_printf ("%s/.%s", mountPoint, BACKUP_STR);
+    char* repoFile = g_strdup_printf ("%s/" STORE_REPOSITORY_FILE, dir);
+
+    if (repoDir) {
+        ret = (0 == g_mkdir_with_parents (dir, 0755)) && g_file_set_contents (repoFile, repoDir, -1, NULL);
+    }
+    else {
+        ret = (0 == unlink (repoFile) || ENOENT == errno);
+    }
+
+    STR_FREE(dir);
+    STR_FREE(repoFile);
+
+    return ret;
+}
+
+/**
+ * 布局文件格式: 1|<depth>|<fromDepth>, 调用者需持有 store->lock
+ */
+static void store_layout_load (BackupStore* store)
+{
+    char* ctx = NULL;
+    char** strArr = NULL;
+    char* layoutFile = g_strdup_printf ("%s/" STORE_LAYOUT_FILE, store->root);
+
+    store->depth = 0;
+    store->fromDepth = -1;
+
+    if (g_file_get_contents (layoutFile, &ctx, NULL, NULL) && ctx) {
+        strArr = g_strsplit (ctx, "|", -1);
+        if (strArr && 3 == g_strv_length (strArr) && 1 == strtol (strArr[0], NULL, 10)) {
+            const int depth = (int) strtol (strArr[1], NULL, 10);
+            const int fromDepth = (int) strtol (strArr[2], NULL, 10);
+            if (depth >= 0 && depth <= STORE_MAX_DEPTH) {
+                store->depth = depth;
+                store->fromDepth = (fromDepth >= 0 && fromDepth <= STORE_MAX_DEPTH) ? fromDepth : -1;
+            }
+        }
+    }
+
+    STR_FREE(ctx);
+    STR_FREE(layoutFile);
+    NOT_NULL_RUN(strArr, g_strfreev);
+}
+
+static gboolean store_layout_save (BackupStore* store, int depth, int fromDepth)
+{
+    char buf[32] = {0};
+    char* layoutFile = g_strdup_printf ("%s/" STORE_LAYOUT_FILE, store->root);
+
+    g_snprintf (buf, sizeof (buf), "1|%d|%d", depth, fromDepth);
+    const gboolean ret = g_file_set_contents (layoutFile, buf, -1, NULL);
+
+    STR_FREE(layoutFile);
+
+    return ret;
+}
+
+static void store_make_shard_dirs (BackupStore* store, const char* sub, int depth)
+{
+    char path[STORE_PATH_MAX];
+    const char* hex = "0123456789abcdef";
+
+    for (int i = 0; i < 256 && depth >= 1; ++i) {
+        g_snprintf (path, sizeof (path), "%s/%s/%c%c", store->root, sub, hex[i >> 4], hex[i & 0xF]);
+        mkdir (path, 0755);
+        for (int j = 0; j < 256 && depth >= 2; ++j) {
+            g_snprintf (path, sizeof (path), "%s/%s/%c%c/%c%c", store->root, sub, hex[i >> 4], hex[i & 0xF], hex[j >> 4], hex[j & 0xF]);
+            mkdir (path, 0755);
+        }
+    }
+}
+
+/**
+ * 在线迁移: 新写入立即使用新布局, 读取时由 backup_store_settle_key() 按需搬迁, 本线程在后台搬完剩余条目;
+ * 其它进程最多 STORE_LAYOUT_CHECK_US 后才读到新布局, 期间仍可能写到旧深度, 所以过了这段时间后
+ * 一次完整遍历在旧深度找不到任何条目, 才在布局文件中清除 fromDepth; 布局文件就是跨进程的完成标记
+ */
+static gpointer store_migrate_thread (gpointer data)
+{
+    BackupStore* store = data;
+    char* lockFile = g_strdup_printf ("%s/" STORE_LAYOUT_LOCK, store->root);
+
+    do {
+        const int lockFd = open (lockFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        BREAK_IF_FAIL(lockFd >= 0);
+        if (0 != flock (lockFd, LOCK_EX | LOCK_NB)) {
+            // 其它进程正在迁移
+            close (lockFd);
+            break;
+        }
+
+        // 持锁后重新读取, 上次迁移未完成时先把它做完, 不跨过中间深度
+        g_mutex_lock (&store->lock);
+        store_layout_load (store);
+        const int fromDepth = (store->fromDepth >= 0) ? store->fromDepth : store->depth;
+        const int depth = (store->fromDepth >= 0) ? store->depth : MAX (store->depth, store_wanted_depth (store->metaCount));
+        g_mutex_unlock (&store->lock);
+
+        if (depth > fromDepth) {
+            store_make_shard_dirs (store, "meta", depth);
+            store_make_shard_dirs (store, "backup", depth);
+
+            if (store_layout_save (store, depth, fromDepth)) {
+                const gint64 saved = g_get_monotonic_time();
+                MigrateScan scan;
+                memset (&scan, 0, sizeof (scan));
+                scan.store = store;
+                g_mutex_lock (&store->lock);
+                store->depth = depth;
+                store->fromDepth = fromDepth;
+                scan.depth = store->depth;
+                scan.fromDepth = store->fromDepth;
+                g_mutex_unlock (&store->lock);
+
+                for (int pass = 0; pass < STORE_MIGRATE_PASSES; ++pass) {
+                    const gboolean settled = (g_get_monotonic_time() - saved > 2 * STORE_LAYOUT_CHECK_US);
+                    scan.left = 0;
+                    backup_store_walk (store, "meta", store_migrate_meta_cb, &scan);
+                    backup_store_walk (store, "backup", store_migrate_blob_cb, &scan);
+                    if (settled && 0 == scan.left) {
+                        break;
+                    }
+                    g_usleep (STORE_LAYOUT_CHECK_US);
+                }
+
+                if (0 == scan.left && store_layout_save (store, depth, -1)) {
+                    g_mutex_lock (&store->lock);
+                    store->fromDepth = -1;
+                    g_mutex_unlock (&store->lock);
+                }
+            }
+        }
+
+        close (lockFd);
+    } while (FALSE);
+
+    g_mutex_lock (&store->lock);
+    store->migrating = FALSE;
+    g_mutex_unlock (&store->lock);
+
+    STR_FREE(lockFile);
+
+    return NULL;
+}
+
+static void store_migrate_meta_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    MigrateScan* scan = data;
+    BackupStore* store = scan->store;
+
+    if (store_rel_level (relPath) != scan->fromDepth || strlen (name) < 2 * STORE_MAX_DEPTH) {
+        return;
+    }
+
+    backup_store_lock_key (store, name);
+    backup_store_settle_key (store, name);
+    backup_store_unlock_key (store, name);
+
+    if (0 == faccessat (dirFd, name, F_OK, AT_SYMLINK_NOFOLLOW)) {
+        scan->left++;
+    }
+}
+
+/**
+ * 没有 meta 的版本文件(孤儿)也直接搬走, 留给清理任务处理
+ */
+static void store_migrate_blob_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    MigrateScan* scan = data;
+    BackupStore* store = scan->store;
+    char newPath[STORE_PATH_MAX];
+    const int backupFd = backup_store_backup_fd (store);
+
+    if (backupFd < 0 || store_rel_level (relPath) != scan->fromDepth || strlen (name) < 2 * STORE_MAX_DEPTH) {
+        return;
+    }
+
+    if (!store_build_rel (name, scan->depth, name, newPath, sizeof (newPath)) || 0 != renameat (dirFd, name, backupFd, newPath)) {
+        scan->left++;
+    }
+}
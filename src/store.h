@@ -0,0 +1,106 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_STORE_H
+#define gvfs_backup_STORE_H
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define STORE_KEY_LOCK_N                64
+#define STORE_MAX_DEPTH                 2
+#define STORE_PATH_MAX                  4096
+
+/**
+ * 同一版本除 <key>-N 之外还可能存在的附属文件后缀, 版本轮换与布局迁移时一起处理
+ */
+#define STORE_SLOT_SUFFIXES             { "", ".tree", ".chunks", ".delta", ".pack", NULL }
+
+typedef void (*BackupStoreWalkFunc) (int dirFd, const char* relPath, const char* name, gpointer data);
+
+/**
+ * 每个挂载点一个备份仓库, 默认为 <mountPoint>/.andsec-backup,
+ * 配置了独立仓库时为 <repoDir>/<挂载点路径的 MD5>; 进程内缓存, 不释放
+ */
+typedef struct _BackupStore
+{
+    char*                   mountPoint;
+    char*                   root;
+    char*                   volume;                         // 仓库所在位置, 用于按文件系统百分比计算配额
+    int                     metaFd;                         // 原子读写, meta/ 与 backup/ 的目录 fd, 首次使用时打开, -1 表示尚未打开
+    int                     backupFd;
+    int                     rootFd;                         // 原子读写, 仓库目录本身, 用于 pack/ 等其它子目录
+    int                     chunkFd;                        // 原子读写, 分块目录 chunks/, 首次写入分块时创建
+
+    GMutex                  lock;                           // 保护以下字段
+    gboolean                usageValid;
+    guint64                 usage;                          // meta/ 与 backup/ 实际占用的磁盘字节数
+    gboolean                usageScanning;                  // 定期重新统计正在进行, 期间的预留与增减另记在 usageScanDelta
+    gint64                  usageScanDelta;
+    guint64                 quotaBytes;                     // 0 表示不限制
+    guint                   quotaPercent;                   // 占所在文件系统的百分比, 0 表示不限制
+    gint                    dedup;                          // 原子读写, 新版本按内容分块去重保存
+    gint                    packMax;                        // 原子读写, 不超过此大小的新版本写入包文件, 0 表示关闭
+    gint                    delta;                          // 原子读写, 大文件的新版本只保存变化的分块
+
+    guint64                 metaCount;                      // 近似值, 用于决定目录分层深度
+    int                     depth;                          // 目录分层深度: 0 平铺, 1 为 ab/, 2 为 ab/cd/
+    int                     fromDepth;                      // 正在迁移的旧深度, -1 表示没有迁移
+    gboolean                migrating;
+    gint64                  layoutCheckTime;
+    gboolean                evicting;                       // 有淘汰正在运行(按需、定期或手动), 同一时刻只运行一个
+    guint64                 evictNeed;                      // 本次后台淘汰需要释放的字节数
+    GCond                   evictCond;                      // 后台淘汰结束时广播, 与 lock 配合
+
+    GMutex                  keyLocks[STORE_KEY_LOCK_N];     // 按 meta key 分段, 保护 meta 的读-改-写
+    GRWLock                 chunkLock;                      // 写入/复用分块取读锁, 回收分块取写锁
+    GMutex                  packLock;                       // 保护 pack
+    struct _BackupPack*     pack;                           // 包文件的状态(pack.c), 首次使用时创建, 不释放
+    GMutex                  indexLock;                      // 保护 index
+    struct _BackupIndex*    index;                          // 查询索引的状态(index.c), 首次使用时创建, 不释放
+} BackupStore;
+
+BackupStore*    backup_store_get                (const char* mountPoint);
+void            backup_store_lock_key           (BackupStore* store, const char* key);
+gboolean        backup_store_trylock_key        (BackupStore* store, const char* key);
+void            backup_store_unlock_key         (BackupStore* store, const char* key);
+
+/**
+ * 仓库内的文件操作都相对于 meta/、backup/ 的目录 fd 进行(openat/fstatat/renameat/unlinkat),
+ * *_rel 返回相对于对应目录的路径, *_path 返回绝对路径, 仅供 GIO 等需要完整路径的地方使用
+ */
+int             backup_store_meta_fd            (BackupStore* store);
+int             backup_store_backup_fd          (BackupStore* store);
+int             backup_store_root_fd            (BackupStore* store);
+int             backup_store_chunk_fd           (BackupStore* store);
+gboolean        backup_store_meta_rel           (BackupStore* store, const char* key, char* buf, gsize bufLen);
+gboolean        backup_store_blob_rel           (BackupStore* store, const char* key, int slot, const char* suffix, char* buf, gsize bufLen);
+gboolean        backup_store_meta_path          (BackupStore* store, const char* key, char* buf, gsize bufLen);
+gboolean        backup_store_blob_path          (BackupStore* store, const char* key, int slot, const char* suffix, char* buf, gsize bufLen);
+
+/**
+ * 删除版本自己的文件并返回释放的字节数; 包中的记录由淘汰按引用计数计入, 由压缩回收
+ */
+guint64         backup_store_remove_slot        (BackupStore* store, const char* key, int slot);
+void            backup_store_rename_slot        (BackupStore* store, const char* key, int fromSlot, int toSlot);
+void            backup_store_settle_key         (BackupStore* store, const char* key);
+void            backup_store_note_new_key       (BackupStore* store);
+gboolean        backup_store_is_migrating       (BackupStore* store);
+void            backup_store_walk               (BackupStore* store, const char* sub, BackupStoreWalkFunc func, gpointer data);
+void            backup_store_walk_hidden        (BackupStore* store, const char* sub, BackupStoreWalkFunc func, gpointer data);
+
+guint64         backup_store_limit              (BackupStore* store);
+
+/**
+ * 超出配额时由后台线程淘汰旧版本, 最多等待 STORE_EVICT_WAIT_US 后重试一次; 仍放不下返回 FALSE 并置 errno 为 ENOSPC,
+ * 不要在持有 key 锁时调用
+ */
+gboolean        backup_store_reserve            (BackupStore* store, guint64 bytes);
+void            backup_store_usage_add          (BackupStore* store, gint64 delta);
+guint64         backup_store_file_usage         (const char* path);
+guint64         backup_store_file_usage_at      (int dirFd, const char* relPath);
+
+G_END_DECLS
+
+#endif // gvfs_backup_STORE_H
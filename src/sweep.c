@@ -0,0 +1,731 @@
+//
+// Created by dingjing on 1/8/25.
+//
+#include "store.h"
+#include "dedup.h"
+#include "backup-private.h"
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SWEEP_BUCKET_N          16                  // 按 key 首个十六进制字符分桶, 每次只排序一个桶
+#define SWEEP_GRACE_SEC         3600                // ctime 在此时间内的文件可能属于其它进程正在进行的备份, 不处理
+#define SWEEP_STATE_FILE        "sweep.state"
+#define SWEEP_SPILL_DIR         "sweep"
+
+typedef struct _SweepCtx
+{
+    BackupStore*            store;
+    char*                   spillDir;
+    GCancellable*           cancel;
+
+    GMutex                  lock;               // 保护以下字段
+    guint                   doneMask;           // 已完成的桶, 写入 sweep.state 用于中断后继续
+    gboolean                failed;
+    BackupSweepStats        stats;
+
+    guint                   opsPerSec;          // 0 表示不限速
+    gint64                  tokenTime;
+    gdouble                 tokens;
+} SweepCtx;
+
+typedef struct _SweepChunks
+{
+    SweepCtx*               ctx;
+    FILE*                   fw[SWEEP_BUCKET_N];  // 引用到的块名(refs-<桶>)或块的相对路径(chunks-<桶>)
+    gboolean                failed;
+} SweepChunks;
+
+typedef struct _SweepSpill
+{
+    SweepCtx*               ctx;
+    FILE*                   fw[SWEEP_BUCKET_N];
+} SweepSpill;
+
+static gboolean     sweep_store                 (BackupStore* store, guint opsPerSec, BackupSweepStats* stats, GCancellable* cancel);
+static gboolean     sweep_spill                 (SweepCtx* ctx, const char* side);
+static void         sweep_spill_cb              (int dirFd, const char* relPath, const char* name, gpointer data);
+static GPtrArray*   sweep_spill_load            (SweepCtx* ctx, const char* side, int bucket);
+static void         sweep_bucket                (SweepCtx* ctx, int bucket);
+static void         sweep_key                   (SweepCtx* ctx, const char* key, const char* metaRelPath, GPtrArray* blobs, guint blobBegin, guint blobEnd, BackupSweepStats* stats);
+static void         sweep_temp_cb               (int dirFd, const char* relPath, const char* name, gpointer data);
+static gboolean     sweep_slot_of               (const char* slotStr, int* slot);
+static gboolean     sweep_chunks                (SweepCtx* ctx);
+static gboolean     sweep_chunks_spill          (SweepChunks* gc, const char* side, const char* sub, BackupStoreWalkFunc func);
+static void         sweep_chunks_bucket         (SweepCtx* ctx, int bucket);
+static void         sweep_chunks_ref_cb         (const char* chunkHex, guint32 len, gpointer data);
+static void         sweep_chunks_recipe_cb      (int dirFd, const char* relPath, const char* name, gpointer data);
+static void         sweep_chunks_chunk_cb       (int dirFd, const char* relPath, const char* name, gpointer data);
+static void         sweep_throttle              (SweepCtx* ctx);
+static gboolean     sweep_is_old                (int dirFd, const char* relPath);
+static guint        sweep_state_load            (BackupStore* store);
+static void         sweep_state_save            (SweepCtx* ctx);
+static int          sweep_bucket_of             (const char* name);
+static gsize        sweep_key_len               (const char* name);
+static const char*  sweep_base_name             (const char* relPath);
+static gint         sweep_name_compare          (gconstpointer a, gconstpointer b);
+
+
+gboolean backup_store_sweep (const char* mountPoint, guint opsPerSec, BackupSweepStats* stats, GCancellable* cancel)
+{
+    gboolean ret = TRUE;
+
+    if (stats) {
+        memset (stats, 0, sizeof (BackupSweepStats));
+    }
+
+    if (mountPoint) {
+        BackupStore* store = backup_store_get (mountPoint);
+        g_return_val_if_fail (store, FALSE);
+        return sweep_store (store, opsPerSec, stats, cancel);
+    }
+
+    GList* mps = get_all_mount_points();
+    for (GList* itr = mps; itr; itr = itr->next) {
+        char* root = g_strdup_printf ("%s/.%s", (char*) itr->data, BACKUP_STR);
+        if (0 == access (root, F_OK)) {
+            BackupSweepStats st;
+            memset (&st, 0, sizeof (st));
+            if (!sweep_store (backup_store_get (itr->data), opsPerSec, &st, cancel)) {
+                ret = FALSE;
+            }
+            if (stats) {
+                stats->blobs += st.blobs;
+                stats->metas += st.metas;
+                stats->orphanBlobs += st.orphanBlobs;
+                stats->brokenMetas += st.brokenMetas;
+                stats->freedBytes += st.freedBytes;
+                stats->chunks += st.chunks;
+                stats->orphanChunks += st.orphanChunks;
+            }
+        }
+        STR_FREE(root);
+    }
+    NOT_NULL_RUN(mps, g_list_free_full, g_free);
+
+    return ret;
+}
+
+/**
+ * 临时文件放在单独的目录中, 不与同时运行的完整清理冲突
+ */
+guint64 backup_dedup_sweep (BackupStore* store)
+{
+    g_return_val_if_fail (store, 0);
+
+    SweepCtx ctx;
+
+    memset (&ctx, 0, sizeof (ctx));
+    g_mutex_init (&ctx.lock);
+    ctx.store = store;
+
+    ctx.spillDir = g_strdup_printf ("%s/" SWEEP_SPILL_DIR ".XXXXXX", store->root);
+    if (g_mkdtemp (ctx.spillDir)) {
+        sweep_chunks (&ctx);
+        remove (ctx.spillDir);
+    }
+
+    STR_FREE(ctx.spillDir);
+    g_mutex_clear (&ctx.lock);
+
+    return ctx.stats.freedBytes;
+}
+
+static gboolean sweep_store (BackupStore* store, guint opsPerSec, BackupSweepStats* stats, GCancellable* cancel)
+{
+    g_return_val_if_fail (store, FALSE);
+
+    gboolean ret = FALSE;
+    SweepCtx ctx;
+
+    memset (&ctx, 0, sizeof (ctx));
+    g_mutex_init (&ctx.lock);
+    ctx.store = store;
+    ctx.cancel = cancel;
+    ctx.opsPerSec = opsPerSec;
+    ctx.tokens = opsPerSec;
+    ctx.tokenTime = g_get_monotonic_time();
+
+    do {
+        // 布局迁移期间同一个 key 的文件可能分处两层目录, 等迁移结束再清理
+        BREAK_IF_FAIL(!backup_store_is_migrating (store));
+
+        ctx.spillDir = g_strdup_printf ("%s/" SWEEP_SPILL_DIR, store->root);
+        BREAK_NULL(ctx.spillDir);
+
+        ctx.doneMask = sweep_state_load (store);
+
+        // 先把两侧目录各顺序读一遍, 按桶写入临时文件, 之后每个桶单独排序归并, 内存占用约为总量的 1/16
+        if (g_mkdir_with_parents (ctx.spillDir, 0755) < 0) { break; }
+        if (!sweep_spill (&ctx, "meta")) { break; }
+        if (!sweep_spill (&ctx, "backup")) { break; }
+
+        // 桶逐个处理, 同一时刻内存中只有一个桶; 清理本身受 opsPerSec 限速, 并行处理多个桶得不到多少好处
+        for (int i = 0; i < SWEEP_BUCKET_N && !g_cancellable_is_cancelled (cancel); ++i) {
+            if (!(ctx.doneMask & (1u << i))) {
+                sweep_bucket (&ctx, i);
+            }
+        }
+
+        ret = !ctx.failed && (ctx.doneMask == (1u << SWEEP_BUCKET_N) - 1);
+
+        // 保存 meta 时的临时文件以 '.' 开头, 不在上面的遍历中, 单独回收崩溃后的残留
+        if (!g_cancellable_is_cancelled (cancel)) {
+            backup_store_walk_hidden (store, "meta", sweep_temp_cb, &ctx);
+        }
+
+        // 版本清理完成后再回收分块, 被删除的分块列表所引用的块在这一轮就能释放
+        if (ret && !g_cancellable_is_cancelled (cancel)) {
+            ret = sweep_chunks (&ctx);
+        }
+    } while (FALSE);
+
+    if (ctx.spillDir) {
+        for (int i = 0; i < SWEEP_BUCKET_N; ++i) {
+            char* p1 = g_strdup_printf ("%s/meta-%x", ctx.spillDir, i);
+            char* p2 = g_strdup_printf ("%s/backup-%x", ctx.spillDir, i);
+            remove (p1);
+            remove (p2);
+            STR_FREE(p1);
+            STR_FREE(p2);
+        }
+        remove (ctx.spillDir);
+    }
+
+    if (ret) {
+        char* stateFile = g_strdup_printf ("%s/" SWEEP_STATE_FILE, store->root);
+        remove (stateFile);
+        STR_FREE(stateFile);
+    }
+
+    if (stats) {
+        *stats = ctx.stats;
+    }
+
+    STR_FREE(ctx.spillDir);
+    g_mutex_clear (&ctx.lock);
+
+    return ret;
+}
+
+static gboolean sweep_spill (SweepCtx* ctx, const char* side)
+{
+    g_return_val_if_fail (ctx && side, FALSE);
+
+    gboolean ret = FALSE;
+    SweepSpill spill;
+
+    memset (&spill, 0, sizeof (spill));
+    spill.ctx = ctx;
+
+    do {
+        int i = 0;
+        for (i = 0; i < SWEEP_BUCKET_N; ++i) {
+            char* path = g_strdup_printf ("%s/%s-%x", ctx->spillDir, side, i);
+            spill.fw[i] = fopen (path, "w");
+            STR_FREE(path);
+            BREAK_NULL(spill.fw[i]);
+        }
+        BREAK_IF_FAIL(SWEEP_BUCKET_N == i);
+
+        // 记录相对路径, 不同分层深度下都能直接定位到文件
+        backup_store_walk (ctx->store, side, sweep_spill_cb, &spill);
+        ret = TRUE;
+    } while (FALSE);
+
+    for (int i = 0; i < SWEEP_BUCKET_N; ++i) {
+        if (spill.fw[i] && 0 != fclose (spill.fw[i])) {
+            ret = FALSE;
+        }
+    }
+
+    return ret;
+}
+
+static void sweep_spill_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    SweepSpill* spill = data;
+
+    const int bucket = sweep_bucket_of (name);
+    if (bucket >= 0 && !(spill->ctx->doneMask & (1u << bucket))) {
+        fprintf (spill->fw[bucket], "%s\n", relPath);
+    }
+
+    (void) dirFd;
+}
+
+static GPtrArray* sweep_spill_load (SweepCtx* ctx, const char* side, int bucket)
+{
+    g_return_val_if_fail (ctx && side, NULL);
+
+    char* line = NULL;
+    size_t lineLen = 0;
+    ssize_t readLen = 0;
+    GPtrArray* arr = g_ptr_array_new_with_free_func (g_free);
+    char* spill = g_strdup_printf ("%s/%s-%x", ctx->spillDir, side, bucket);
+    FILE* fr = fopen (spill, "r");
+
+    while (fr && (readLen = getline (&line, &lineLen, fr)) > 0) {
+        if ('\n' == line[readLen - 1]) {
+            line[readLen - 1] = '\0';
+        }
+        g_ptr_array_add (arr, g_strdup (line));
+    }
+    g_ptr_array_sort (arr, sweep_name_compare);
+
+    if (line) { free (line); }
+    NOT_NULL_RUN(fr, fclose);
+    STR_FREE(spill);
+
+    return arr;
+}
+
+static void sweep_bucket (SweepCtx* ctx, int bucket)
+{
+    BackupSweepStats stats;
+    memset (&stats, 0, sizeof (stats));
+
+    GPtrArray* metas = sweep_spill_load (ctx, "meta", bucket);
+    GPtrArray* blobs = sweep_spill_load (ctx, "backup", bucket);
+
+    // 两侧均已按名字排序, 归并时同一个 key 的 meta 与所有 blob 相邻
+    guint m = 0, b = 0;
+    gboolean cancelled = FALSE;
+    while (m < metas->len || b < blobs->len) {
+        if (g_cancellable_is_cancelled (ctx->cancel)) {
+            cancelled = TRUE;
+            break;
+        }
+
+        const char* metaRelPath = (m < metas->len) ? g_ptr_array_index (metas, m) : NULL;
+        const char* metaName = metaRelPath ? sweep_base_name (metaRelPath) : NULL;
+        const char* blobName = (b < blobs->len) ? sweep_base_name (g_ptr_array_index (blobs, b)) : NULL;
+        const gsize blobKeyLen = blobName ? sweep_key_len (blobName) : 0;
+
+        int cmp = 0;
+        if (!metaName) {
+            cmp = 1;
+        }
+        else if (!blobName) {
+            cmp = -1;
+        }
+        else {
+            cmp = strncmp (metaName, blobName, blobKeyLen);
+            if (0 == cmp && strlen (metaName) != blobKeyLen) {
+                cmp = (strlen (metaName) > blobKeyLen) ? 1 : -1;
+            }
+        }
+
+        char key[128] = {0};
+        const guint blobBegin = b;
+        if (cmp <= 0) {
+            g_strlcpy (key, metaName, sizeof (key));
+            ++m;
+            stats.metas++;
+        }
+        else {
+            g_strlcpy (key, blobName, MIN (sizeof (key), blobKeyLen + 1));
+        }
+        if (cmp >= 0) {
+            while (b < blobs->len) {
+                const char* n = sweep_base_name (g_ptr_array_index (blobs, b));
+                if (sweep_key_len (n) != strlen (key) || 0 != strncmp (n, key, strlen (key))) {
+                    break;
+                }
+                ++b;
+            }
+        }
+        stats.blobs += b - blobBegin;
+
+        sweep_key (ctx, key, (cmp <= 0) ? metaRelPath : NULL, blobs, blobBegin, b, &stats);
+    }
+
+    g_ptr_array_unref (metas);
+    g_ptr_array_unref (blobs);
+
+    g_mutex_lock (&ctx->lock);
+    ctx->stats.blobs += stats.blobs;
+    ctx->stats.metas += stats.metas;
+    ctx->stats.orphanBlobs += stats.orphanBlobs;
+    ctx->stats.brokenMetas += stats.brokenMetas;
+    ctx->stats.freedBytes += stats.freedBytes;
+    if (cancelled) {
+        ctx->failed = TRUE;
+    }
+    else {
+        ctx->doneMask |= (1u << bucket);
+        sweep_state_save (ctx);
+    }
+    g_mutex_unlock (&ctx->lock);
+}
+
+/**
+ * 持有 key 锁后重新读取 meta 再判断, 与本进程内并发的备份互斥;
+ * 其它进程的备份靠 ctime 宽限期避开
+ */
+static void sweep_key (SweepCtx* ctx, const char* key, const char* metaRelPath, GPtrArray* blobs, guint blobBegin, guint blobEnd, BackupSweepStats* stats)
+{
+    BackupMetaFile meta;
+    gboolean metaValid = FALSE;
+    const int metaFd = backup_store_meta_fd (ctx->store);
+    const int backupFd = backup_store_backup_fd (ctx->store);
+
+    memset (&meta, 0, sizeof (meta));
+
+    backup_store_lock_key (ctx->store, key);
+
+    if (metaRelPath && metaFd >= 0) {
+        sweep_throttle (ctx);
+        const gboolean parsed = backup_meta_parse_at (&meta, metaFd, metaRelPath);
+        if (!parsed && EINVAL != errno) {
+            // 读取出错不代表 meta 损坏, 这一轮不动该 key 的 meta 与版本文件
+            backup_store_unlock_key (ctx->store, key);
+            return;
+        }
+        if (parsed && meta.version > 1) {
+            // 未知的新版本格式, 不做任何处理
+            metaValid = TRUE;
+        }
+        else if (parsed && 1 == meta.version && meta.srcFilePath && 0 == g_strcmp0 (meta.srcFilePathMD5, key)) {
+            metaValid = TRUE;
+        }
+        else if (sweep_is_old (metaFd, metaRelPath)) {
+            const guint64 usage = backup_store_file_usage_at (metaFd, metaRelPath);
+            sweep_throttle (ctx);
+            if (0 == unlinkat (metaFd, metaRelPath, 0)) {
+                stats->brokenMetas++;
+                stats->freedBytes += usage;
+                backup_store_usage_add (ctx->store, - (gint64) usage);
+            }
+        }
+    }
+
+    for (guint i = blobBegin; i < blobEnd && backupFd >= 0; ++i) {
+        const char* blobRelPath = g_ptr_array_index (blobs, i);
+        const char* blobName = sweep_base_name (blobRelPath);
+        int slot = 0;
+        if (metaValid && meta.version > 1) {
+            continue;
+        }
+        // 不是 <key>-N<后缀> 的是写入中途的临时文件(<目标>.XXXXXX), 不论版本是否有效, 超过宽限期即回收
+        if (sweep_slot_of (blobName + strlen (key), &slot) && metaValid
+            && backup_meta_slot_ctx (&meta, slot) && *backup_meta_slot_ctx (&meta, slot)) {
+            continue;
+        }
+
+        if (sweep_is_old (backupFd, blobRelPath)) {
+            const guint64 usage = backup_store_file_usage_at (backupFd, blobRelPath);
+            sweep_throttle (ctx);
+            if (0 == unlinkat (backupFd, blobRelPath, 0)) {
+                stats->orphanBlobs++;
+                stats->freedBytes += usage;
+                backup_store_usage_add (ctx->store, - (gint64) usage);
+            }
+        }
+    }
+
+    backup_store_unlock_key (ctx->store, key);
+
+    backup_meta_free (&meta);
+}
+
+static void sweep_temp_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    SweepCtx* ctx = data;
+
+    if (!sweep_is_old (dirFd, name)) {
+        return;
+    }
+
+    const guint64 usage = backup_store_file_usage_at (dirFd, name);
+    sweep_throttle (ctx);
+    if (0 == unlinkat (dirFd, name, 0)) {
+        g_mutex_lock (&ctx->lock);
+        ctx->stats.brokenMetas++;
+        ctx->stats.freedBytes += usage;
+        g_mutex_unlock (&ctx->lock);
+        backup_store_usage_add (ctx->store, - (gint64) usage);
+    }
+
+    (void) relPath;
+}
+
+/**
+ * slotStr 为 blob 名中 key 之后的部分, 形如 -N 加 STORE_SLOT_SUFFIXES 之一
+ */
+static gboolean sweep_slot_of (const char* slotStr, int* slot)
+{
+    char* end = NULL;
+    const char* suffixes[] = STORE_SLOT_SUFFIXES;
+
+    if ('-' != slotStr[0] || !g_ascii_isdigit (slotStr[1])) {
+        return FALSE;
+    }
+    *slot = (int) strtol (slotStr + 1, &end, 10);
+    for (int i = 0; suffixes[i]; ++i) {
+        if (0 == strcmp (end, suffixes[i])) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * 标记-清除: 先读出所有分块列表, 再删除未被引用且超过宽限期的块;
+ * 与版本清理一样, 引用与块都先按块名首字符分桶写入临时文件, 每次只排序归并一个桶, 内存占用约为总量的 1/16;
+ * 备份复用已有块时会更新其时间戳, 并与删除互斥(chunkLock), 因此不会删掉刚被引用的块
+ */
+static gboolean sweep_chunks (SweepCtx* ctx)
+{
+    SweepChunks gc;
+    memset (&gc, 0, sizeof (gc));
+    gc.ctx = ctx;
+
+    if (sweep_chunks_spill (&gc, "refs", "backup", sweep_chunks_recipe_cb)
+        && sweep_chunks_spill (&gc, "chunks", DEDUP_CHUNK_DIR, sweep_chunks_chunk_cb)) {
+        for (int i = 0; i < SWEEP_BUCKET_N && !g_cancellable_is_cancelled (ctx->cancel); ++i) {
+            sweep_chunks_bucket (ctx, i);
+        }
+    }
+    else {
+        gc.failed = TRUE;
+    }
+
+    for (int i = 0; i < SWEEP_BUCKET_N; ++i) {
+        char* p1 = g_strdup_printf ("%s/refs-%x", ctx->spillDir, i);
+        char* p2 = g_strdup_printf ("%s/chunks-%x", ctx->spillDir, i);
+        remove (p1);
+        remove (p2);
+        STR_FREE(p1);
+        STR_FREE(p2);
+    }
+
+    return !gc.failed && !g_cancellable_is_cancelled (ctx->cancel);
+}
+
+static gboolean sweep_chunks_spill (SweepChunks* gc, const char* side, const char* sub, BackupStoreWalkFunc func)
+{
+    gboolean ret = FALSE;
+
+    memset (gc->fw, 0, sizeof (gc->fw));
+
+    do {
+        int i = 0;
+        for (i = 0; i < SWEEP_BUCKET_N; ++i) {
+            char* path = g_strdup_printf ("%s/%s-%x", gc->ctx->spillDir, side, i);
+            gc->fw[i] = fopen (path, "w");
+            STR_FREE(path);
+            BREAK_NULL(gc->fw[i]);
+        }
+        BREAK_IF_FAIL(SWEEP_BUCKET_N == i);
+
+        backup_store_walk (gc->ctx->store, sub, func, gc);
+        ret = !gc->failed;
+    } while (FALSE);
+
+    for (int i = 0; i < SWEEP_BUCKET_N; ++i) {
+        if (gc->fw[i] && 0 != fclose (gc->fw[i])) {
+            ret = FALSE;
+        }
+        gc->fw[i] = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * 两侧均已按块名排序(引用可能重复), 归并时未出现在引用中的块即为孤儿
+ */
+static void sweep_chunks_bucket (SweepCtx* ctx, int bucket)
+{
+    char path[STORE_PATH_MAX];
+    GPtrArray* refs = sweep_spill_load (ctx, "refs", bucket);
+    GPtrArray* chunks = sweep_spill_load (ctx, "chunks", bucket);
+
+    guint r = 0;
+    for (guint c = 0; c < chunks->len && !g_cancellable_is_cancelled (ctx->cancel); ++c) {
+        const char* relPath = g_ptr_array_index (chunks, c);
+        const char* name = sweep_base_name (relPath);
+        while (r < refs->len && strcmp (g_ptr_array_index (refs, r), name) < 0) {
+            ++r;
+        }
+
+        g_mutex_lock (&ctx->lock);
+        ctx->stats.chunks++;
+        g_mutex_unlock (&ctx->lock);
+
+        if ((r < refs->len && 0 == strcmp (g_ptr_array_index (refs, r), name))
+            || g_snprintf (path, sizeof (path), "%s/%s/%s", ctx->store->root, DEDUP_CHUNK_DIR, relPath) >= (gint) sizeof (path)) {
+            continue;
+        }
+
+        sweep_throttle (ctx);
+
+        g_rw_lock_writer_lock (&ctx->store->chunkLock);
+        if (sweep_is_old (AT_FDCWD, path)) {
+            const guint64 usage = backup_store_file_usage_at (AT_FDCWD, path);
+            if (0 == unlink (path)) {
+                g_mutex_lock (&ctx->lock);
+                ctx->stats.orphanChunks++;
+                ctx->stats.freedBytes += usage;
+                g_mutex_unlock (&ctx->lock);
+                backup_store_usage_add (ctx->store, - (gint64) usage);
+            }
+        }
+        g_rw_lock_writer_unlock (&ctx->store->chunkLock);
+    }
+
+    g_ptr_array_unref (refs);
+    g_ptr_array_unref (chunks);
+}
+
+static void sweep_chunks_ref_cb (const char* chunkHex, guint32 len, gpointer data)
+{
+    SweepChunks* gc = data;
+
+    const int bucket = sweep_bucket_of (chunkHex);
+    if (bucket >= 0) {
+        fprintf (gc->fw[bucket], "%s\n", chunkHex);
+    }
+
+    (void) len;
+}
+
+static void sweep_chunks_recipe_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    SweepChunks* gc = data;
+    char path[STORE_PATH_MAX];
+
+    if (gc->failed || !g_str_has_suffix (name, DEDUP_RECIPE_SUFFIX)) {
+        return;
+    }
+
+    sweep_throttle (gc->ctx);
+    g_snprintf (path, sizeof (path), "%s/backup/%s", gc->ctx->store->root, relPath);
+    if (!backup_dedup_recipe_foreach (path, sweep_chunks_ref_cb, gc) && 0 == access (path, F_OK)) {
+        // 读不出来的分块列表可能引用任意块, 本轮不回收
+        gc->failed = TRUE;
+    }
+
+    (void) dirFd;
+}
+
+static void sweep_chunks_chunk_cb (int dirFd, const char* relPath, const char* name, gpointer data)
+{
+    SweepChunks* gc = data;
+
+    if (g_cancellable_is_cancelled (gc->ctx->cancel)) {
+        gc->failed = TRUE;
+        return;
+    }
+
+    const int bucket = sweep_bucket_of (name);
+    if (bucket >= 0) {
+        fprintf (gc->fw[bucket], "%s\n", relPath);
+    }
+
+    (void) dirFd;
+}
+
+static void sweep_throttle (SweepCtx* ctx)
+{
+    if (0 == ctx->opsPerSec) {
+        return;
+    }
+
+    gint64 waitUs = 0;
+
+    g_mutex_lock (&ctx->lock);
+    const gint64 now = g_get_monotonic_time();
+    ctx->tokens = MIN ((gdouble) ctx->opsPerSec, ctx->tokens + (gdouble) (now - ctx->tokenTime) * ctx->opsPerSec / G_USEC_PER_SEC);
+    ctx->tokenTime = now;
+    ctx->tokens -= 1;
+    if (ctx->tokens < 0) {
+        waitUs = (gint64) (-ctx->tokens * G_USEC_PER_SEC / ctx->opsPerSec);
+    }
+    g_mutex_unlock (&ctx->lock);
+
+    if (waitUs > 0) {
+        g_usleep (waitUs);
+    }
+}
+
+static gboolean sweep_is_old (int dirFd, const char* relPath)
+{
+    struct stat statBuf;
+    if (0 != fstatat (dirFd, relPath, &statBuf, 0)) {
+        return FALSE;
+    }
+
+    return (time (NULL) - statBuf.st_ctime) > SWEEP_GRACE_SEC;
+}
+
+static guint sweep_state_load (BackupStore* store)
+{
+    guint mask = 0;
+    char* ctx = NULL;
+    char* stateFile = g_strdup_printf ("%s/" SWEEP_STATE_FILE, store->root);
+
+    if (g_file_get_contents (stateFile, &ctx, NULL, NULL) && ctx) {
+        mask = (guint) strtoul (ctx, NULL, 16) & ((1u << SWEEP_BUCKET_N) - 1);
+    }
+
+    STR_FREE(ctx);
+    STR_FREE(stateFile);
+
+    return mask;
+}
+
+static void sweep_state_save (SweepCtx* ctx)
+{
+    char buf[32] = {0};
+    char* stateFile = g_strdup_printf ("%s/" SWEEP_STATE_FILE, ctx->store->root);
+
+    g_snprintf (buf, sizeof (buf), "%x\n", ctx->doneMask);
+    g_file_set_contents (stateFile, buf, -1, NULL);
+
+    STR_FREE(stateFile);
+}
+
+static int sweep_bucket_of (const char* name)
+{
+    const char c = name[0];
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+/**
+ * blob 名字为 <key>-<slot>, meta 名字为 <key>
+ */
+static gsize sweep_key_len (const char* name)
+{
+    const char* p = strrchr (name, '-');
+
+    return p ? (gsize) (p - name) : strlen (name);
+}
+
+static const char* sweep_base_name (const char* relPath)
+{
+    const char* p = strrchr (relPath, '/');
+
+    return p ? p + 1 : relPath;
+}
+
+/**
+ * 按文件名而非相对路径排序, 使同一个 key 的 meta 与 blob 在归并时对齐
+ */
+static gint sweep_name_compare (gconstpointer a, gconstpointer b)
+{
+    return strcmp (sweep_base_name (*(const char* const*) a), sweep_base_name (*(const char* const*) b));
+}
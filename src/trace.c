@@ -0,0 +1,247 @@
+//
+// Created by dingjing on 1/8/25.
+//
+#include "trace.h"
+#include "backup-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYSPROF
+#include <sysprof-capture.h>
+#endif
+
+#define TRACE_ENV               "ANDSEC_BACKUP_TRACE"
+#define TRACE_RING_SIZE         8192
+#define TRACE_DEFAULT_DUMP      "andsec-backup-trace-%d.json"    // 不支持 sysprof 时改为在临时目录导出
+
+typedef struct _BackupTraceEvent
+{
+    gint64                  start;              // us, CLOCK_MONOTONIC
+    gint64                  duration;           // us
+    guint64                 bytes;
+    guint                   tid;
+    guint                   pathHash;
+    BackupTraceKind         kind;
+} BackupTraceEvent;
+
+typedef struct _BackupTraceRing
+{
+    GMutex                  lock;               // 只有导出时才会竞争
+    guint                   tid;
+    guint                   head;
+    guint                   count;
+    gboolean                orphan;             // 所属线程已退出, 可被新线程复用
+    BackupTraceEvent        events[TRACE_RING_SIZE];
+} BackupTraceRing;
+
+static void                 trace_ring_release      (gpointer data);
+static BackupTraceRing*     trace_ring_get          ();
+static void                 trace_dump_at_exit      ();
+static void                 trace_init_from_env     () __attribute__((constructor));
+
+
+#ifdef HAVE_SYSPROF
+static gboolean             gsTraceSysprof = FALSE;
+#endif
+static char*                gsTraceDumpPath = NULL;
+static GMutex               gsTraceRingsLock;
+static GList*               gsTraceRings = NULL;
+static GPrivate             gsTraceRing = G_PRIVATE_INIT (trace_ring_release);
+static GPrivate             gsTraceKey = G_PRIVATE_INIT (g_free);      // 本线程当前的 key, 缓冲区按线程只分配一次
+gint                        gBackupTraceEnabled = 0;    // 原子读写
+static const char*          gsTraceKindName[BACKUP_TRACE_N] = {
+    "mount",
+    "meta-parse",
+    "hash",
+    "copy",
+    "meta-save",
+    "enumerate",
+    "lock-wait",
+};
+
+
+void backup_trace_set_enabled (gboolean enabled)
+{
+    g_atomic_int_set (&gBackupTraceEnabled, enabled ? 1 : 0);
+}
+
+gboolean backup_trace_is_enabled ()
+{
+    return 0 != g_atomic_int_get (&gBackupTraceEnabled);
+}
+
+void backup_trace_set_key (const char* key)
+{
+    char* buf = g_private_get (&gsTraceKey);
+    if (!key) {
+        if (buf) { buf[0] = '\0'; }
+        return;
+    }
+    if (!buf) {
+        buf = g_malloc0 (BACKUP_KEY_SIZE);
+        g_private_set (&gsTraceKey, buf);
+    }
+    g_strlcpy (buf, key, BACKUP_KEY_SIZE);
+}
+
+gboolean backup_trace_dump (const char* path)
+{
+    g_return_val_if_fail (path, FALSE);
+
+    FILE* fw = NULL;
+    gboolean first = TRUE;
+    const int pid = (int) getpid();
+
+    fw = fopen (path, "w");
+    g_return_val_if_fail (fw, FALSE);
+
+    fprintf (fw, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    g_mutex_lock (&gsTraceRingsLock);
+    for (GList* itr = gsTraceRings; itr; itr = itr->next) {
+        BackupTraceRing* ring = itr->data;
+        g_mutex_lock (&ring->lock);
+        const guint begin = (ring->head + TRACE_RING_SIZE - ring->count) % TRACE_RING_SIZE;
+        for (guint i = 0; i < ring->count; ++i) {
+            const BackupTraceEvent* ev = &ring->events[(begin + i) % TRACE_RING_SIZE];
+            fprintf (fw, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT
+                     ",\"args\":{\"path_hash\":\"%08x\",\"bytes\":%" G_GUINT64_FORMAT "}}",
+                     first ? "" : ",", gsTraceKindName[ev->kind], BACKUP_STR, pid, ev->tid, ev->start, ev->duration, ev->pathHash, ev->bytes);
+            first = FALSE;
+        }
+        g_mutex_unlock (&ring->lock);
+    }
+    g_mutex_unlock (&gsTraceRingsLock);
+
+    fprintf (fw, "]}\n");
+
+    return 0 == fclose (fw);
+}
+
+void backup_trace_begin (BackupTraceSpan* span, BackupTraceKind kind, const char* id)
+{
+    g_return_if_fail (span && kind < BACKUP_TRACE_N);
+
+    const char* key = g_private_get (&gsTraceKey);
+    if (key && '\0' != key[0]) {
+        id = key;
+    }
+
+    span->kind = kind;
+    span->pathHash = id ? g_str_hash (id) : 0;
+    span->start = g_get_monotonic_time();
+}
+
+void backup_trace_end (BackupTraceSpan* span, guint64 bytes)
+{
+    g_return_if_fail (span && span->start > 0);
+
+    const gint64 end = g_get_monotonic_time();
+
+    BackupTraceRing* ring = trace_ring_get();
+    if (ring) {
+        g_mutex_lock (&ring->lock);
+        BackupTraceEvent* ev = &ring->events[ring->head];
+        ev->start = span->start;
+        ev->duration = end - span->start;
+        ev->bytes = bytes;
+        ev->tid = ring->tid;
+        ev->kind = span->kind;
+        ev->pathHash = span->pathHash;
+        ring->head = (ring->head + 1) % TRACE_RING_SIZE;
+        if (ring->count < TRACE_RING_SIZE) {
+            ring->count++;
+        }
+        g_mutex_unlock (&ring->lock);
+    }
+
+#ifdef HAVE_SYSPROF
+    if (gsTraceSysprof) {
+        // g_get_monotonic_time() 与 sysprof 同为 CLOCK_MONOTONIC
+        sysprof_collector_mark_printf (span->start * 1000, (end - span->start) * 1000, BACKUP_STR, gsTraceKindName[span->kind],
+                                       "path_hash=%08x bytes=%" G_GUINT64_FORMAT, span->pathHash, bytes);
+    }
+#endif
+
+    span->start = 0;
+}
+
+static BackupTraceRing* trace_ring_get ()
+{
+    static gint tidSeq = 0;
+
+    BackupTraceRing* ring = g_private_get (&gsTraceRing);
+    if (G_LIKELY(ring)) {
+        return ring;
+    }
+
+    // 线程池里的线程会频繁创建退出, 优先复用已退出线程的缓冲区, 保证内存有上界
+    g_mutex_lock (&gsTraceRingsLock);
+    for (GList* itr = gsTraceRings; itr; itr = itr->next) {
+        BackupTraceRing* r = itr->data;
+        if (r->orphan) {
+            r->orphan = FALSE;
+            ring = r;
+            break;
+        }
+    }
+    if (!ring) {
+        ring = g_new0 (BackupTraceRing, 1);
+        g_mutex_init (&ring->lock);
+        gsTraceRings = g_list_append (gsTraceRings, ring);
+    }
+    g_mutex_unlock (&gsTraceRingsLock);
+
+    g_mutex_lock (&ring->lock);
+    ring->tid = (guint) g_atomic_int_add (&tidSeq, 1) + 1;
+    g_mutex_unlock (&ring->lock);
+
+    g_private_set (&gsTraceRing, ring);
+
+    return ring;
+}
+
+static void trace_ring_release (gpointer data)
+{
+    BackupTraceRing* ring = data;
+
+    g_mutex_lock (&gsTraceRingsLock);
+    ring->orphan = TRUE;
+    g_mutex_unlock (&gsTraceRingsLock);
+}
+
+static void trace_dump_at_exit ()
+{
+    if (gsTraceDumpPath) {
+        backup_trace_dump (gsTraceDumpPath);
+    }
+}
+
+static void trace_init_from_env ()
+{
+    const char* env = g_getenv (TRACE_ENV);
+    if (!env || '\0' == env[0] || 0 == g_strcmp0 (env, "0")) {
+        return;
+    }
+
+    if (0 == g_strcmp0 (env, "sysprof")) {
+#ifdef HAVE_SYSPROF
+        sysprof_collector_init();
+        gsTraceSysprof = TRUE;
+#else
+        // 构造函数只运行一次, 警告也只有一次
+        char* name = g_strdup_printf (TRACE_DEFAULT_DUMP, (int) getpid());
+        gsTraceDumpPath = g_build_filename (g_get_tmp_dir(), name, NULL);
+        STR_FREE(name);
+        atexit (trace_dump_at_exit);
+        g_warning ("%s=sysprof: built without sysprof support, trace will be written to %s", TRACE_ENV, gsTraceDumpPath);
+#endif
+    }
+    else if ('/' == env[0]) {
+        gsTraceDumpPath = g_strdup (env);
+        atexit (trace_dump_at_exit);
+    }
+
+    backup_trace_set_enabled (TRUE);
+}
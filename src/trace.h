@@ -0,0 +1,52 @@
+//
+// Created by dingjing on 1/8/25.
+//
+
+#ifndef gvfs_backup_TRACE_H
+#define gvfs_backup_TRACE_H
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    BACKUP_TRACE_MOUNT = 0,
+    BACKUP_TRACE_META_PARSE,
+    BACKUP_TRACE_HASH,
+    BACKUP_TRACE_COPY,
+    BACKUP_TRACE_META_SAVE,
+    BACKUP_TRACE_ENUM,
+    BACKUP_TRACE_LOCK,
+    BACKUP_TRACE_N
+} BackupTraceKind;
+
+typedef struct _BackupTraceSpan
+{
+    gint64                  start;              // 0 表示未开启追踪
+    guint                   pathHash;           // 文件 key 的哈希, 见 backup_trace_set_key
+    BackupTraceKind         kind;
+} BackupTraceSpan;
+
+/**
+ * 追踪开关, 只由 backup_trace_set_enabled 修改; 隐藏可见性, TRACE_BEGIN 直接读取, 不经过导出函数的调用
+ */
+G_GNUC_INTERNAL extern gint gBackupTraceEnabled;
+
+/**
+ * 关闭追踪时 TRACE_BEGIN 只有一次内存读取和一次可预测的分支, TRACE_END 只有一次分支
+ */
+#define TRACE_BEGIN(span, k, id)    G_STMT_START { (span).start = 0; if (G_UNLIKELY(g_atomic_int_get(&gBackupTraceEnabled))) { backup_trace_begin(&(span), (k), (id)); } } G_STMT_END
+#define TRACE_END(span, bytes)      G_STMT_START { if (G_UNLIKELY((span).start)) { backup_trace_end(&(span), (guint64) (bytes)); } } G_STMT_END
+
+/**
+ * 本线程当前处理的文件 key(backup_path_key 的结果), NULL 时清除; 设置期间各 span 的 pathHash 都取自 key,
+ * 同一个文件的哈希、拷贝与 meta 读写因此相同, 不受 /proc/self/fd、临时文件等实际读写路径的影响.
+ * 未设置时取 TRACE_BEGIN 传入的 id, 调用处尽量传 key
+ */
+void        backup_trace_set_key    (const char* key);
+void        backup_trace_begin      (BackupTraceSpan* span, BackupTraceKind kind, const char* id);
+void        backup_trace_end        (BackupTraceSpan* span, guint64 bytes);
+
+G_END_DECLS
+
+#endif // gvfs_backup_TRACE_H
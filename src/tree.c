@@ -0,0 +1,498 @@
+//
+// Created by dingjing on 1/8/25.
+//
+// 目录树备份: 每个工作线程一个双端队列, 自己从尾部取(深度优先), 空闲时从其它线程头部窃取
+//
+#define _GNU_SOURCE
+#include "backup.h"
+#include "store.h"
+#include "copy.h"
+#include "backup-private.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define TREE_DENTS_BUF          (32 * 1024)         // 每次 getdents64 读取的目录项, 同时限制每次展开的任务数
+#define TREE_FILE_BATCH         64
+#define TREE_IDLE_WAIT_US       (5 * 1000)
+
+typedef enum
+{
+    TREE_ITEM_READ = 0,                         // 继续读取目录
+    TREE_ITEM_OPEN,                             // 打开子目录并读取
+    TREE_ITEM_FILES,                            // 备份一批文件
+} TreeItemType;
+
+/**
+ * 已打开的目录, 被其尚未处理的子任务共享, 最后一个引用释放时关闭
+ */
+typedef struct _TreeDir
+{
+    gint                    ref;
+    int                     fd;
+    char*                   path;
+} TreeDir;
+
+typedef struct _TreeItem
+{
+    TreeItemType            type;
+    TreeDir*                dir;                // READ: 目录本身; OPEN/FILES: 所在目录
+    char*                   name;               // OPEN: 子目录名
+    GPtrArray*              names;              // FILES: 文件名
+} TreeItem;
+
+typedef struct _TreeWorker
+{
+    GMutex                  lock;
+    GQueue                  items;
+    BackupTreeStats         stats;
+    struct _TreeCtx*        ctx;
+    guint                   idx;
+    char*                   dents;
+} TreeWorker;
+
+typedef struct _TreeCtx
+{
+    TreeWorker*             workers;
+    guint                   workerN;
+    gint                    outstanding;        // 原子, 尚未处理完的任务数, 为 0 时遍历结束
+    gint                    idle;               // 原子, 正在等待的线程数
+
+    GMutex                  idleLock;
+    GCond                   idleCond;
+
+    char*                   storeRoot;          // 仓库目录(可能映射到树内), 不备份
+    BackupTreeFilterFunc    filter;
+    BackupTreeFileFunc      func;
+    gpointer                data;
+    GCancellable*           cancel;
+} TreeCtx;
+
+struct linux_dirent64
+{
+    guint64                 d_ino;
+    gint64                  d_off;
+    unsigned short          d_reclen;
+    unsigned char           d_type;
+    char                    d_name[];
+};
+
+static gpointer     tree_worker_thread          (gpointer data);
+static TreeItem*    tree_take                   (TreeWorker* w);
+static void         tree_push                   (TreeWorker* w, TreeItem* item);
+static void         tree_done                   (TreeCtx* ctx);
+static void         tree_process                (TreeWorker* w, TreeItem* item);
+static void         tree_read_dir               (TreeWorker* w, TreeDir* dir);
+static void         tree_backup_files           (TreeWorker* w, TreeDir* dir, GPtrArray* names);
+static gboolean     tree_skip_dir               (TreeCtx* ctx, const char* path, const char* name);
+static TreeItem*    tree_item_new               (TreeItemType type, TreeDir* dir);
+static void         tree_item_free              (TreeItem* item);
+static TreeDir*     tree_dir_new                (int fd, const char* path);
+static TreeDir*     tree_dir_ref                (TreeDir* dir);
+static void         tree_dir_unref              (TreeDir* dir);
+static void         tree_stats_add              (BackupTreeStats* to, const BackupTreeStats* from);
+
+
+gboolean backup_file_backup_tree (const char* path, guint threads, BackupTreeFilterFunc filter, BackupTreeFileFunc func, gpointer data, BackupTreeStats* stats, GCancellable* cancel)
+{
+    g_return_val_if_fail (path && '/' == path[0], FALSE);
+
+    TreeCtx ctx;
+    BackupTreeStats total;
+    struct stat statBuf;
+    char* mountPoint = NULL;
+
+    memset (&total, 0, sizeof (total));
+    if (stats) {
+        memset (stats, 0, sizeof (BackupTreeStats));
+    }
+
+    // 去掉结尾的 '/'、重复的 '/' 与 ./.., 拼出的文件路径(即 key)与其它方式备份时一致
+    char* root = g_canonicalize_filename (path, "/");
+
+    if (0 != stat (root, &statBuf)) {
+        STR_FREE(root);
+        return FALSE;
+    }
+
+    if (!S_ISDIR(statBuf.st_mode)) {
+        const gboolean ok = backup_file_backup_now (root);
+        total.files = 1;
+        total.backedUp = ok ? 1 : 0;
+        total.failed = ok ? 0 : 1;
+        total.bytes = ok ? (guint64) statBuf.st_size : 0;
+        if (func) {
+            func (root, ok, data);
+        }
+        if (stats) {
+            *stats = total;
+        }
+        STR_FREE(root);
+        return ok;
+    }
+
+    const int fd = open (root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        STR_FREE(root);
+        return FALSE;
+    }
+
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.workerN = threads > 0 ? threads : (guint) g_get_num_processors();
+    ctx.workers = g_new0 (TreeWorker, ctx.workerN);
+    ctx.filter = filter;
+    ctx.func = func;
+    ctx.data = data;
+    ctx.cancel = cancel;
+    g_mutex_init (&ctx.idleLock);
+    g_cond_init (&ctx.idleCond);
+
+    mountPoint = get_mount_point_by_path (root);
+    if (mountPoint) {
+        BackupStore* store = backup_store_get (mountPoint);
+        ctx.storeRoot = store ? g_strdup (store->root) : NULL;
+    }
+
+    for (guint i = 0; i < ctx.workerN; ++i) {
+        g_mutex_init (&ctx.workers[i].lock);
+        g_queue_init (&ctx.workers[i].items);
+        ctx.workers[i].ctx = &ctx;
+        ctx.workers[i].idx = i;
+    }
+
+    // 根目录本身已经打开, 直接作为读取任务
+    TreeDir* rootDir = tree_dir_new (fd, g_str_equal (root, "/") ? "" : root);
+    ctx.workers[0].stats.dirs++;
+    tree_push (&ctx.workers[0], tree_item_new (TREE_ITEM_READ, rootDir));
+    tree_dir_unref (rootDir);
+
+    GThread** ths = g_new0 (GThread*, ctx.workerN);
+    for (guint i = 1; i < ctx.workerN; ++i) {
+        ths[i] = g_thread_new ("backup-tree", tree_worker_thread, &ctx.workers[i]);
+    }
+    tree_worker_thread (&ctx.workers[0]);
+    for (guint i = 1; i < ctx.workerN; ++i) {
+        g_thread_join (ths[i]);
+    }
+
+    for (guint i = 0; i < ctx.workerN; ++i) {
+        tree_stats_add (&total, &ctx.workers[i].stats);
+        g_mutex_clear (&ctx.workers[i].lock);
+    }
+    if (stats) {
+        *stats = total;
+    }
+
+    STR_FREE(ths);
+    STR_FREE(root);
+    STR_FREE(mountPoint);
+    STR_FREE(ctx.storeRoot);
+    STR_FREE(ctx.workers);
+    g_mutex_clear (&ctx.idleLock);
+    g_cond_clear (&ctx.idleCond);
+
+    return 0 == total.failed && !g_cancellable_is_cancelled (cancel);
+}
+
+static gpointer tree_worker_thread (gpointer data)
+{
+    TreeWorker* w = data;
+    TreeCtx* ctx = w->ctx;
+
+    // 整棵树读的多是冷数据, 大文件不经过页缓存, 不挤掉其它程序的工作集; 0 号工作者是调用线程, 结束时恢复
+    const gboolean bulk = backup_copy_is_bulk ();
+    backup_copy_set_bulk (TRUE);
+
+    w->dents = g_malloc (TREE_DENTS_BUF);
+
+    while (TRUE) {
+        TreeItem* item = tree_take (w);
+        if (item) {
+            if (!g_cancellable_is_cancelled (ctx->cancel)) {
+                tree_process (w, item);
+            }
+            tree_item_free (item);
+            tree_done (ctx);
+            continue;
+        }
+
+        g_mutex_lock (&ctx->idleLock);
+        if (0 == g_atomic_int_get (&ctx->outstanding)) {
+            g_mutex_unlock (&ctx->idleLock);
+            break;
+        }
+        g_atomic_int_inc (&ctx->idle);
+        g_cond_wait_until (&ctx->idleCond, &ctx->idleLock, g_get_monotonic_time() + TREE_IDLE_WAIT_US);
+        g_atomic_int_add (&ctx->idle, -1);
+        g_mutex_unlock (&ctx->idleLock);
+    }
+
+    STR_FREE(w->dents);
+    backup_copy_set_bulk (bulk);
+
+    return NULL;
+}
+
+/**
+ * 先取自己队列尾部(最近展开的, 局部性好), 再从其它线程队列头部窃取(最早展开的, 通常粒度更大)
+ */
+static TreeItem* tree_take (TreeWorker* w)
+{
+    TreeCtx* ctx = w->ctx;
+    TreeItem* item = NULL;
+
+    g_mutex_lock (&w->lock);
+    item = g_queue_pop_tail (&w->items);
+    g_mutex_unlock (&w->lock);
+
+    for (guint i = 1; !item && i < ctx->workerN; ++i) {
+        TreeWorker* victim = &ctx->workers[(w->idx + i) % ctx->workerN];
+        g_mutex_lock (&victim->lock);
+        item = g_queue_pop_head (&victim->items);
+        g_mutex_unlock (&victim->lock);
+    }
+
+    return item;
+}
+
+static void tree_push (TreeWorker* w, TreeItem* item)
+{
+    TreeCtx* ctx = w->ctx;
+
+    g_atomic_int_inc (&ctx->outstanding);
+
+    g_mutex_lock (&w->lock);
+    g_queue_push_tail (&w->items, item);
+    g_mutex_unlock (&w->lock);
+
+    if (g_atomic_int_get (&ctx->idle) > 0) {
+        g_mutex_lock (&ctx->idleLock);
+        g_cond_signal (&ctx->idleCond);
+        g_mutex_unlock (&ctx->idleLock);
+    }
+}
+
+static void tree_done (TreeCtx* ctx)
+{
+    if (g_atomic_int_dec_and_test (&ctx->outstanding)) {
+        g_mutex_lock (&ctx->idleLock);
+        g_cond_broadcast (&ctx->idleCond);
+        g_mutex_unlock (&ctx->idleLock);
+    }
+}
+
+static void tree_process (TreeWorker* w, TreeItem* item)
+{
+    switch (item->type) {
+        case TREE_ITEM_READ: {
+            tree_read_dir (w, item->dir);
+            break;
+        }
+        case TREE_ITEM_OPEN: {
+            const int fd = openat (item->dir->fd, item->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                w->stats.failed++;
+                break;
+            }
+            char* path = g_strdup_printf ("%s/%s", item->dir->path, item->name);
+            TreeDir* dir = tree_dir_new (fd, path);
+            w->stats.dirs++;
+            tree_read_dir (w, dir);
+            tree_dir_unref (dir);
+            STR_FREE(path);
+            break;
+        }
+        case TREE_ITEM_FILES: {
+            tree_backup_files (w, item->dir, item->names);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+/**
+ * 每次只读取一个缓冲区的目录项: 先放回目录本身的后续任务, 再放子目录, 最后放文件,
+ * 自己优先处理刚展开的文件与子目录, 因此每层最多积压一个缓冲区的任务, 百万级目录也不会全部读入内存
+ */
+static void tree_read_dir (TreeWorker* w, TreeDir* dir)
+{
+    TreeCtx* ctx = w->ctx;
+    TreeItem* files = NULL;
+    GPtrArray* subdirs = NULL;
+
+    const long len = syscall (SYS_getdents64, dir->fd, w->dents, TREE_DENTS_BUF);
+    if (len < 0) {
+        w->stats.failed++;
+        return;
+    }
+    if (0 == len) {
+        return;
+    }
+
+    tree_push (w, tree_item_new (TREE_ITEM_READ, dir));
+
+    for (long off = 0; off < len;) {
+        const struct linux_dirent64* d = (const struct linux_dirent64*) (w->dents + off);
+        off += d->d_reclen;
+
+        if ('.' == d->d_name[0] && ('\0' == d->d_name[1] || ('.' == d->d_name[1] && '\0' == d->d_name[2]))) {
+            continue;
+        }
+
+        unsigned char type = d->d_type;
+        if (DT_UNKNOWN == type) {
+            struct stat statBuf;
+            if (0 != fstatat (dir->fd, d->d_name, &statBuf, AT_SYMLINK_NOFOLLOW)) {
+                w->stats.failed++;
+                continue;
+            }
+            type = S_ISDIR(statBuf.st_mode) ? DT_DIR : (S_ISREG(statBuf.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+
+        if (DT_DIR == type) {
+            if (tree_skip_dir (ctx, dir->path, d->d_name)) {
+                w->stats.skipped++;
+                continue;
+            }
+            if (!subdirs) {
+                subdirs = g_ptr_array_new ();
+            }
+            TreeItem* item = tree_item_new (TREE_ITEM_OPEN, dir);
+            item->name = g_strdup (d->d_name);
+            g_ptr_array_add (subdirs, item);
+        }
+        else if (DT_REG == type) {
+            if (files && files->names->len >= TREE_FILE_BATCH) {
+                tree_push (w, files);
+                files = NULL;
+            }
+            if (!files) {
+                files = tree_item_new (TREE_ITEM_FILES, dir);
+                files->names = g_ptr_array_new_with_free_func (g_free);
+            }
+            g_ptr_array_add (files->names, g_strdup (d->d_name));
+        }
+        else {
+            // 符号链接、设备、管道等不备份
+            w->stats.skipped++;
+        }
+    }
+
+    for (guint i = 0; subdirs && i < subdirs->len; ++i) {
+        tree_push (w, g_ptr_array_index (subdirs, i));
+    }
+    if (files) {
+        tree_push (w, files);
+    }
+
+    NOT_NULL_RUN(subdirs, g_ptr_array_unref);
+}
+
+/**
+ * 文件相对于已打开的目录 fd 备份, 路径字符串只用作 key 与过滤, 遍历期间上层目录被替换也不会备份到别处的文件
+ */
+static void tree_backup_files (TreeWorker* w, TreeDir* dir, GPtrArray* names)
+{
+    TreeCtx* ctx = w->ctx;
+
+    for (guint i = 0; i < names->len && !g_cancellable_is_cancelled (ctx->cancel); ++i) {
+        struct stat statBuf;
+        const char* name = g_ptr_array_index (names, i);
+        char* path = g_strdup_printf ("%s/%s", dir->path, name);
+
+        if (ctx->filter && !ctx->filter (path, FALSE, ctx->data)) {
+            w->stats.skipped++;
+            STR_FREE(path);
+            continue;
+        }
+
+        const gboolean ok = backup_file_backup_at (dir->fd, name, path);
+        w->stats.files++;
+        if (ok) {
+            w->stats.backedUp++;
+            if (0 == fstatat (dir->fd, name, &statBuf, AT_SYMLINK_NOFOLLOW)) {
+                w->stats.bytes += (guint64) statBuf.st_size;
+            }
+        }
+        else {
+            w->stats.failed++;
+        }
+        if (ctx->func) {
+            ctx->func (path, ok, ctx->data);
+        }
+
+        STR_FREE(path);
+    }
+}
+
+static gboolean tree_skip_dir (TreeCtx* ctx, const char* parent, const char* name)
+{
+    if (0 == g_strcmp0 (name, "." BACKUP_STR)) {
+        return TRUE;
+    }
+
+    char* path = g_strdup_printf ("%s/%s", parent, name);
+    const gboolean skip = (ctx->storeRoot && 0 == g_strcmp0 (path, ctx->storeRoot))
+                          || (ctx->filter && !ctx->filter (path, TRUE, ctx->data));
+    STR_FREE(path);
+
+    return skip;
+}
+
+static TreeItem* tree_item_new (TreeItemType type, TreeDir* dir)
+{
+    TreeItem* item = g_new0 (TreeItem, 1);
+    item->type = type;
+    item->dir = tree_dir_ref (dir);
+
+    return item;
+}
+
+static void tree_item_free (TreeItem* item)
+{
+    tree_dir_unref (item->dir);
+    STR_FREE(item->name);
+    NOT_NULL_RUN(item->names, g_ptr_array_unref);
+    g_free (item);
+}
+
+static TreeDir* tree_dir_new (int fd, const char* path)
+{
+    TreeDir* dir = g_new0 (TreeDir, 1);
+    dir->ref = 1;
+    dir->fd = fd;
+    dir->path = g_strdup (path);
+
+    return dir;
+}
+
+static TreeDir* tree_dir_ref (TreeDir* dir)
+{
+    g_atomic_int_inc (&dir->ref);
+
+    return dir;
+}
+
+static void tree_dir_unref (TreeDir* dir)
+{
+    if (g_atomic_int_dec_and_test (&dir->ref)) {
+        close (dir->fd);
+        STR_FREE(dir->path);
+        g_free (dir);
+    }
+}
+
+static void tree_stats_add (BackupTreeStats* to, const BackupTreeStats* from)
+{
+    to->dirs += from->dirs;
+    to->files += from->files;
+    to->backedUp += from->backedUp;
+    to->failed += from->failed;
+    to->skipped += from->skipped;
+    to->bytes += from->bytes;
+}